@@ -0,0 +1,171 @@
+/*
+ * merge_template.h - order statistics of two sorted arrays
+ *
+ * Copyright (C) Tomas Vondra, 2011
+ *
+ * This is a template, included once for each element type. It generates
+ * functions working with two sorted arrays - typically the sorted prefix of
+ * the elements, and a (much shorter) sorted tail added after it:
+ *
+ *     merge           merges the sorted array b into the sorted array a
+ *                     (which has to have space for the elements of both)
+ *
+ *     merged_select   returns the k-th smallest element (counting from 0)
+ *                     of the two arrays, without merging them
+ *
+ *     split_sorted    splits a nearly sorted array into a sorted part and
+ *                     the (few) elements out of order, which can then be
+ *                     sorted and merged back (only when MS_WITH_SPLIT is
+ *                     defined)
+ *
+ * The caller has to define:
+ *
+ *     MS_PREFIX       prefix of the generated functions (e.g. double)
+ *     MS_ELEMENT_TYPE type of the array elements
+ *     MS_LT(a, b)     strict "less than" for two elements (NaNs have to be
+ *                     handled by the caller)
+ *
+ * Optionally, MS_ARG_TYPE may be defined, in which case all the generated
+ * functions accept an additional argument 'arg' of that type, which MS_LT
+ * may use (e.g. sort support for the type).
+ *
+ * The merge goes from the end of the arrays, so it needs no buffer except
+ * for the array b itself (which must not overlap with a). The selection is
+ * a binary search for the number of elements taken from each array, so the
+ * cost is O(log(na + nb)).
+ *
+ * All the parameters are undefined at the end, so the file can be included
+ * repeatedly.
+ */
+
+#define MS_MAKE_PREFIX(a)		CppConcat(a,_)
+#define MS_MAKE_NAME(a,b)		MS_MAKE_NAME_(MS_MAKE_PREFIX(a),b)
+#define MS_MAKE_NAME_(a,b)		CppConcat(a,b)
+
+#define MS_MERGE		MS_MAKE_NAME(MS_PREFIX, merge)
+#define MS_SELECT		MS_MAKE_NAME(MS_PREFIX, merged_select)
+#define MS_SPLIT		MS_MAKE_NAME(MS_PREFIX, split_sorted)
+
+#ifdef MS_ARG_TYPE
+#define MS_ARG_DECL		, MS_ARG_TYPE arg
+#else
+#define MS_ARG_DECL
+#endif
+
+/*
+ * Merges the sorted array b (nb elements) into the sorted array a (with na
+ * elements, and space for na + nb elements).
+ */
+static void
+MS_MERGE(MS_ELEMENT_TYPE *a, int na, MS_ELEMENT_TYPE *b, int nb MS_ARG_DECL)
+{
+	int	i = na - 1;
+	int	j = nb - 1;
+	int	k = na + nb - 1;
+
+	/* once b is exhausted, the rest of a is already in place */
+	while (j >= 0)
+	{
+		if ((i >= 0) && MS_LT(b[j], a[i]))
+			a[k--] = a[i--];
+		else
+			a[k--] = b[j--];
+	}
+}
+
+/*
+ * Returns the k-th smallest element of the two sorted arrays. The k+1
+ * smallest elements consist of the first i elements of a and the first
+ * (k+1-i) elements of b, and the binary search looks for the smallest such
+ * i, i.e. the first one where a[i] is not smaller than the last element
+ * taken from b. The result is the larger of the last elements taken.
+ */
+static MS_ELEMENT_TYPE
+MS_SELECT(MS_ELEMENT_TYPE *a, int na, MS_ELEMENT_TYPE *b, int nb, int k
+		  MS_ARG_DECL)
+{
+	int	lo = Max(0, k + 1 - nb);
+	int	hi = Min(k + 1, na);
+	int	i, j;
+
+	Assert((k >= 0) && (k < na + nb));
+
+	while (lo < hi)
+	{
+		i = lo + (hi - lo) / 2;
+		j = k + 1 - i;
+
+		if ((j > 0) && MS_LT(a[i], b[j-1]))
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	i = lo;
+	j = k + 1 - i;
+
+	if (i == 0)
+		return b[j-1];
+	else if (j == 0)
+		return a[i-1];
+
+	return MS_LT(a[i-1], b[j-1]) ? b[j-1] : a[i-1];
+}
+
+#ifdef MS_WITH_SPLIT
+/*
+ * Splits the array a (n elements, the first 'first' of them known to be
+ * sorted) into a sorted subsequence, compacted at the beginning of a, and
+ * the remaining elements, moved to b (with space for maxb elements). Returns
+ * the length of the sorted subsequence, or -1 if more than maxb elements
+ * would have to be moved out - in that case all the elements are put back
+ * into a (but not in the original order).
+ *
+ * An element smaller than the last element of the subsequence gets moved
+ * out together with that last element, so that a single outlier (larger
+ * than the elements after it) does not force moving out all those elements.
+ */
+static int
+MS_SPLIT(MS_ELEMENT_TYPE *a, int n, int first, MS_ELEMENT_TYPE *b, int maxb
+		 MS_ARG_DECL)
+{
+	int	i;
+	int	na = first;
+	int	nb = 0;
+
+	for (i = first; i < n; i++)
+	{
+		if ((na == 0) || !MS_LT(a[i], a[na-1]))
+		{
+			a[na++] = a[i];
+			continue;
+		}
+
+		/* out of space, so put the elements back into a[na .. i) */
+		if (nb + 2 > maxb)
+		{
+			memcpy(a + na, b, sizeof(MS_ELEMENT_TYPE) * nb);
+			return -1;
+		}
+
+		b[nb++] = a[--na];
+		b[nb++] = a[i];
+	}
+
+	return na;
+}
+#endif
+
+
+#undef MS_MAKE_PREFIX
+#undef MS_MAKE_NAME
+#undef MS_MAKE_NAME_
+#undef MS_MERGE
+#undef MS_SELECT
+#undef MS_SPLIT
+#undef MS_ARG_DECL
+#undef MS_PREFIX
+#undef MS_ELEMENT_TYPE
+#undef MS_LT
+#undef MS_ARG_TYPE
+#undef MS_WITH_SPLIT
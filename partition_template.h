@@ -0,0 +1,135 @@
+/*
+ * partition_template.h - vectorized partition around a pivot
+ *
+ * Copyright (C) Tomas Vondra, 2011
+ *
+ * This is a template, included once for each element type and instruction
+ * set. It generates a function partitioning an array in place, so that the
+ * elements smaller than the pivot (or not greater, when 'le' is true) are
+ * moved to the beginning of the array, and returns the number of them. The
+ * order of the elements within the two parts is not preserved.
+ *
+ * The caller has to define:
+ *
+ *     PT_PREFIX       prefix of the generated function (e.g. double_avx2)
+ *     PT_TARGET       instruction set for the target attribute (e.g. "avx2")
+ *     PT_ELEMENT_TYPE type of the array elements
+ *     PT_VECTOR       vector type
+ *     PT_LANES        number of elements in a vector
+ *     PT_SET1(x)      vector with all elements set to x
+ *     PT_LOAD(p)      loads a vector from p (unaligned)
+ *     PT_LOAD_PART(p, n)  loads the first n elements from p, without reading
+ *                     the memory after them
+ *     PT_CMP(v, pivot, le)  bitmask of elements of v smaller (or not greater,
+ *                     with le) than the pivot, as an unsigned int
+ *     PT_STORE(p, v, mask)  stores the elements of v selected by the mask at
+ *                     p (contiguously, without touching the memory after
+ *                     them)
+ *     PT_SCALAR       function used for arrays shorter than two vectors
+ *
+ * The partition reads the vectors from both ends of the array, and writes
+ * the two parts into the space freed by the reads - the first and the last
+ * vector are kept in registers until the end, so there's always enough free
+ * space on the side the next vector gets read from. The vector compared with
+ * the pivot gets stored twice - the selected elements at the end of the left
+ * part, the remaining ones at the start of the right part - so there are no
+ * branches depending on the data.
+ *
+ * All the parameters are undefined at the end, so the file can be included
+ * repeatedly.
+ */
+
+#define PT_MAKE_PREFIX(a)		CppConcat(a,_)
+#define PT_MAKE_NAME(a,b)		PT_MAKE_NAME_(PT_MAKE_PREFIX(a),b)
+#define PT_MAKE_NAME_(a,b)		CppConcat(a,b)
+
+#define PT_PARTITION	PT_MAKE_NAME(PT_PREFIX, partition)
+
+/* bitmask of the first n elements of a vector */
+#define PT_MASK(n)		((unsigned int) ((1ULL << (n)) - 1))
+
+/* moves the elements of v selected by valid to the two parts */
+#define PT_STEP(v, valid) \
+	do { \
+		unsigned int	left = PT_CMP((v), pivotv, le) & (valid); \
+		unsigned int	right = ~left & (valid); \
+		PT_STORE(a + lw, (v), left); \
+		lw += __builtin_popcount(left); \
+		rw -= __builtin_popcount(right); \
+		PT_STORE(a + rw, (v), right); \
+	} while (0)
+
+__attribute__((target(PT_TARGET)))
+static int
+PT_PARTITION(PT_ELEMENT_TYPE *a, int n, PT_ELEMENT_TYPE pivot, bool le)
+{
+	PT_VECTOR	pivotv;
+	PT_VECTOR	first;
+	PT_VECTOR	last;
+	PT_VECTOR	v;
+	int			lr,		/* next element to read from the left */
+				rr,		/* end of the elements to read from the right */
+				lw,		/* end of the left part */
+				rw;		/* start of the right part */
+
+	if (n < 2 * PT_LANES)
+		return PT_SCALAR(a, n, pivot, le);
+
+	pivotv = PT_SET1(pivot);
+	first = PT_LOAD(a);
+	last = PT_LOAD(a + n - PT_LANES);
+
+	lw = 0;
+	rw = n;
+	lr = PT_LANES;
+	rr = n - PT_LANES;
+
+	while (rr - lr >= PT_LANES)
+	{
+		/* read from the side with less free space */
+		if (lr - lw <= rw - rr)
+		{
+			v = PT_LOAD(a + lr);
+			lr += PT_LANES;
+		}
+		else
+		{
+			rr -= PT_LANES;
+			v = PT_LOAD(a + rr);
+		}
+
+		PT_STEP(v, PT_MASK(PT_LANES));
+	}
+
+	/* the remaining elements in the middle (fewer than a vector) */
+	if (rr > lr)
+	{
+		v = PT_LOAD_PART(a + lr, rr - lr);
+		PT_STEP(v, PT_MASK(rr - lr));
+	}
+
+	PT_STEP(first, PT_MASK(PT_LANES));
+	PT_STEP(last, PT_MASK(PT_LANES));
+
+	Assert(lw == rw);
+
+	return lw;
+}
+
+#undef PT_MAKE_PREFIX
+#undef PT_MAKE_NAME
+#undef PT_MAKE_NAME_
+#undef PT_PARTITION
+#undef PT_MASK
+#undef PT_STEP
+#undef PT_PREFIX
+#undef PT_TARGET
+#undef PT_ELEMENT_TYPE
+#undef PT_VECTOR
+#undef PT_LANES
+#undef PT_SET1
+#undef PT_LOAD
+#undef PT_LOAD_PART
+#undef PT_CMP
+#undef PT_STORE
+#undef PT_SCALAR
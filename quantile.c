@@ -10,14 +10,33 @@
 #include <sys/time.h>
 #include <unistd.h>
 #include <limits.h>
+#include <float.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "postgres.h"
+#include "access/htup_details.h"
+#include "funcapi.h"
 #include "utils/array.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
 #include "utils/numeric.h"
 #include "utils/builtins.h"
+#include "utils/datum.h"
 #include "catalog/pg_type.h"
 #include "nodes/execnodes.h"
+#include "nodes/plannodes.h"
+#include "miscadmin.h"
+#include "portability/instr_time.h"
+#include "storage/buffile.h"
+#include "utils/guc.h"
+#include "utils/sortsupport.h"
+#include "libpq/pqformat.h"
+
+#if (PG_VERSION_NUM >= 120000)
+#include "utils/float.h"
+#endif
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
@@ -74,279 +93,1611 @@ PG_MODULE_MAGIC;
 
 #endif
 
+/*
+ * A sorted run of elements, written into the temporary file.
+ */
+typedef struct quantile_run
+{
+	int		fileno;			/* start of the run in the temporary file */
+	off_t	offset;
+	int		nelements;		/* number of elements in the run */
+	bool	sorted;			/* are the elements sorted (see 'extreme')? */
+} quantile_run;
+
+/*
+ * Runtime statistics of a state, collected only with quantile.track_stats
+ * (and only for regular aggregates). When the aggregate shuts down, the
+ * statistics are logged (DEBUG1) and kept in a backend-local history, which
+ * is what quantile_stats() returns.
+ */
+typedef struct quantile_state_stats
+{
+	Oid		func;			/* transition function */
+	int		elemsize;		/* size of the elements */
+	int64	nvalues;		/* number of values accumulated */
+	int		nreallocs;		/* number of times the array was enlarged */
+	Size	blockbytes;		/* bytes allocated for numeric values */
+	Size	peakbytes;		/* largest memory used by the state */
+	int		nruns;			/* runs spilled to the temporary file */
+	int64	nspilled;		/* values spilled to the temporary file */
+	int64	ncounted;		/* values counted (few distinct values) */
+	int		nfinals;		/* number of final function calls */
+	double	finaltime;		/* time spent in the final functions (ms) */
+	const char *path;		/* how the last final call found the values */
+	instr_time	start;		/* start of the current final call */
+} quantile_state_stats;
+
+/*
+ * Reservoir of the sampling aggregates (quantile_sample) - the elements array
+ * keeps a uniform random sample of at most 'size' values, replaced using
+ * Algorithm L (which computes how many values to skip before the next
+ * replacement, so once the reservoir is full, most values only get counted).
+ */
+typedef struct quantile_reservoir
+{
+	int		size;			/* maximum number of sampled values */
+	int64	nvalues;		/* number of values seen */
+	int64	next;			/* index of the next value to sample */
+	double	w;				/* the weight of Algorithm L */
+	uint64	seed;			/* state of the random generator */
+} quantile_reservoir;
+
+/* size of the elements buffer embedded in the state (for small groups) */
+#define QUANTILE_INLINE_BYTES	160
+
 /*
  * Structures used to keep the data - the 'elements' array is extended
  * on the fly if needed.
+ *
+ * When the array reaches the memory limit (quantile.work_mem), the elements
+ * are sorted and written into a temporary file as a run, and the array is
+ * then reused for new elements. That's only done for fixed-width types.
+ *
+ * The fields only needed by states with many values (spilled, counted or
+ * approximated), by the sampling or numeric states, for extreme quantiles
+ * or statistics are kept in a separate struct, allocated on demand. Until
+ * then, the state points to a shared read-only copy with the defaults, so
+ * reading the fields does not need any checks (but changing them has to
+ * call quantile_state_ext_alloc first).
  */
+typedef struct quantile_state_ext
+{
+	/* elements spilled to a temporary file */
+	int		nspilled;		/* number of elements in the runs */
+	int		nruns;			/* number of runs in the file */
+	int		maxruns;		/* size of the runs array */
+	quantile_run *runs;
+	BufFile *file;
+	int		endfileno;		/* end of the last run, where the next goes */
+	off_t	endoffset;
+
+	/* numeric values are copied into large blocks, not palloc'ed one by one */
+	char   *block;			/* current block */
+	Size	blocksize;		/* size of the current block */
+	Size	blockused;		/* bytes used in the current block */
+	Size	blockbytes;		/* size of all the blocks (for the limit) */
+
+	/*
+	 * Inputs with only a few distinct values are not kept as elements, but
+	 * counted in a hash table (distinct values and their counts, with an
+	 * open-addressing index). Whenever the elements array gets full, the
+	 * elements are added to the counts, until there'd be too many distinct
+	 * values - then the counting is abandoned (for good). The values are
+	 * stored as the leading bytes of the keys, so that it works for all the
+	 * fixed-width types. That's never combined with spilling.
+	 *
+	 * Integer values within a narrow range are counted in a dense array
+	 * instead (indexed by the value - densemin), until the range gets too
+	 * wide - then the non-zero counts are moved to the hash table.
+	 */
+	int		ncounted;		/* number of values counted */
+	int		nkeys;			/* number of distinct values */
+	int		maxkeys;		/* size of the keys and counts arrays */
+	int		nslots;			/* size of the hash table (power of two) */
+	uint64 *keys;
+	int	   *counts;
+	int	   *slots;			/* indexes of keys, or -1 for empty slots */
+	int64	densemin;		/* value counted in dense[0] */
+	int		ndense;			/* size of the dense array */
+	int	   *dense;
+
+	/*
+	 * With quantile.on_overflow = approximate, the elements over the memory
+	 * limit are added to a t-digest, and the array only buffers the new
+	 * elements - so the result is an estimate. That's never combined with
+	 * spilling or counting.
+	 */
+	struct tdigest_state *digest;
+
+	/* sample of the values (only for quantile_sample), or NULL */
+	quantile_reservoir *reservoir;
+
+	/*
+	 * When all the requested quantiles are extreme (e.g. p99.9), only the
+	 * values in that tail are needed to answer them. So when the array
+	 * reaches the memory limit, the values too far from the tail are written
+	 * into the temporary file as a run (unsorted), and only the rest is kept
+	 * in memory. The values in memory at or beyond the bound (the smallest
+	 * value kept when pruning, or the largest one for the lower tail) are
+	 * then known to be the most extreme ones, and if there's enough of them,
+	 * the final function only sorts those. Otherwise the runs get sorted and
+	 * merged as usual, so the result is always exact.
+	 */
+	int		extreme;		/* QUANTILE_EXTREME_* */
+	int64	extremebound;	/* bound of the tail (element bytes) */
+
+	quantile_state_stats *stats;	/* runtime statistics (or NULL) */
+} quantile_state_ext;
+
 typedef struct quantile_state
 {
 	int	nquantiles;		/* size of the quantiles array */
 	int	maxelements;	/* size of the elements array */
 	int	nelements;		/* number of elements */
 
+	/*
+	 * While all the numeric values have the same scale and fit into int64,
+	 * the elements are not pointers but the values as fixed-point integers
+	 * (multiplied by 10^fixedscale), processed like the int64 elements. It's
+	 * -1 for regular numeric elements (and the other types). It's checked for
+	 * every numeric value, so it stays in the state.
+	 */
+	int		fixedscale;
+
 	/* arrays of elements and requested quantiles */
 	double *quantiles;
 	void   *elements;
-} quantile_state;
-
-#define	QUANTILE_MIN_ELEMENTS	4
 
-/* comparators, used for qsort */
+	/*
+	 * The append functions also count the pairs of consecutive elements out
+	 * of order and in order (descents and ascents), so that elements added in
+	 * nearly sorted (or descending) order can be sorted cheaply. The counts
+	 * are only a hint, and get set to nelements once the order is unknown.
+	 */
+	int		ndescents;
+	int		nascents;
 
-static int  double_comparator(const void *a, const void *b);
-static int  int32_comparator(const void *a, const void *b);
-static int  int64_comparator(const void *a, const void *b);
-static int  numeric_comparator(const void *a, const void *b);
+	int		spillelements;	/* maximum number of elements kept in memory */
 
-/* parse the quantiles array */
-static double *
-array_to_double(FunctionCallInfo fcinfo, ArrayType *v, int * len);
+	/*
+	 * What to do when the elements reach the memory limit (the value of
+	 * quantile.on_overflow when the state was created).
+	 */
+	int		overflow;
 
-static Datum
-double_to_array(FunctionCallInfo fcinfo, double * d, int len);
+	/*
+	 * The final functions may be called repeatedly on the same state (e.g.
+	 * by ordered-set aggregates sharing it), so remember how many elements
+	 * at the beginning of the array are sorted, and whether a final function
+	 * already ran on the elements (the second call sorts the whole array).
+	 */
+	int		nsorted;
+	bool	finalized;
 
-static Datum
-int32_to_array(FunctionCallInfo fcinfo, int32 * d, int len);
+	/* may the elements still be counted? (see quantile_state_ext) */
+	bool	counting;
 
-static Datum
-int64_to_array(FunctionCallInfo fcinfo, int64 * d, int len);
+	quantile_state_ext *ext;	/* the rarely used fields (see above) */
 
-static Datum
-numeric_to_array(FunctionCallInfo fcinfo, Numeric * d, int len);
+	/*
+	 * With many small groups (e.g. GROUP BY with millions of groups), the
+	 * separate allocations would cost more than the values, so a single
+	 * quantile and the first few elements are kept in the state itself. The
+	 * elements get moved to a separate array once they outgrow the buffer.
+	 */
+	double	quantile;
+	double	inline_elements[QUANTILE_INLINE_BYTES / sizeof(double)];
+} quantile_state;
 
-static void
-check_quantiles(int nquantiles, double * quantiles);
+/* defaults of the rarely used fields (all zero), shared until changed */
+static const quantile_state_ext quantile_state_ext_default;
 
-/* prototypes */
-PG_FUNCTION_INFO_V1(quantile_append_double_array);
-PG_FUNCTION_INFO_V1(quantile_append_double);
+/* pruning for extreme quantiles (decided when the array first gets full) */
+#define QUANTILE_EXTREME_UNKNOWN	0
+#define QUANTILE_EXTREME_NONE		1
+#define QUANTILE_EXTREME_UPPER		2	/* all quantiles >= 1 - threshold */
+#define QUANTILE_EXTREME_LOWER		3	/* all quantiles <= threshold */
 
-PG_FUNCTION_INFO_V1(quantile_double_array);
-PG_FUNCTION_INFO_V1(quantile_double);
+/*
+ * The pruning applies to quantiles within this distance of 0 or 1, and
+ * keeps (about) twice as many values as needed for the current count, plus
+ * some slack, so that the values in memory remain sufficient as more values
+ * get added (and the array does not need to be pruned too often).
+ */
+#define QUANTILE_EXTREME_THRESHOLD	0.05
+#define QUANTILE_EXTREME_SLACK		1024
 
-PG_FUNCTION_INFO_V1(quantile_append_int32_array);
-PG_FUNCTION_INFO_V1(quantile_append_int32);
+#define QUANTILE_INLINE(state) \
+	((state)->elements == (void *) (state)->inline_elements)
 
-PG_FUNCTION_INFO_V1(quantile_int32_array);
-PG_FUNCTION_INFO_V1(quantile_int32);
+#define	QUANTILE_MIN_ELEMENTS	4
 
-PG_FUNCTION_INFO_V1(quantile_append_int64_array);
-PG_FUNCTION_INFO_V1(quantile_append_int64);
+/*
+ * Upper limit on the initial number of elements, derived from the planner
+ * estimate (so that a misestimate does not allocate too much memory).
+ */
+#define	QUANTILE_MAX_INITIAL_ELEMENTS	(1024 * 1024)
+
+/* total number of elements, in memory, spilled and counted */
+#define QUANTILE_COUNT(state) \
+	((state)->nelements + (state)->ext->nspilled + (state)->ext->ncounted)
+
+/* records how a final function found the values (when tracking statistics) */
+#define QUANTILE_STATS_PATH(state, name) \
+	do { \
+		if ((state)->ext->stats != NULL) \
+			(state)->ext->stats->path = (name); \
+	} while (0)
+
+/* returns the result of a final function, adding the time to the statistics */
+#define QUANTILE_STATS_RETURN(state, result) \
+	do { \
+		Datum	_result = (result); \
+		if ((state)->ext->stats != NULL) \
+			quantile_stats_final_end(state); \
+		PG_RETURN_DATUM(_result); \
+	} while (0)
 
-PG_FUNCTION_INFO_V1(quantile_int64_array);
-PG_FUNCTION_INFO_V1(quantile_int64);
+/*
+ * The elements get counted only once there's enough of them to tell the
+ * input has few distinct values (or when the array can't grow anymore), and
+ * only while there are at most 1/8 as many distinct values as counted ones
+ * (so the counts use much less memory than the elements would).
+ */
+#define QUANTILE_COUNT_MIN_ELEMENTS		(64 * 1024)
+#define QUANTILE_COUNT_MAX_KEYS			(64 * 1024)
+#define QUANTILE_COUNT_RATIO			8
+#define QUANTILE_COUNT_MIN_KEYS			1024
 
-PG_FUNCTION_INFO_V1(quantile_append_numeric_array);
-PG_FUNCTION_INFO_V1(quantile_append_numeric);
+/* memory used by a distinct value (the key, count and two hash slots) */
+#define QUANTILE_COUNT_KEY_SIZE	(sizeof(uint64) + 3 * sizeof(int))
 
-PG_FUNCTION_INFO_V1(quantile_numeric_array);
-PG_FUNCTION_INFO_V1(quantile_numeric);
+/* maximum range of integer values counted in the dense array */
+#define QUANTILE_DENSE_MAX_RANGE		(64 * 1024)
 
-Datum quantile_append_double_array(PG_FUNCTION_ARGS);
-Datum quantile_append_double(PG_FUNCTION_ARGS);
+/*
+ * Updates the order counts for a value about to be appended, and extends the
+ * sorted prefix while all the elements are sorted. The comparison results
+ * are only added up (no branches depend on them), so this costs almost
+ * nothing even when the values arrive in random order.
+ */
+#define QUANTILE_TRACK_ORDER(state, elements, value, LT) \
+	do { \
+		int		descent = 0; \
+		if ((state)->nelements > 0) \
+		{ \
+			descent = LT((value), (elements)[(state)->nelements - 1]); \
+			(state)->ndescents += descent; \
+			(state)->nascents += LT((elements)[(state)->nelements - 1], (value)); \
+		} \
+		(state)->nsorted += ((state)->nsorted == (state)->nelements) & !descent; \
+	} while (0)
+
+/* the order of the float4 and double values, with NaN values sorted last */
+#define FLOAT_LT(a, b)		(((a) < (b)) | (isnan(b) && !isnan(a)))
+#define INTEGER_LT(a, b)	((a) < (b))
+
+/* sizes of the blocks for numeric values (each block is twice the previous) */
+#define QUANTILE_MIN_BLOCK		256
+#define QUANTILE_MAX_BLOCK		(1024 * 1024)
 
-Datum quantile_double_array(PG_FUNCTION_ARGS);
-Datum quantile_double(PG_FUNCTION_ARGS);
+/*
+ * The format of numeric values is private to numeric.c, but it's also the
+ * on-disk format, so it can't really change. The values are converted to
+ * fixed-point integers by reading the header and the digits (base 10000)
+ * directly, which is much cheaper than going through the numeric functions.
+ */
+#define QUANTILE_NUMERIC_NBASE			10000
+#define QUANTILE_NUMERIC_DEC_DIGITS		4
 
-Datum quantile_append_int32_array(PG_FUNCTION_ARGS);
-Datum quantile_append_int32(PG_FUNCTION_ARGS);
+#define QUANTILE_NUMERIC_SIGN_MASK		0xC000
+#define QUANTILE_NUMERIC_NEG			0x4000
+#define QUANTILE_NUMERIC_SHORT			0x8000
+#define QUANTILE_NUMERIC_SPECIAL		0xC000	/* NaN and infinities */
+#define QUANTILE_NUMERIC_DSCALE_MASK	0x3FFF
 
-Datum quantile_int32_array(PG_FUNCTION_ARGS);
-Datum quantile_int32(PG_FUNCTION_ARGS);
+#define QUANTILE_NUMERIC_SHORT_SIGN_MASK		0x2000
+#define QUANTILE_NUMERIC_SHORT_DSCALE_MASK		0x1F80
+#define QUANTILE_NUMERIC_SHORT_DSCALE_SHIFT		7
+#define QUANTILE_NUMERIC_SHORT_WEIGHT_SIGN_MASK	0x0040
+#define QUANTILE_NUMERIC_SHORT_WEIGHT_MASK		0x003F
 
-Datum quantile_append_int64_array(PG_FUNCTION_ARGS);
-Datum quantile_append_int64(PG_FUNCTION_ARGS);
+/*
+ * Maximum scale of the fixed-point values (10^scale has to fit into int64).
+ * The elements array has the same size either way, so that's only possible
+ * when the pointers are 8 bytes.
+ */
+#define QUANTILE_FIXED_MAX_SCALE		18
+#define QUANTILE_FIXED_ENABLED			(sizeof(Numeric) == sizeof(int64))
 
-Datum quantile_int64_array(PG_FUNCTION_ARGS);
-Datum quantile_int64(PG_FUNCTION_ARGS);
+/* maximum number of runs merged at once (more runs are merged in passes) */
+#define QUANTILE_MERGE_ORDER	128
 
-Datum quantile_append_numeric_array(PG_FUNCTION_ARGS);
-Datum quantile_append_numeric(PG_FUNCTION_ARGS);
+/* memory limit for the elements (kB), -1 means work_mem and 0 no limit */
+static int	quantile_work_mem = -1;
 
-Datum quantile_numeric_array(PG_FUNCTION_ARGS);
-Datum quantile_numeric(PG_FUNCTION_ARGS);
+#define QUANTILE_WORK_MEM \
+	((quantile_work_mem >= 0) ? quantile_work_mem : work_mem)
 
-static void
-AssertCheckQuantileState(quantile_state *state)
+/* what to do when a state reaches the memory limit (quantile.on_overflow) */
+typedef enum quantile_overflow
 {
-#ifdef USE_ASSERT_CHECKING
-	Assert(state->nquantiles >= 1);
+	QUANTILE_OVERFLOW_ERROR,		/* fail the query */
+	QUANTILE_OVERFLOW_SPILL,		/* write sorted runs to a temporary file */
+	QUANTILE_OVERFLOW_APPROXIMATE	/* switch to a t-digest */
+} quantile_overflow;
 
-	Assert(state->nelements >= 0);
-	Assert(state->nelements <= state->maxelements);
-#endif
-}
+static const struct config_enum_entry quantile_overflow_options[] = {
+	{"error", QUANTILE_OVERFLOW_ERROR, false},
+	{"spill", QUANTILE_OVERFLOW_SPILL, false},
+	{"approximate", QUANTILE_OVERFLOW_APPROXIMATE, false},
+	{NULL, 0, false}
+};
+
+static int	quantile_on_overflow = QUANTILE_OVERFLOW_SPILL;
 
 /*
- * The memory consumption might be a problem, as all the values are
- * kept in the memory - for example 1.000.000 of 8-byte values (bigint)
- * requires about 8MB of memory.
+ * Whether the memory limit applies to a new state. Spilling needs fixed-width
+ * values, and a callback closing the temporary file (so only in regular
+ * aggregates). Failing or switching to a t-digest works for all states, but
+ * numeric states fail in both cases (the values can't be approximated).
  */
-
-Datum
-quantile_append_double(PG_FUNCTION_ARGS)
+typedef enum quantile_limit
 {
-	quantile_state *state;
+	QUANTILE_LIMIT_NONE,			/* the size is bounded or known */
+	QUANTILE_LIMIT_MEMORY,			/* limited, but can't spill (numeric) */
+	QUANTILE_LIMIT_SPILL			/* limited, and may spill */
+} quantile_limit;
 
-	MemoryContext	oldcontext;
-	MemoryContext	aggcontext;
+/* compression of the t-digest used by states over the memory limit */
+#define QUANTILE_OVERFLOW_COMPRESSION	TDIGEST_DEFAULT_COMPRESSION
 
-	double		   *elements;
+/* collect runtime statistics of the states (see quantile_state_stats) */
+static bool	quantile_track_stats = false;
 
-	/* OK, we do want to skip NULL values altogether */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
-		else
-			/* if there already is a state accumulated, don't forget it */
-			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+/* number of threads sorting large arrays of fixed-width values */
+static int	quantile_sort_threads = 1;
 
-	GET_AGG_CONTEXT("quantile_append_double", fcinfo, aggcontext);
+#define QUANTILE_SORT_MAX_THREADS		64
 
-	oldcontext = MemoryContextSwitchTo(aggcontext);
+/*
+ * Minimum number of elements for each sort thread. Only a developer option
+ * (not shown by SHOW ALL), so that the regression tests can use the threads
+ * without sorting millions of values.
+ */
+#define QUANTILE_SORT_THREAD_ELEMENTS	(1024 * 1024)
 
-	if (PG_ARGISNULL(0))
-	{
-		state = (quantile_state *) palloc(sizeof(quantile_state));
-		state->elements  = palloc(QUANTILE_MIN_ELEMENTS * sizeof(double));
-		state->maxelements = QUANTILE_MIN_ELEMENTS;
-		state->nelements = 0;
+static int	quantile_sort_thread_elements = QUANTILE_SORT_THREAD_ELEMENTS;
 
-		state->quantiles = (double *) palloc(sizeof(double));
-		state->quantiles[0] = PG_GETARG_FLOAT8(2);
-		state->nquantiles = 1;
+#define QUANTILE_SORT_THREADS(nelements) \
+	Min(quantile_sort_threads, (nelements) / quantile_sort_thread_elements)
 
-		check_quantiles(state->nquantiles, state->quantiles);
-	}
-	else
-		state = (quantile_state *) PG_GETARG_POINTER(0);
+/* statistics of the states that shut down recently (a ring buffer) */
+#define QUANTILE_STATS_HISTORY	1000
 
-	AssertCheckQuantileState(state);
+static quantile_state_stats *quantile_stats_history = NULL;
+static int	quantile_stats_count = 0;		/* entries in the history */
+static int	quantile_stats_next = 0;		/* next entry to overwrite */
 
-	/* we can be sure the value is not null (see the check above) */
-	if (state->nelements == state->maxelements)
-	{
-		state->maxelements *= 2;
-		state->elements = repalloc(state->elements,
-								   sizeof(double) * state->maxelements);
-	}
+/*
+ * Information about the element type needed to spill the elements, i.e. to
+ * sort the runs and to merge them back.
+ */
+typedef struct quantile_spill_ops
+{
+	int		elemsize;
+	void  (*sort) (void *elements, int nelements);
+	/* merges sorted elements b into sorted elements a (with space for both) */
+	void  (*merge) (void *a, int na, void *b, int nb);
+	/* partitions the elements around the k-th smallest one */
+	void  (*select) (void *elements, int nelements, int k);
+	int   (*compare) (const void *a, const void *b);
+	/* range of the (integer) elements for the dense counting, or NULL */
+	void  (*minmax) (const void *elements, int nelements, int64 *min, int64 *max);
+	/* adding the elements to a t-digest, and converting an estimate back */
+	void  (*approximate) (struct tdigest_state *digest, const void *elements,
+						  int nelements);
+	void  (*estimate) (double value, void *element);
+} quantile_spill_ops;
 
-	Assert(state->nelements < state->maxelements);
+/*
+ * State of the approximate (t-digest) aggregates. The centroids array has
+ * space for the merged centroids (at most compression of them), followed by
+ * a buffer of new values, merged into the centroids when it gets full.
+ */
+typedef struct tdigest_centroid
+{
+	double	mean;
+	int64	count;
+} tdigest_centroid;
 
-	/* make sure to cast the array to (double *) before updating it */
-	elements = (double *) state->elements;
-	elements[state->nelements++] = PG_GETARG_FLOAT8(1);
+typedef struct tdigest_state
+{
+	int		nquantiles;		/* number of requested quantiles */
+	double *quantiles;		/* requested quantiles */
 
-	MemoryContextSwitchTo(oldcontext);
+	int		compression;	/* accuracy / size of the digest */
+	int64	count;			/* number of values (excluding NaNs) */
+	int64	nnans;			/* number of NaN values */
+	double	min;			/* minimum / maximum value */
+	double	max;
 
-	PG_RETURN_POINTER(state);
-}
+	int		ncentroids;		/* number of centroids (including buffered) */
+	int		nmerged;		/* number of merged (sorted) centroids */
+	int		maxcentroids;	/* space for centroids */
+	tdigest_centroid *centroids;
+} tdigest_state;
 
-Datum
-quantile_append_double_array(PG_FUNCTION_ARGS)
+#define TDIGEST_DEFAULT_COMPRESSION		100
+#define TDIGEST_MIN_COMPRESSION			10
+#define TDIGEST_MAX_COMPRESSION			10000
+
+/* merged centroids, and a buffer for new values (5x the compression) */
+#define TDIGEST_MAX_CENTROIDS(compression)	((compression) + 1 + 5 * (compression))
+
+/*
+ * State of the HDR histogram aggregates (quantile_hdr). The (non-negative)
+ * values are counted in log-linear buckets - bucket b > 0 covers the values
+ * [2^b * H, 2^(b+1) * H) in H sub-buckets of width 2^b, where H is the
+ * smallest power of two >= 10^digits, and bucket 0 covers [0, 2H) in
+ * sub-buckets of width 1. So each value is known with the requested number
+ * of significant digits, and the index of the counter is just a couple of
+ * shifts. The counts array only extends as far as the largest value needs.
+ */
+typedef struct hdr_state
 {
-	quantile_state *state;
+	int		nquantiles;		/* number of requested quantiles */
+	double *quantiles;		/* requested quantiles */
 
-	MemoryContext	oldcontext;
-	MemoryContext	aggcontext;
+	int		digits;			/* significant decimal digits */
+	int		magnitude;		/* log2(H), sub-buckets in a bucket */
+	int64	count;			/* number of values */
+	int64	min;			/* minimum / maximum value (exact) */
+	int64	max;
 
-	double		   *elements;
-	ArrayType	   *quantiles;
+	int		ncounts;		/* size of the counts array */
+	int64  *counts;
+} hdr_state;
 
-	/* OK, we do want to skip NULL values altogether */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
-		else
-			/* if there already is a state accumulated, don't forget it */
-			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+#define HDR_DEFAULT_DIGITS		2
+#define HDR_MIN_DIGITS			1
+#define HDR_MAX_DIGITS			5
 
-	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+/* number of counters needed to cover all the int64 values */
+#define HDR_MAX_COUNTS(magnitude)	((64 - (magnitude)) << (magnitude))
 
-	GET_AGG_CONTEXT("quantile_append_double_array", fcinfo, aggcontext);
+/*
+ * State of the aggregates on presorted input (quantile_presorted). The
+ * number of values is known upfront, so the positions of the quantiles are
+ * known too, and only the values at those positions are kept while the
+ * sorted values stream through. The previous value is kept to check that
+ * the values really are sorted.
+ */
+typedef struct presorted_state
+{
+	int		nquantiles;		/* number of requested quantiles */
+	double *quantiles;		/* requested quantiles */
+	int	   *indexes;		/* position (index) for each quantile */
 
-	oldcontext = MemoryContextSwitchTo(aggcontext);
+	Oid		elemtype;		/* type of the values */
+	int16	typlen;
+	bool	typbyval;
+	char	typalign;
+	bool	(*lt) (Datum a, Datum b);	/* a < b (in the ORDER BY order) */
 
-	if (PG_ARGISNULL(0))
-	{
-		state = (quantile_state *) palloc(sizeof(quantile_state));
-		state->elements  = palloc(QUANTILE_MIN_ELEMENTS * sizeof(double));
-		state->maxelements = QUANTILE_MIN_ELEMENTS;
-		state->nelements = 0;
+	int64	count;			/* expected number of values */
+	int64	nvalues;		/* number of values seen */
 
-		/* read the array of quantiles */
-		state->quantiles = array_to_double(fcinfo, quantiles,
-										   &state->nquantiles);
+	int		npositions;		/* distinct positions, in ascending order */
+	int64  *positions;
+	int		next;			/* next position to look for */
+	Datum  *values;			/* values at the positions */
 
-		check_quantiles(state->nquantiles, state->quantiles);
-	}
-	else
-		state = (quantile_state *) PG_GETARG_POINTER(0);
+	Datum	last;			/* the previous value */
+	char   *lastbuf;		/* copy of the previous value (by-reference) */
+	Size	lastsize;		/* size of the lastbuf */
+} presorted_state;
 
-	AssertCheckQuantileState(state);
+/*
+ * The quantile_sketch data type, a compressed t-digest (with the centroids
+ * sorted by mean) that can be stored in tables and merged later.
+ */
+typedef struct quantile_sketch
+{
+	int32	vl_len_;		/* varlena header (do not touch directly!) */
+	int32	compression;
+	int32	ncentroids;
+	int64	count;
+	int64	nnans;
+	double	min;
+	double	max;
+	tdigest_centroid centroids[FLEXIBLE_ARRAY_MEMBER];
+} quantile_sketch;
+
+#define PG_GETARG_QUANTILE_SKETCH(n) \
+	((quantile_sketch *) PG_DETOAST_DATUM(PG_GETARG_DATUM(n)))
 
-	/* we can be sure the value is not null (see the check above) */
-	if (state->nelements == state->maxelements)
-	{
-		state->maxelements *= 2;
-		state->elements = repalloc(state->elements,
-								   sizeof(double) * state->maxelements);
-	}
+/*
+ * State of the moving aggregates (window frames), a treap of the values in
+ * the current frame.
+ */
+typedef union quantile_tree_value
+{
+	double	d;
+	float4	f4;
+	int16	i2;
+	int32	i4;
+	int64	i8;
+	Numeric	n;
+} quantile_tree_value;
+
+typedef struct quantile_tree_node
+{
+	quantile_tree_value value;
+	uint32	priority;		/* random priority (max-heap order) */
+	int32	size;			/* number of nodes in the subtree */
+	int32	left;			/* index of the left/right child (0 - none) */
+	int32	right;
+} quantile_tree_node;
+
+typedef struct quantile_tree
+{
+	int		nquantiles;		/* number of requested quantiles */
+	double *quantiles;		/* requested quantiles */
 
-	Assert(state->nelements < state->maxelements);
+	/* compares two values (pointers to quantile_tree_value) */
+	int   (*compare) (const void *a, const void *b);
+	bool	copy_numerics;	/* values are numeric copies (free on delete) */
 
-	elements = (double *) state->elements;
-	elements[state->nelements++] = PG_GETARG_FLOAT8(1);
+	int		root;			/* index of the root node */
+	int		freelist;		/* first removed node (linked by left) */
+	int		nnodes;			/* number of used nodes (including removed) */
+	int		maxnodes;		/* space for nodes */
+	uint32	seed;			/* state of the random generator */
+	quantile_tree_node *nodes;
 
-	MemoryContextSwitchTo(oldcontext);
+	/*
+	 * Memory limit (with quantile.on_overflow = error or approximate, as the
+	 * values removed from the frame can't be removed from a t-digest, the
+	 * query fails in both cases), or 0. The numeric copies count too.
+	 */
+	Size	maxbytes;
+	Size	numericbytes;	/* size of the numeric copies */
+} quantile_tree;
 
-	PG_RETURN_POINTER(state);
-}
+/*
+ * When a significant fraction of the elements is requested, it's cheaper to
+ * simply sort the whole array than to do the multi-select.
+ */
+#define QUANTILE_SORT_POSITIONS(npositions, nelements) \
+	((npositions) > (nelements) / 4)
 
-Datum
-quantile_append_numeric(PG_FUNCTION_ARGS)
-{
-	quantile_state *state;
+/*
+ * For fixed-width types the radix sort is cheap enough to beat multi-select
+ * with more than a handful of positions, so switch to it much earlier.
+ */
+#define QUANTILE_RADIX_POSITIONS(npositions, nelements) \
+	(((npositions) > 4) || QUANTILE_SORT_POSITIONS(npositions, nelements))
 
-	MemoryContext	oldcontext;
-	MemoryContext	aggcontext;
+/* comparators, used for qsort */
 
-	Numeric			num;
-	Numeric			value;
-	Numeric		   *elements;
+static int  double_comparator(const void *a, const void *b);
+static int  float4_comparator(const void *a, const void *b);
+static int  int16_comparator(const void *a, const void *b);
+static int  int32_comparator(const void *a, const void *b);
+static int  int64_comparator(const void *a, const void *b);
+static int  tdigest_centroid_comparator(const void *a, const void *b);
 
-	/* OK, we do want to skip NULL values altogether */
-	if (PG_ARGISNULL(1))
-	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
-		else
-			/* if there already is a state accumulated, don't forget it */
-			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+/*
+ * Numeric values are compared using the sort support of the numeric type,
+ * with abbreviated keys (when available), so that the full comparison is
+ * only needed when the abbreviated keys are equal. The keys are computed
+ * just once, before the selection (or sort).
+ */
+typedef struct numeric_key
+{
+	Datum	abbrev;			/* abbreviated key (or the value itself) */
+	Numeric	value;
+} numeric_key;
 
-	num = PG_GETARG_NUMERIC(1);
+static inline int
+numeric_key_compare(const numeric_key *a, const numeric_key *b,
+					SortSupport ssup)
+{
+	int	cmp = ssup->comparator(a->abbrev, b->abbrev, ssup);
 
-	GET_AGG_CONTEXT("quantile_append_numeric", fcinfo, aggcontext);
+	if ((cmp == 0) && (ssup->abbrev_converter != NULL))
+		cmp = ssup->abbrev_full_comparator(NumericGetDatum(a->value),
+										   NumericGetDatum(b->value),
+										   ssup);
 
-	oldcontext = MemoryContextSwitchTo(aggcontext);
+	return cmp;
+}
 
-	if (PG_ARGISNULL(0))
+static int  numeric_key_comparator(const void *a, const void *b, void *arg);
+
+static numeric_key *numeric_sort_keys(quantile_state *state, int first,
+									  SortSupport ssup);
+static void numeric_store_keys(quantile_state *state, numeric_key *keys);
+
+/* vectorized partition, min/max and NaN scans (when supported by the CPU) */
+#include "simd_kernels.h"
+
+/*
+ * Selection of a single order statistic (used when only one quantile is
+ * needed, which does not require sorting the whole array). The double
+ * variant expects the NaN values to be moved out of the way first. The
+ * double, int32 and int64 variants partition using the vectorized kernels.
+ */
+#define QS_PREFIX			double
+#define QS_ELEMENT_TYPE		double
+#define QS_LT(a, b)			((a) < (b))
+#define QS_PARTITION		double_partition_kernel
+#include "select_template.h"
+
+#define QS_PREFIX			float4
+#define QS_ELEMENT_TYPE		float4
+#define QS_LT(a, b)			((a) < (b))
+#include "select_template.h"
+
+#define QS_PREFIX			int16
+#define QS_ELEMENT_TYPE		int16
+#define QS_LT(a, b)			((a) < (b))
+#include "select_template.h"
+
+#define QS_PREFIX			int32
+#define QS_ELEMENT_TYPE		int32
+#define QS_LT(a, b)			((a) < (b))
+#define QS_PARTITION		int32_partition_kernel
+#include "select_template.h"
+
+#define QS_PREFIX			int64
+#define QS_ELEMENT_TYPE		int64
+#define QS_LT(a, b)			((a) < (b))
+#define QS_PARTITION		int64_partition_kernel
+#include "select_template.h"
+
+#define QS_PREFIX			numeric
+#define QS_ELEMENT_TYPE		numeric_key
+#define QS_ARG_TYPE			SortSupport
+#define QS_LT(a, b)			(numeric_key_compare(&(a), &(b), arg) < 0)
+#include "select_template.h"
+
+/* comparison of the full numeric values, without the abbreviated keys */
+static inline int
+numeric_full_compare(Numeric a, Numeric b, SortSupport ssup)
+{
+	if (ssup->abbrev_converter != NULL)
+		return ssup->abbrev_full_comparator(NumericGetDatum(a),
+											NumericGetDatum(b), ssup);
+
+	return ssup->comparator(NumericGetDatum(a), NumericGetDatum(b), ssup);
+}
+
+/*
+ * Merging a sorted tail into the sorted prefix of the elements, and the
+ * selection from the two sorted parts (without merging them). Used when
+ * the final function gets called repeatedly on a growing state, e.g. in a
+ * window with a frame starting at UNBOUNDED PRECEDING, and for elements
+ * added in nearly sorted order (for the fixed-width types).
+ */
+#define MS_PREFIX			double
+#define MS_ELEMENT_TYPE		double
+#define MS_LT(a, b)			FLOAT_LT(a, b)
+#define MS_WITH_SPLIT
+#include "merge_template.h"
+
+#define MS_PREFIX			float4
+#define MS_ELEMENT_TYPE		float4
+#define MS_LT(a, b)			FLOAT_LT(a, b)
+#define MS_WITH_SPLIT
+#include "merge_template.h"
+
+#define MS_PREFIX			int16
+#define MS_ELEMENT_TYPE		int16
+#define MS_LT(a, b)			((a) < (b))
+#define MS_WITH_SPLIT
+#include "merge_template.h"
+
+#define MS_PREFIX			int32
+#define MS_ELEMENT_TYPE		int32
+#define MS_LT(a, b)			((a) < (b))
+#define MS_WITH_SPLIT
+#include "merge_template.h"
+
+#define MS_PREFIX			int64
+#define MS_ELEMENT_TYPE		int64
+#define MS_LT(a, b)			((a) < (b))
+#define MS_WITH_SPLIT
+#include "merge_template.h"
+
+#define MS_PREFIX			numeric
+#define MS_ELEMENT_TYPE		Numeric
+#define MS_ARG_TYPE			SortSupport
+#define MS_LT(a, b)			(numeric_full_compare((a), (b), arg) < 0)
+#include "merge_template.h"
+
+/*
+ * Maximum length of a tail (added after the sorted prefix) which is sorted
+ * and searched separately. Longer tails get merged into the prefix. As the
+ * tail is sorted again on each call, it's kept short compared to the prefix
+ * (which is what makes the separate tail cheaper than merging each time).
+ */
+#define QUANTILE_TAIL_SIZE(nsorted)	Max(64, (int) sqrt((double) (nsorted)))
+
+/*
+ * The sorted prefix is used when the tail is short, or when a final function
+ * already ran on the state (so the subsequent calls would sort it anyway). A
+ * long tail after a prefix found by the append functions is sorted as usual.
+ */
+#define QUANTILE_SELECT_TAIL(state) \
+	(((state)->nsorted > 0) && \
+	 ((state)->finalized || \
+	  ((state)->nelements - (state)->nsorted <= QUANTILE_TAIL_SIZE((state)->nsorted))))
+
+/*
+ * Maximum number of elements out of order moved aside when sorting elements
+ * added in nearly sorted order. With more of them it's cheaper to simply sort
+ * (or select from) the whole array.
+ */
+#define QUANTILE_PRESORTED_LIMIT(nelements)	((nelements) / 16)
+
+/*
+ * Sorting of the fixed-width types (when needed) uses radix sort, with the
+ * keys mapped to unsigned integers with the same ordering. For the integer
+ * types it's enough to flip the sign bit, for float4/double the negative
+ * values need all bits flipped (NaN values have to be moved out of the way
+ * first).
+ */
+static inline uint64
+double_radix_key(double value)
+{
+	uint64	key;
+
+	memcpy(&key, &value, sizeof(uint64));
+
+	if (key & (UINT64CONST(1) << 63))
+		return ~key;
+
+	return key | (UINT64CONST(1) << 63);
+}
+
+static inline uint32
+float4_radix_key(float4 value)
+{
+	uint32	key;
+
+	memcpy(&key, &value, sizeof(uint32));
+
+	if (key & ((uint32) 1 << 31))
+		return ~key;
+
+	return key | ((uint32) 1 << 31);
+}
+
+/*
+ * Runs the task function for tasks [0, ntasks), each in a separate thread
+ * (the first one in the backend itself), and waits for all of them. The
+ * tasks must not call any PostgreSQL code - no allocations, no elog(), no
+ * interrupt checks. The threads block all signals, so that the signal
+ * handlers only ever run in the backend. If a thread can't be started, the
+ * task simply runs in the backend after the others.
+ */
+typedef void (*quantile_task_function) (void *arg, int task);
+
+typedef struct quantile_task
+{
+	quantile_task_function	function;
+	void				   *arg;
+	int						task;
+} quantile_task;
+
+static void *
+quantile_task_main(void *arg)
+{
+	quantile_task *task = (quantile_task *) arg;
+
+	task->function(task->arg, task->task);
+
+	return NULL;
+}
+
+static void
+quantile_parallel_run(quantile_task_function function, void *arg, int ntasks)
+{
+	int				i;
+	sigset_t		blocked;
+	sigset_t		oldmask;
+	pthread_t		threads[QUANTILE_SORT_MAX_THREADS];
+	bool			started[QUANTILE_SORT_MAX_THREADS];
+	quantile_task	tasks[QUANTILE_SORT_MAX_THREADS];
+
+	Assert((ntasks > 0) && (ntasks <= QUANTILE_SORT_MAX_THREADS));
+
+	/* the new threads inherit the signal mask */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_SETMASK, &blocked, &oldmask);
+
+	for (i = 1; i < ntasks; i++)
 	{
-		state = (quantile_state *) palloc(sizeof(quantile_state));
-		state->elements  = palloc(QUANTILE_MIN_ELEMENTS * sizeof(Numeric));
-		state->maxelements = QUANTILE_MIN_ELEMENTS;
-		state->nelements = 0;
+		tasks[i].function = function;
+		tasks[i].arg = arg;
+		tasks[i].task = i;
 
-		state->quantiles = (double *) palloc(sizeof(double));
-		state->quantiles[0] = PG_GETARG_FLOAT8(2);
-		state->nquantiles = 1;
+		started[i] = (pthread_create(&threads[i], NULL, quantile_task_main,
+									 &tasks[i]) == 0);
+	}
 
-		check_quantiles(state->nquantiles, state->quantiles);
+	pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
+
+	function(arg, 0);
+
+	for (i = 1; i < ntasks; i++)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			function(arg, i);
+	}
+}
+
+#define RS_PREFIX			double
+#define RS_ELEMENT_TYPE		double
+#define RS_KEY_TYPE			uint64
+#define RS_KEY(x)			double_radix_key(x)
+#define RS_COMPARATOR		double_comparator
+#define RS_PARALLEL_THREADS(n)	QUANTILE_SORT_THREADS(n)
+#define RS_PARALLEL_MAX_THREADS	QUANTILE_SORT_MAX_THREADS
+#define RS_PARALLEL_RUN(f, a, n)	quantile_parallel_run((f), (a), (n))
+#include "radix_template.h"
+
+#define RS_PREFIX			float4
+#define RS_ELEMENT_TYPE		float4
+#define RS_KEY_TYPE			uint32
+#define RS_KEY(x)			float4_radix_key(x)
+#define RS_COMPARATOR		float4_comparator
+#define RS_PARALLEL_THREADS(n)	QUANTILE_SORT_THREADS(n)
+#define RS_PARALLEL_MAX_THREADS	QUANTILE_SORT_MAX_THREADS
+#define RS_PARALLEL_RUN(f, a, n)	quantile_parallel_run((f), (a), (n))
+#include "radix_template.h"
+
+#define RS_PREFIX			int16
+#define RS_ELEMENT_TYPE		int16
+#define RS_KEY_TYPE			uint16
+#define RS_KEY(x)			((uint16) (x) ^ ((uint16) 1 << 15))
+#define RS_COMPARATOR		int16_comparator
+#define RS_PARALLEL_THREADS(n)	QUANTILE_SORT_THREADS(n)
+#define RS_PARALLEL_MAX_THREADS	QUANTILE_SORT_MAX_THREADS
+#define RS_PARALLEL_RUN(f, a, n)	quantile_parallel_run((f), (a), (n))
+#include "radix_template.h"
+
+#define RS_PREFIX			int32
+#define RS_ELEMENT_TYPE		int32
+#define RS_KEY_TYPE			uint32
+#define RS_KEY(x)			((uint32) (x) ^ ((uint32) 1 << 31))
+#define RS_COMPARATOR		int32_comparator
+#define RS_PARALLEL_THREADS(n)	QUANTILE_SORT_THREADS(n)
+#define RS_PARALLEL_MAX_THREADS	QUANTILE_SORT_MAX_THREADS
+#define RS_PARALLEL_RUN(f, a, n)	quantile_parallel_run((f), (a), (n))
+#include "radix_template.h"
+
+#define RS_PREFIX			int64
+#define RS_ELEMENT_TYPE		int64
+#define RS_KEY_TYPE			uint64
+#define RS_KEY(x)			((uint64) (x) ^ (UINT64CONST(1) << 63))
+#define RS_COMPARATOR		int64_comparator
+#define RS_PARALLEL_THREADS(n)	QUANTILE_SORT_THREADS(n)
+#define RS_PARALLEL_MAX_THREADS	QUANTILE_SORT_MAX_THREADS
+#define RS_PARALLEL_RUN(f, a, n)	quantile_parallel_run((f), (a), (n))
+#include "radix_template.h"
+
+static int	double_partition_nans(double *elements, int nelements);
+static int	float4_partition_nans(float4 *elements, int nelements);
+
+static void double_select_tail(quantile_state *state, int *positions,
+							   int npositions, double *values);
+static void float4_select_tail(quantile_state *state, int *positions,
+							   int npositions, float4 *values);
+static void int16_select_tail(quantile_state *state, int *positions,
+							  int npositions, int16 *values);
+static void int32_select_tail(quantile_state *state, int *positions,
+							  int npositions, int32 *values);
+static void int64_select_tail(quantile_state *state, int *positions,
+							  int npositions, int64 *values);
+static void numeric_select_tail(quantile_state *state, int *positions,
+								int npositions, Numeric *values);
+
+static bool double_sort_presorted(quantile_state *state);
+static bool float4_sort_presorted(quantile_state *state);
+static bool int16_sort_presorted(quantile_state *state);
+static bool int32_sort_presorted(quantile_state *state);
+static bool int64_sort_presorted(quantile_state *state);
+
+static void	double_sort_run(void *elements, int nelements);
+static void	float4_sort_run(void *elements, int nelements);
+static void	int16_sort_run(void *elements, int nelements);
+static void	int32_sort_run(void *elements, int nelements);
+static void	int64_sort_run(void *elements, int nelements);
+
+static void	double_merge_run(void *a, int na, void *b, int nb);
+static void	float4_merge_run(void *a, int na, void *b, int nb);
+static void	int16_merge_run(void *a, int na, void *b, int nb);
+static void	int32_merge_run(void *a, int na, void *b, int nb);
+static void	int64_merge_run(void *a, int na, void *b, int nb);
+
+static void	double_select_run(void *elements, int nelements, int k);
+static void	float4_select_run(void *elements, int nelements, int k);
+static void	int16_select_run(void *elements, int nelements, int k);
+static void	int32_select_run(void *elements, int nelements, int k);
+static void	int64_select_run(void *elements, int nelements, int k);
+
+static void	int16_minmax(const void *elements, int nelements, int64 *min, int64 *max);
+static void	int32_minmax(const void *elements, int nelements, int64 *min, int64 *max);
+static void	int64_minmax(const void *elements, int nelements, int64 *min, int64 *max);
+
+static void	double_approximate(struct tdigest_state *digest, const void *elements, int nelements);
+static void	float4_approximate(struct tdigest_state *digest, const void *elements, int nelements);
+static void	int16_approximate(struct tdigest_state *digest, const void *elements, int nelements);
+static void	int32_approximate(struct tdigest_state *digest, const void *elements, int nelements);
+static void	int64_approximate(struct tdigest_state *digest, const void *elements, int nelements);
+
+static void	double_estimate(double value, void *element);
+static void	float4_estimate(double value, void *element);
+static void	int16_estimate(double value, void *element);
+static void	int32_estimate(double value, void *element);
+static void	int64_estimate(double value, void *element);
+
+static const quantile_spill_ops double_spill_ops =
+	{sizeof(double), double_sort_run, double_merge_run, double_select_run,
+	 double_comparator, NULL,
+	 double_approximate, double_estimate};
+
+static const quantile_spill_ops float4_spill_ops =
+	{sizeof(float4), float4_sort_run, float4_merge_run, float4_select_run,
+	 float4_comparator, NULL,
+	 float4_approximate, float4_estimate};
+
+static const quantile_spill_ops int16_spill_ops =
+	{sizeof(int16), int16_sort_run, int16_merge_run, int16_select_run,
+	 int16_comparator, int16_minmax,
+	 int16_approximate, int16_estimate};
+
+static const quantile_spill_ops int32_spill_ops =
+	{sizeof(int32), int32_sort_run, int32_merge_run, int32_select_run,
+	 int32_comparator, int32_minmax,
+	 int32_approximate, int32_estimate};
+
+static const quantile_spill_ops int64_spill_ops =
+	{sizeof(int64), int64_sort_run, int64_merge_run, int64_select_run,
+	 int64_comparator, int64_minmax,
+	 int64_approximate, int64_estimate};
+
+/* creating the states, adding space for elements and spilling them */
+static quantile_state *
+quantile_state_create(FunctionCallInfo fcinfo, int elemsize, int maxelements,
+					  quantile_limit mode);
+
+static void quantile_state_ext_alloc(quantile_state *state);
+
+static void
+quantile_state_reserve(FunctionCallInfo fcinfo, quantile_state *state,
+					   int elemsize, const quantile_spill_ops *ops);
+
+static void
+quantile_state_grow(quantile_state *state, int elemsize, int nelements);
+
+static int
+quantile_expected_elements(FunctionCallInfo fcinfo);
+
+/* counting the values of inputs with only a few distinct values */
+static bool
+quantile_counted_fold(quantile_state *state, const quantile_spill_ops *ops);
+
+static bool
+quantile_counted_fold_keys(quantile_state *state, const quantile_spill_ops *ops);
+
+static void
+quantile_counted_expand(FunctionCallInfo fcinfo, quantile_state *state,
+						const quantile_spill_ops *ops);
+
+static bool
+quantile_counted(FunctionCallInfo fcinfo, quantile_state *state,
+				 const quantile_spill_ops *ops);
+
+static void
+quantile_counted_select(quantile_state *state, const quantile_spill_ops *ops,
+						int *indexes, int nquantiles, int *positions,
+						int npositions, void *result);
+
+static int
+quantile_counted_sorted(quantile_state *state, const quantile_spill_ops *ops,
+						char **values, int **counts);
+
+static Numeric
+quantile_numeric_copy(quantile_state *state, const void *value, Size len);
+
+static void quantile_numeric_check_memory(quantile_state *state,
+										  int maxelements);
+static void quantile_numeric_overflow(quantile_state *state);
+
+/* numeric values stored as fixed-point integers */
+static int numeric_fixed_scale(Numeric num);
+static bool numeric_to_fixed(Numeric num, int scale, int64 *result);
+static Numeric fixed_to_numeric(int64 value, int scale);
+
+static void
+quantile_numeric_add(FunctionCallInfo fcinfo, quantile_state *state,
+					 Numeric num);
+
+static void
+quantile_numeric_unfix(quantile_state *state);
+
+/* runtime statistics of the states */
+static void
+quantile_stats_memory(quantile_state *state);
+
+static void
+quantile_stats_final_start(quantile_state *state);
+
+static void
+quantile_stats_final_end(quantile_state *state);
+
+static void
+quantile_stats_publish(Datum arg);
+
+static void
+quantile_spill_select(FunctionCallInfo fcinfo, quantile_state *state,
+					  const quantile_spill_ops *ops, int *indexes,
+					  int nquantiles, int *positions, int npositions,
+					  void *result);
+
+/* estimating the quantiles of states over the memory limit */
+static void
+quantile_approx_begin(quantile_state *state, const quantile_spill_ops *ops);
+
+static void
+quantile_approx_fold(quantile_state *state, const quantile_spill_ops *ops);
+
+static void
+quantile_approx_select(quantile_state *state, const quantile_spill_ops *ops,
+					   double *quantiles, int nquantiles, void *result);
+
+/* the t-digest (used by the approximate aggregates and sketches too) */
+static tdigest_state *tdigest_state_create(int compression);
+static void tdigest_add(tdigest_state *state, double value);
+static void tdigest_merge(tdigest_state *state, tdigest_centroid *centroids,
+						  int ncentroids, int64 count, int64 nnans,
+						  double min, double max);
+static double tdigest_estimate(tdigest_state *state, double quantile);
+static quantile_sketch *tdigest_to_sketch(tdigest_state *state);
+static tdigest_state *tdigest_from_sketch(quantile_sketch *sketch);
+static void quantile_sketch_check(quantile_sketch *sketch);
+
+static Size
+quantile_spill_pack(FunctionCallInfo fcinfo, quantile_state *state,
+					const quantile_spill_ops *ops, char *ptr, bool pack);
+
+static int *quantile_positions(quantile_state *state, double *quantiles,
+							   int nquantiles, int **positions,
+							   int *npositions);
+
+static int *quantile_count_positions(int nelements, double *quantiles,
+									 int nquantiles, int **positions,
+									 int *npositions);
+
+static double *quantile_final_quantiles(FunctionCallInfo fcinfo,
+										quantile_state *state, bool array,
+										int *nquantiles);
+
+static bool quantile_final_sort(quantile_state *state);
+
+static void quantile_copy_results(int *indexes, int nquantiles,
+								  int *positions, int npositions,
+								  const char *values, int elemsize,
+								  void *result);
+
+/* parse the quantiles array */
+static double *
+array_to_double(FunctionCallInfo fcinfo, ArrayType *v, int * len);
+
+static void
+quantile_state_set_quantiles(FunctionCallInfo fcinfo, quantile_state *state,
+							 const void *quantiles, int nquantiles);
+
+static Datum
+double_to_array(FunctionCallInfo fcinfo, double * d, int len);
+
+static Datum
+float4_to_array(FunctionCallInfo fcinfo, float4 * d, int len);
+
+static Datum
+int16_to_array(FunctionCallInfo fcinfo, int16 * d, int len);
+
+static Datum
+int32_to_array(FunctionCallInfo fcinfo, int32 * d, int len);
+
+static Datum
+int64_to_array(FunctionCallInfo fcinfo, int64 * d, int len);
+
+static void
+int64_final_values(FunctionCallInfo fcinfo, quantile_state *state,
+				   double *quantiles, int nquantiles, int64 *result);
+
+static Datum
+numeric_to_array(FunctionCallInfo fcinfo, Numeric * d, int len);
+
+static void
+check_quantiles(int nquantiles, double * quantiles);
+
+/* parallel aggregation (combining and serializing the states) */
+static Datum
+quantile_combine(FunctionCallInfo fcinfo, const char *fname, int elemsize,
+				 const quantile_spill_ops *ops, bool copy_numerics);
+
+static void
+quantile_combine_elements(FunctionCallInfo fcinfo, quantile_state *state1,
+						  quantile_state *state2, int elemsize,
+						  const quantile_spill_ops *ops, bool copy_numerics);
+
+static void
+quantile_combine_spilled(FunctionCallInfo fcinfo, quantile_state *state1,
+						 quantile_state *state2, const quantile_spill_ops *ops);
+
+static void
+quantile_combine_counted(FunctionCallInfo fcinfo, quantile_state *state1,
+						 quantile_state *state2, const quantile_spill_ops *ops);
+
+static bytea *
+quantile_serialize(FunctionCallInfo fcinfo, quantile_state *state,
+				   const quantile_spill_ops *ops);
+
+static quantile_state *
+quantile_deserialize(FunctionCallInfo fcinfo, bytea *data,
+					 const quantile_spill_ops *ops);
+
+void		_PG_init(void);
+
+/* prototypes */
+PG_FUNCTION_INFO_V1(quantile_append_double_array);
+PG_FUNCTION_INFO_V1(quantile_append_double);
+
+PG_FUNCTION_INFO_V1(quantile_double_array);
+PG_FUNCTION_INFO_V1(quantile_double);
+
+PG_FUNCTION_INFO_V1(quantile_append_float4_array);
+PG_FUNCTION_INFO_V1(quantile_append_float4);
+
+PG_FUNCTION_INFO_V1(quantile_float4_array);
+PG_FUNCTION_INFO_V1(quantile_float4);
+
+PG_FUNCTION_INFO_V1(quantile_append_int32_array);
+PG_FUNCTION_INFO_V1(quantile_append_int32);
+
+PG_FUNCTION_INFO_V1(quantile_int32_array);
+PG_FUNCTION_INFO_V1(quantile_int32);
+
+PG_FUNCTION_INFO_V1(quantile_append_int16_array);
+PG_FUNCTION_INFO_V1(quantile_append_int16);
+
+PG_FUNCTION_INFO_V1(quantile_int16_array);
+PG_FUNCTION_INFO_V1(quantile_int16);
+
+PG_FUNCTION_INFO_V1(quantile_append_int64_array);
+PG_FUNCTION_INFO_V1(quantile_append_int64);
+
+PG_FUNCTION_INFO_V1(quantile_int64_array);
+PG_FUNCTION_INFO_V1(quantile_int64);
+
+PG_FUNCTION_INFO_V1(quantile_append_numeric_array);
+PG_FUNCTION_INFO_V1(quantile_append_numeric);
+
+PG_FUNCTION_INFO_V1(quantile_numeric_array);
+PG_FUNCTION_INFO_V1(quantile_numeric);
+
+PG_FUNCTION_INFO_V1(quantile_combine_double);
+PG_FUNCTION_INFO_V1(quantile_combine_float4);
+PG_FUNCTION_INFO_V1(quantile_combine_int32);
+PG_FUNCTION_INFO_V1(quantile_combine_int16);
+PG_FUNCTION_INFO_V1(quantile_combine_int64);
+PG_FUNCTION_INFO_V1(quantile_combine_numeric);
+
+PG_FUNCTION_INFO_V1(quantile_serialize_double);
+PG_FUNCTION_INFO_V1(quantile_serialize_float4);
+PG_FUNCTION_INFO_V1(quantile_serialize_int32);
+PG_FUNCTION_INFO_V1(quantile_serialize_int16);
+PG_FUNCTION_INFO_V1(quantile_serialize_int64);
+PG_FUNCTION_INFO_V1(quantile_serialize_numeric);
+
+PG_FUNCTION_INFO_V1(quantile_deserialize_double);
+PG_FUNCTION_INFO_V1(quantile_deserialize_float4);
+PG_FUNCTION_INFO_V1(quantile_deserialize_int32);
+PG_FUNCTION_INFO_V1(quantile_deserialize_int16);
+PG_FUNCTION_INFO_V1(quantile_deserialize_int64);
+PG_FUNCTION_INFO_V1(quantile_deserialize_numeric);
+
+PG_FUNCTION_INFO_V1(quantile_approx_append);
+PG_FUNCTION_INFO_V1(quantile_approx_append_array);
+
+PG_FUNCTION_INFO_V1(quantile_approx_double);
+PG_FUNCTION_INFO_V1(quantile_approx_double_array);
+
+PG_FUNCTION_INFO_V1(quantile_approx_combine);
+PG_FUNCTION_INFO_V1(quantile_approx_serialize);
+PG_FUNCTION_INFO_V1(quantile_approx_deserialize);
+
+PG_FUNCTION_INFO_V1(quantile_sketch_in);
+PG_FUNCTION_INFO_V1(quantile_sketch_out);
+PG_FUNCTION_INFO_V1(quantile_sketch_send);
+PG_FUNCTION_INFO_V1(quantile_sketch_recv);
+
+PG_FUNCTION_INFO_V1(quantile_sketch_append);
+PG_FUNCTION_INFO_V1(quantile_sketch_merge);
+PG_FUNCTION_INFO_V1(quantile_sketch_final);
+
+PG_FUNCTION_INFO_V1(quantile_sketch_get);
+PG_FUNCTION_INFO_V1(quantile_sketch_get_array);
+
+PG_FUNCTION_INFO_V1(quantile_moving_append_double);
+PG_FUNCTION_INFO_V1(quantile_moving_append_double_array);
+PG_FUNCTION_INFO_V1(quantile_moving_remove_double);
+
+PG_FUNCTION_INFO_V1(quantile_moving_append_float4);
+PG_FUNCTION_INFO_V1(quantile_moving_append_float4_array);
+PG_FUNCTION_INFO_V1(quantile_moving_remove_float4);
+
+PG_FUNCTION_INFO_V1(quantile_moving_append_int32);
+PG_FUNCTION_INFO_V1(quantile_moving_append_int32_array);
+PG_FUNCTION_INFO_V1(quantile_moving_remove_int32);
+
+PG_FUNCTION_INFO_V1(quantile_moving_append_int16);
+PG_FUNCTION_INFO_V1(quantile_moving_append_int16_array);
+PG_FUNCTION_INFO_V1(quantile_moving_remove_int16);
+
+PG_FUNCTION_INFO_V1(quantile_moving_append_int64);
+PG_FUNCTION_INFO_V1(quantile_moving_append_int64_array);
+PG_FUNCTION_INFO_V1(quantile_moving_remove_int64);
+
+PG_FUNCTION_INFO_V1(quantile_moving_append_numeric);
+PG_FUNCTION_INFO_V1(quantile_moving_append_numeric_array);
+PG_FUNCTION_INFO_V1(quantile_moving_remove_numeric);
+
+PG_FUNCTION_INFO_V1(quantile_moving_double);
+PG_FUNCTION_INFO_V1(quantile_moving_double_array);
+PG_FUNCTION_INFO_V1(quantile_moving_float4);
+PG_FUNCTION_INFO_V1(quantile_moving_float4_array);
+PG_FUNCTION_INFO_V1(quantile_moving_int32);
+PG_FUNCTION_INFO_V1(quantile_moving_int32_array);
+PG_FUNCTION_INFO_V1(quantile_moving_int16);
+PG_FUNCTION_INFO_V1(quantile_moving_int16_array);
+
+PG_FUNCTION_INFO_V1(quantile_moving_int64);
+PG_FUNCTION_INFO_V1(quantile_moving_int64_array);
+PG_FUNCTION_INFO_V1(quantile_moving_numeric);
+PG_FUNCTION_INFO_V1(quantile_moving_numeric_array);
+
+PG_FUNCTION_INFO_V1(quantile_sample_append_double);
+PG_FUNCTION_INFO_V1(quantile_sample_append_double_array);
+PG_FUNCTION_INFO_V1(quantile_sample_combine);
+PG_FUNCTION_INFO_V1(quantile_sample_serialize);
+PG_FUNCTION_INFO_V1(quantile_sample_deserialize);
+
+PG_FUNCTION_INFO_V1(quantile_hdr_append);
+PG_FUNCTION_INFO_V1(quantile_hdr_append_array);
+PG_FUNCTION_INFO_V1(quantile_hdr_int64);
+PG_FUNCTION_INFO_V1(quantile_hdr_int64_array);
+PG_FUNCTION_INFO_V1(quantile_hdr_combine);
+PG_FUNCTION_INFO_V1(quantile_hdr_serialize);
+PG_FUNCTION_INFO_V1(quantile_hdr_deserialize);
+
+PG_FUNCTION_INFO_V1(quantile_presorted_append);
+PG_FUNCTION_INFO_V1(quantile_presorted_append_array);
+PG_FUNCTION_INFO_V1(quantile_presorted);
+PG_FUNCTION_INFO_V1(quantile_presorted_array);
+
+PG_FUNCTION_INFO_V1(quantile_append_double_values);
+PG_FUNCTION_INFO_V1(quantile_append_double_values_array);
+PG_FUNCTION_INFO_V1(quantile_append_int64_values);
+PG_FUNCTION_INFO_V1(quantile_append_int64_values_array);
+PG_FUNCTION_INFO_V1(quantile_of);
+PG_FUNCTION_INFO_V1(quantile_of_array);
+
+PG_FUNCTION_INFO_V1(quantile_stats);
+PG_FUNCTION_INFO_V1(quantile_stats_reset);
+
+Datum quantile_append_double_array(PG_FUNCTION_ARGS);
+Datum quantile_append_double(PG_FUNCTION_ARGS);
+
+Datum quantile_double_array(PG_FUNCTION_ARGS);
+Datum quantile_double(PG_FUNCTION_ARGS);
+
+Datum quantile_append_float4_array(PG_FUNCTION_ARGS);
+Datum quantile_append_float4(PG_FUNCTION_ARGS);
+
+Datum quantile_float4_array(PG_FUNCTION_ARGS);
+Datum quantile_float4(PG_FUNCTION_ARGS);
+
+Datum quantile_append_int32_array(PG_FUNCTION_ARGS);
+Datum quantile_append_int32(PG_FUNCTION_ARGS);
+
+Datum quantile_int32_array(PG_FUNCTION_ARGS);
+Datum quantile_int32(PG_FUNCTION_ARGS);
+
+Datum quantile_append_int16_array(PG_FUNCTION_ARGS);
+Datum quantile_append_int16(PG_FUNCTION_ARGS);
+
+Datum quantile_int16_array(PG_FUNCTION_ARGS);
+Datum quantile_int16(PG_FUNCTION_ARGS);
+
+Datum quantile_append_int64_array(PG_FUNCTION_ARGS);
+Datum quantile_append_int64(PG_FUNCTION_ARGS);
+
+Datum quantile_int64_array(PG_FUNCTION_ARGS);
+Datum quantile_int64(PG_FUNCTION_ARGS);
+
+Datum quantile_append_numeric_array(PG_FUNCTION_ARGS);
+Datum quantile_append_numeric(PG_FUNCTION_ARGS);
+
+Datum quantile_numeric_array(PG_FUNCTION_ARGS);
+Datum quantile_numeric(PG_FUNCTION_ARGS);
+
+Datum quantile_combine_double(PG_FUNCTION_ARGS);
+Datum quantile_combine_float4(PG_FUNCTION_ARGS);
+Datum quantile_combine_int32(PG_FUNCTION_ARGS);
+Datum quantile_combine_int16(PG_FUNCTION_ARGS);
+Datum quantile_combine_int64(PG_FUNCTION_ARGS);
+Datum quantile_combine_numeric(PG_FUNCTION_ARGS);
+
+Datum quantile_serialize_double(PG_FUNCTION_ARGS);
+Datum quantile_serialize_float4(PG_FUNCTION_ARGS);
+Datum quantile_serialize_int32(PG_FUNCTION_ARGS);
+Datum quantile_serialize_int16(PG_FUNCTION_ARGS);
+Datum quantile_serialize_int64(PG_FUNCTION_ARGS);
+Datum quantile_serialize_numeric(PG_FUNCTION_ARGS);
+
+Datum quantile_deserialize_double(PG_FUNCTION_ARGS);
+Datum quantile_deserialize_float4(PG_FUNCTION_ARGS);
+Datum quantile_deserialize_int32(PG_FUNCTION_ARGS);
+Datum quantile_deserialize_int16(PG_FUNCTION_ARGS);
+Datum quantile_deserialize_int64(PG_FUNCTION_ARGS);
+Datum quantile_deserialize_numeric(PG_FUNCTION_ARGS);
+
+Datum quantile_approx_append(PG_FUNCTION_ARGS);
+Datum quantile_approx_append_array(PG_FUNCTION_ARGS);
+
+Datum quantile_approx_double(PG_FUNCTION_ARGS);
+Datum quantile_approx_double_array(PG_FUNCTION_ARGS);
+
+Datum quantile_approx_combine(PG_FUNCTION_ARGS);
+Datum quantile_approx_serialize(PG_FUNCTION_ARGS);
+Datum quantile_approx_deserialize(PG_FUNCTION_ARGS);
+
+Datum quantile_sketch_in(PG_FUNCTION_ARGS);
+Datum quantile_sketch_out(PG_FUNCTION_ARGS);
+Datum quantile_sketch_send(PG_FUNCTION_ARGS);
+Datum quantile_sketch_recv(PG_FUNCTION_ARGS);
+
+Datum quantile_sketch_append(PG_FUNCTION_ARGS);
+Datum quantile_sketch_merge(PG_FUNCTION_ARGS);
+Datum quantile_sketch_final(PG_FUNCTION_ARGS);
+
+Datum quantile_sketch_get(PG_FUNCTION_ARGS);
+Datum quantile_sketch_get_array(PG_FUNCTION_ARGS);
+
+Datum quantile_moving_append_double(PG_FUNCTION_ARGS);
+Datum quantile_moving_append_double_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_remove_double(PG_FUNCTION_ARGS);
+
+Datum quantile_moving_append_float4(PG_FUNCTION_ARGS);
+Datum quantile_moving_append_float4_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_remove_float4(PG_FUNCTION_ARGS);
+
+Datum quantile_moving_append_int32(PG_FUNCTION_ARGS);
+Datum quantile_moving_append_int32_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_remove_int32(PG_FUNCTION_ARGS);
+
+Datum quantile_moving_append_int16(PG_FUNCTION_ARGS);
+Datum quantile_moving_append_int16_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_remove_int16(PG_FUNCTION_ARGS);
+
+Datum quantile_moving_append_int64(PG_FUNCTION_ARGS);
+Datum quantile_moving_append_int64_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_remove_int64(PG_FUNCTION_ARGS);
+
+Datum quantile_moving_append_numeric(PG_FUNCTION_ARGS);
+Datum quantile_moving_append_numeric_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_remove_numeric(PG_FUNCTION_ARGS);
+
+Datum quantile_moving_double(PG_FUNCTION_ARGS);
+Datum quantile_moving_double_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_float4(PG_FUNCTION_ARGS);
+Datum quantile_moving_float4_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_int32(PG_FUNCTION_ARGS);
+Datum quantile_moving_int32_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_int16(PG_FUNCTION_ARGS);
+Datum quantile_moving_int16_array(PG_FUNCTION_ARGS);
+
+Datum quantile_moving_int64(PG_FUNCTION_ARGS);
+Datum quantile_moving_int64_array(PG_FUNCTION_ARGS);
+Datum quantile_moving_numeric(PG_FUNCTION_ARGS);
+Datum quantile_moving_numeric_array(PG_FUNCTION_ARGS);
+
+Datum quantile_sample_append_double(PG_FUNCTION_ARGS);
+Datum quantile_sample_append_double_array(PG_FUNCTION_ARGS);
+Datum quantile_sample_combine(PG_FUNCTION_ARGS);
+Datum quantile_sample_serialize(PG_FUNCTION_ARGS);
+Datum quantile_sample_deserialize(PG_FUNCTION_ARGS);
+
+Datum quantile_presorted_append(PG_FUNCTION_ARGS);
+Datum quantile_presorted_append_array(PG_FUNCTION_ARGS);
+Datum quantile_presorted(PG_FUNCTION_ARGS);
+Datum quantile_presorted_array(PG_FUNCTION_ARGS);
+
+Datum quantile_append_double_values(PG_FUNCTION_ARGS);
+Datum quantile_append_double_values_array(PG_FUNCTION_ARGS);
+Datum quantile_append_int64_values(PG_FUNCTION_ARGS);
+Datum quantile_append_int64_values_array(PG_FUNCTION_ARGS);
+Datum quantile_of(PG_FUNCTION_ARGS);
+Datum quantile_of_array(PG_FUNCTION_ARGS);
+
+Datum quantile_stats(PG_FUNCTION_ARGS);
+Datum quantile_stats_reset(PG_FUNCTION_ARGS);
+
+/* all the elements in memory got sorted */
+static inline void
+quantile_mark_sorted(quantile_state *state)
+{
+	state->nsorted = state->nelements;
+	state->ndescents = 0;
+	state->nascents = state->nelements;
+}
+
+/* the elements got reordered (or added without counting) */
+static inline void
+quantile_order_unknown(quantile_state *state)
+{
+	state->ndescents = state->nelements;
+	state->nascents = state->nelements;
+}
+
+static void
+AssertCheckQuantileState(quantile_state *state)
+{
+#ifdef USE_ASSERT_CHECKING
+	/* the ordered-set aggregates get the quantiles in the final function */
+	Assert(state->nquantiles >= 0);
+
+	Assert(state->nelements >= 0);
+	Assert(state->nelements <= state->maxelements);
+	Assert(state->nsorted <= state->nelements);
+	Assert(state->ndescents <= state->nelements);
+	Assert(state->nascents <= state->nelements);
+	Assert(state->maxelements <= state->spillelements);
+
+	Assert((state->ext->nruns == 0) || (state->ext->file != NULL));
+	Assert((state->ext->nspilled > 0) == (state->ext->nruns > 0));
+
+	Assert(state->ext->nkeys <= state->ext->ncounted);
+	Assert((state->ext->nkeys == 0) || (state->ext->ndense == 0));
+	Assert((state->ext->ncounted == 0) || (state->ext->nruns == 0));
+	Assert((state->ext->nkeys + state->ext->ndense == 0) ==
+		   (state->ext->ncounted == 0));
+	Assert((state->ext->digest == NULL) || (state->ext->nruns == 0));
+	Assert((state->ext->digest == NULL) || !state->counting);
+#endif
+}
+
+void
+_PG_init(void)
+{
+	DefineCustomIntVariable("quantile.work_mem",
+							"Sets the maximum memory used for the values of a single quantile aggregate.",
+							"Values over the limit are sorted and written to temporary files. "
+							"-1 means to use work_mem, 0 disables the limit.",
+							&quantile_work_mem,
+							-1, -1, MAX_KILOBYTES,
+							PGC_USERSET,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+
+	DefineCustomEnumVariable("quantile.on_overflow",
+							 "Sets what happens when a quantile aggregate reaches the memory limit.",
+							 "With 'error' the query fails, with 'spill' the values are written "
+							 "to temporary files (only in regular aggregates of fixed-width "
+							 "values, others ignore the limit), and with 'approximate' the "
+							 "quantiles are estimated using a t-digest (numeric values and "
+							 "moving window frames fail instead).",
+							 &quantile_on_overflow,
+							 QUANTILE_OVERFLOW_SPILL,
+							 quantile_overflow_options,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomBoolVariable("quantile.track_stats",
+							 "Collects runtime statistics of the quantile aggregates.",
+							 "The statistics are logged at DEBUG1 when the aggregate "
+							 "finishes, and returned by quantile_stats().",
+							 &quantile_track_stats,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL, NULL, NULL);
+
+	DefineCustomIntVariable("quantile.sort_threads",
+							"Sets the number of threads sorting large arrays of values.",
+							"Applies to all sorts of fixed-width values (in the final "
+							"functions, of the runs written to temporary files, and of "
+							"the serialized and combined states), with at least 1M "
+							"values for each thread. 1 disables the parallel sort.",
+							&quantile_sort_threads,
+							1, 1, QUANTILE_SORT_MAX_THREADS,
+							PGC_USERSET,
+							0,
+							NULL, NULL, NULL);
+
+	DefineCustomIntVariable("quantile.sort_thread_elements",
+							"Sets the minimum number of values sorted by each thread.",
+							"Developer option, meant for testing the parallel sort.",
+							&quantile_sort_thread_elements,
+							QUANTILE_SORT_THREAD_ELEMENTS, 1024, INT_MAX,
+							PGC_USERSET,
+							GUC_NO_SHOW_ALL | GUC_NOT_IN_SAMPLE,
+							NULL, NULL, NULL);
+
+#if (PG_VERSION_NUM >= 150000)
+	MarkGUCPrefixReserved("quantile");
+#else
+	EmitWarningsOnPlaceholders("quantile");
+#endif
+
+	quantile_simd_init();
+}
+
+/*
+ * The memory consumption might be a problem, as all the values are
+ * kept in the memory - for example 1.000.000 of 8-byte values (bigint)
+ * requires about 8MB of memory.
+ */
+
+Datum
+quantile_append_double(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	double		   *elements;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_append_double", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(double),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* the ordered-set aggregates pass the quantile to the final function */
+		if (PG_NARGS() > 2)
+		{
+			state->quantile = PG_GETARG_FLOAT8(2);
+			state->quantiles = &state->quantile;
+			state->nquantiles = 1;
+
+			check_quantiles(state->nquantiles, state->quantiles);
+		}
 	}
 	else
 		state = (quantile_state *) PG_GETARG_POINTER(0);
@@ -355,615 +1706,9641 @@ quantile_append_numeric(PG_FUNCTION_ARGS)
 
 	/* we can be sure the value is not null (see the check above) */
 	if (state->nelements == state->maxelements)
-	{
-		state->maxelements *= 2;
-		state->elements = repalloc(state->elements,
-								   sizeof(Numeric) * state->maxelements);
-	}
+		quantile_state_reserve(fcinfo, state, sizeof(double), &double_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	/* make sure to cast the array to (double *) before updating it */
+	elements = (double *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_FLOAT8(1), FLOAT_LT);
+	elements[state->nelements++] = PG_GETARG_FLOAT8(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_double_array(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	double		   *elements;
+	ArrayType	   *quantiles;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_append_double_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(double),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, quantiles,
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(double), &double_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	elements = (double *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_FLOAT8(1), FLOAT_LT);
+	elements[state->nelements++] = PG_GETARG_FLOAT8(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_float4(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	float4		   *elements;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_append_float4", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(float4),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* the ordered-set aggregates pass the quantile to the final function */
+		if (PG_NARGS() > 2)
+		{
+			state->quantile = PG_GETARG_FLOAT8(2);
+			state->quantiles = &state->quantile;
+			state->nquantiles = 1;
+
+			check_quantiles(state->nquantiles, state->quantiles);
+		}
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(float4), &float4_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	/* make sure to cast the array to (float4 *) before updating it */
+	elements = (float4 *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_FLOAT4(1), FLOAT_LT);
+	elements[state->nelements++] = PG_GETARG_FLOAT4(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_float4_array(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	float4		   *elements;
+	ArrayType	   *quantiles;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_append_float4_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(float4),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, quantiles,
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(float4), &float4_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	elements = (float4 *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_FLOAT4(1), FLOAT_LT);
+	elements[state->nelements++] = PG_GETARG_FLOAT4(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_numeric(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	Numeric			num;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	num = PG_GETARG_NUMERIC(1);
+
+	GET_AGG_CONTEXT("quantile_append_numeric", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(Numeric),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_MEMORY);
+
+		/* the scale of the fixed-point values comes from the first value */
+		state->fixedscale = numeric_fixed_scale(num);
+
+		/* the ordered-set aggregates pass the quantile to the final function */
+		if (PG_NARGS() > 2)
+		{
+			state->quantile = PG_GETARG_FLOAT8(2);
+			state->quantiles = &state->quantile;
+			state->nquantiles = 1;
+
+			check_quantiles(state->nquantiles, state->quantiles);
+		}
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	quantile_numeric_add(fcinfo, state, num);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_numeric_array(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	Numeric			num;
+	ArrayType	   *quantiles;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	num = PG_GETARG_NUMERIC(1);
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_append_numeric_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(Numeric),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_MEMORY);
+
+		/* the scale of the fixed-point values comes from the first value */
+		state->fixedscale = numeric_fixed_scale(num);
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, quantiles,
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	/* we can be sure the value is not null (see the check above) */
+	quantile_numeric_add(fcinfo, state, num);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_int32(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	int32		   *elements;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_append_int32", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(int32),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* the ordered-set aggregates pass the quantile to the final function */
+		if (PG_NARGS() > 2)
+		{
+			state->quantile = PG_GETARG_FLOAT8(2);
+			state->quantiles = &state->quantile;
+			state->nquantiles = 1;
+
+			check_quantiles(state->nquantiles, state->quantiles);
+		}
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(int32), &int32_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	/* make sure to cast the array to (int32 *) before updating it */
+	elements = (int32 *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_INT32(1), INTEGER_LT);
+	elements[state->nelements++] = PG_GETARG_INT32(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_int32_array(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	ArrayType	   *quantiles;
+	int32		   *elements;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_append_int32_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(int32),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, quantiles,
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(int32), &int32_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	/* make sure to cast the array to (int32 *) before updating it */
+	elements = (int32 *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_INT32(1), INTEGER_LT);
+	elements[state->nelements++] = PG_GETARG_INT32(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_int16(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	int16		   *elements;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_append_int16", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(int16),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* the ordered-set aggregates pass the quantile to the final function */
+		if (PG_NARGS() > 2)
+		{
+			state->quantile = PG_GETARG_FLOAT8(2);
+			state->quantiles = &state->quantile;
+			state->nquantiles = 1;
+
+			check_quantiles(state->nquantiles, state->quantiles);
+		}
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(int16), &int16_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	/* make sure to cast the array to (int16 *) before updating it */
+	elements = (int16 *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_INT16(1), INTEGER_LT);
+	elements[state->nelements++] = PG_GETARG_INT16(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_int16_array(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	ArrayType	   *quantiles;
+	int16		   *elements;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_append_int16_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(int16),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, quantiles,
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(int16), &int16_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	/* make sure to cast the array to (int16 *) before updating it */
+	elements = (int16 *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_INT16(1), INTEGER_LT);
+	elements[state->nelements++] = PG_GETARG_INT16(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_int64(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	int64		   *elements;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_append_int64", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(int64),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* the ordered-set aggregates pass the quantile to the final function */
+		if (PG_NARGS() > 2)
+		{
+			state->quantile = PG_GETARG_FLOAT8(2);
+			state->quantiles = &state->quantile;
+			state->nquantiles = 1;
+
+			check_quantiles(state->nquantiles, state->quantiles);
+		}
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(int64), &int64_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	/* make sure to cast the array to (int64 *) before updating it */
+	elements = (int64 *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_INT64(1), INTEGER_LT);
+	elements[state->nelements++] = PG_GETARG_INT64(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_int64_array(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	ArrayType	   *quantiles;
+	int64		   *elements;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_append_int64_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, sizeof(int64),
+									  quantile_expected_elements(fcinfo),
+									  QUANTILE_LIMIT_SPILL);
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, quantiles,
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	/* we can be sure the value is not null (see the check above) */
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(int64), &int64_spill_ops);
+
+	Assert(state->nelements < state->maxelements);
+
+	/* make sure to cast the array to (int64 *) before updating it */
+	elements = (int64 *) state->elements;
+	QUANTILE_TRACK_ORDER(state, elements, PG_GETARG_INT64(1), INTEGER_LT);
+	elements[state->nelements++] = PG_GETARG_INT64(1);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Aggregates over arrays of values (e.g. samples stored as an array in each
+ * row). All the values of an array get added to the state at once, in chunks
+ * as large as the space left in the elements array, so adding a value costs
+ * about as much as copying it. NULL values in the arrays are skipped.
+ */
+static Datum
+quantile_append_values(FunctionCallInfo fcinfo, const char *fname,
+					   const quantile_spill_ops *ops, bool array)
+{
+	int				i;
+	int				nitems;
+	int				elemsize = ops->elemsize;
+	char		   *data;
+	bits8		   *bitmap;
+	quantile_state *state;
+	ArrayType	   *values;
+	ArrayType	   *quantiles = NULL;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	values = PG_GETARG_ARRAYTYPE_P(1);
+
+	if (array)
+		quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT(fname, fcinfo, aggcontext);
+
+	nitems = ArrayGetNItems(ARR_NDIM(values), ARR_DIMS(values));
+	bitmap = ARR_NULLBITMAP(values);
+
+	/* empty arrays (or only NULL values) are skipped, just like NULL arrays */
+	if (bitmap != NULL)
+	{
+		int		nvalues = 0;
+
+		for (i = 0; i < nitems; i++)
+			nvalues += ((bitmap[i / 8] & (1 << (i % 8))) != 0);
+
+		if (nvalues == 0)
+			nitems = 0;
+	}
+
+	if (nitems == 0)
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_state_create(fcinfo, elemsize,
+									  Max(quantile_expected_elements(fcinfo),
+										  nitems),
+									  QUANTILE_LIMIT_SPILL);
+
+		if (array)
+			state->quantiles = array_to_double(fcinfo, quantiles,
+											   &state->nquantiles);
+		else
+		{
+			state->quantile = PG_GETARG_FLOAT8(2);
+			state->quantiles = &state->quantile;
+			state->nquantiles = 1;
+		}
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	AssertCheckQuantileState(state);
+
+	data = ARR_DATA_PTR(values);
+
+	i = 0;
+	while (i < nitems)
+	{
+		char   *elements;
+		int		n;
+
+		if (state->nelements == state->maxelements)
+			quantile_state_reserve(fcinfo, state, elemsize, ops);
+
+		elements = (char *) state->elements;
+		n = Min(nitems - i, state->maxelements - state->nelements);
+
+		/* without NULL values, the whole chunk is copied at once */
+		if (bitmap == NULL)
+		{
+			memcpy(elements + (Size) elemsize * state->nelements, data,
+				   (Size) elemsize * n);
+
+			data += (Size) elemsize * n;
+			state->nelements += n;
+			i += n;
+
+			continue;
+		}
+
+		for (; (i < nitems) && (state->nelements < state->maxelements); i++)
+		{
+			if ((bitmap[i / 8] & (1 << (i % 8))) == 0)
+				continue;
+
+			memcpy(elements + (Size) elemsize * state->nelements++, data,
+				   elemsize);
+			data += elemsize;
+		}
+	}
+
+	/* the sorted prefix is still valid, but the new elements were not counted */
+	quantile_order_unknown(state);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_append_double_values(PG_FUNCTION_ARGS)
+{
+	return quantile_append_values(fcinfo, "quantile_append_double_values",
+								  &double_spill_ops, false);
+}
+
+Datum
+quantile_append_double_values_array(PG_FUNCTION_ARGS)
+{
+	return quantile_append_values(fcinfo, "quantile_append_double_values_array",
+								  &double_spill_ops, true);
+}
+
+Datum
+quantile_append_int64_values(PG_FUNCTION_ARGS)
+{
+	return quantile_append_values(fcinfo, "quantile_append_int64_values",
+								  &int64_spill_ops, false);
+}
+
+Datum
+quantile_append_int64_values_array(PG_FUNCTION_ARGS)
+{
+	return quantile_append_values(fcinfo, "quantile_append_int64_values_array",
+								  &int64_spill_ops, true);
+}
+
+/*
+ * Quantiles of the values of a single array, without an aggregate. The
+ * non-NULL values are copied from the (detoasted) array, and the requested
+ * positions are selected directly, just like in the final functions. The
+ * results are of the element type, or NULL when there are no values.
+ */
+static bool
+quantile_of_values(FunctionCallInfo fcinfo, ArrayType *array,
+				   double *quantiles, int nquantiles, Datum *result)
+{
+	int			i;
+	int			n = 0;
+	int			nvalues;
+	int			elemsize;
+	int		   *indexes;
+	int		   *positions;
+	int			npositions;
+	char	   *data = ARR_DATA_PTR(array);
+	char	   *values;
+	bits8	   *bitmap = ARR_NULLBITMAP(array);
+	Oid			elemtype = ARR_ELEMTYPE(array);
+	int			nitems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+
+	switch (elemtype)
+	{
+		case FLOAT8OID:
+		case INT8OID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			elemsize = sizeof(int64);
+			break;
+		case FLOAT4OID:
+		case INT4OID:
+		case DATEOID:
+			elemsize = sizeof(int32);
+			break;
+		case INT2OID:
+			elemsize = sizeof(int16);
+			break;
+		default:
+			elog(ERROR, "quantile_of: unsupported array element type (OID %u)",
+				 elemtype);
+			return false;	/* keep the compiler quiet */
+	}
+
+	check_quantiles(nquantiles, quantiles);
+
+	values = palloc((Size) elemsize * Max(nitems, 1));
+
+	for (i = 0; i < nitems; i++)
+	{
+		if ((bitmap != NULL) && ((bitmap[i / 8] & (1 << (i % 8))) == 0))
+			continue;
+
+		memcpy(values + (Size) elemsize * n++, data, elemsize);
+		data += elemsize;
+	}
+
+	if (n == 0)
+		return false;
+
+	indexes = quantile_count_positions(n, quantiles, nquantiles,
+									   &positions, &npositions);
+
+	/* the NaN values are moved to the end, so only select among the rest */
+	nvalues = n;
+	if (elemtype == FLOAT8OID)
+		nvalues = double_partition_nans((double *) values, n);
+	else if (elemtype == FLOAT4OID)
+		nvalues = float4_partition_nans((float4 *) values, n);
+
+	while ((npositions > 0) && (positions[npositions-1] >= nvalues))
+		npositions--;
+
+	switch (elemtype)
+	{
+		case FLOAT8OID:
+			double_multiselect((double *) values, nvalues, positions, npositions);
+			for (i = 0; i < nquantiles; i++)
+				result[i] = Float8GetDatum(((double *) values)[indexes[i]]);
+			break;
+		case FLOAT4OID:
+			float4_multiselect((float4 *) values, nvalues, positions, npositions);
+			for (i = 0; i < nquantiles; i++)
+				result[i] = Float4GetDatum(((float4 *) values)[indexes[i]]);
+			break;
+		case INT2OID:
+			int16_multiselect((int16 *) values, nvalues, positions, npositions);
+			for (i = 0; i < nquantiles; i++)
+				result[i] = Int16GetDatum(((int16 *) values)[indexes[i]]);
+			break;
+		case INT4OID:
+		case DATEOID:
+			int32_multiselect((int32 *) values, nvalues, positions, npositions);
+			for (i = 0; i < nquantiles; i++)
+				result[i] = Int32GetDatum(((int32 *) values)[indexes[i]]);
+			break;
+		default:
+			int64_multiselect((int64 *) values, nvalues, positions, npositions);
+			for (i = 0; i < nquantiles; i++)
+				result[i] = Int64GetDatum(((int64 *) values)[indexes[i]]);
+			break;
+	}
+
+	return true;
+}
+
+Datum
+quantile_of(PG_FUNCTION_ARGS)
+{
+	double	quantile = PG_GETARG_FLOAT8(1);
+	Datum	result;
+
+	if (!quantile_of_values(fcinfo, PG_GETARG_ARRAYTYPE_P(0), &quantile, 1,
+							&result))
+		PG_RETURN_NULL();
+
+	PG_RETURN_DATUM(result);
+}
+
+Datum
+quantile_of_array(PG_FUNCTION_ARGS)
+{
+	int			nquantiles;
+	double	   *quantiles;
+	Datum	   *result;
+	ArrayType  *array = PG_GETARG_ARRAYTYPE_P(0);
+	Oid			elemtype = ARR_ELEMTYPE(array);
+	int16		typlen;
+	bool		typbyval;
+	char		typalign;
+
+	quantiles = array_to_double(fcinfo, PG_GETARG_ARRAYTYPE_P(1), &nquantiles);
+
+	result = (Datum *) palloc(sizeof(Datum) * Max(nquantiles, 1));
+
+	if (!quantile_of_values(fcinfo, array, quantiles, nquantiles, result))
+		PG_RETURN_NULL();
+
+	get_typlenbyvalalign(elemtype, &typlen, &typbyval, &typalign);
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(result, nquantiles, elemtype,
+										  typlen, typbyval, typalign));
+}
+
+Datum
+quantile_double(PG_FUNCTION_ARGS)
+{
+	int				idx = 0;
+	int				nvalues;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	double		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_double", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, false, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	if (quantiles[0] > 0)
+		idx = (int) ceil(QUANTILE_COUNT(state) * quantiles[0]) - 1;
+
+	/* few distinct values, counted instead of kept as elements */
+	if (quantile_counted(fcinfo, state, &double_spill_ops))
+	{
+		double	value;
+
+		quantile_counted_select(state, &double_spill_ops, &idx, 1, &idx, 1,
+								&value);
+
+		QUANTILE_STATS_RETURN(state, Float8GetDatum(value));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (double *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		double	value;
+
+		quantile_spill_select(fcinfo, state, &double_spill_ops,
+							  &idx, 1, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Float8GetDatum(value));
+	}
+
+	/* over the memory limit, so only estimated from a t-digest */
+	if (state->ext->digest != NULL)
+	{
+		double	value;
+
+		quantile_approx_select(state, &double_spill_ops, quantiles, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Float8GetDatum(value));
+	}
+
+	/* sorted by a previous call or added in sorted order (NaN values last) */
+	if (state->nsorted == state->nelements)
+		QUANTILE_STATS_RETURN(state, Float8GetDatum(elements[idx]));
+
+	/* sorted by a previous call, except for a tail added since then */
+	if (QUANTILE_SELECT_TAIL(state))
+	{
+		double	value;
+
+		double_select_tail(state, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Float8GetDatum(value));
+	}
+
+	/* added in (nearly) sorted order, so cheap to sort */
+	if (double_sort_presorted(state))
+		QUANTILE_STATS_RETURN(state, Float8GetDatum(elements[idx]));
+
+	if (quantile_final_sort(state))
+	{
+		QUANTILE_STATS_PATH(state, "sort");
+		double_sort_run(elements, state->nelements);
+		quantile_mark_sorted(state);
+
+		QUANTILE_STATS_RETURN(state, Float8GetDatum(elements[idx]));
+	}
+
+	QUANTILE_STATS_PATH(state, "select");
+
+	/* the NaN values are at the end, so only select among the rest */
+	nvalues = double_partition_nans(elements, state->nelements);
+
+	if (idx < nvalues)
+		double_select(elements, nvalues, idx);
+
+	QUANTILE_STATS_RETURN(state, Float8GetDatum(elements[idx]));
+}
+
+Datum
+quantile_double_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int			   *indexes;
+	int			   *positions;
+	int				npositions;
+	int				nvalues;
+	int				nquantiles;
+	double		   *quantiles;
+	double		   *result;
+	quantile_state *state;
+	double		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_double_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, true, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	result = palloc(nquantiles * sizeof(double));
+
+	indexes = quantile_positions(state, quantiles, nquantiles,
+								 &positions, &npositions);
+
+	if (quantile_counted(fcinfo, state, &double_spill_ops))
+	{
+		quantile_counted_select(state, &double_spill_ops, indexes, nquantiles,
+								positions, npositions, result);
+
+		QUANTILE_STATS_RETURN(state, double_to_array(fcinfo, result, nquantiles));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (double *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		quantile_spill_select(fcinfo, state, &double_spill_ops,
+							  indexes, nquantiles, positions, npositions,
+							  result);
+
+		QUANTILE_STATS_RETURN(state, double_to_array(fcinfo, result, nquantiles));
+	}
+
+	if (state->ext->digest != NULL)
+	{
+		quantile_approx_select(state, &double_spill_ops, quantiles, nquantiles,
+							   result);
+
+		QUANTILE_STATS_RETURN(state, double_to_array(fcinfo, result, nquantiles));
+	}
+
+	if ((state->nsorted < state->nelements) && QUANTILE_SELECT_TAIL(state))
+	{
+		double	   *values = palloc(npositions * sizeof(double));
+
+		double_select_tail(state, positions, npositions, values);
+
+		quantile_copy_results(indexes, nquantiles, positions, npositions,
+							  (char *) values, sizeof(double), result);
+
+		QUANTILE_STATS_RETURN(state, double_to_array(fcinfo, result, nquantiles));
+	}
+
+	if ((state->nsorted < state->nelements) && !double_sort_presorted(state))
+	{
+		/* the NaN values are at the end, so only select among the rest */
+		nvalues = double_partition_nans(elements, state->nelements);
+
+		while ((npositions > 0) && (positions[npositions-1] >= nvalues))
+			npositions--;
+
+		if (quantile_final_sort(state) ||
+			QUANTILE_RADIX_POSITIONS(npositions, nvalues))
+		{
+			QUANTILE_STATS_PATH(state, "sort");
+			double_sort(elements, nvalues);
+			quantile_mark_sorted(state);
+		}
+		else
+		{
+			QUANTILE_STATS_PATH(state, "multiselect");
+			double_multiselect(elements, nvalues, positions, npositions);
+		}
+	}
+
+	for (i = 0; i < nquantiles; i++)
+		result[i] = elements[indexes[i]];
+
+	QUANTILE_STATS_RETURN(state, double_to_array(fcinfo, result, nquantiles));
+}
+
+Datum
+quantile_float4(PG_FUNCTION_ARGS)
+{
+	int				idx = 0;
+	int				nvalues;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	float4		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_float4", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, false, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	if (quantiles[0] > 0)
+		idx = (int) ceil(QUANTILE_COUNT(state) * quantiles[0]) - 1;
+
+	/* few distinct values, counted instead of kept as elements */
+	if (quantile_counted(fcinfo, state, &float4_spill_ops))
+	{
+		float4	value;
+
+		quantile_counted_select(state, &float4_spill_ops, &idx, 1, &idx, 1,
+								&value);
+
+		QUANTILE_STATS_RETURN(state, Float4GetDatum(value));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (float4 *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		float4	value;
+
+		quantile_spill_select(fcinfo, state, &float4_spill_ops,
+							  &idx, 1, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Float4GetDatum(value));
+	}
+
+	/* over the memory limit, so only estimated from a t-digest */
+	if (state->ext->digest != NULL)
+	{
+		float4	value;
+
+		quantile_approx_select(state, &float4_spill_ops, quantiles, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Float4GetDatum(value));
+	}
+
+	/* sorted by a previous call or added in sorted order (NaN values last) */
+	if (state->nsorted == state->nelements)
+		QUANTILE_STATS_RETURN(state, Float4GetDatum(elements[idx]));
+
+	/* sorted by a previous call, except for a tail added since then */
+	if (QUANTILE_SELECT_TAIL(state))
+	{
+		float4	value;
+
+		float4_select_tail(state, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Float4GetDatum(value));
+	}
+
+	/* added in (nearly) sorted order, so cheap to sort */
+	if (float4_sort_presorted(state))
+		QUANTILE_STATS_RETURN(state, Float4GetDatum(elements[idx]));
+
+	if (quantile_final_sort(state))
+	{
+		QUANTILE_STATS_PATH(state, "sort");
+		float4_sort_run(elements, state->nelements);
+		quantile_mark_sorted(state);
+
+		QUANTILE_STATS_RETURN(state, Float4GetDatum(elements[idx]));
+	}
+
+	QUANTILE_STATS_PATH(state, "select");
+
+	/* the NaN values are at the end, so only select among the rest */
+	nvalues = float4_partition_nans(elements, state->nelements);
+
+	if (idx < nvalues)
+		float4_select(elements, nvalues, idx);
+
+	QUANTILE_STATS_RETURN(state, Float4GetDatum(elements[idx]));
+}
+
+Datum
+quantile_float4_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int			   *indexes;
+	int			   *positions;
+	int				npositions;
+	int				nvalues;
+	int				nquantiles;
+	double		   *quantiles;
+	float4		   *result;
+	quantile_state *state;
+	float4		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_float4_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, true, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	result = palloc(nquantiles * sizeof(float4));
+
+	indexes = quantile_positions(state, quantiles, nquantiles,
+								 &positions, &npositions);
+
+	if (quantile_counted(fcinfo, state, &float4_spill_ops))
+	{
+		quantile_counted_select(state, &float4_spill_ops, indexes, nquantiles,
+								positions, npositions, result);
+
+		QUANTILE_STATS_RETURN(state, float4_to_array(fcinfo, result, nquantiles));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (float4 *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		quantile_spill_select(fcinfo, state, &float4_spill_ops,
+							  indexes, nquantiles, positions, npositions,
+							  result);
+
+		QUANTILE_STATS_RETURN(state, float4_to_array(fcinfo, result, nquantiles));
+	}
+
+	if (state->ext->digest != NULL)
+	{
+		quantile_approx_select(state, &float4_spill_ops, quantiles, nquantiles,
+							   result);
+
+		QUANTILE_STATS_RETURN(state, float4_to_array(fcinfo, result, nquantiles));
+	}
+
+	if ((state->nsorted < state->nelements) && QUANTILE_SELECT_TAIL(state))
+	{
+		float4	   *values = palloc(npositions * sizeof(float4));
+
+		float4_select_tail(state, positions, npositions, values);
+
+		quantile_copy_results(indexes, nquantiles, positions, npositions,
+							  (char *) values, sizeof(float4), result);
+
+		QUANTILE_STATS_RETURN(state, float4_to_array(fcinfo, result, nquantiles));
+	}
+
+	if ((state->nsorted < state->nelements) && !float4_sort_presorted(state))
+	{
+		/* the NaN values are at the end, so only select among the rest */
+		nvalues = float4_partition_nans(elements, state->nelements);
+
+		while ((npositions > 0) && (positions[npositions-1] >= nvalues))
+			npositions--;
+
+		if (quantile_final_sort(state) ||
+			QUANTILE_RADIX_POSITIONS(npositions, nvalues))
+		{
+			QUANTILE_STATS_PATH(state, "sort");
+			float4_sort(elements, nvalues);
+			quantile_mark_sorted(state);
+		}
+		else
+		{
+			QUANTILE_STATS_PATH(state, "multiselect");
+			float4_multiselect(elements, nvalues, positions, npositions);
+		}
+	}
+
+	for (i = 0; i < nquantiles; i++)
+		result[i] = elements[indexes[i]];
+
+	QUANTILE_STATS_RETURN(state, float4_to_array(fcinfo, result, nquantiles));
+}
+
+Datum
+quantile_int32(PG_FUNCTION_ARGS)
+{
+	int				idx = 0;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	int32		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_int32", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, false, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	if (quantiles[0] > 0)
+		idx = (int) ceil(QUANTILE_COUNT(state) * quantiles[0]) - 1;
+
+	/* few distinct values, counted instead of kept as elements */
+	if (quantile_counted(fcinfo, state, &int32_spill_ops))
+	{
+		int32	value;
+
+		quantile_counted_select(state, &int32_spill_ops, &idx, 1, &idx, 1,
+								&value);
+
+		QUANTILE_STATS_RETURN(state, Int32GetDatum(value));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (int32 *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		int32	value;
+
+		quantile_spill_select(fcinfo, state, &int32_spill_ops,
+							  &idx, 1, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int32GetDatum(value));
+	}
+
+	/* over the memory limit, so only estimated from a t-digest */
+	if (state->ext->digest != NULL)
+	{
+		int32	value;
+
+		quantile_approx_select(state, &int32_spill_ops, quantiles, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int32GetDatum(value));
+	}
+
+	if (state->nsorted == state->nelements)
+		QUANTILE_STATS_RETURN(state, Int32GetDatum(elements[idx]));
+
+	if (QUANTILE_SELECT_TAIL(state))
+	{
+		int32	value;
+
+		int32_select_tail(state, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int32GetDatum(value));
+	}
+
+	/* added in (nearly) sorted order, so cheap to sort */
+	if (int32_sort_presorted(state))
+		QUANTILE_STATS_RETURN(state, Int32GetDatum(elements[idx]));
+
+	if (quantile_final_sort(state))
+	{
+		QUANTILE_STATS_PATH(state, "sort");
+		int32_sort(elements, state->nelements);
+		quantile_mark_sorted(state);
+	}
+	else
+	{
+		QUANTILE_STATS_PATH(state, "select");
+		int32_select(elements, state->nelements, idx);
+	}
+
+	QUANTILE_STATS_RETURN(state, Int32GetDatum(elements[idx]));
+}
+
+Datum
+quantile_int32_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int			   *indexes;
+	int			   *positions;
+	int				npositions;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	int32		   *result;
+	int32		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_int32_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, true, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	result = palloc(nquantiles * sizeof(int32));
+
+	indexes = quantile_positions(state, quantiles, nquantiles,
+								 &positions, &npositions);
+
+	if (quantile_counted(fcinfo, state, &int32_spill_ops))
+	{
+		quantile_counted_select(state, &int32_spill_ops, indexes, nquantiles,
+								positions, npositions, result);
+
+		QUANTILE_STATS_RETURN(state, int32_to_array(fcinfo, result, nquantiles));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (int32 *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		quantile_spill_select(fcinfo, state, &int32_spill_ops,
+							  indexes, nquantiles, positions, npositions,
+							  result);
+
+		QUANTILE_STATS_RETURN(state, int32_to_array(fcinfo, result, nquantiles));
+	}
+
+	if (state->ext->digest != NULL)
+	{
+		quantile_approx_select(state, &int32_spill_ops, quantiles, nquantiles,
+							   result);
+
+		QUANTILE_STATS_RETURN(state, int32_to_array(fcinfo, result, nquantiles));
+	}
+
+	if ((state->nsorted < state->nelements) && QUANTILE_SELECT_TAIL(state))
+	{
+		int32	   *values = palloc(npositions * sizeof(int32));
+
+		int32_select_tail(state, positions, npositions, values);
+
+		quantile_copy_results(indexes, nquantiles, positions, npositions,
+							  (char *) values, sizeof(int32), result);
+
+		QUANTILE_STATS_RETURN(state, int32_to_array(fcinfo, result, nquantiles));
+	}
+
+	if ((state->nsorted < state->nelements) && !int32_sort_presorted(state))
+	{
+		if (quantile_final_sort(state) ||
+			QUANTILE_RADIX_POSITIONS(npositions, state->nelements))
+		{
+			QUANTILE_STATS_PATH(state, "sort");
+			int32_sort(elements, state->nelements);
+			quantile_mark_sorted(state);
+		}
+		else
+		{
+			QUANTILE_STATS_PATH(state, "multiselect");
+			int32_multiselect(elements, state->nelements, positions, npositions);
+		}
+	}
+
+	for (i = 0; i < nquantiles; i++)
+		result[i] = elements[indexes[i]];
+
+	QUANTILE_STATS_RETURN(state, int32_to_array(fcinfo, result, nquantiles));
+}
+
+Datum
+quantile_int16(PG_FUNCTION_ARGS)
+{
+	int				idx = 0;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	int16		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_int16", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, false, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	if (quantiles[0] > 0)
+		idx = (int) ceil(QUANTILE_COUNT(state) * quantiles[0]) - 1;
+
+	/* few distinct values, counted instead of kept as elements */
+	if (quantile_counted(fcinfo, state, &int16_spill_ops))
+	{
+		int16	value;
+
+		quantile_counted_select(state, &int16_spill_ops, &idx, 1, &idx, 1,
+								&value);
+
+		QUANTILE_STATS_RETURN(state, Int16GetDatum(value));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (int16 *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		int16	value;
+
+		quantile_spill_select(fcinfo, state, &int16_spill_ops,
+							  &idx, 1, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int16GetDatum(value));
+	}
+
+	/* over the memory limit, so only estimated from a t-digest */
+	if (state->ext->digest != NULL)
+	{
+		int16	value;
+
+		quantile_approx_select(state, &int16_spill_ops, quantiles, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int16GetDatum(value));
+	}
+
+	if (state->nsorted == state->nelements)
+		QUANTILE_STATS_RETURN(state, Int16GetDatum(elements[idx]));
+
+	if (QUANTILE_SELECT_TAIL(state))
+	{
+		int16	value;
+
+		int16_select_tail(state, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int16GetDatum(value));
+	}
+
+	/* added in (nearly) sorted order, so cheap to sort */
+	if (int16_sort_presorted(state))
+		QUANTILE_STATS_RETURN(state, Int16GetDatum(elements[idx]));
+
+	if (quantile_final_sort(state))
+	{
+		QUANTILE_STATS_PATH(state, "sort");
+		int16_sort(elements, state->nelements);
+		quantile_mark_sorted(state);
+	}
+	else
+	{
+		QUANTILE_STATS_PATH(state, "select");
+		int16_select(elements, state->nelements, idx);
+	}
+
+	QUANTILE_STATS_RETURN(state, Int16GetDatum(elements[idx]));
+}
+
+Datum
+quantile_int16_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int			   *indexes;
+	int			   *positions;
+	int				npositions;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	int16		   *result;
+	int16		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_int16_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, true, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	result = palloc(nquantiles * sizeof(int16));
+
+	indexes = quantile_positions(state, quantiles, nquantiles,
+								 &positions, &npositions);
+
+	if (quantile_counted(fcinfo, state, &int16_spill_ops))
+	{
+		quantile_counted_select(state, &int16_spill_ops, indexes, nquantiles,
+								positions, npositions, result);
+
+		QUANTILE_STATS_RETURN(state, int16_to_array(fcinfo, result, nquantiles));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (int16 *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		quantile_spill_select(fcinfo, state, &int16_spill_ops,
+							  indexes, nquantiles, positions, npositions,
+							  result);
+
+		QUANTILE_STATS_RETURN(state, int16_to_array(fcinfo, result, nquantiles));
+	}
+
+	if (state->ext->digest != NULL)
+	{
+		quantile_approx_select(state, &int16_spill_ops, quantiles, nquantiles,
+							   result);
+
+		QUANTILE_STATS_RETURN(state, int16_to_array(fcinfo, result, nquantiles));
+	}
+
+	if ((state->nsorted < state->nelements) && QUANTILE_SELECT_TAIL(state))
+	{
+		int16	   *values = palloc(npositions * sizeof(int16));
+
+		int16_select_tail(state, positions, npositions, values);
+
+		quantile_copy_results(indexes, nquantiles, positions, npositions,
+							  (char *) values, sizeof(int16), result);
+
+		QUANTILE_STATS_RETURN(state, int16_to_array(fcinfo, result, nquantiles));
+	}
+
+	if ((state->nsorted < state->nelements) && !int16_sort_presorted(state))
+	{
+		if (quantile_final_sort(state) ||
+			QUANTILE_RADIX_POSITIONS(npositions, state->nelements))
+		{
+			QUANTILE_STATS_PATH(state, "sort");
+			int16_sort(elements, state->nelements);
+			quantile_mark_sorted(state);
+		}
+		else
+		{
+			QUANTILE_STATS_PATH(state, "multiselect");
+			int16_multiselect(elements, state->nelements, positions, npositions);
+		}
+	}
+
+	for (i = 0; i < nquantiles; i++)
+		result[i] = elements[indexes[i]];
+
+	QUANTILE_STATS_RETURN(state, int16_to_array(fcinfo, result, nquantiles));
+}
+
+Datum
+quantile_int64(PG_FUNCTION_ARGS)
+{
+	int				idx = 0;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	int64		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_int64", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, false, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	if (quantiles[0] > 0)
+		idx = (int) ceil(QUANTILE_COUNT(state) * quantiles[0]) - 1;
+
+	/* few distinct values, counted instead of kept as elements */
+	if (quantile_counted(fcinfo, state, &int64_spill_ops))
+	{
+		int64	value;
+
+		quantile_counted_select(state, &int64_spill_ops, &idx, 1, &idx, 1,
+								&value);
+
+		QUANTILE_STATS_RETURN(state, Int64GetDatum(value));
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (int64 *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		int64	value;
+
+		quantile_spill_select(fcinfo, state, &int64_spill_ops,
+							  &idx, 1, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int64GetDatum(value));
+	}
+
+	/* over the memory limit, so only estimated from a t-digest */
+	if (state->ext->digest != NULL)
+	{
+		int64	value;
+
+		quantile_approx_select(state, &int64_spill_ops, quantiles, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int64GetDatum(value));
+	}
+
+	if (state->nsorted == state->nelements)
+		QUANTILE_STATS_RETURN(state, Int64GetDatum(elements[idx]));
+
+	if (QUANTILE_SELECT_TAIL(state))
+	{
+		int64	value;
+
+		int64_select_tail(state, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, Int64GetDatum(value));
+	}
+
+	/* added in (nearly) sorted order, so cheap to sort */
+	if (int64_sort_presorted(state))
+		QUANTILE_STATS_RETURN(state, Int64GetDatum(elements[idx]));
+
+	if (quantile_final_sort(state))
+	{
+		QUANTILE_STATS_PATH(state, "sort");
+		int64_sort(elements, state->nelements);
+		quantile_mark_sorted(state);
+	}
+	else
+	{
+		QUANTILE_STATS_PATH(state, "select");
+		int64_select(elements, state->nelements, idx);
+	}
+
+	QUANTILE_STATS_RETURN(state, Int64GetDatum(elements[idx]));
+}
+
+Datum
+quantile_int64_array(PG_FUNCTION_ARGS)
+{
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	int64		   *result;
+
+	CHECK_AGG_CONTEXT("quantile_int64_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, true, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	result = palloc(nquantiles * sizeof(int64));
+
+	int64_final_values(fcinfo, state, quantiles, nquantiles, result);
+
+	QUANTILE_STATS_RETURN(state, int64_to_array(fcinfo, result, nquantiles));
+}
+
+/*
+ * Finds the values of the quantiles in an int64 state (one for each of the
+ * quantiles). Shared with the numeric aggregates, while the state keeps the
+ * numeric values as fixed-point integers.
+ */
+static void
+int64_final_values(FunctionCallInfo fcinfo, quantile_state *state,
+				   double *quantiles, int nquantiles, int64 *result)
+{
+	int				i;
+	int			   *indexes;
+	int			   *positions;
+	int				npositions;
+	int64		   *elements;
+
+	indexes = quantile_positions(state, quantiles, nquantiles,
+								 &positions, &npositions);
+
+	if (quantile_counted(fcinfo, state, &int64_spill_ops))
+	{
+		quantile_counted_select(state, &int64_spill_ops, indexes, nquantiles,
+								positions, npositions, result);
+		return;
+	}
+
+	/* the counted values may have been added back, growing the array */
+	elements = (int64 *) state->elements;
+
+	if (state->ext->nruns > 0)
+	{
+		quantile_spill_select(fcinfo, state, &int64_spill_ops,
+							  indexes, nquantiles, positions, npositions,
+							  result);
+		return;
+	}
+
+	if (state->ext->digest != NULL)
+	{
+		quantile_approx_select(state, &int64_spill_ops, quantiles, nquantiles,
+							   result);
+		return;
+	}
+
+	if ((state->nsorted < state->nelements) && QUANTILE_SELECT_TAIL(state))
+	{
+		int64	   *values = palloc(npositions * sizeof(int64));
+
+		int64_select_tail(state, positions, npositions, values);
+
+		quantile_copy_results(indexes, nquantiles, positions, npositions,
+							  (char *) values, sizeof(int64), result);
+		return;
+	}
+
+	if ((state->nsorted < state->nelements) && !int64_sort_presorted(state))
+	{
+		if (quantile_final_sort(state) ||
+			QUANTILE_RADIX_POSITIONS(npositions, state->nelements))
+		{
+			QUANTILE_STATS_PATH(state, "sort");
+			int64_sort(elements, state->nelements);
+			quantile_mark_sorted(state);
+		}
+		else
+		{
+			QUANTILE_STATS_PATH(state, "multiselect");
+			int64_multiselect(elements, state->nelements, positions, npositions);
+		}
+	}
+
+	for (i = 0; i < nquantiles; i++)
+		result[i] = elements[indexes[i]];
+}
+
+Datum
+quantile_numeric(PG_FUNCTION_ARGS)
+{
+	int				idx = 0;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	numeric_key	   *keys;
+	SortSupportData	ssup;
+
+	CHECK_AGG_CONTEXT("quantile_numeric", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, false, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	/* the fixed-point values are processed as int64, only the result is numeric */
+	if (state->fixedscale >= 0)
+	{
+		int64	value;
+
+		int64_final_values(fcinfo, state, quantiles, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, NumericGetDatum(fixed_to_numeric(value, state->fixedscale)));
+	}
+
+	if (quantiles[0] > 0)
+		idx = (int) ceil(QUANTILE_COUNT(state) * quantiles[0]) - 1;
+
+	if (state->nsorted == state->nelements)
+		QUANTILE_STATS_RETURN(state, NumericGetDatum(((Numeric *) state->elements)[idx]));
+
+	if (state->nsorted > 0)
+	{
+		Numeric	value;
+
+		numeric_select_tail(state, &idx, 1, &value);
+
+		QUANTILE_STATS_RETURN(state, NumericGetDatum(value));
+	}
+
+	keys = numeric_sort_keys(state, 0, &ssup);
+
+	if (quantile_final_sort(state))
+	{
+		QUANTILE_STATS_PATH(state, "sort");
+		qsort_arg(keys, state->nelements, sizeof(numeric_key),
+				  numeric_key_comparator, &ssup);
+		numeric_store_keys(state, keys);
+	}
+	else
+	{
+		QUANTILE_STATS_PATH(state, "select");
+		numeric_select(keys, state->nelements, idx, &ssup);
+	}
+
+	QUANTILE_STATS_RETURN(state, NumericGetDatum(keys[idx].value));
+}
+
+Datum
+quantile_numeric_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int			   *indexes;
+	int			   *positions;
+	int				npositions;
+	int				nquantiles;
+	double		   *quantiles;
+	quantile_state *state;
+	Numeric		   *result;
+	Numeric		   *elements;
+	numeric_key	   *keys;
+	SortSupportData	ssup;
+
+	CHECK_AGG_CONTEXT("quantile_numeric_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantiles = quantile_final_quantiles(fcinfo, state, true, &nquantiles);
+
+	if (quantiles == NULL)
+		PG_RETURN_NULL();
+
+	result = palloc(nquantiles * sizeof(Numeric));
+	elements = (Numeric *) state->elements;
+
+	if (state->fixedscale >= 0)
+	{
+		int64	   *values = palloc(nquantiles * sizeof(int64));
+
+		int64_final_values(fcinfo, state, quantiles, nquantiles, values);
+
+		for (i = 0; i < nquantiles; i++)
+			result[i] = fixed_to_numeric(values[i], state->fixedscale);
+
+		QUANTILE_STATS_RETURN(state, numeric_to_array(fcinfo, result, nquantiles));
+	}
+
+	indexes = quantile_positions(state, quantiles, nquantiles,
+								 &positions, &npositions);
+
+	if (state->nsorted == state->nelements)
+	{
+		for (i = 0; i < nquantiles; i++)
+			result[i] = elements[indexes[i]];
+
+		QUANTILE_STATS_RETURN(state, numeric_to_array(fcinfo, result, nquantiles));
+	}
+
+	if (state->nsorted > 0)
+	{
+		Numeric	   *values = palloc(npositions * sizeof(Numeric));
+
+		numeric_select_tail(state, positions, npositions, values);
+
+		quantile_copy_results(indexes, nquantiles, positions, npositions,
+							  (char *) values, sizeof(Numeric), result);
+
+		QUANTILE_STATS_RETURN(state, numeric_to_array(fcinfo, result, nquantiles));
+	}
+
+	keys = numeric_sort_keys(state, 0, &ssup);
+
+	if (quantile_final_sort(state) ||
+		QUANTILE_SORT_POSITIONS(npositions, state->nelements))
+	{
+		QUANTILE_STATS_PATH(state, "sort");
+		qsort_arg(keys, state->nelements, sizeof(numeric_key),
+				  numeric_key_comparator, &ssup);
+		numeric_store_keys(state, keys);
+	}
+	else
+	{
+		QUANTILE_STATS_PATH(state, "multiselect");
+		numeric_multiselect(keys, state->nelements, positions, npositions,
+							&ssup);
+	}
+
+	for (i = 0; i < nquantiles; i++)
+		result[i] = keys[indexes[i]].value;
+
+	QUANTILE_STATS_RETURN(state, numeric_to_array(fcinfo, result, nquantiles));
+}
+
+/*
+ * Creating the states and adding space for more elements. With spilling,
+ * the memory limit only applies to regular aggregates, as it relies on
+ * registering a callback to close the temporary file (which is not possible
+ * for window aggregates, and those keep the elements in memory). Failing or
+ * approximating the quantiles works in all contexts (see quantile_limit).
+ */
+static quantile_state *
+quantile_state_create(FunctionCallInfo fcinfo, int elemsize, int maxelements,
+					  quantile_limit mode)
+{
+	quantile_state *state;
+	int				limit = QUANTILE_WORK_MEM;
+	MemoryContext	aggcontext;
+
+	/* keep the state (with the chunk header) in the 256B chunks */
+	StaticAssertStmt(sizeof(quantile_state) <= 256 - 16,
+					 "quantile_state does not fit into 256B chunks");
+
+	state = (quantile_state *) palloc(sizeof(quantile_state));
+	state->spillelements = INT_MAX;
+
+	if ((mode != QUANTILE_LIMIT_NONE) && (limit > 0) &&
+		((quantile_on_overflow != QUANTILE_OVERFLOW_SPILL) ||
+		 ((mode == QUANTILE_LIMIT_SPILL) &&
+		  (AggCheckCallContext(fcinfo, NULL) == AGG_CONTEXT_AGGREGATE))))
+		state->spillelements = (int) Max(QUANTILE_MIN_ELEMENTS,
+										 Min((int64) limit * 1024L / elemsize,
+											 INT_MAX));
+
+	state->maxelements = Min(Max(QUANTILE_MIN_ELEMENTS, maxelements),
+							 state->spillelements);
+
+	/* use the inline buffer (as a whole) if the elements fit into it */
+	if ((Size) elemsize * state->maxelements <= QUANTILE_INLINE_BYTES)
+	{
+		state->maxelements = Min(QUANTILE_INLINE_BYTES / elemsize,
+								 state->spillelements);
+		state->elements = state->inline_elements;
+	}
+	else
+		state->elements = MemoryContextAllocHuge(CurrentMemoryContext,
+												 (Size) elemsize * state->maxelements);
+	state->nelements = 0;
+	state->nsorted = 0;
+	state->finalized = false;
+	state->ndescents = 0;
+	state->nascents = 0;
+
+	state->nquantiles = 0;
+	state->quantiles = NULL;
+
+	state->fixedscale = -1;
+	state->counting = true;
+	state->overflow = quantile_on_overflow;
+
+	state->ext = (quantile_state_ext *) &quantile_state_ext_default;
+
+	/* not for the deserialized states (short-lived, see quantile_spill_write) */
+	if (quantile_track_stats &&
+		(AggCheckCallContext(fcinfo, &aggcontext) == AGG_CONTEXT_AGGREGATE) &&
+		(CurrentMemoryContext == aggcontext))
+	{
+		quantile_state_ext_alloc(state);
+
+		state->ext->stats = palloc0(sizeof(quantile_state_stats));
+		state->ext->stats->func = fcinfo->flinfo->fn_oid;
+		state->ext->stats->elemsize = elemsize;
+		state->ext->stats->path = "none";
+
+		quantile_stats_memory(state);
+
+		AggRegisterCallback(fcinfo, quantile_stats_publish,
+							PointerGetDatum(state));
+	}
+
+	return state;
+}
+
+/*
+ * Makes sure the state has its own copy of the rarely used fields, so that
+ * they can be changed (the copy is allocated in the context of the state).
+ */
+static void
+quantile_state_ext_alloc(quantile_state *state)
+{
+	if (state->ext != &quantile_state_ext_default)
+		return;
+
+	state->ext = (quantile_state_ext *)
+		MemoryContextAllocZero(GetMemoryChunkContext(state),
+							   sizeof(quantile_state_ext));
+}
+
+/*
+ * Copies a numeric value (len bytes, including the header) into the current
+ * block of the state, starting a new block (in the current memory context)
+ * when it does not fit. The blocks are never freed individually, they go
+ * away with the aggregate context.
+ */
+static Numeric
+quantile_numeric_copy(quantile_state *state, const void *value, Size len)
+{
+	Numeric	result;
+
+	if (state->ext->blockused + INTALIGN(len) > state->ext->blocksize)
+	{
+		Size	blocksize = QUANTILE_MIN_BLOCK;
+
+		quantile_state_ext_alloc(state);
+
+		if (state->ext->block != NULL)
+			blocksize = Min(state->ext->blocksize * 2, QUANTILE_MAX_BLOCK);
+
+		state->ext->blocksize = Max(blocksize, INTALIGN(len));
+		state->ext->blockbytes += state->ext->blocksize;
+
+		quantile_numeric_check_memory(state, state->maxelements);
+
+		state->ext->block = palloc(state->ext->blocksize);
+		state->ext->blockused = 0;
+
+		if (state->ext->stats != NULL)
+		{
+			state->ext->stats->blockbytes += state->ext->blocksize;
+			quantile_stats_memory(state);
+		}
+	}
+
+	result = (Numeric) (state->ext->block + state->ext->blockused);
+	memcpy(result, value, len);
+
+	state->ext->blockused += INTALIGN(len);
+
+	return result;
+}
+
+/*
+ * The blocks count towards the memory limit of numeric states too (with the
+ * array of maxelements pointers). The values can't be spilled, so the query
+ * fails when both exceed the limit.
+ */
+static void
+quantile_numeric_check_memory(quantile_state *state, int maxelements)
+{
+	if ((state->spillelements < INT_MAX) &&
+		((Size) maxelements * sizeof(Numeric) + state->ext->blockbytes >
+		 (Size) state->spillelements * sizeof(Numeric)))
+		quantile_numeric_overflow(state);
+}
+
+/* numeric values can't be approximated either, so both modes fail */
+static void
+quantile_numeric_overflow(quantile_state *state)
+{
+	int		limit = (int) ((int64) state->spillelements * sizeof(Numeric) / 1024);
+
+	if (state->overflow == QUANTILE_OVERFLOW_APPROXIMATE)
+		elog(ERROR, "quantile state exceeds the memory limit (%d kB), and "
+			 "numeric values can't be approximated", limit);
+
+	elog(ERROR, "quantile state exceeds the memory limit (%d kB)", limit);
+}
+
+/*
+ * Reads the header of a numeric value - the sign, display scale and weight,
+ * and the digits. Returns false for NaN and infinities.
+ */
+static bool
+numeric_decode(Numeric num, bool *negative, int *dscale, int *weight,
+			   const int16 **digits, int *ndigits)
+{
+	uint16	header;
+	Size	hdrlen;
+
+	memcpy(&header, (char *) num + VARHDRSZ, sizeof(uint16));
+
+	if ((header & QUANTILE_NUMERIC_SIGN_MASK) == QUANTILE_NUMERIC_SPECIAL)
+		return false;
+
+	if (header & QUANTILE_NUMERIC_SHORT)
+	{
+		*negative = (header & QUANTILE_NUMERIC_SHORT_SIGN_MASK) != 0;
+		*dscale = (header & QUANTILE_NUMERIC_SHORT_DSCALE_MASK) >>
+					QUANTILE_NUMERIC_SHORT_DSCALE_SHIFT;
+		*weight = (int16) (((header & QUANTILE_NUMERIC_SHORT_WEIGHT_SIGN_MASK) ?
+							~QUANTILE_NUMERIC_SHORT_WEIGHT_MASK : 0) |
+						   (header & QUANTILE_NUMERIC_SHORT_WEIGHT_MASK));
+		hdrlen = VARHDRSZ + sizeof(uint16);
+	}
+	else
+	{
+		int16	w;
+
+		memcpy(&w, (char *) num + VARHDRSZ + sizeof(uint16), sizeof(int16));
+
+		*negative = (header & QUANTILE_NUMERIC_SIGN_MASK) == QUANTILE_NUMERIC_NEG;
+		*dscale = header & QUANTILE_NUMERIC_DSCALE_MASK;
+		*weight = w;
+		hdrlen = VARHDRSZ + sizeof(uint16) + sizeof(int16);
+	}
+
+	*digits = (const int16 *) ((char *) num + hdrlen);
+	*ndigits = (VARSIZE(num) - hdrlen) / sizeof(int16);
+
+	return true;
+}
+
+/*
+ * Returns the scale to use for fixed-point values, based on the first value
+ * of a state (its display scale), or -1 when that's not possible.
+ */
+static int
+numeric_fixed_scale(Numeric num)
+{
+	bool		negative;
+	int			dscale;
+	int			weight;
+	int			ndigits;
+	const int16 *digits;
+
+	if (!QUANTILE_FIXED_ENABLED ||
+		!numeric_decode(num, &negative, &dscale, &weight, &digits, &ndigits) ||
+		(dscale > QUANTILE_FIXED_MAX_SCALE))
+		return -1;
+
+	return dscale;
+}
+
+/*
+ * Converts the value to a fixed-point integer (the value multiplied by
+ * 10^scale). Returns false when the display scale of the value is not the
+ * same (the result would not have the same scale as the value), or when the
+ * value does not fit into int64.
+ */
+static bool
+numeric_to_fixed(Numeric num, int scale, int64 *result)
+{
+	static const uint64 powers[] = {1, 10, 100, 1000, 10000};
+
+	int			i;
+	bool		negative;
+	int			dscale;
+	int			weight;
+	int			ndigits;
+	int			exponent = 0;
+	const int16 *digits;
+	uint64		value = 0;
+
+	if (!numeric_decode(num, &negative, &dscale, &weight, &digits, &ndigits) ||
+		(dscale != scale))
+		return false;
+
+	for (i = 0; i < ndigits; i++)
+	{
+		uint64	digit = digits[i];
+		int		ncut;
+
+		/* exponent of the last decimal digit, and how many are past the scale */
+		exponent = QUANTILE_NUMERIC_DEC_DIGITS * (weight - i);
+		ncut = Min(Max(-scale - exponent, 0), QUANTILE_NUMERIC_DEC_DIGITS);
+
+		/* the digits past the display scale are always zero */
+		if (digit % powers[ncut] != 0)
+			return false;
+
+		digit /= powers[ncut];
+
+		if (value > (PG_UINT64_MAX - digit) /
+					powers[QUANTILE_NUMERIC_DEC_DIGITS - ncut])
+			return false;
+
+		value = value * powers[QUANTILE_NUMERIC_DEC_DIGITS - ncut] + digit;
+	}
+
+	/* the trailing zero digits are not stored, add them up to the scale */
+	if (ndigits > 0)
+		exponent = Max(exponent, -scale) + scale;
+
+	for (; (value != 0) && (exponent > 0); exponent--)
+	{
+		if (value > PG_UINT64_MAX / 10)
+			return false;
+
+		value *= 10;
+	}
+
+	if (value > (uint64) PG_INT64_MAX)
+		return false;
+
+	*result = negative ? -(int64) value : (int64) value;
+
+	return true;
+}
+
+/*
+ * Converts a fixed-point integer back to numeric, with the display scale
+ * the values had. Only done for the results (and when the state has to
+ * switch to regular numeric values), so simply format and parse it.
+ */
+static Numeric
+fixed_to_numeric(int64 value, int scale)
+{
+	char	digits[32];
+	char	str[64];
+	char   *ptr = str;
+	int		len;
+	uint64	absval = (value < 0) ? -(uint64) value : (uint64) value;
+
+	len = snprintf(digits, sizeof(digits), UINT64_FORMAT, absval);
+
+	if (value < 0)
+		*ptr++ = '-';
+
+	/* the integer part, or a zero with leading zeros of the fraction */
+	if (len > scale)
+	{
+		memcpy(ptr, digits, len - scale);
+		ptr += len - scale;
+	}
+	else
+	{
+		*ptr++ = '0';
+		memset(ptr + 1, '0', scale - len);
+	}
+
+	if (scale > 0)
+	{
+		*ptr++ = '.';
+		ptr += Max(scale - len, 0);
+	}
+
+	strcpy(ptr, digits + Max(len - scale, 0));
+
+	return DatumGetNumeric(DirectFunctionCall3(numeric_in,
+											   CStringGetDatum(str),
+											   ObjectIdGetDatum(InvalidOid),
+											   Int32GetDatum(-1)));
+}
+
+/*
+ * Adds a numeric value to the state (in the current memory context), as a
+ * fixed-point integer if possible. The first value that does not fit (NaN,
+ * different scale, too large) switches the state to regular numerics.
+ */
+static void
+quantile_numeric_add(FunctionCallInfo fcinfo, quantile_state *state,
+					 Numeric num)
+{
+	Numeric	   *elements;
+
+	if (state->nelements == state->maxelements)
+		quantile_state_reserve(fcinfo, state, sizeof(Numeric), NULL);
+
+	if (state->fixedscale >= 0)
+	{
+		int64	value;
+		int64  *fixed = (int64 *) state->elements;
+
+		if (numeric_to_fixed(num, state->fixedscale, &value))
+		{
+			QUANTILE_TRACK_ORDER(state, fixed, value, INTEGER_LT);
+			fixed[state->nelements++] = value;
+			return;
+		}
+
+		quantile_numeric_unfix(state);
+	}
+
+	/* make sure to cast the array to (Numeric *) before updating it */
+	elements = (Numeric *) state->elements;
+	elements[state->nelements++] = quantile_numeric_copy(state, num,
+														  VARSIZE(num));
+}
+
+/*
+ * Replaces the fixed-point elements with regular numeric values (copied into
+ * the blocks). The order of the elements does not change, so the sorted
+ * prefix remains valid.
+ */
+static void
+quantile_numeric_unfix(quantile_state *state)
+{
+	int			i;
+	int64	   *fixed = (int64 *) state->elements;
+	Numeric	   *elements = (Numeric *) state->elements;
+
+	Assert(state->fixedscale >= 0);
+
+	for (i = 0; i < state->nelements; i++)
+	{
+		Numeric	num = fixed_to_numeric(fixed[i], state->fixedscale);
+
+		elements[i] = quantile_numeric_copy(state, num, VARSIZE(num));
+		pfree(num);
+	}
+
+	state->fixedscale = -1;
+}
+
+/*
+ * Runtime statistics of the states. The memory is computed from the sizes
+ * of the arrays (not the actual allocations), so it does not include the
+ * allocator overhead or the memory used by the final functions.
+ */
+static void
+quantile_stats_memory(quantile_state *state)
+{
+	Size	bytes;
+
+	bytes = (Size) state->ext->stats->elemsize * state->maxelements +
+			state->ext->stats->blockbytes +
+			(Size) state->ext->maxkeys * (sizeof(uint64) + sizeof(int)) +
+			(Size) state->ext->nslots * sizeof(int) +
+			(Size) state->ext->ndense * sizeof(int);
+
+	if (state->ext->digest != NULL)
+		bytes += (Size) state->ext->digest->maxcentroids *
+			sizeof(tdigest_centroid);
+
+	state->ext->stats->peakbytes = Max(state->ext->stats->peakbytes, bytes);
+}
+
+static void
+quantile_stats_final_start(quantile_state *state)
+{
+	state->ext->stats->nfinals++;
+	state->ext->stats->path = "sorted";
+
+	INSTR_TIME_SET_CURRENT(state->ext->stats->start);
+}
+
+static void
+quantile_stats_final_end(quantile_state *state)
+{
+	instr_time	elapsed;
+
+	INSTR_TIME_SET_CURRENT(elapsed);
+	INSTR_TIME_SUBTRACT(elapsed, state->ext->stats->start);
+
+	state->ext->stats->finaltime += INSTR_TIME_GET_MILLISEC(elapsed);
+}
+
+/*
+ * Called when the aggregate shuts down - logs the statistics of the state,
+ * and adds them to the history (overwriting the oldest entry when full).
+ */
+static void
+quantile_stats_publish(Datum arg)
+{
+	quantile_state		 *state = (quantile_state *) DatumGetPointer(arg);
+	quantile_state_stats *stats = state->ext->stats;
+
+	/* a sample keeps only some of the values, a digest most of them */
+	if (state->ext->reservoir != NULL)
+		stats->nvalues = state->ext->reservoir->nvalues;
+	else if (state->ext->digest != NULL)
+		stats->nvalues = QUANTILE_COUNT(state) +
+						 state->ext->digest->count +
+						 state->ext->digest->nnans;
+	else
+		stats->nvalues = QUANTILE_COUNT(state);
+
+	stats->nruns = state->ext->nruns;
+	stats->nspilled = state->ext->nspilled;
+	stats->ncounted = state->ext->ncounted;
+
+	quantile_stats_memory(state);
+
+	elog(DEBUG1, "quantile state of %s: " INT64_FORMAT " values, "
+		 "%d reallocations, %zu peak bytes, %d runs (" INT64_FORMAT
+		 " spilled), " INT64_FORMAT " counted, %d finals (%.3f ms), path %s",
+		 get_func_name(stats->func), stats->nvalues, stats->nreallocs,
+		 stats->peakbytes, stats->nruns, stats->nspilled, stats->ncounted,
+		 stats->nfinals, stats->finaltime, stats->path);
+
+	if (quantile_stats_history == NULL)
+		quantile_stats_history = MemoryContextAlloc(TopMemoryContext,
+													sizeof(quantile_state_stats) *
+													QUANTILE_STATS_HISTORY);
+
+	quantile_stats_history[quantile_stats_next] = *stats;
+
+	quantile_stats_next = (quantile_stats_next + 1) % QUANTILE_STATS_HISTORY;
+	quantile_stats_count = Min(quantile_stats_count + 1, QUANTILE_STATS_HISTORY);
+}
+
+static void
+quantile_file_seek(BufFile *file, int fileno, off_t offset)
+{
+	if (BufFileSeek(file, fileno, offset, SEEK_SET) != 0)
+		elog(ERROR, "could not seek in quantile temporary file");
+}
+
+static void
+quantile_file_read(BufFile *file, void *ptr, Size len)
+{
+	if (BufFileRead(file, ptr, len) != len)
+		elog(ERROR, "could not read from quantile temporary file");
+}
+
+static void
+quantile_file_write(BufFile *file, void *ptr, Size len)
+{
+#if (PG_VERSION_NUM >= 130000)
+	BufFileWrite(file, ptr, len);
+#else
+	if (BufFileWrite(file, ptr, len) != len)
+		elog(ERROR, "could not write to quantile temporary file");
+#endif
+}
+
+/* closes the temporary file when the aggregate state is discarded */
+static void
+quantile_spill_cleanup(Datum arg)
+{
+	quantile_state *state = (quantile_state *) DatumGetPointer(arg);
+
+	if (state->ext->file != NULL)
+		BufFileClose(state->ext->file);
+
+	state->ext->file = NULL;
+}
+
+static void
+quantile_spill_reset(void *arg)
+{
+	quantile_spill_cleanup(PointerGetDatum(arg));
+}
+
+/*
+ * Writes the elements into the temporary file as a new run (creating the
+ * file on the first call). The elements may be unsorted, if the run only
+ * gets merged when the tail of the values turns out insufficient.
+ *
+ * The deserialized states are not allocated in the aggregate context, but
+ * in a short-lived one (reset after each combine), so those close the file
+ * from a reset callback of that context instead.
+ */
+static void
+quantile_spill_write(FunctionCallInfo fcinfo, quantile_state *state,
+					 const quantile_spill_ops *ops, void *elements,
+					 int nelements, bool sorted)
+{
+	quantile_run   *run;
+
+	if (state->ext->file == NULL)
+	{
+		MemoryContext	aggcontext;
+		MemoryContext	context = GetMemoryChunkContext(state);
+
+		quantile_state_ext_alloc(state);
+
+		state->ext->file = BufFileCreateTemp(false);
+
+		state->ext->maxruns = 16;
+		state->ext->runs = (quantile_run *)
+			palloc(sizeof(quantile_run) * state->ext->maxruns);
+
+		if ((AggCheckCallContext(fcinfo, &aggcontext) == AGG_CONTEXT_AGGREGATE) &&
+			(context != aggcontext))
+		{
+			MemoryContextCallback *callback;
+
+			callback = MemoryContextAlloc(context, sizeof(MemoryContextCallback));
+			callback->func = quantile_spill_reset;
+			callback->arg = state;
+
+			MemoryContextRegisterResetCallback(context, callback);
+		}
+		else
+			AggRegisterCallback(fcinfo, quantile_spill_cleanup,
+								PointerGetDatum(state));
+	}
+	else if (state->ext->nruns == state->ext->maxruns)
+	{
+		state->ext->maxruns *= 2;
+		state->ext->runs = (quantile_run *)
+			repalloc(state->ext->runs,
+					 sizeof(quantile_run) * state->ext->maxruns);
+	}
+
+	run = &state->ext->runs[state->ext->nruns++];
+	run->fileno = state->ext->endfileno;
+	run->offset = state->ext->endoffset;
+	run->nelements = nelements;
+	run->sorted = sorted;
+
+	/* the merges may have moved the position, so seek to the end first */
+	quantile_file_seek(state->ext->file, state->ext->endfileno,
+					   state->ext->endoffset);
+	quantile_file_write(state->ext->file, elements,
+						(Size) ops->elemsize * nelements);
+	BufFileTell(state->ext->file, &state->ext->endfileno,
+				&state->ext->endoffset);
+
+	state->ext->nspilled += nelements;
+
+	/* the count has to fit into int, even with the array filled again */
+	if ((int64) state->ext->nspilled + state->maxelements > INT_MAX)
+		elog(ERROR, "too many values in a quantile state");
+}
+
+/*
+ * Sorts the elements in memory and writes them into the temporary file as a
+ * new run, which makes the whole array available for new elements.
+ */
+static void
+quantile_spill_run(FunctionCallInfo fcinfo, quantile_state *state,
+				   const quantile_spill_ops *ops)
+{
+	/* the elements may have been added in sorted order */
+	if (state->nsorted < state->nelements)
+		ops->sort(state->elements, state->nelements);
+
+	quantile_spill_write(fcinfo, state, ops, state->elements,
+						 state->nelements, true);
+
+	state->nelements = 0;
+	state->nsorted = 0;
+	state->ndescents = 0;
+	state->nascents = 0;
+
+	/* the tail of the values is not in memory anymore */
+	state->ext->extreme = QUANTILE_EXTREME_NONE;
+}
+
+/*
+ * Decides whether the pruning for extreme quantiles applies to the state -
+ * only to regular aggregates that may spill (the runs are needed when the
+ * tail turns out insufficient), and when all the quantiles are close to 0
+ * or 1. The exact counting and the estimates don't combine with it.
+ */
+static int
+quantile_extreme_mode(FunctionCallInfo fcinfo, quantile_state *state)
+{
+	int		i;
+	bool	upper = true;
+	bool	lower = true;
+
+	if ((AggCheckCallContext(fcinfo, NULL) != AGG_CONTEXT_AGGREGATE) ||
+		(state->overflow != QUANTILE_OVERFLOW_SPILL) ||
+		(state->nquantiles == 0) || (state->ext->reservoir != NULL) ||
+		(state->ext->digest != NULL) || (state->ext->nruns > 0))
+		return QUANTILE_EXTREME_NONE;
+
+	for (i = 0; i < state->nquantiles; i++)
+	{
+		upper &= (state->quantiles[i] >= 1.0 - QUANTILE_EXTREME_THRESHOLD);
+		lower &= (state->quantiles[i] <= QUANTILE_EXTREME_THRESHOLD);
+	}
+
+	if (upper)
+		return QUANTILE_EXTREME_UPPER;
+	else if (lower)
+		return QUANTILE_EXTREME_LOWER;
+
+	return QUANTILE_EXTREME_NONE;
+}
+
+/*
+ * Moves the elements too far from the tail into the temporary file, if the
+ * tail (for the current count of values) is small enough compared to the
+ * array - it has to make at least half of the array available, otherwise
+ * it's better to spill the elements as usual. Only called when the array
+ * reached the memory limit.
+ */
+static bool
+quantile_extreme_prune(FunctionCallInfo fcinfo, quantile_state *state,
+					const quantile_spill_ops *ops)
+{
+	int		i;
+	int		pivot;
+	int		nkeep;
+	int64	ntail = 0;
+	int64	count = QUANTILE_COUNT(state);
+	char   *elements = (char *) state->elements;
+	Size	elemsize = ops->elemsize;
+
+	/*
+	 * The counting is tried first, so wait until it gets abandoned, and the
+	 * counted values get added back as elements.
+	 */
+	if (state->counting || (state->ext->ncounted > 0))
+		return false;
+
+	quantile_state_ext_alloc(state);
+
+	if (state->ext->extreme == QUANTILE_EXTREME_UNKNOWN)
+		state->ext->extreme = quantile_extreme_mode(fcinfo, state);
+
+	if (state->ext->extreme == QUANTILE_EXTREME_NONE)
+		return false;
+
+	/* number of values from the tail to the furthest requested position */
+	for (i = 0; i < state->nquantiles; i++)
+	{
+		double	q = state->quantiles[i];
+		int64	idx = (q > 0) ? (int64) ceil(count * q) - 1 : 0;
+
+		if (state->ext->extreme == QUANTILE_EXTREME_UPPER)
+			ntail = Max(ntail, count - idx);
+		else
+			ntail = Max(ntail, idx + 1);
+	}
+
+	if (2 * ntail + QUANTILE_EXTREME_SLACK > state->nelements / 2)
+		return false;
+
+	nkeep = (int) (2 * ntail + QUANTILE_EXTREME_SLACK);
+
+	/*
+	 * Partition the elements around the pivot - the smallest value kept (or
+	 * the largest one, for the lower tail) - and remember it as the bound.
+	 * All the spilled values are on the other side of it.
+	 */
+	if (state->ext->extreme == QUANTILE_EXTREME_UPPER)
+	{
+		pivot = state->nelements - nkeep;
+
+		ops->select(elements, state->nelements, pivot);
+
+		quantile_spill_write(fcinfo, state, ops, elements, pivot, false);
+
+		if ((state->ext->nruns == 1) ||
+			(ops->compare(elements + elemsize * pivot,
+						  &state->ext->extremebound) > 0))
+			memcpy(&state->ext->extremebound, elements + elemsize * pivot,
+				   elemsize);
+
+		memmove(elements, elements + elemsize * pivot, elemsize * nkeep);
+	}
+	else
+	{
+		pivot = nkeep - 1;
+
+		ops->select(elements, state->nelements, pivot);
+
+		quantile_spill_write(fcinfo, state, ops, elements + elemsize * nkeep,
+							 state->nelements - nkeep, false);
+
+		if ((state->ext->nruns == 1) ||
+			(ops->compare(elements + elemsize * pivot,
+						  &state->ext->extremebound) < 0))
+			memcpy(&state->ext->extremebound, elements + elemsize * pivot,
+				   elemsize);
+	}
+
+	state->nelements = nkeep;
+	state->nsorted = 0;
+	quantile_order_unknown(state);
+
+	if (state->ext->stats != NULL)
+		quantile_stats_memory(state);
+
+	return true;
+}
+
+/*
+ * Makes room for at least one more element - either by growing the array
+ * (up to the memory limit), or by spilling the elements to a temporary file
+ * (only for fixed-width types, i.e. when ops is not NULL).
+ */
+static void
+quantile_state_reserve(FunctionCallInfo fcinfo, quantile_state *state,
+					   int elemsize, const quantile_spill_ops *ops)
+{
+	Assert(state->nelements == state->maxelements);
+
+	if (state->ext->stats != NULL)
+		quantile_stats_memory(state);
+
+	/*
+	 * Try counting the elements first, once there's enough of them (or when
+	 * the array can't grow anymore). With too many distinct values, the
+	 * counting is abandoned and the values counted so far are added back
+	 * as elements, which may or may not make room for more.
+	 */
+	if ((ops != NULL) && state->counting &&
+		((state->nelements >= QUANTILE_COUNT_MIN_ELEMENTS) ||
+		 (state->maxelements >= state->spillelements)))
+	{
+		if (quantile_counted_fold(state, ops))
+			return;
+
+		quantile_counted_expand(fcinfo, state, ops);
+
+		if (state->nelements < state->maxelements)
+			return;
+	}
+
+	/*
+	 * Over the memory limit already (possibly while expanding the counted
+	 * values), so just add the elements to the digest.
+	 */
+	if (state->ext->digest != NULL)
+	{
+		quantile_approx_fold(state, ops);
+		return;
+	}
+
+	if (state->maxelements >= state->spillelements)
+	{
+		/*
+		 * Extreme quantiles only need the tail, so spill just the other
+		 * values (instead of all of them), and keep the tail in memory.
+		 * That's only done at the memory limit - below it the array simply
+		 * grows, without any temporary files.
+		 */
+		if ((ops != NULL) && quantile_extreme_prune(fcinfo, state, ops))
+			return;
+
+		/* numeric values can't be spilled (or approximated) */
+		if ((ops == NULL) && (state->spillelements < INT_MAX))
+			quantile_numeric_overflow(state);
+
+		/* no memory limit, so we've hit INT_MAX */
+		if (ops == NULL)
+			elog(ERROR, "too many values in a quantile state");
+
+		if ((state->overflow == QUANTILE_OVERFLOW_ERROR) &&
+			(state->spillelements < INT_MAX))
+			elog(ERROR, "quantile state exceeds the memory limit (%d kB)",
+				 (int) ((int64) state->spillelements * elemsize / 1024));
+		else if ((state->overflow == QUANTILE_OVERFLOW_APPROXIMATE) &&
+				 (state->spillelements < INT_MAX))
+		{
+			elog(NOTICE, "quantile state exceeds the memory limit (%d kB), "
+				 "switching to approximate quantiles",
+				 (int) ((int64) state->spillelements * elemsize / 1024));
+
+			quantile_approx_begin(state, ops);
+			return;
+		}
+
+		quantile_spill_run(fcinfo, state, ops);
+		return;
+	}
+
+	/* the numeric values are in blocks, which count towards the limit too */
+	if (ops == NULL)
+		quantile_numeric_check_memory(state,
+									  (int) Min((int64) state->maxelements * 2,
+												state->spillelements));
+
+	quantile_state_grow(state, elemsize, state->maxelements + 1);
+}
+
+/*
+ * Grows the elements array so that it has space for at least nelements
+ * (doubling the size, up to the memory limit).
+ */
+static void
+quantile_state_grow(quantile_state *state, int elemsize, int nelements)
+{
+	int		maxelements = state->maxelements;
+
+	Assert(nelements <= state->spillelements);
+
+	while (maxelements < nelements)
+		maxelements = (int) Min((int64) maxelements * 2, state->spillelements);
+
+	if (maxelements == state->maxelements)
+		return;
+
+	state->maxelements = maxelements;
+
+	/*
+	 * The array may get larger than MaxAllocSize, so use the huge variant.
+	 * Large chunks are allocated by malloc() directly, so the realloc() can
+	 * usually remap the pages instead of copying the data.
+	 */
+	if (QUANTILE_INLINE(state))
+	{
+		/* the inline buffer is outgrown, so copy it into a separate array */
+		void   *elements;
+
+		elements = MemoryContextAllocHuge(GetMemoryChunkContext(state),
+										  (Size) elemsize * state->maxelements);
+		memcpy(elements, state->elements, (Size) elemsize * state->nelements);
+		state->elements = elements;
+	}
+	else
+		state->elements = repalloc_huge(state->elements,
+										(Size) elemsize * state->maxelements);
+
+	if (state->ext->stats != NULL)
+	{
+		state->ext->stats->nreallocs++;
+		quantile_stats_memory(state);
+	}
+}
+
+/*
+ * Counting the values of inputs with only a few distinct values. The keys
+ * are stored in the order of insertion, with an open-addressing hash table
+ * (linear probing, at most half full) pointing to them.
+ */
+static inline uint32
+quantile_counted_hash(uint64 key)
+{
+	/* the murmur3 finalizer, so that all the bits affect the slot */
+	key ^= key >> 33;
+	key *= UINT64CONST(0xff51afd7ed558ccd);
+	key ^= key >> 33;
+	key *= UINT64CONST(0xc4ceb9fe1a85ec53);
+	key ^= key >> 33;
+
+	return (uint32) key;
+}
+
+/* rebuilds the hash table for the keys (e.g. after it got resized) */
+static void
+quantile_counted_build(quantile_state *state)
+{
+	int		i;
+	uint32	mask = state->ext->nslots - 1;
+
+	memset(state->ext->slots, -1, sizeof(int) * state->ext->nslots);
+
+	for (i = 0; i < state->ext->nkeys; i++)
+	{
+		uint32	slot = quantile_counted_hash(state->ext->keys[i]) & mask;
+
+		while (state->ext->slots[slot] >= 0)
+			slot = (slot + 1) & mask;
+
+		state->ext->slots[slot] = i;
+	}
+}
+
+/* allocates the (empty) hash table, unless already done */
+static void
+quantile_counted_init(quantile_state *state)
+{
+	if (state->ext->keys != NULL)
+		return;
+
+	quantile_state_ext_alloc(state);
+
+	state->ext->maxkeys = QUANTILE_COUNT_MIN_KEYS;
+	state->ext->nslots = 2 * QUANTILE_COUNT_MIN_KEYS;
+
+	state->ext->keys = (uint64 *) palloc(sizeof(uint64) * state->ext->maxkeys);
+	state->ext->counts = (int *) palloc(sizeof(int) * state->ext->maxkeys);
+	state->ext->slots = (int *) palloc(sizeof(int) * state->ext->nslots);
+
+	quantile_counted_build(state);
+}
+
+/*
+ * Returns the index of the key, adding it when it's not there yet - but only
+ * if there are less than maxkeys keys, otherwise returns -1.
+ */
+static int
+quantile_counted_lookup(quantile_state *state, uint64 key, int maxkeys)
+{
+	uint32	mask = state->ext->nslots - 1;
+	uint32	slot = quantile_counted_hash(key) & mask;
+
+	while (state->ext->slots[slot] >= 0)
+	{
+		if (state->ext->keys[state->ext->slots[slot]] == key)
+			return state->ext->slots[slot];
+
+		slot = (slot + 1) & mask;
+	}
+
+	if (state->ext->nkeys >= maxkeys)
+		return -1;
+
+	if (state->ext->nkeys == state->ext->maxkeys)
+	{
+		state->ext->maxkeys *= 2;
+		state->ext->nslots *= 2;
+
+		state->ext->keys = (uint64 *)
+			repalloc(state->ext->keys, sizeof(uint64) * state->ext->maxkeys);
+		state->ext->counts = (int *)
+			repalloc(state->ext->counts, sizeof(int) * state->ext->maxkeys);
+
+		pfree(state->ext->slots);
+		state->ext->slots = (int *) palloc(sizeof(int) * state->ext->nslots);
+
+		quantile_counted_build(state);
+
+		return quantile_counted_lookup(state, key, maxkeys);
+	}
+
+	state->ext->keys[state->ext->nkeys] = key;
+	state->ext->counts[state->ext->nkeys] = 0;
+	state->ext->slots[slot] = state->ext->nkeys;
+
+	return state->ext->nkeys++;
+}
+
+/* integer element (of the given size) at ptr */
+static inline int64
+quantile_dense_get(const char *ptr, int elemsize)
+{
+	int16	i2;
+	int32	i4;
+	int64	i8;
+
+	switch (elemsize)
+	{
+		case sizeof(int16):
+			memcpy(&i2, ptr, sizeof(int16));
+			return i2;
+		case sizeof(int32):
+			memcpy(&i4, ptr, sizeof(int32));
+			return i4;
+		default:
+			memcpy(&i8, ptr, sizeof(int64));
+			return i8;
+	}
+}
+
+/* stores the integer value as an element of the given size at ptr */
+static inline void
+quantile_dense_set(char *ptr, int elemsize, int64 value)
+{
+	int16	i2 = (int16) value;
+	int32	i4 = (int32) value;
+
+	switch (elemsize)
+	{
+		case sizeof(int16):
+			memcpy(ptr, &i2, sizeof(int16));
+			break;
+		case sizeof(int32):
+			memcpy(ptr, &i4, sizeof(int32));
+			break;
+		default:
+			memcpy(ptr, &value, sizeof(int64));
+			break;
+	}
+}
+
+/*
+ * Adds the elements to the dense counts, extending the range of the array
+ * as needed. Returns false (without changing anything) when the range would
+ * get too wide, or the array would use more memory than the elements.
+ */
+static bool
+quantile_counted_fold_dense(quantile_state *state, const quantile_spill_ops *ops)
+{
+	int		i;
+	int		elemsize = ops->elemsize;
+	char   *elements = (char *) state->elements;
+	int64	minval;
+	int64	maxval;
+	uint64	range;
+	uint64	maxrange;
+
+	ops->minmax(elements, state->nelements, &minval, &maxval);
+
+	if (state->ext->ndense > 0)
+	{
+		minval = Min(minval, state->ext->densemin);
+		maxval = Max(maxval, state->ext->densemin + state->ext->ndense - 1);
+	}
+
+	/* the difference may not fit into int64 */
+	range = (uint64) maxval - (uint64) minval + 1;
+	maxrange = Min(QUANTILE_DENSE_MAX_RANGE,
+				   (uint64) state->maxelements * elemsize / sizeof(int));
+
+	if ((range == 0) || (range > maxrange))
+		return false;
+
+	if (range > state->ext->ndense)
+	{
+		int	   *dense = (int *) palloc0(sizeof(int) * range);
+
+		if (state->ext->ndense > 0)
+		{
+			memcpy(dense + (state->ext->densemin - minval), state->ext->dense,
+				   sizeof(int) * state->ext->ndense);
+			pfree(state->ext->dense);
+		}
+
+		state->ext->dense = dense;
+		state->ext->densemin = minval;
+		state->ext->ndense = (int) range;
+	}
+
+	for (i = 0; i < state->nelements; i++)
+		state->ext->dense[quantile_dense_get(elements + (Size) elemsize * i,
+											 elemsize) -
+						  state->ext->densemin]++;
+
+	return true;
+}
+
+/* moves the dense counts to the hash table (there are few enough of them) */
+static void
+quantile_counted_dense_to_keys(quantile_state *state, const quantile_spill_ops *ops)
+{
+	int		i;
+
+	if (state->ext->ndense == 0)
+		return;
+
+	quantile_counted_init(state);
+
+	for (i = 0; i < state->ext->ndense; i++)
+	{
+		uint64	key = 0;
+		int		k;
+
+		if (state->ext->dense[i] == 0)
+			continue;
+
+		quantile_dense_set((char *) &key, ops->elemsize,
+						   state->ext->densemin + i);
+
+		/* the lookup may reallocate the counts */
+		k = quantile_counted_lookup(state, key, INT_MAX);
+		state->ext->counts[k] = state->ext->dense[i];
+	}
+
+	pfree(state->ext->dense);
+	state->ext->dense = NULL;
+	state->ext->ndense = 0;
+}
+
+/*
+ * Adds all the elements in memory to the counts, and empties the array.
+ * Integer values are counted in the dense array while the range is narrow
+ * enough, otherwise in the hash table. If that would need too many distinct
+ * values, the counts are restored to what they were before, the elements
+ * are not touched, and returns false.
+ */
+static bool
+quantile_counted_fold(quantile_state *state, const quantile_spill_ops *ops)
+{
+	bool	result;
+
+	quantile_state_ext_alloc(state);
+
+	if ((ops->minmax != NULL) && (state->ext->nkeys == 0) &&
+		quantile_counted_fold_dense(state, ops))
+		result = true;
+	else
+	{
+		quantile_counted_dense_to_keys(state, ops);
+		result = quantile_counted_fold_keys(state, ops);
+	}
+
+	if (!result)
+		return false;
+
+	state->ext->ncounted += state->nelements;
+	state->nelements = 0;
+	state->nsorted = 0;
+	state->ndescents = 0;
+	state->nascents = 0;
+
+	/* the count has to fit into int, even with the array filled again */
+	if ((int64) state->ext->ncounted + state->maxelements > INT_MAX)
+		elog(ERROR, "too many values in a quantile state");
+
+	if (state->ext->stats != NULL)
+		quantile_stats_memory(state);
+
+	return true;
+}
+
+/* counts the elements in the hash table (see quantile_counted_fold) */
+static bool
+quantile_counted_fold_keys(quantile_state *state, const quantile_spill_ops *ops)
+{
+	int		i;
+	int		nkeys = state->ext->nkeys;
+	int		elemsize = ops->elemsize;
+	char   *elements = (char *) state->elements;
+	int64	maxkeys;
+
+	/* few distinct values, and the counts are smaller than the elements */
+	maxkeys = ((int64) state->ext->ncounted + state->nelements) /
+		QUANTILE_COUNT_RATIO;
+	maxkeys = Min(maxkeys, (int64) state->maxelements * elemsize /
+						   QUANTILE_COUNT_KEY_SIZE);
+	maxkeys = Min(maxkeys, QUANTILE_COUNT_MAX_KEYS);
+
+	quantile_counted_init(state);
+
+	for (i = 0; i < state->nelements; i++)
+	{
+		uint64	key = 0;
+		int		k;
+
+		memcpy(&key, elements + (Size) elemsize * i, elemsize);
+
+		if ((k = quantile_counted_lookup(state, key, (int) maxkeys)) < 0)
+			break;
+
+		state->ext->counts[k]++;
+	}
+
+	if (i == state->nelements)
+		return true;
+
+	/* too many distinct values, so forget the elements counted so far */
+	while (i-- > 0)
+	{
+		uint64	key = 0;
+		int		k;
+
+		memcpy(&key, elements + (Size) elemsize * i, elemsize);
+
+		if ((k = quantile_counted_lookup(state, key, 0)) < nkeys)
+			state->ext->counts[k]--;
+	}
+
+	state->ext->nkeys = nkeys;
+	quantile_counted_build(state);
+
+	return false;
+}
+
+/* number of counted entries (values in the dense array, or distinct keys) */
+#define QUANTILE_COUNTED_ENTRIES(state) \
+	(((state)->ext->ndense > 0) ? (state)->ext->ndense : (state)->ext->nkeys)
+
+#define QUANTILE_COUNTED_COUNTS(state) \
+	(((state)->ext->ndense > 0) ? (state)->ext->dense : (state)->ext->counts)
+
+/* stores the value of the i-th counted entry at ptr */
+static inline void
+quantile_counted_value(quantile_state *state, int i, int elemsize, char *ptr)
+{
+	if (state->ext->ndense > 0)
+		quantile_dense_set(ptr, elemsize, state->ext->densemin + i);
+	else
+		memcpy(ptr, &state->ext->keys[i], elemsize);
+}
+
+/*
+ * Abandons the counting, and adds the counted values back as elements (the
+ * array grows or gets spilled as usual).
+ */
+static void
+quantile_counted_expand(FunctionCallInfo fcinfo, quantile_state *state,
+						const quantile_spill_ops *ops)
+{
+	int		i;
+	int		elemsize = ops->elemsize;
+	int		nentries = QUANTILE_COUNTED_ENTRIES(state);
+	int	   *counts = QUANTILE_COUNTED_COUNTS(state);
+
+	state->counting = false;
+
+	for (i = 0; i < nentries; i++)
+	{
+		while (counts[i] > 0)
+		{
+			int		n;
+			char   *ptr;
+
+			if (state->nelements == state->maxelements)
+				quantile_state_reserve(fcinfo, state, elemsize, ops);
+
+			n = Min(counts[i], state->maxelements - state->nelements);
+			ptr = (char *) state->elements + (Size) elemsize * state->nelements;
+
+			counts[i] -= n;
+			state->ext->ncounted -= n;
+			state->nelements += n;
+
+			while (n-- > 0)
+			{
+				quantile_counted_value(state, i, elemsize, ptr);
+				ptr += elemsize;
+			}
+		}
+	}
+
+	Assert(state->ext->ncounted == 0);
+
+	if (state->ext->keys != NULL)
+	{
+		pfree(state->ext->keys);
+		pfree(state->ext->counts);
+		pfree(state->ext->slots);
+
+		state->ext->nkeys = 0;
+		state->ext->maxkeys = 0;
+		state->ext->nslots = 0;
+		state->ext->keys = NULL;
+		state->ext->counts = NULL;
+		state->ext->slots = NULL;
+	}
+
+	if (state->ext->dense != NULL)
+	{
+		pfree(state->ext->dense);
+
+		state->ext->densemin = 0;
+		state->ext->ndense = 0;
+		state->ext->dense = NULL;
+	}
+
+	quantile_order_unknown(state);
+}
+
+/*
+ * Called by the final functions - counts the elements added since the last
+ * fold, and returns true if the values are counted (so the result has to be
+ * computed by quantile_counted_select).
+ */
+static bool
+quantile_counted(FunctionCallInfo fcinfo, quantile_state *state,
+				 const quantile_spill_ops *ops)
+{
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	if (state->ext->ncounted == 0)
+		return false;
+
+	if (state->nelements == 0)
+		return true;
+
+	GET_AGG_CONTEXT("quantile_counted", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (!quantile_counted_fold(state, ops))
+		quantile_counted_expand(fcinfo, state, ops);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return (state->ext->ncounted > 0);
+}
+
+/*
+ * Finds the values at the requested positions (sorted and distinct) when the
+ * values are counted - sorts the distinct values, and walks the cumulative
+ * counts (the dense counts are already in order, so no sort is needed). The
+ * result gets one element for each quantile, using the indexes.
+ */
+static void
+quantile_counted_select(quantile_state *state, const quantile_spill_ops *ops,
+						int *indexes, int nquantiles, int *positions,
+						int npositions, void *result)
+{
+	int		i;
+	int		p = 0;
+	int64	count = 0;
+	int		elemsize = ops->elemsize;
+	char   *values;
+	char   *selected = palloc((Size) elemsize * npositions);
+
+	QUANTILE_STATS_PATH(state, (state->ext->ndense > 0) ? "dense" : "counted");
+
+	for (i = 0; (i < state->ext->ndense) && (p < npositions); i++)
+	{
+		count += state->ext->dense[i];
+
+		while ((p < npositions) && (positions[p] < count))
+		{
+			quantile_counted_value(state, i, elemsize,
+								   selected + (Size) elemsize * p);
+			p++;
+		}
+	}
+
+	if (state->ext->ndense > 0)
+	{
+		Assert(p == npositions);
+
+		quantile_copy_results(indexes, nquantiles, positions, npositions,
+							  selected, elemsize, result);
+
+		pfree(selected);
+		return;
+	}
+
+	values = palloc((Size) elemsize * state->ext->nkeys);
+
+	for (i = 0; i < state->ext->nkeys; i++)
+		memcpy(values + (Size) elemsize * i, &state->ext->keys[i], elemsize);
+
+	ops->sort(values, state->ext->nkeys);
+
+	for (i = 0; (i < state->ext->nkeys) && (p < npositions); i++)
+	{
+		uint64	key = 0;
+		char   *value = values + (Size) elemsize * i;
+
+		memcpy(&key, value, elemsize);
+		count += state->ext->counts[quantile_counted_lookup(state, key, 0)];
+
+		while ((p < npositions) && (positions[p] < count))
+		{
+			memcpy(selected + (Size) elemsize * p, value, elemsize);
+			p++;
+		}
+	}
+
+	Assert(p == npositions);
+
+	quantile_copy_results(indexes, nquantiles, positions, npositions,
+						  selected, elemsize, result);
+
+	pfree(values);
+	pfree(selected);
+}
+
+/*
+ * Returns the number of distinct counted values, and the values in sorted
+ * order with their counts (in the same order), in newly allocated arrays.
+ */
+static int
+quantile_counted_sorted(quantile_state *state, const quantile_spill_ops *ops,
+						char **values, int **counts)
+{
+	int		i;
+	int		n = 0;
+	int		elemsize = ops->elemsize;
+	int		nentries = QUANTILE_COUNTED_ENTRIES(state);
+
+	*values = palloc((Size) elemsize * Max(1, nentries));
+	*counts = palloc(sizeof(int) * Max(1, nentries));
+
+	/* the dense counts are already in order, but some of them are zero */
+	if (state->ext->ndense > 0)
+	{
+		for (i = 0; i < state->ext->ndense; i++)
+		{
+			if (state->ext->dense[i] == 0)
+				continue;
+
+			quantile_counted_value(state, i, elemsize,
+								   *values + (Size) elemsize * n);
+			(*counts)[n++] = state->ext->dense[i];
+		}
+
+		return n;
+	}
+
+	for (i = 0; i < state->ext->nkeys; i++)
+		memcpy(*values + (Size) elemsize * i, &state->ext->keys[i], elemsize);
+
+	ops->sort(*values, state->ext->nkeys);
+
+	for (i = 0; i < state->ext->nkeys; i++)
+	{
+		uint64	key = 0;
+
+		memcpy(&key, *values + (Size) elemsize * i, elemsize);
+		(*counts)[i] =
+			state->ext->counts[quantile_counted_lookup(state, key, 0)];
+	}
+
+	return state->ext->nkeys;
+}
+
+/*
+ * Initial size of the elements array, based on the planner estimate of the
+ * number of rows per group. Only used for plain and sorted aggregation, with
+ * (at most) a single group in memory at a time - with hashing the estimate
+ * is only an average, and misestimates would be multiplied by the number of
+ * groups. The estimate is capped, so the worst case is a moderate amount of
+ * memory (the rest is handled by doubling the array).
+ */
+static int
+quantile_expected_elements(FunctionCallInfo fcinfo)
+{
+	AggState   *aggstate;
+	Agg		   *agg;
+	Plan	   *outer;
+	double		rows;
+
+	if ((fcinfo->context == NULL) || !IsA(fcinfo->context, AggState))
+		return QUANTILE_MIN_ELEMENTS;
+
+	aggstate = (AggState *) fcinfo->context;
+	agg = (Agg *) aggstate->ss.ps.plan;
+	outer = outerPlan(agg);
+
+	if ((outer == NULL) || (agg->plan.plan_rows <= 0) ||
+		((agg->aggstrategy != AGG_PLAIN) && (agg->aggstrategy != AGG_SORTED)))
+		return QUANTILE_MIN_ELEMENTS;
+
+	rows = outer->plan_rows / agg->plan.plan_rows;
+
+	return (int) Max(QUANTILE_MIN_ELEMENTS,
+					 Min(rows, QUANTILE_MAX_INITIAL_ELEMENTS));
+}
+
+/*
+ * Merging the sorted runs (and the elements still in memory) - each input
+ * has a buffer of elements read from the file, and a binary heap of inputs
+ * ordered by their next element is used to return the elements in order.
+ */
+typedef struct quantile_merge_input
+{
+	char   *elements;		/* buffered elements */
+	int		nelements;		/* number of buffered elements */
+	int		next;			/* next buffered element */
+	int		remaining;		/* elements of the run not read yet */
+	int		fileno;			/* position of the part not read yet */
+	off_t	offset;
+} quantile_merge_input;
+
+typedef struct quantile_merge
+{
+	quantile_state *state;
+	const quantile_spill_ops *ops;
+	int				bufsize;	/* size of the input buffers (elements) */
+	int				nruns;		/* number of inputs reading from the file */
+	int				ninputs;
+	quantile_merge_input *inputs;
+	int				nheap;		/* number of inputs not exhausted yet */
+	int			   *heap;
+	int64			value;		/* last returned element */
+} quantile_merge;
+
+#define QUANTILE_MERGE_NEXT(merge, input) \
+	((merge)->inputs[input].elements + \
+	 (Size) (merge)->ops->elemsize * (merge)->inputs[input].next)
+
+static void
+quantile_merge_load(quantile_merge *merge, quantile_merge_input *input)
+{
+	input->nelements = Min(input->remaining, merge->bufsize);
+	input->remaining -= input->nelements;
+	input->next = 0;
+
+	quantile_file_seek(merge->state->ext->file, input->fileno, input->offset);
+	quantile_file_read(merge->state->ext->file, input->elements,
+					   (Size) merge->ops->elemsize * input->nelements);
+	BufFileTell(merge->state->ext->file, &input->fileno, &input->offset);
+}
+
+static void
+quantile_merge_sift(quantile_merge *merge, int i)
+{
+	for (;;)
+	{
+		int	left = 2 * i + 1;
+		int	right = left + 1;
+		int	smallest = i;
+		int	tmp;
+
+		if ((left < merge->nheap) &&
+			(merge->ops->compare(QUANTILE_MERGE_NEXT(merge, merge->heap[left]),
+								 QUANTILE_MERGE_NEXT(merge, merge->heap[smallest])) < 0))
+			smallest = left;
+
+		if ((right < merge->nheap) &&
+			(merge->ops->compare(QUANTILE_MERGE_NEXT(merge, merge->heap[right]),
+								 QUANTILE_MERGE_NEXT(merge, merge->heap[smallest])) < 0))
+			smallest = right;
+
+		if (smallest == i)
+			break;
+
+		tmp = merge->heap[i];
+		merge->heap[i] = merge->heap[smallest];
+		merge->heap[smallest] = tmp;
+
+		i = smallest;
+	}
+}
+
+/*
+ * Starts merging runs [firstrun, firstrun + nruns), and optionally also the
+ * elements in memory (which get sorted first). The buffers are sized so that
+ * all of them together use about as much memory as the elements array.
+ */
+static void
+quantile_merge_begin(quantile_merge *merge, quantile_state *state,
+					 const quantile_spill_ops *ops, int firstrun, int nruns,
+					 bool memory)
+{
+	int	i;
+
+	merge->state = state;
+	merge->ops = ops;
+	merge->bufsize = Max(BLCKSZ / ops->elemsize,
+						 state->spillelements / Max(1, nruns));
+	merge->nruns = nruns;
+	merge->ninputs = nruns + ((memory && state->nelements > 0) ? 1 : 0);
+	merge->inputs = (quantile_merge_input *)
+		palloc(sizeof(quantile_merge_input) * Max(1, merge->ninputs));
+	merge->heap = (int *) palloc(sizeof(int) * Max(1, merge->ninputs));
+	merge->nheap = 0;
+
+	for (i = 0; i < nruns; i++)
+	{
+		quantile_run		 *run = &state->ext->runs[firstrun + i];
+		quantile_merge_input *input = &merge->inputs[i];
+
+		input->elements = palloc((Size) ops->elemsize *
+								 Min(merge->bufsize, run->nelements));
+		input->remaining = run->nelements;
+		input->fileno = run->fileno;
+		input->offset = run->offset;
+
+		quantile_merge_load(merge, input);
+	}
+
+	if (merge->ninputs > nruns)
+	{
+		quantile_merge_input *input = &merge->inputs[nruns];
+
+		if (state->nsorted < state->nelements)
+			ops->sort(state->elements, state->nelements);
+
+		quantile_mark_sorted(state);
+
+		input->elements = (char *) state->elements;
+		input->nelements = state->nelements;
+		input->next = 0;
+		input->remaining = 0;
+	}
+
+	for (i = 0; i < merge->ninputs; i++)
+		merge->heap[merge->nheap++] = i;
+
+	for (i = merge->nheap / 2 - 1; i >= 0; i--)
+		quantile_merge_sift(merge, i);
+}
+
+/* returns the next element in the sort order, or NULL when done */
+static char *
+quantile_merge_next(quantile_merge *merge)
+{
+	int						input;
+	quantile_merge_input   *current;
+
+	if (merge->nheap == 0)
+		return NULL;
+
+	input = merge->heap[0];
+	current = &merge->inputs[input];
+
+	memcpy(&merge->value, QUANTILE_MERGE_NEXT(merge, input),
+		   merge->ops->elemsize);
+
+	if (++current->next == current->nelements)
+	{
+		if (current->remaining > 0)
+			quantile_merge_load(merge, current);
+		else
+			merge->heap[0] = merge->heap[--merge->nheap];
+	}
+
+	quantile_merge_sift(merge, 0);
+
+	return (char *) &merge->value;
+}
+
+static void
+quantile_merge_end(quantile_merge *merge)
+{
+	int	i;
+
+	/* the in-memory input uses the elements array directly */
+	for (i = 0; i < merge->nruns; i++)
+		pfree(merge->inputs[i].elements);
+
+	pfree(merge->inputs);
+	pfree(merge->heap);
+}
+
+/*
+ * With too many runs, the buffers would get too small for efficient reads,
+ * so merge groups of runs into longer runs (written into a new file) until
+ * there are few enough to merge them all at once.
+ */
+static void
+quantile_spill_merge_runs(FunctionCallInfo fcinfo, quantile_state *state,
+						  const quantile_spill_ops *ops)
+{
+	int				i;
+	MemoryContext	aggcontext;
+
+	GET_AGG_CONTEXT("quantile_spill_merge_runs", fcinfo, aggcontext);
+
+	/*
+	 * The runs spilled for extreme quantiles are not sorted, so sort them first
+	 * (in place in the file). Those runs are smaller than the array.
+	 */
+	for (i = 0; i < state->ext->nruns; i++)
+	{
+		quantile_run   *run = &state->ext->runs[i];
+		Size			len = (Size) ops->elemsize * run->nelements;
+		void		   *elements;
+
+		if (run->sorted)
+			continue;
+
+		elements = MemoryContextAllocHuge(CurrentMemoryContext, len);
+
+		quantile_file_seek(state->ext->file, run->fileno, run->offset);
+		quantile_file_read(state->ext->file, elements, len);
+
+		ops->sort(elements, run->nelements);
+
+		quantile_file_seek(state->ext->file, run->fileno, run->offset);
+		quantile_file_write(state->ext->file, elements, len);
+
+		run->sorted = true;
+
+		pfree(elements);
+	}
+
+	while (state->ext->nruns > QUANTILE_MERGE_ORDER)
+	{
+		int				nruns = 0;
+		int				nbuffered = 0;
+		int				bufsize = Max(BLCKSZ / ops->elemsize,
+									  state->spillelements / QUANTILE_MERGE_ORDER);
+		char		   *buffer = palloc((Size) ops->elemsize * bufsize);
+		BufFile		   *file;
+		quantile_run   *runs;
+		MemoryContext	oldcontext;
+
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		file = BufFileCreateTemp(false);
+		runs = (quantile_run *)
+			palloc(sizeof(quantile_run) *
+				   (state->ext->nruns / QUANTILE_MERGE_ORDER + 1));
+
+		MemoryContextSwitchTo(oldcontext);
+
+		for (i = 0; i < state->ext->nruns; i += QUANTILE_MERGE_ORDER)
+		{
+			char		   *value;
+			quantile_merge	merge;
+			quantile_run   *run = &runs[nruns++];
+
+			BufFileTell(file, &run->fileno, &run->offset);
+			run->nelements = 0;
+			run->sorted = true;
+
+			quantile_merge_begin(&merge, state, ops, i,
+								 Min(QUANTILE_MERGE_ORDER,
+									 state->ext->nruns - i),
+								 false);
+
+			while ((value = quantile_merge_next(&merge)) != NULL)
+			{
+				memcpy(buffer + (Size) ops->elemsize * nbuffered, value,
+					   ops->elemsize);
+
+				if (++nbuffered == bufsize)
+				{
+					quantile_file_write(file, buffer,
+										(Size) ops->elemsize * nbuffered);
+					nbuffered = 0;
+				}
+
+				run->nelements++;
+			}
+
+			quantile_file_write(file, buffer, (Size) ops->elemsize * nbuffered);
+			nbuffered = 0;
+
+			quantile_merge_end(&merge);
+		}
+
+		BufFileClose(state->ext->file);
+		pfree(state->ext->runs);
+
+		state->ext->file = file;
+		state->ext->runs = runs;
+		state->ext->nruns = nruns;
+		state->ext->maxruns = nruns;
+
+		BufFileTell(state->ext->file, &state->ext->endfileno,
+					&state->ext->endoffset);
+
+		pfree(buffer);
+	}
+}
+
+/*
+ * Finds the elements at the requested positions (sorted and distinct) in a
+ * state pruned to the tail, if the values in memory at or beyond the bound
+ * cover all the positions - those are the most extreme values (in the sort
+ * order), so only the elements in memory need to be sorted.
+ */
+static bool
+quantile_extreme_select(quantile_state *state, const quantile_spill_ops *ops,
+					 int *positions, int npositions, char *values)
+{
+	int		i;
+	int		ntail = 0;
+	int64	offset = 0;
+	int64	count = QUANTILE_COUNT(state);
+	char   *elements = (char *) state->elements;
+	Size	elemsize = ops->elemsize;
+
+	if ((state->ext->extreme != QUANTILE_EXTREME_UPPER) &&
+		(state->ext->extreme != QUANTILE_EXTREME_LOWER))
+		return false;
+
+	for (i = 0; i < state->nelements; i++)
+	{
+		int		cmp = ops->compare(elements + elemsize * i,
+								   &state->ext->extremebound);
+
+		if ((state->ext->extreme == QUANTILE_EXTREME_UPPER) ?
+			(cmp >= 0) : (cmp <= 0))
+			ntail++;
+	}
+
+	/* in the upper tail, the elements are the last ones in the sort order */
+	if (state->ext->extreme == QUANTILE_EXTREME_UPPER)
+	{
+		if (positions[0] < count - ntail)
+			return false;
+
+		offset = count - state->nelements;
+	}
+	else if (positions[npositions - 1] >= ntail)
+		return false;
+
+	if (state->nsorted < state->nelements)
+		ops->sort(state->elements, state->nelements);
+
+	quantile_mark_sorted(state);
+
+	for (i = 0; i < npositions; i++)
+		memcpy(values + elemsize * i,
+			   elements + elemsize * (positions[i] - offset), elemsize);
+
+	return true;
+}
+
+/*
+ * Finds the elements at the requested positions (sorted and distinct) in a
+ * spilled state, merging the runs only up to the last requested position.
+ * The result gets one element for each quantile, using the indexes.
+ */
+static void
+quantile_spill_select(FunctionCallInfo fcinfo, quantile_state *state,
+					  const quantile_spill_ops *ops, int *indexes,
+					  int nquantiles, int *positions, int npositions,
+					  void *result)
+{
+	int				i;
+	int				position = 0;
+	char		   *value = NULL;
+	char		   *values = palloc((Size) ops->elemsize * npositions);
+	quantile_merge	merge;
+
+	if (quantile_extreme_select(state, ops, positions, npositions, values))
+	{
+		QUANTILE_STATS_PATH(state, "extreme");
+
+		quantile_copy_results(indexes, nquantiles, positions, npositions,
+							  values, ops->elemsize, result);
+
+		pfree(values);
+		return;
+	}
+
+	QUANTILE_STATS_PATH(state, "spilled");
+
+	quantile_spill_merge_runs(fcinfo, state, ops);
+
+	quantile_merge_begin(&merge, state, ops, 0, state->ext->nruns, true);
+
+	for (i = 0; i < npositions; i++)
+	{
+		while (position <= positions[i])
+		{
+			value = quantile_merge_next(&merge);
+			position++;
+		}
+
+		Assert(value != NULL);
+
+		memcpy(values + (Size) ops->elemsize * i, value, ops->elemsize);
+	}
+
+	quantile_merge_end(&merge);
+
+	quantile_copy_results(indexes, nquantiles, positions, npositions,
+						  values, ops->elemsize, result);
+
+	pfree(values);
+}
+
+/*
+ * States over the memory limit (with quantile.on_overflow = approximate) add
+ * the elements to a t-digest, and the array only buffers the new elements.
+ * The digest is allocated in the current (aggregate) memory context, and its
+ * size only depends on the compression.
+ */
+static void
+quantile_approx_begin(quantile_state *state, const quantile_spill_ops *ops)
+{
+	Assert(state->ext->digest == NULL);
+
+	if (state->ext->nruns > 0)
+		elog(ERROR, "cannot approximate a spilled quantile state");
+
+	quantile_state_ext_alloc(state);
+
+	state->ext->digest = tdigest_state_create(QUANTILE_OVERFLOW_COMPRESSION);
+	state->counting = false;
+
+	quantile_approx_fold(state, ops);
+}
+
+/* adds the buffered elements to the digest, which makes the array empty */
+static void
+quantile_approx_fold(quantile_state *state, const quantile_spill_ops *ops)
+{
+	ops->approximate(state->ext->digest, state->elements, state->nelements);
+
+	state->nelements = 0;
+	state->nsorted = 0;
+	state->ndescents = 0;
+	state->nascents = 0;
+
+	if (state->ext->stats != NULL)
+		quantile_stats_memory(state);
+}
+
+/* estimates the quantiles (in the element type), one for each quantile */
+static void
+quantile_approx_select(quantile_state *state, const quantile_spill_ops *ops,
+					   double *quantiles, int nquantiles, void *result)
+{
+	int		i;
+
+	QUANTILE_STATS_PATH(state, "approximate");
+
+	quantile_approx_fold(state, ops);
+
+	for (i = 0; i < nquantiles; i++)
+		ops->estimate(tdigest_estimate(state->ext->digest, quantiles[i]),
+					  (char *) result + (Size) ops->elemsize * i);
+}
+
+/*
+ * Parallel aggregation - combining partial states from multiple workers, and
+ * serializing the states so that they can be passed between processes.
+ *
+ * All the combine functions share the same logic, except that numeric values
+ * are not stored in the elements array directly (it's just pointers), so the
+ * values need to be copied into the aggregate context too. The elements are
+ * added in chunks, so that the first state may spill them as needed. The
+ * second state is usually deserialized, so it may be spilled or counted too.
+ */
+static Datum
+quantile_combine(FunctionCallInfo fcinfo, const char *fname, int elemsize,
+				 const quantile_spill_ops *ops, bool copy_numerics)
+{
+	quantile_state *state1;
+	quantile_state *state2;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	GET_AGG_CONTEXT(fname, fcinfo, aggcontext);
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	state2 = (quantile_state *) PG_GETARG_POINTER(1);
+
+	AssertCheckQuantileState(state2);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state1 = quantile_state_create(fcinfo, elemsize, state2->nelements,
+									   (ops != NULL) ? QUANTILE_LIMIT_SPILL :
+									   QUANTILE_LIMIT_MEMORY);
+
+		quantile_state_set_quantiles(fcinfo, state1, state2->quantiles,
+									 state2->nquantiles);
+	}
+	else
+	{
+		state1 = (quantile_state *) PG_GETARG_POINTER(0);
+
+		/* both states have to be built for the same quantiles */
+		if ((state1->nquantiles != state2->nquantiles) ||
+			(memcmp(state1->quantiles, state2->quantiles,
+					sizeof(double) * state1->nquantiles) != 0))
+			elog(ERROR, "%s: cannot combine states with different quantiles",
+				 fname);
+	}
+
+	AssertCheckQuantileState(state1);
+
+	/*
+	 * The second state is over the memory limit (approximate), so the first
+	 * one has to switch to the digest too (the counted values are expanded
+	 * first, which may be enough for the switch).
+	 */
+	if (state2->ext->digest != NULL)
+	{
+		Assert(ops != NULL);
+
+		if (state1->ext->ncounted > 0)
+			quantile_counted_expand(fcinfo, state1, ops);
+
+		if (state1->ext->digest == NULL)
+			quantile_approx_begin(state1, ops);
+
+		tdigest_merge(state1->ext->digest, state2->ext->digest->centroids,
+					  state2->ext->digest->ncentroids,
+					  state2->ext->digest->count, state2->ext->digest->nnans,
+					  state2->ext->digest->min, state2->ext->digest->max);
+	}
+
+	/*
+	 * The serialized elements are sorted, so if all the elements of the first
+	 * state are sorted too (e.g. because it was built by combining the other
+	 * states), and there's enough memory for both, merge the elements. The
+	 * result remains sorted, so the final function does not need to sort.
+	 */
+	if ((ops != NULL) && (state1->ext->digest == NULL) &&
+		(state1->ext->nruns == 0) && (state1->ext->ncounted == 0) &&
+		(state2->ext->nruns == 0) &&
+		(state1->nsorted == state1->nelements) &&
+		(state2->nsorted == state2->nelements) &&
+		((int64) state1->nelements + state2->nelements <= state1->spillelements))
+	{
+		quantile_state_grow(state1, elemsize,
+							state1->nelements + state2->nelements);
+
+		ops->merge(state1->elements, state1->nelements,
+				   state2->elements, state2->nelements);
+
+		state1->nelements += state2->nelements;
+		quantile_mark_sorted(state1);
+	}
+	else if (state2->ext->nruns > 0)
+		quantile_combine_spilled(fcinfo, state1, state2, ops);
+	else
+		quantile_combine_elements(fcinfo, state1, state2, elemsize, ops,
+								  copy_numerics);
+
+	/* the values counted in the second state */
+	if (state2->ext->ncounted > 0)
+		quantile_combine_counted(fcinfo, state1, state2, ops);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/* copies the elements of the second state, in chunks (as the first has space) */
+static void
+quantile_combine_elements(FunctionCallInfo fcinfo, quantile_state *state1,
+						  quantile_state *state2, int elemsize,
+						  const quantile_spill_ops *ops, bool copy_numerics)
+{
+	int		i;
+	int		n;
+
+	for (i = 0; i < state2->nelements; i += n)
+	{
+		if (state1->nelements == state1->maxelements)
+			quantile_state_reserve(fcinfo, state1, elemsize, ops);
+
+		n = Min(state2->nelements - i,
+				state1->maxelements - state1->nelements);
+
+		memcpy((char *) state1->elements + (Size) elemsize * state1->nelements,
+			   (char *) state2->elements + (Size) elemsize * i,
+			   (Size) elemsize * n);
+
+		/* the pointers reference values in the second state, so copy them */
+		if (copy_numerics)
+		{
+			int			j;
+			Numeric	   *elements = (Numeric *) state1->elements;
+
+			for (j = state1->nelements; j < state1->nelements + n; j++)
+				elements[j] = quantile_numeric_copy(state1, elements[j],
+												VARSIZE(elements[j]));
+		}
+
+		state1->nelements += n;
+	}
+
+	/* the sorted prefix is still valid, but the copied elements were not counted */
+	if (state2->nelements > 0)
+		quantile_order_unknown(state1);
+}
+
+/*
+ * Adds the elements of a spilled second state (which may happen when it was
+ * deserialized), merging its runs one element at a time - so the first state
+ * may spill the elements as usual, and the memory stays within the limit.
+ */
+static void
+quantile_combine_spilled(FunctionCallInfo fcinfo, quantile_state *state1,
+						 quantile_state *state2, const quantile_spill_ops *ops)
+{
+	char		   *value;
+	int				elemsize = ops->elemsize;
+	quantile_merge	merge;
+
+	quantile_spill_merge_runs(fcinfo, state2, ops);
+
+	quantile_merge_begin(&merge, state2, ops, 0, state2->ext->nruns, true);
+
+	while ((value = quantile_merge_next(&merge)) != NULL)
+	{
+		if (state1->nelements == state1->maxelements)
+			quantile_state_reserve(fcinfo, state1, elemsize, ops);
+
+		memcpy((char *) state1->elements + (Size) elemsize * state1->nelements,
+			   value, elemsize);
+
+		state1->nelements++;
+	}
+
+	quantile_merge_end(&merge);
+
+	quantile_order_unknown(state1);
+}
+
+/*
+ * Adds the values counted in the second state - to the counts of the first
+ * state while it's still counting, and there are few enough distinct values
+ * in both states together. Otherwise the values are added as elements (so
+ * the first state may count them again, or spill them).
+ */
+static void
+quantile_combine_counted(FunctionCallInfo fcinfo, quantile_state *state1,
+						 quantile_state *state2, const quantile_spill_ops *ops)
+{
+	int		i;
+	int		elemsize = ops->elemsize;
+	int		nentries = QUANTILE_COUNTED_ENTRIES(state2);
+	int	   *counts = QUANTILE_COUNTED_COUNTS(state2);
+
+	/* the count has to fit into int (see quantile_counted_fold) */
+	if ((int64) QUANTILE_COUNT(state1) + state2->ext->ncounted +
+		state1->maxelements > INT_MAX)
+		elog(ERROR, "too many values in a quantile state");
+
+	if (state1->counting &&
+		(QUANTILE_COUNTED_ENTRIES(state1) + nentries <= QUANTILE_COUNT_MAX_KEYS))
+	{
+		quantile_counted_dense_to_keys(state1, ops);
+		quantile_counted_init(state1);
+
+		for (i = 0; i < nentries; i++)
+		{
+			uint64	key = 0;
+			int		k;
+
+			if (counts[i] == 0)
+				continue;
+
+			quantile_counted_value(state2, i, elemsize, (char *) &key);
+
+			/* the lookup may reallocate the counts */
+			k = quantile_counted_lookup(state1, key, INT_MAX);
+			state1->ext->counts[k] += counts[i];
+		}
+
+		state1->ext->ncounted += state2->ext->ncounted;
+
+		if (state1->ext->stats != NULL)
+			quantile_stats_memory(state1);
+
+		return;
+	}
+
+	for (i = 0; i < nentries; i++)
+	{
+		int		n;
+		int		count = counts[i];
+
+		for (; count > 0; count -= n)
+		{
+			int		j;
+			char   *ptr;
+
+			if (state1->nelements == state1->maxelements)
+				quantile_state_reserve(fcinfo, state1, elemsize, ops);
+
+			n = Min(count, state1->maxelements - state1->nelements);
+			ptr = (char *) state1->elements + (Size) elemsize * state1->nelements;
+
+			for (j = 0; j < n; j++)
+				quantile_counted_value(state2, i, elemsize,
+									   ptr + (Size) elemsize * j);
+
+			state1->nelements += n;
+		}
+	}
+
+	quantile_order_unknown(state1);
+}
+
+Datum
+quantile_combine_double(PG_FUNCTION_ARGS)
+{
+	return quantile_combine(fcinfo, "quantile_combine_double",
+							sizeof(double), &double_spill_ops, false);
+}
+
+Datum
+quantile_combine_float4(PG_FUNCTION_ARGS)
+{
+	return quantile_combine(fcinfo, "quantile_combine_float4",
+							sizeof(float4), &float4_spill_ops, false);
+}
+
+Datum
+quantile_combine_int32(PG_FUNCTION_ARGS)
+{
+	return quantile_combine(fcinfo, "quantile_combine_int32",
+							sizeof(int32), &int32_spill_ops, false);
+}
+
+Datum
+quantile_combine_int16(PG_FUNCTION_ARGS)
+{
+	return quantile_combine(fcinfo, "quantile_combine_int16",
+							sizeof(int16), &int16_spill_ops, false);
+}
+
+Datum
+quantile_combine_int64(PG_FUNCTION_ARGS)
+{
+	return quantile_combine(fcinfo, "quantile_combine_int64",
+							sizeof(int64), &int64_spill_ops, false);
+}
+
+/*
+ * States with fixed-point values with the same scale are combined just like
+ * int64 states. Otherwise both states are switched to regular numerics.
+ */
+Datum
+quantile_combine_numeric(PG_FUNCTION_ARGS)
+{
+	int				fixedscale;
+	Datum			result;
+	quantile_state *state1;
+	quantile_state *state2;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	GET_AGG_CONTEXT("quantile_combine_numeric", fcinfo, aggcontext);
+
+	if (PG_ARGISNULL(1))
+		return quantile_combine(fcinfo, "quantile_combine_numeric",
+								sizeof(Numeric), NULL, true);
+
+	state1 = PG_ARGISNULL(0) ? NULL : (quantile_state *) PG_GETARG_POINTER(0);
+	state2 = (quantile_state *) PG_GETARG_POINTER(1);
+
+	if ((state1 != NULL) && (state1->fixedscale != state2->fixedscale))
+	{
+		oldcontext = MemoryContextSwitchTo(aggcontext);
+
+		if (state1->fixedscale >= 0)
+			quantile_numeric_unfix(state1);
+
+		if (state2->fixedscale >= 0)
+			quantile_numeric_unfix(state2);
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	fixedscale = state2->fixedscale;
+
+	result = quantile_combine(fcinfo, "quantile_combine_numeric",
+							  sizeof(Numeric), NULL, (fixedscale < 0));
+
+	/* the first state may be a new one */
+	((quantile_state *) DatumGetPointer(result))->fixedscale = fixedscale;
+
+	return result;
+}
+
+/*
+ * The serialized state is a bytea value with the number of quantiles and
+ * elements, the format version and the encoding of the elements, followed
+ * by the quantiles and then the elements. Numeric values are stored one
+ * after another (each including the varlena header).
+ *
+ * Fixed-width elements are always sorted (spilled states are merged into a
+ * single sorted array), so that the combine function can merge them instead
+ * of sorting everything again. Sorted integers are usually packed too - the
+ * first value is stored as a varint (zigzag-encoded, i.e. small absolute
+ * values take a single byte), followed by the differences between the
+ * consecutive distinct values (as unsigned varints). A zero difference is
+ * followed by the number of additional copies of the preceding value, so
+ * runs of duplicate values take only a couple bytes. The packed encoding is
+ * only used when it's actually smaller than the plain sorted elements.
+ *
+ * Counted states are stored as the distinct values (in sorted order), each
+ * followed by its count (as a varint), and deserialized as counted states
+ * again - so the number of values does not matter at all.
+ */
+#define QUANTILE_SERIAL_HEADER(nquantiles) \
+	(2 * sizeof(int32) + 2 * sizeof(uint8) + (nquantiles) * sizeof(double))
+
+#define QUANTILE_SERIAL_VERSION			1
+
+/* encoding of the elements */
+#define QUANTILE_ENCODING_RAW			0	/* copied as is */
+#define QUANTILE_ENCODING_SORTED		1	/* copied in sorted order */
+#define QUANTILE_ENCODING_PACKED		2	/* sorted, delta-encoded integers */
+#define QUANTILE_ENCODING_FIXED			3	/* fixed-point numerics (int64) */
+#define QUANTILE_ENCODING_COUNTED		4	/* distinct values with counts */
+
+/* maximum length of a varint (for uint64 values) */
+#define QUANTILE_VARINT_MAX				10
+
+/*
+ * Number of elements of a state over the memory limit (approximate), which
+ * is followed by the t-digest (as a quantile_sketch) instead of elements.
+ */
+#define QUANTILE_SERIAL_APPROXIMATE		(-1)
+
+/* number of unpacked elements appended to the state at once */
+#define QUANTILE_UNPACK_ELEMENTS		1024
+
+static char *
+quantile_serialize_header(quantile_state *state, int encoding, Size datalen,
+						  bytea **result)
+{
+	char   *ptr;
+	int32	value;
+	Size	len = VARHDRSZ + QUANTILE_SERIAL_HEADER(state->nquantiles) + datalen;
+
+	if (!AllocSizeIsValid(len))
+		elog(ERROR, "quantile state too large to serialize (%d elements)",
+			 QUANTILE_COUNT(state));
+
+	*result = (bytea *) palloc(len);
+	SET_VARSIZE(*result, len);
+
+	ptr = VARDATA(*result);
+
+	value = state->nquantiles;
+	memcpy(ptr, &value, sizeof(int32));
+	ptr += sizeof(int32);
+
+	value = (state->ext->digest != NULL) ? QUANTILE_SERIAL_APPROXIMATE :
+									  QUANTILE_COUNT(state);
+	memcpy(ptr, &value, sizeof(int32));
+	ptr += sizeof(int32);
+
+	*ptr++ = QUANTILE_SERIAL_VERSION;
+	*ptr++ = encoding;
+
+	memcpy(ptr, state->quantiles, state->nquantiles * sizeof(double));
+	ptr += state->nquantiles * sizeof(double);
+
+	return ptr;
+}
+
+/*
+ * Reads the header of a serialized state, and creates the state. When the
+ * encoding is NULL, the elements have to be raw.
+ *
+ * Without spilling, the array gets allocated for all the elements, and the
+ * caller simply copies them into it. Otherwise the state starts empty (the
+ * number of values is returned in nvalues), and the caller adds the values
+ * just like the append functions - so the state may get counted, spilled
+ * or approximated, and a large deserialized state does not exceed the
+ * memory limit (except for the serialized value itself).
+ */
+static char *
+quantile_deserialize_header(FunctionCallInfo fcinfo, bytea *data,
+							int elemsize, bool spill, quantile_state **result,
+							int *nvalues, Size *datalen, int *encoding)
+{
+	quantile_state *state;
+	char		   *ptr = VARDATA_ANY(data);
+	Size			len = VARSIZE_ANY_EXHDR(data);
+	int32			nquantiles;
+	int32			nelements;
+	int				version;
+	int				format;
+	bool			approximate;
+
+	if (len < QUANTILE_SERIAL_HEADER(0))
+		elog(ERROR, "invalid serialized quantile state (length %zu)", len);
+
+	memcpy(&nquantiles, ptr, sizeof(int32));
+	ptr += sizeof(int32);
+
+	memcpy(&nelements, ptr, sizeof(int32));
+	ptr += sizeof(int32);
+
+	version = (uint8) *ptr++;
+	format = (uint8) *ptr++;
+
+	if (version != QUANTILE_SERIAL_VERSION)
+		elog(ERROR, "unsupported serialized quantile state version %d", version);
+
+	if ((format > QUANTILE_ENCODING_COUNTED) ||
+		((encoding == NULL) && (format != QUANTILE_ENCODING_RAW)))
+		elog(ERROR, "invalid serialized quantile state (encoding %d)", format);
+
+	if (encoding != NULL)
+		*encoding = format;
+
+	approximate = (nelements == QUANTILE_SERIAL_APPROXIMATE);
+	if (approximate)
+		nelements = 0;
+
+	if ((nquantiles < 1) || (nelements < 0) ||
+		(len < QUANTILE_SERIAL_HEADER(nquantiles)))
+		elog(ERROR, "invalid serialized quantile state");
+
+	/* counted values are not elements, so don't allocate the array for them */
+	state = quantile_state_create(fcinfo, elemsize,
+								  (format == QUANTILE_ENCODING_COUNTED) ? 0 : nelements,
+								  spill ? QUANTILE_LIMIT_SPILL :
+								  QUANTILE_LIMIT_NONE);
+	state->nelements = spill ? 0 : nelements;
+	quantile_order_unknown(state);
+
+	if (nvalues != NULL)
+		*nvalues = nelements;
+
+	quantile_state_set_quantiles(fcinfo, state, (double *) ptr, nquantiles);
+	ptr += state->nquantiles * sizeof(double);
+
+	*result = state;
+	*datalen = len - QUANTILE_SERIAL_HEADER(state->nquantiles);
+
+	/* the digest of a state over the memory limit (copied, for alignment) */
+	if (approximate)
+	{
+		quantile_sketch *sketch;
+
+		if (*datalen < offsetof(quantile_sketch, centroids))
+			elog(ERROR, "invalid serialized quantile state");
+
+		sketch = (quantile_sketch *) palloc(*datalen);
+		memcpy(sketch, ptr, *datalen);
+
+		if (VARSIZE(sketch) != *datalen)
+			elog(ERROR, "invalid serialized quantile state");
+
+		quantile_sketch_check(sketch);
+
+		quantile_state_ext_alloc(state);
+
+		state->ext->digest = tdigest_from_sketch(sketch);
+		state->counting = false;
+
+		pfree(sketch);
+
+		ptr += *datalen;
+		*datalen = 0;
+	}
+
+	return ptr;
+}
+
+/* appends the value to ptr as a varint (7 bits per byte), returns the end */
+static inline char *
+quantile_varint_write(char *ptr, uint64 value)
+{
+	while (value >= 0x80)
+	{
+		*ptr++ = (char) ((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+
+	*ptr++ = (char) value;
+
+	return ptr;
+}
+
+/* reads a varint at ptr (not past end), returns false if it's invalid */
+static inline bool
+quantile_varint_read(const char **ptr, const char *end, uint64 *value)
+{
+	int		shift = 0;
+
+	*value = 0;
+
+	while ((*ptr < end) && (shift < 7 * QUANTILE_VARINT_MAX))
+	{
+		uint8	byte = (uint8) *(*ptr)++;
+
+		*value |= (uint64) (byte & 0x7F) << shift;
+		shift += 7;
+
+		if ((byte & 0x80) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+static inline Size
+quantile_varint_size(uint64 value)
+{
+	Size	len = 1;
+
+	while (value >= 0x80)
+	{
+		value >>= 7;
+		len++;
+	}
+
+	return len;
+}
+
+#define QUANTILE_ZIGZAG(v)		(((uint64) (v) << 1) ^ (uint64) ((v) >> 63))
+#define QUANTILE_UNZIGZAG(u)	((int64) ((u) >> 1) ^ -((int64) ((u) & 1)))
+
+/*
+ * Packs sorted integers added one by one (e.g. while merging the runs of a
+ * spilled state) into ptr, or just computes the length when ptr is NULL.
+ */
+typedef struct quantile_packer
+{
+	char   *ptr;			/* where the next varint goes (or NULL) */
+	Size	len;			/* length of the packed values so far */
+	int64	nvalues;		/* number of values added */
+	int64	value;			/* the last value added */
+	uint64	ncopies;		/* additional copies of the last value */
+} quantile_packer;
+
+static void
+quantile_packer_begin(quantile_packer *packer, char *ptr)
+{
+	packer->ptr = ptr;
+	packer->len = 0;
+	packer->nvalues = 0;
+	packer->value = 0;
+	packer->ncopies = 0;
+}
+
+static inline void
+quantile_packer_write(quantile_packer *packer, uint64 value)
+{
+	packer->len += quantile_varint_size(value);
+
+	if (packer->ptr != NULL)
+		packer->ptr = quantile_varint_write(packer->ptr, value);
+}
+
+/* the copies of the last value, if any (a zero difference and the count) */
+static inline void
+quantile_packer_flush(quantile_packer *packer)
+{
+	if (packer->ncopies == 0)
+		return;
+
+	quantile_packer_write(packer, 0);
+	quantile_packer_write(packer, packer->ncopies);
+
+	packer->ncopies = 0;
+}
+
+static inline void
+quantile_packer_add(quantile_packer *packer, int64 value)
+{
+	if ((packer->nvalues > 0) && (value == packer->value))
+		packer->ncopies++;
+	else
+	{
+		quantile_packer_flush(packer);
+
+		/* the first value, or the difference from the preceding one */
+		quantile_packer_write(packer, (packer->nvalues == 0) ?
+							  QUANTILE_ZIGZAG(value) :
+							  (uint64) value - (uint64) packer->value);
+
+		packer->value = value;
+	}
+
+	packer->nvalues++;
+}
+
+/* returns the length of the packed values */
+static Size
+quantile_packer_end(quantile_packer *packer)
+{
+	quantile_packer_flush(packer);
+
+	return packer->len;
+}
+
+/*
+ * Packs the sorted integer elements (of the given size) into ptr, or just
+ * computes the length of the packed elements when ptr is NULL.
+ */
+static Size
+quantile_pack(const char *elements, int nelements, int elemsize, char *ptr)
+{
+	int				i;
+	quantile_packer	packer;
+
+	quantile_packer_begin(&packer, ptr);
+
+	for (i = 0; i < nelements; i++)
+		quantile_packer_add(&packer,
+							quantile_dense_get(elements + (Size) elemsize * i,
+											   elemsize));
+
+	return quantile_packer_end(&packer);
+}
+
+/*
+ * Merges all the elements of a spilled state into ptr in sorted order, either
+ * packed (see quantile_pack) or as they are, and returns the length. With ptr
+ * NULL, only computes the length (which is only needed for packing).
+ */
+static Size
+quantile_spill_pack(FunctionCallInfo fcinfo, quantile_state *state,
+					const quantile_spill_ops *ops, char *ptr, bool pack)
+{
+	char		   *value;
+	Size			len = 0;
+	quantile_merge	merge;
+	quantile_packer	packer;
+
+	quantile_spill_merge_runs(fcinfo, state, ops);
+
+	quantile_merge_begin(&merge, state, ops, 0, state->ext->nruns, true);
+	quantile_packer_begin(&packer, ptr);
+
+	while ((value = quantile_merge_next(&merge)) != NULL)
+	{
+		if (pack)
+			quantile_packer_add(&packer,
+								quantile_dense_get(value, ops->elemsize));
+		else
+		{
+			memcpy(ptr + len, value, ops->elemsize);
+			len += ops->elemsize;
+		}
+	}
+
+	quantile_merge_end(&merge);
+
+	if (pack)
+		len = quantile_packer_end(&packer);
+
+	return len;
+}
+
+/*
+ * Appends the elements to the state, growing or spilling the array (or even
+ * counting the elements) as needed. With sorted elements that follow all the
+ * elements already in memory, the sorted prefix covers them too.
+ */
+static void
+quantile_state_append(FunctionCallInfo fcinfo, quantile_state *state,
+					  const quantile_spill_ops *ops, const char *elements,
+					  int nelements, bool sorted)
+{
+	int		elemsize = ops->elemsize;
+
+	while (nelements > 0)
+	{
+		int		n;
+
+		if (state->nelements == state->maxelements)
+			quantile_state_reserve(fcinfo, state, elemsize, ops);
+
+		n = Min(nelements, state->maxelements - state->nelements);
+
+		memcpy((char *) state->elements + (Size) elemsize * state->nelements,
+			   elements, (Size) elemsize * n);
+
+		if (sorted && (state->nsorted == state->nelements))
+		{
+			state->nelements += n;
+			quantile_mark_sorted(state);
+		}
+		else
+		{
+			state->nelements += n;
+			quantile_order_unknown(state);
+		}
+
+		elements += (Size) elemsize * n;
+		nelements -= n;
+	}
+}
+
+/* unpacks exactly nelements sorted integers from ptr (len bytes) */
+static void
+quantile_unpack(FunctionCallInfo fcinfo, quantile_state *state,
+				const quantile_spill_ops *ops, const char *ptr, Size len,
+				int nelements)
+{
+	const char *end = ptr + len;
+	int		n = 0;
+	int		nbuffered = 0;
+	int		elemsize = ops->elemsize;
+	int64	prev = 0;
+	int64	min = (elemsize == sizeof(int16)) ? PG_INT16_MIN :
+				  (elemsize == sizeof(int32)) ? PG_INT32_MIN : PG_INT64_MIN;
+	int64	max = (elemsize == sizeof(int16)) ? PG_INT16_MAX :
+				  (elemsize == sizeof(int32)) ? PG_INT32_MAX : PG_INT64_MAX;
+	char   *buffer = palloc((Size) elemsize * QUANTILE_UNPACK_ELEMENTS);
+
+	while (ptr < end)
+	{
+		uint64	delta;
+		uint64	count = 1;
+		int64	value;
+
+		if (!quantile_varint_read(&ptr, end, &delta))
+			elog(ERROR, "invalid serialized quantile state (truncated)");
+
+		/* more copies of the preceding value */
+		if ((n > 0) && (delta == 0))
+		{
+			if (!quantile_varint_read(&ptr, end, &count) ||
+				(count == 0) || (count > (uint64) (nelements - n)))
+				elog(ERROR, "invalid serialized quantile state (packed elements)");
+
+			value = prev;
+		}
+		else
+		{
+			if (n == 0)
+				value = QUANTILE_UNZIGZAG(delta);
+			else
+				value = (int64) ((uint64) prev + delta);
+
+			/* the values have to be increasing, and fit into the element type */
+			if ((n == nelements) || ((n > 0) && (value <= prev)) ||
+				(value < min) || (value > max))
+				elog(ERROR, "invalid serialized quantile state (packed elements)");
+		}
+
+		n += (int) count;
+		prev = value;
+
+		while (count-- > 0)
+		{
+			quantile_dense_set(buffer + (Size) elemsize * nbuffered++,
+							   elemsize, value);
+
+			if (nbuffered == QUANTILE_UNPACK_ELEMENTS)
+			{
+				quantile_state_append(fcinfo, state, ops, buffer, nbuffered,
+									  true);
+				nbuffered = 0;
+			}
+		}
+	}
+
+	quantile_state_append(fcinfo, state, ops, buffer, nbuffered, true);
+
+	pfree(buffer);
+
+	if (n != nelements)
+		elog(ERROR, "invalid serialized quantile state (%d of %d elements)",
+			 n, nelements);
+}
+
+/* serializes a counted state (no elements), as distinct values with counts */
+static bytea *
+quantile_serialize_counted(quantile_state *state, const quantile_spill_ops *ops)
+{
+	int		i;
+	int		nvalues;
+	int	   *counts;
+	char   *values;
+	char   *ptr;
+	bytea  *result;
+	Size	datalen = 0;
+	int		elemsize = ops->elemsize;
+
+	Assert(state->nelements == 0);
+
+	nvalues = quantile_counted_sorted(state, ops, &values, &counts);
+
+	for (i = 0; i < nvalues; i++)
+		datalen += elemsize + quantile_varint_size(counts[i]);
+
+	ptr = quantile_serialize_header(state, QUANTILE_ENCODING_COUNTED, datalen,
+									&result);
+
+	for (i = 0; i < nvalues; i++)
+	{
+		memcpy(ptr, values + (Size) elemsize * i, elemsize);
+		ptr = quantile_varint_write(ptr + elemsize, counts[i]);
+	}
+
+	pfree(values);
+	pfree(counts);
+
+	return result;
+}
+
+/* restores the counts of a state serialized by quantile_serialize_counted */
+static void
+quantile_deserialize_counted(quantile_state *state,
+							 const quantile_spill_ops *ops, const char *ptr,
+							 Size len, int nvalues)
+{
+	const char *end = ptr + len;
+	uint64		prev = 0;
+	int			elemsize = ops->elemsize;
+
+	Assert(state->counting && (state->nelements == 0));
+
+	quantile_counted_init(state);
+
+	while (ptr < end)
+	{
+		uint64	key = 0;
+		uint64	count;
+		int		k;
+
+		if (ptr + elemsize > end)
+			elog(ERROR, "invalid serialized quantile state (truncated)");
+
+		/* copied, as the values may not be aligned */
+		memcpy(&key, ptr, elemsize);
+		ptr += elemsize;
+
+		/* the values have to be sorted and distinct (e.g. -0.0 and 0.0 are) */
+		if ((state->ext->nkeys > 0) && (ops->compare(&prev, &key) > 0))
+			elog(ERROR, "invalid serialized quantile state (counted values)");
+
+		prev = key;
+
+		if (!quantile_varint_read(&ptr, end, &count) || (count == 0) ||
+			(count > (uint64) (nvalues - state->ext->ncounted)))
+			elog(ERROR, "invalid serialized quantile state (counted values)");
+
+		k = quantile_counted_lookup(state, key, INT_MAX);
+
+		if (state->ext->counts[k] != 0)
+			elog(ERROR, "invalid serialized quantile state (counted values)");
+
+		state->ext->counts[k] = (int) count;
+		state->ext->ncounted += (int) count;
+	}
+
+	if (state->ext->ncounted != nvalues)
+		elog(ERROR, "invalid serialized quantile state (%d of %d elements)",
+			 state->ext->ncounted, nvalues);
+}
+
+static bytea *
+quantile_serialize(FunctionCallInfo fcinfo, quantile_state *state,
+				   const quantile_spill_ops *ops)
+{
+	bytea  *result;
+	char   *ptr;
+	char   *elements;
+	int		elemsize = ops->elemsize;
+	int		nelements;
+	Size	datalen;
+	int		encoding = QUANTILE_ENCODING_SORTED;
+
+	AssertCheckQuantileState(state);
+
+	/* over the memory limit, so serialize the digest instead of elements */
+	if (state->ext->digest != NULL)
+	{
+		quantile_sketch *sketch;
+
+		quantile_approx_fold(state, ops);
+		sketch = tdigest_to_sketch(state->ext->digest);
+
+		ptr = quantile_serialize_header(state, QUANTILE_ENCODING_RAW,
+										VARSIZE(sketch), &result);
+		memcpy(ptr, sketch, VARSIZE(sketch));
+
+		pfree(sketch);
+
+		return result;
+	}
+
+	/*
+	 * Count the elements added since the last fold, and serialize just the
+	 * counts. Otherwise the counting gets abandoned, which may spill the
+	 * counted values.
+	 */
+	if (quantile_counted(fcinfo, state, ops))
+		return quantile_serialize_counted(state, ops);
+
+	nelements = QUANTILE_COUNT(state);
+	datalen = (Size) elemsize * nelements;
+
+	/*
+	 * Merge the runs directly into the result (for integers twice, to get
+	 * the packed length first), so that the elements are never all in memory
+	 * at once outside the serialized state.
+	 */
+	if (state->ext->nruns > 0)
+	{
+		bool	pack = false;
+
+		if (ops->minmax != NULL)
+		{
+			Size	packedlen = quantile_spill_pack(fcinfo, state, ops, NULL,
+													true);
+
+			if (packedlen < datalen)
+			{
+				encoding = QUANTILE_ENCODING_PACKED;
+				datalen = packedlen;
+				pack = true;
+			}
+		}
+
+		ptr = quantile_serialize_header(state, encoding, datalen, &result);
+		quantile_spill_pack(fcinfo, state, ops, ptr, pack);
+
+		return result;
+	}
+
+	/* sort the elements in place (the state remains valid, just sorted) */
+	elements = (char *) state->elements;
+
+	if (state->nsorted < state->nelements)
+	{
+		ops->sort(elements, nelements);
+		quantile_mark_sorted(state);
+	}
+
+	/* pack the integers, if that makes them smaller */
+	if (ops->minmax != NULL)
+	{
+		Size	packedlen = quantile_pack(elements, nelements, elemsize, NULL);
+
+		if (packedlen < datalen)
+		{
+			encoding = QUANTILE_ENCODING_PACKED;
+			datalen = packedlen;
+		}
+	}
+
+	ptr = quantile_serialize_header(state, encoding, datalen, &result);
+
+	if (encoding == QUANTILE_ENCODING_PACKED)
+		quantile_pack(elements, nelements, elemsize, ptr);
+	else
+		memcpy(ptr, elements, datalen);
+
+	return result;
+}
+
+/*
+ * The values are added to the state just like by the append functions, so
+ * that it may get spilled (or counted) like any other state.
+ */
+static quantile_state *
+quantile_deserialize(FunctionCallInfo fcinfo, bytea *data,
+					 const quantile_spill_ops *ops)
+{
+	quantile_state *state;
+	Size			datalen;
+	char		   *ptr;
+	int				encoding;
+	int				nvalues;
+	int				elemsize = ops->elemsize;
+
+	ptr = quantile_deserialize_header(fcinfo, data, elemsize, true, &state,
+									  &nvalues, &datalen, &encoding);
+
+	/* only numeric states have fixed-point values */
+	if (encoding == QUANTILE_ENCODING_FIXED)
+		elog(ERROR, "invalid serialized quantile state (encoding %d)", encoding);
+
+	if (encoding == QUANTILE_ENCODING_COUNTED)
+		quantile_deserialize_counted(state, ops, ptr, datalen, nvalues);
+	else if (encoding == QUANTILE_ENCODING_PACKED)
+	{
+		/* only integers get packed */
+		if (ops->minmax == NULL)
+			elog(ERROR, "invalid serialized quantile state (encoding %d)",
+				 encoding);
+
+		quantile_unpack(fcinfo, state, ops, ptr, datalen, nvalues);
+	}
+	else
+	{
+		if (datalen != (Size) elemsize * nvalues)
+			elog(ERROR, "invalid serialized quantile state (%zu bytes for %d elements)",
+				 datalen, nvalues);
+
+		/* the sorted elements don't need to be sorted by the final function */
+		quantile_state_append(fcinfo, state, ops, ptr, nvalues,
+							  (encoding != QUANTILE_ENCODING_RAW));
+	}
+
+	return state;
+}
+
+Datum
+quantile_serialize_double(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_serialize_double", fcinfo);
+
+	PG_RETURN_BYTEA_P(quantile_serialize(fcinfo,
+										 (quantile_state *) PG_GETARG_POINTER(0),
+										 &double_spill_ops));
+}
+
+Datum
+quantile_serialize_float4(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_serialize_float4", fcinfo);
+
+	PG_RETURN_BYTEA_P(quantile_serialize(fcinfo,
+										 (quantile_state *) PG_GETARG_POINTER(0),
+										 &float4_spill_ops));
+}
+
+Datum
+quantile_serialize_int32(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_serialize_int32", fcinfo);
+
+	PG_RETURN_BYTEA_P(quantile_serialize(fcinfo,
+										 (quantile_state *) PG_GETARG_POINTER(0),
+										 &int32_spill_ops));
+}
+
+Datum
+quantile_serialize_int16(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_serialize_int16", fcinfo);
+
+	PG_RETURN_BYTEA_P(quantile_serialize(fcinfo,
+										 (quantile_state *) PG_GETARG_POINTER(0),
+										 &int16_spill_ops));
+}
+
+Datum
+quantile_serialize_int64(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_serialize_int64", fcinfo);
+
+	PG_RETURN_BYTEA_P(quantile_serialize(fcinfo,
+										 (quantile_state *) PG_GETARG_POINTER(0),
+										 &int64_spill_ops));
+}
+
+Datum
+quantile_serialize_numeric(PG_FUNCTION_ARGS)
+{
+	int				i;
+	Size			datalen = 0;
+	bytea		   *result;
+	char		   *ptr;
+	quantile_state *state;
+	Numeric		   *elements;
+
+	CHECK_AGG_CONTEXT("quantile_serialize_numeric", fcinfo);
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+	elements = (Numeric *) state->elements;
+
+	AssertCheckQuantileState(state);
+
+	/* fixed-point values are copied as is, after the scale */
+	if (state->fixedscale >= 0)
+	{
+		int32	scale = state->fixedscale;
+
+		datalen = sizeof(int32) + sizeof(int64) * state->nelements;
+
+		ptr = quantile_serialize_header(state, QUANTILE_ENCODING_FIXED, datalen,
+										&result);
+
+		memcpy(ptr, &scale, sizeof(int32));
+		memcpy(ptr + sizeof(int32), state->elements,
+			   sizeof(int64) * state->nelements);
+
+		PG_RETURN_BYTEA_P(result);
+	}
+
+	for (i = 0; i < state->nelements; i++)
+		datalen += VARSIZE(elements[i]);
+
+	ptr = quantile_serialize_header(state, QUANTILE_ENCODING_RAW, datalen,
+									&result);
+
+	for (i = 0; i < state->nelements; i++)
+	{
+		memcpy(ptr, elements[i], VARSIZE(elements[i]));
+		ptr += VARSIZE(elements[i]);
+	}
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+Datum
+quantile_deserialize_double(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_deserialize_double", fcinfo);
+
+	PG_RETURN_POINTER(quantile_deserialize(fcinfo, PG_GETARG_BYTEA_PP(0),
+										   &double_spill_ops));
+}
+
+Datum
+quantile_deserialize_float4(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_deserialize_float4", fcinfo);
+
+	PG_RETURN_POINTER(quantile_deserialize(fcinfo, PG_GETARG_BYTEA_PP(0),
+										   &float4_spill_ops));
+}
+
+Datum
+quantile_deserialize_int32(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_deserialize_int32", fcinfo);
+
+	PG_RETURN_POINTER(quantile_deserialize(fcinfo, PG_GETARG_BYTEA_PP(0),
+										   &int32_spill_ops));
+}
+
+Datum
+quantile_deserialize_int16(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_deserialize_int16", fcinfo);
+
+	PG_RETURN_POINTER(quantile_deserialize(fcinfo, PG_GETARG_BYTEA_PP(0),
+										   &int16_spill_ops));
+}
+
+Datum
+quantile_deserialize_int64(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_deserialize_int64", fcinfo);
+
+	PG_RETURN_POINTER(quantile_deserialize(fcinfo, PG_GETARG_BYTEA_PP(0),
+										   &int64_spill_ops));
+}
+
+Datum
+quantile_deserialize_numeric(PG_FUNCTION_ARGS)
+{
+	int				i;
+	quantile_state *state;
+	Size			datalen;
+	char		   *ptr;
+	char		   *end;
+	Numeric		   *elements;
+	int				encoding;
+
+	CHECK_AGG_CONTEXT("quantile_deserialize_numeric", fcinfo);
+
+	ptr = quantile_deserialize_header(fcinfo, PG_GETARG_BYTEA_PP(0),
+									  sizeof(Numeric), false, &state, NULL,
+									  &datalen, &encoding);
+	end = ptr + datalen;
+
+	if (encoding == QUANTILE_ENCODING_FIXED)
+	{
+		int32	scale;
+
+		if (datalen != sizeof(int32) + sizeof(int64) * state->nelements)
+			elog(ERROR, "invalid serialized quantile state (%zu bytes for %d elements)",
+				 datalen, state->nelements);
+
+		memcpy(&scale, ptr, sizeof(int32));
+
+		if (!QUANTILE_FIXED_ENABLED ||
+			(scale < 0) || (scale > QUANTILE_FIXED_MAX_SCALE))
+			elog(ERROR, "invalid serialized quantile state (scale %d)", scale);
+
+		memcpy(state->elements, ptr + sizeof(int32),
+			   sizeof(int64) * state->nelements);
+
+		state->fixedscale = scale;
+
+		PG_RETURN_POINTER(state);
+	}
+
+	if (encoding != QUANTILE_ENCODING_RAW)
+		elog(ERROR, "invalid serialized quantile state (encoding %d)", encoding);
+
+	elements = (Numeric *) state->elements;
+
+	/* the values may not be aligned, so copy them one by one */
+	for (i = 0; i < state->nelements; i++)
+	{
+		uint32	header;
+		Size	len;
+
+		if (ptr + VARHDRSZ > end)
+			elog(ERROR, "invalid serialized quantile state (truncated)");
+
+		memcpy(&header, ptr, VARHDRSZ);
+		len = VARSIZE(&header);
+
+		if ((len < VARHDRSZ) || (ptr + len > end))
+			elog(ERROR, "invalid serialized quantile state (truncated)");
+
+		elements[i] = quantile_numeric_copy(state, ptr, len);
+		ptr += len;
+	}
+
+	if (ptr != end)
+		elog(ERROR, "invalid serialized quantile state (trailing data)");
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Approximate quantiles, using a t-digest (the merging variant). The values
+ * are added to a buffer, and when it gets full, they are sorted and merged
+ * with the existing centroids. The scale function limits the size of the
+ * centroids, keeping them small at the tails (so the estimates are accurate
+ * there), and also their number, so the memory is bounded by the compression.
+ *
+ * NaN values are only counted, and are considered larger than all the other
+ * values (just like in the exact aggregates).
+ */
+static void
+tdigest_check_compression(int compression)
+{
+	if ((compression < TDIGEST_MIN_COMPRESSION) ||
+		(compression > TDIGEST_MAX_COMPRESSION))
+		elog(ERROR, "invalid compression value %d - needs to be in [%d,%d]",
+			 compression, TDIGEST_MIN_COMPRESSION, TDIGEST_MAX_COMPRESSION);
+}
+
+static tdigest_state *
+tdigest_state_create(int compression)
+{
+	tdigest_state  *state = (tdigest_state *) palloc(sizeof(tdigest_state));
+
+	tdigest_check_compression(compression);
+
+	state->nquantiles = 0;
+	state->quantiles = NULL;
+
+	state->compression = compression;
+	state->count = 0;
+	state->nnans = 0;
+	state->min = 0;
+	state->max = 0;
+
+	state->ncentroids = 0;
+	state->nmerged = 0;
+	state->maxcentroids = TDIGEST_MAX_CENTROIDS(compression);
+	state->centroids = (tdigest_centroid *)
+		palloc(sizeof(tdigest_centroid) * state->maxcentroids);
+
+	return state;
+}
+
+/* the k1 scale function, k(q) = compression / (2 * pi) * asin(2q - 1) */
+static inline double
+tdigest_k(double q, int compression)
+{
+	return compression * asin(2.0 * Min(1.0, q) - 1.0) / (2.0 * M_PI);
+}
+
+/*
+ * Merges the buffered centroids with the merged ones. The centroids are
+ * sorted, and then neighbors are combined as long as the combined centroid
+ * does not span more than a unit in the scale function.
+ */
+static void
+tdigest_compress(tdigest_state *state)
+{
+	int					i;
+	int					n = 0;
+	double				weight = 0;
+	double				limit;
+	tdigest_centroid   *c = state->centroids;
+
+	if ((state->ncentroids == state->nmerged) || (state->ncentroids == 0))
+		return;
+
+	qsort(c, state->ncentroids, sizeof(tdigest_centroid),
+		  &tdigest_centroid_comparator);
+
+	limit = tdigest_k(0, state->compression) + 1.0;
+
+	for (i = 1; i < state->ncentroids; i++)
+	{
+		int64	proposed = c[n].count + c[i].count;
+
+		if (tdigest_k((weight + proposed) / state->count,
+					  state->compression) <= limit)
+		{
+			c[n].mean += (c[i].mean - c[n].mean) * c[i].count / proposed;
+			c[n].count = proposed;
+		}
+		else
+		{
+			weight += c[n].count;
+			limit = tdigest_k(weight / state->count, state->compression) + 1.0;
+
+			c[++n] = c[i];
+		}
+	}
+
+	state->ncentroids = state->nmerged = n + 1;
+}
+
+static void
+tdigest_add_centroid(tdigest_state *state, double mean, int64 count)
+{
+	if (state->ncentroids == state->maxcentroids)
+		tdigest_compress(state);
+
+	Assert(state->ncentroids < state->maxcentroids);
+
+	if (state->count == 0)
+	{
+		state->min = mean;
+		state->max = mean;
+	}
+	else
+	{
+		state->min = Min(state->min, mean);
+		state->max = Max(state->max, mean);
+	}
+
+	state->centroids[state->ncentroids].mean = mean;
+	state->centroids[state->ncentroids].count = count;
+	state->ncentroids++;
+
+	state->count += count;
+}
+
+static void
+tdigest_add(tdigest_state *state, double value)
+{
+	if (isnan(value))
+		state->nnans++;
+	else
+		tdigest_add_centroid(state, value, 1);
+}
+
+/*
+ * Adds centroids of another digest (with the given count, number of NaNs and
+ * minimum/maximum) to the state.
+ */
+static void
+tdigest_merge(tdigest_state *state, tdigest_centroid *centroids,
+			  int ncentroids, int64 count, int64 nnans, double min, double max)
+{
+	int		i;
+
+	for (i = 0; i < ncentroids; i++)
+		tdigest_add_centroid(state, centroids[i].mean, centroids[i].count);
+
+	/* the centroids don't include the minimum/maximum (not exactly) */
+	if (count > 0)
+	{
+		state->min = Min(state->min, min);
+		state->max = Max(state->max, max);
+	}
+
+	state->nnans += nnans;
+}
+
+/*
+ * Estimates the quantile, by interpolating between the means of neighboring
+ * centroids (and the minimum/maximum at the tails). When all the values are
+ * still buffered, the exact value (as computed by quantile) is returned.
+ */
+static double
+tdigest_estimate(tdigest_state *state, double quantile)
+{
+	int					i;
+	int64				idx = 0;
+	double				index;
+	double				left;
+	tdigest_centroid   *c = state->centroids;
+
+	if (quantile > 0)
+		idx = (int64) ceil((state->count + state->nnans) * quantile) - 1;
+
+	/* the NaN values are sorted after all the other values */
+	if (idx >= state->count)
+		return get_float8_nan();
+
+	/* no centroids merged yet, so just pick the value */
+	if (state->ncentroids == state->count)
+	{
+		if (state->nmerged != state->ncentroids)
+			qsort(c, state->ncentroids, sizeof(tdigest_centroid),
+				  &tdigest_centroid_comparator);
+
+		state->nmerged = state->ncentroids;
+
+		return c[idx].mean;
+	}
+
+	tdigest_compress(state);
+
+	index = Min(quantile * (state->count + state->nnans), state->count);
+
+	/* between the minimum and the first centroid */
+	left = c[0].count / 2.0;
+
+	if (index < left)
+		return state->min + (c[0].mean - state->min) * (index / left);
+
+	for (i = 0; i < state->ncentroids - 1; i++)
+	{
+		double	right = left + (c[i].count + c[i+1].count) / 2.0;
+
+		if (index < right)
+			return c[i].mean + (c[i+1].mean - c[i].mean) *
+				(index - left) / (right - left);
+
+		left = right;
+	}
+
+	/* between the last centroid and the maximum */
+	if (index >= state->count)
+		return state->max;
+
+	return c[i].mean + (state->max - c[i].mean) *
+		(index - left) / (state->count - left);
+}
+
+Datum
+quantile_approx_append(PG_FUNCTION_ARGS)
+{
+	tdigest_state  *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_approx_append", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		int		compression = TDIGEST_DEFAULT_COMPRESSION;
+
+		if (PG_NARGS() > 3)
+			compression = PG_GETARG_INT32(3);
+
+		state = tdigest_state_create(compression);
+
+		state->quantiles = (double *) palloc(sizeof(double));
+		state->quantiles[0] = PG_GETARG_FLOAT8(2);
+		state->nquantiles = 1;
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (tdigest_state *) PG_GETARG_POINTER(0);
+
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_approx_append_array(PG_FUNCTION_ARGS)
+{
+	tdigest_state  *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	ArrayType	   *quantiles;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_approx_append_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		int		compression = TDIGEST_DEFAULT_COMPRESSION;
+
+		if (PG_NARGS() > 3)
+			compression = PG_GETARG_INT32(3);
+
+		state = tdigest_state_create(compression);
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, quantiles,
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (tdigest_state *) PG_GETARG_POINTER(0);
+
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_approx_double(PG_FUNCTION_ARGS)
+{
+	tdigest_state  *state;
+
+	CHECK_AGG_CONTEXT("quantile_approx_double", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (tdigest_state *) PG_GETARG_POINTER(0);
+
+	/* only NULL values */
+	if (state->count + state->nnans == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(tdigest_estimate(state, state->quantiles[0]));
+}
+
+Datum
+quantile_approx_double_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	double		   *result;
+	tdigest_state  *state;
+
+	CHECK_AGG_CONTEXT("quantile_approx_double_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (tdigest_state *) PG_GETARG_POINTER(0);
+
+	if (state->count + state->nnans == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(state->nquantiles * sizeof(double));
+
+	for (i = 0; i < state->nquantiles; i++)
+		result[i] = tdigest_estimate(state, state->quantiles[i]);
+
+	return double_to_array(fcinfo, result, state->nquantiles);
+}
+
+Datum
+quantile_approx_combine(PG_FUNCTION_ARGS)
+{
+	tdigest_state  *state1;
+	tdigest_state  *state2;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	GET_AGG_CONTEXT("quantile_approx_combine", fcinfo, aggcontext);
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	state2 = (tdigest_state *) PG_GETARG_POINTER(1);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state1 = tdigest_state_create(state2->compression);
+
+		state1->nquantiles = state2->nquantiles;
+		state1->quantiles = (double *) palloc(sizeof(double) * state2->nquantiles);
+		memcpy(state1->quantiles, state2->quantiles,
+			   sizeof(double) * state2->nquantiles);
+	}
+	else
+	{
+		state1 = (tdigest_state *) PG_GETARG_POINTER(0);
+
+		/* both states have to be built for the same quantiles */
+		if ((state1->nquantiles != state2->nquantiles) ||
+			(memcmp(state1->quantiles, state2->quantiles,
+					sizeof(double) * state1->nquantiles) != 0))
+			elog(ERROR, "quantile_approx_combine: cannot combine states with different quantiles");
+	}
+
+	/*
+	 * The states may use different compression (when merging sketches built
+	 * with different compression), in which case the first one is used.
+	 */
+	tdigest_merge(state1, state2->centroids, state2->ncentroids,
+				  state2->count, state2->nnans, state2->min, state2->max);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * The serialized t-digest has a fixed header, followed by the quantiles and
+ * the (compressed) centroids.
+ */
+typedef struct tdigest_serial_header
+{
+	int32	nquantiles;
+	int32	compression;
+	int32	ncentroids;
+	int64	count;
+	int64	nnans;
+	double	min;
+	double	max;
+} tdigest_serial_header;
+
+Datum
+quantile_approx_serialize(PG_FUNCTION_ARGS)
+{
+	tdigest_state		   *state;
+	tdigest_serial_header	header;
+	bytea				   *result;
+	char				   *ptr;
+	Size					len;
+
+	CHECK_AGG_CONTEXT("quantile_approx_serialize", fcinfo);
+
+	state = (tdigest_state *) PG_GETARG_POINTER(0);
+
+	/* when the values are not just buffered, compress them first */
+	if (state->ncentroids != state->count)
+		tdigest_compress(state);
+
+	header.nquantiles = state->nquantiles;
+	header.compression = state->compression;
+	header.ncentroids = state->ncentroids;
+	header.count = state->count;
+	header.nnans = state->nnans;
+	header.min = state->min;
+	header.max = state->max;
+
+	len = VARHDRSZ + sizeof(tdigest_serial_header) +
+		state->nquantiles * sizeof(double) +
+		state->ncentroids * sizeof(tdigest_centroid);
+
+	result = (bytea *) palloc(len);
+	SET_VARSIZE(result, len);
+
+	ptr = VARDATA(result);
+
+	memcpy(ptr, &header, sizeof(tdigest_serial_header));
+	ptr += sizeof(tdigest_serial_header);
+
+	memcpy(ptr, state->quantiles, state->nquantiles * sizeof(double));
+	ptr += state->nquantiles * sizeof(double);
+
+	memcpy(ptr, state->centroids, state->ncentroids * sizeof(tdigest_centroid));
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+Datum
+quantile_approx_deserialize(PG_FUNCTION_ARGS)
+{
+	bytea				   *data;
+	tdigest_state		   *state;
+	tdigest_serial_header	header;
+	char				   *ptr;
+	Size					len;
+
+	CHECK_AGG_CONTEXT("quantile_approx_deserialize", fcinfo);
+
+	data = PG_GETARG_BYTEA_PP(0);
+	ptr = VARDATA_ANY(data);
+	len = VARSIZE_ANY_EXHDR(data);
+
+	if (len < sizeof(tdigest_serial_header))
+		elog(ERROR, "invalid serialized t-digest (length %zu)", len);
+
+	memcpy(&header, ptr, sizeof(tdigest_serial_header));
+	ptr += sizeof(tdigest_serial_header);
+
+	if ((header.nquantiles < 0) || (header.ncentroids < 0) ||
+		(header.ncentroids > TDIGEST_MAX_CENTROIDS(header.compression)) ||
+		(len != sizeof(tdigest_serial_header) +
+				header.nquantiles * sizeof(double) +
+				header.ncentroids * sizeof(tdigest_centroid)))
+		elog(ERROR, "invalid serialized t-digest");
+
+	state = tdigest_state_create(header.compression);
+
+	state->nquantiles = header.nquantiles;
+	state->quantiles = (double *) palloc(state->nquantiles * sizeof(double));
+	memcpy(state->quantiles, ptr, state->nquantiles * sizeof(double));
+	ptr += state->nquantiles * sizeof(double);
+
+	memcpy(state->centroids, ptr, header.ncentroids * sizeof(tdigest_centroid));
+
+	state->ncentroids = header.ncentroids;
+	state->nmerged = (header.ncentroids == header.count) ? 0 : header.ncentroids;
+	state->count = header.count;
+	state->nnans = header.nnans;
+	state->min = header.min;
+	state->max = header.max;
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Persistent sketches - the compressed t-digest as a regular data type, so
+ * that it can be stored (e.g. in rollup tables), merged and queried later.
+ */
+static quantile_sketch *
+tdigest_to_sketch(tdigest_state *state)
+{
+	Size				len;
+	quantile_sketch	   *sketch;
+
+	/* keep the values exact when not compressed yet, but sort them */
+	if (state->ncentroids == state->count)
+	{
+		if (state->nmerged != state->ncentroids)
+			qsort(state->centroids, state->ncentroids,
+				  sizeof(tdigest_centroid), &tdigest_centroid_comparator);
+
+		state->nmerged = state->ncentroids;
+	}
+	else
+		tdigest_compress(state);
+
+	len = offsetof(quantile_sketch, centroids) +
+		state->ncentroids * sizeof(tdigest_centroid);
+
+	sketch = (quantile_sketch *) palloc0(len);
+	SET_VARSIZE(sketch, len);
+
+	sketch->compression = state->compression;
+	sketch->ncentroids = state->ncentroids;
+	sketch->count = state->count;
+	sketch->nnans = state->nnans;
+	sketch->min = state->min;
+	sketch->max = state->max;
+
+	memcpy(sketch->centroids, state->centroids,
+		   state->ncentroids * sizeof(tdigest_centroid));
+
+	return sketch;
+}
+
+static tdigest_state *
+tdigest_from_sketch(quantile_sketch *sketch)
+{
+	tdigest_state  *state = tdigest_state_create(sketch->compression);
+
+	memcpy(state->centroids, sketch->centroids,
+		   sketch->ncentroids * sizeof(tdigest_centroid));
+
+	/* the centroids of a sketch are always sorted */
+	state->ncentroids = sketch->ncentroids;
+	state->nmerged = sketch->ncentroids;
+	state->count = sketch->count;
+	state->nnans = sketch->nnans;
+	state->min = sketch->min;
+	state->max = sketch->max;
+
+	return state;
+}
+
+/*
+ * Checks that a sketch (received from the client) is consistent, so that
+ * the functions working with it may rely on that.
+ */
+static void
+quantile_sketch_check(quantile_sketch *sketch)
+{
+	int		i;
+	int64	count = 0;
+
+	tdigest_check_compression(sketch->compression);
+
+	if ((sketch->ncentroids < 0) ||
+		(sketch->ncentroids > TDIGEST_MAX_CENTROIDS(sketch->compression)))
+		elog(ERROR, "invalid number of centroids %d in quantile sketch",
+			 sketch->ncentroids);
+
+	if ((sketch->count < 0) || (sketch->nnans < 0))
+		elog(ERROR, "invalid number of values in quantile sketch");
+
+	for (i = 0; i < sketch->ncentroids; i++)
+	{
+		tdigest_centroid   *c = &sketch->centroids[i];
+
+		if ((c->count <= 0) || isnan(c->mean) ||
+			(c->mean < sketch->min) || (c->mean > sketch->max))
+			elog(ERROR, "invalid centroid (%g, " INT64_FORMAT ") in quantile sketch",
+				 c->mean, c->count);
+
+		if ((i > 0) && (c->mean < sketch->centroids[i-1].mean))
+			elog(ERROR, "centroids in quantile sketch are not sorted");
+
+		count += c->count;
+	}
+
+	if (count != sketch->count)
+		elog(ERROR, "invalid number of values in quantile sketch ("
+			 INT64_FORMAT " expected, " INT64_FORMAT " found)",
+			 sketch->count, count);
+}
+
+/*
+ * The text representation lists the parameters, followed by the centroids:
+ *
+ *     compression 100 count 3 nans 0 min 1 max 3 centroids 3 (1,1) (2,1) (3,1)
+ */
+Datum
+quantile_sketch_in(PG_FUNCTION_ARGS)
+{
+	char			   *str = PG_GETARG_CSTRING(0);
+	char			   *ptr = str;
+	quantile_sketch		header;
+	quantile_sketch	   *sketch;
+	Size				len;
+	int					i;
+	int					n;
+
+	if (sscanf(ptr, " compression %d count " INT64_FORMAT " nans " INT64_FORMAT
+			   " min %lf max %lf centroids %d%n",
+			   &header.compression, &header.count, &header.nnans,
+			   &header.min, &header.max, &header.ncentroids, &n) != 6)
+		elog(ERROR, "invalid input syntax for quantile sketch: \"%s\"", str);
+
+	ptr += n;
+
+	tdigest_check_compression(header.compression);
+
+	if ((header.ncentroids < 0) ||
+		(header.ncentroids > TDIGEST_MAX_CENTROIDS(header.compression)))
+		elog(ERROR, "invalid number of centroids %d in quantile sketch",
+			 header.ncentroids);
+
+	len = offsetof(quantile_sketch, centroids) +
+		header.ncentroids * sizeof(tdigest_centroid);
+
+	sketch = (quantile_sketch *) palloc0(len);
+	SET_VARSIZE(sketch, len);
+
+	sketch->compression = header.compression;
+	sketch->ncentroids = header.ncentroids;
+	sketch->count = header.count;
+	sketch->nnans = header.nnans;
+	sketch->min = header.min;
+	sketch->max = header.max;
+
+	for (i = 0; i < sketch->ncentroids; i++)
+	{
+		if (sscanf(ptr, " (%lf , " INT64_FORMAT " )%n",
+				   &sketch->centroids[i].mean, &sketch->centroids[i].count,
+				   &n) != 2)
+			elog(ERROR, "invalid input syntax for quantile sketch: \"%s\"", str);
+
+		ptr += n;
+	}
+
+	/* only whitespace may follow the last centroid */
+	while (isspace((unsigned char) *ptr))
+		ptr++;
+
+	if (*ptr != '\0')
+		elog(ERROR, "invalid input syntax for quantile sketch: \"%s\"", str);
+
+	quantile_sketch_check(sketch);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+Datum
+quantile_sketch_out(PG_FUNCTION_ARGS)
+{
+	int					i;
+	StringInfoData		str;
+	quantile_sketch	   *sketch = PG_GETARG_QUANTILE_SKETCH(0);
+
+	initStringInfo(&str);
+
+	appendStringInfo(&str, "compression %d count " INT64_FORMAT " nans "
+					 INT64_FORMAT " min %.*g max %.*g centroids %d",
+					 sketch->compression, sketch->count, sketch->nnans,
+					 DBL_DIG + 3, sketch->min, DBL_DIG + 3, sketch->max,
+					 sketch->ncentroids);
+
+	for (i = 0; i < sketch->ncentroids; i++)
+		appendStringInfo(&str, " (%.*g," INT64_FORMAT ")",
+						 DBL_DIG + 3, sketch->centroids[i].mean,
+						 sketch->centroids[i].count);
+
+	PG_RETURN_CSTRING(str.data);
+}
+
+Datum
+quantile_sketch_send(PG_FUNCTION_ARGS)
+{
+	int					i;
+	StringInfoData		buf;
+	quantile_sketch	   *sketch = PG_GETARG_QUANTILE_SKETCH(0);
+
+	pq_begintypsend(&buf);
+
+	pq_sendint(&buf, sketch->compression, 4);
+	pq_sendint64(&buf, sketch->count);
+	pq_sendint64(&buf, sketch->nnans);
+	pq_sendfloat8(&buf, sketch->min);
+	pq_sendfloat8(&buf, sketch->max);
+	pq_sendint(&buf, sketch->ncentroids, 4);
+
+	for (i = 0; i < sketch->ncentroids; i++)
+	{
+		pq_sendfloat8(&buf, sketch->centroids[i].mean);
+		pq_sendint64(&buf, sketch->centroids[i].count);
+	}
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+Datum
+quantile_sketch_recv(PG_FUNCTION_ARGS)
+{
+	int					i;
+	StringInfo			buf = (StringInfo) PG_GETARG_POINTER(0);
+	quantile_sketch		header;
+	quantile_sketch	   *sketch;
+	Size				len;
+
+	header.compression = pq_getmsgint(buf, 4);
+	header.count = pq_getmsgint64(buf);
+	header.nnans = pq_getmsgint64(buf);
+	header.min = pq_getmsgfloat8(buf);
+	header.max = pq_getmsgfloat8(buf);
+	header.ncentroids = pq_getmsgint(buf, 4);
+
+	tdigest_check_compression(header.compression);
+
+	if ((header.ncentroids < 0) ||
+		(header.ncentroids > TDIGEST_MAX_CENTROIDS(header.compression)))
+		elog(ERROR, "invalid number of centroids %d in quantile sketch",
+			 header.ncentroids);
+
+	len = offsetof(quantile_sketch, centroids) +
+		header.ncentroids * sizeof(tdigest_centroid);
+
+	sketch = (quantile_sketch *) palloc0(len);
+	SET_VARSIZE(sketch, len);
+
+	sketch->compression = header.compression;
+	sketch->ncentroids = header.ncentroids;
+	sketch->count = header.count;
+	sketch->nnans = header.nnans;
+	sketch->min = header.min;
+	sketch->max = header.max;
+
+	for (i = 0; i < sketch->ncentroids; i++)
+	{
+		sketch->centroids[i].mean = pq_getmsgfloat8(buf);
+		sketch->centroids[i].count = pq_getmsgint64(buf);
+	}
+
+	quantile_sketch_check(sketch);
+
+	PG_RETURN_POINTER(sketch);
+}
+
+/* builds a sketch from values, i.e. the aggregate quantile_sketch(value) */
+Datum
+quantile_sketch_append(PG_FUNCTION_ARGS)
+{
+	tdigest_state  *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_sketch_append", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		int		compression = TDIGEST_DEFAULT_COMPRESSION;
+
+		if (PG_NARGS() > 2)
+			compression = PG_GETARG_INT32(2);
+
+		state = tdigest_state_create(compression);
+	}
+	else
+		state = (tdigest_state *) PG_GETARG_POINTER(0);
+
+	tdigest_add(state, PG_GETARG_FLOAT8(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+/* merges existing sketches, i.e. the aggregate quantile_merge(sketch) */
+Datum
+quantile_sketch_merge(PG_FUNCTION_ARGS)
+{
+	tdigest_state	   *state;
+	quantile_sketch	   *sketch;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_sketch_merge", fcinfo, aggcontext);
+
+	sketch = PG_GETARG_QUANTILE_SKETCH(1);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	/* the merged sketch uses the compression of the first one */
+	if (PG_ARGISNULL(0))
+		state = tdigest_state_create(sketch->compression);
+	else
+		state = (tdigest_state *) PG_GETARG_POINTER(0);
+
+	tdigest_merge(state, sketch->centroids, sketch->ncentroids,
+				  sketch->count, sketch->nnans, sketch->min, sketch->max);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_sketch_final(PG_FUNCTION_ARGS)
+{
+	CHECK_AGG_CONTEXT("quantile_sketch_final", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	PG_RETURN_POINTER(tdigest_to_sketch((tdigest_state *) PG_GETARG_POINTER(0)));
+}
+
+Datum
+quantile_sketch_get(PG_FUNCTION_ARGS)
+{
+	tdigest_state	   *state;
+	double				quantile = PG_GETARG_FLOAT8(1);
+
+	check_quantiles(1, &quantile);
+
+	state = tdigest_from_sketch(PG_GETARG_QUANTILE_SKETCH(0));
+
+	/* empty sketch (e.g. after merging only empty sketches) */
+	if (state->count + state->nnans == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(tdigest_estimate(state, quantile));
+}
+
+Datum
+quantile_sketch_get_array(PG_FUNCTION_ARGS)
+{
+	int					i;
+	int					nquantiles;
+	double			   *quantiles;
+	double			   *result;
+	tdigest_state	   *state;
+
+	quantiles = array_to_double(fcinfo, PG_GETARG_ARRAYTYPE_P(1), &nquantiles);
+
+	check_quantiles(nquantiles, quantiles);
+
+	state = tdigest_from_sketch(PG_GETARG_QUANTILE_SKETCH(0));
+
+	if (state->count + state->nnans == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(nquantiles * sizeof(double));
+
+	for (i = 0; i < nquantiles; i++)
+		result[i] = tdigest_estimate(state, quantiles[i]);
+
+	return double_to_array(fcinfo, result, nquantiles);
+}
+
+/*
+ * Sampling aggregates (quantile_sample) - the values are sampled into a
+ * reservoir of a fixed size, and the quantiles of the sample are computed
+ * by the regular final functions. The random generator uses a fixed seed,
+ * so the same input (in the same order) always produces the same sample.
+ */
+#define QUANTILE_SAMPLE_MAX_SIZE	(10 * 1000 * 1000)
+
+static void
+quantile_sample_check_size(int size)
+{
+	if ((size < 1) || (size > QUANTILE_SAMPLE_MAX_SIZE))
+		elog(ERROR, "invalid sample size %d - needs to be in [1,%d]",
+			 size, QUANTILE_SAMPLE_MAX_SIZE);
+}
+
+/* xorshift64*, returning a random value in (0,1) */
+static double
+quantile_reservoir_random(quantile_reservoir *reservoir)
+{
+	uint64	x = reservoir->seed;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	reservoir->seed = x;
+
+	return ((double) ((x * UINT64CONST(0x2545F4914F6CDD1D)) >> 11) + 0.5) /
+		   (double) (UINT64CONST(1) << 53);
+}
+
+/* random slot of the reservoir, i.e. in [0, size) */
+static int
+quantile_reservoir_slot(quantile_reservoir *reservoir)
+{
+	return Min((int) (quantile_reservoir_random(reservoir) * reservoir->size),
+			   reservoir->size - 1);
+}
+
+/*
+ * Computes the next value to sample (after the current one, i.e. the value
+ * number nvalues), and updates the weight - the number of skipped values
+ * has a geometric distribution, so it's generated directly.
+ */
+static void
+quantile_reservoir_skip(quantile_reservoir *reservoir)
+{
+	double	skip;
+
+	reservoir->w *= exp(log(quantile_reservoir_random(reservoir)) /
+						reservoir->size);
+
+	skip = floor(log(quantile_reservoir_random(reservoir)) /
+				 log1p(-reservoir->w));
+
+	/* the weight may get so small that no other value gets sampled */
+	if (isnan(skip) || (skip >= (double) (PG_INT64_MAX / 2)))
+		reservoir->next = PG_INT64_MAX;
+	else
+		reservoir->next = reservoir->nvalues + 1 + (int64) skip;
+}
+
+static quantile_state *
+quantile_sample_create(FunctionCallInfo fcinfo, int size)
+{
+	quantile_state *state;
+
+	quantile_sample_check_size(size);
+
+	/* the sample is bounded, so there's nothing to spill or count */
+	state = quantile_state_create(fcinfo, sizeof(double), size,
+								  QUANTILE_LIMIT_NONE);
+	state->counting = false;
+
+	quantile_state_ext_alloc(state);
+
+	state->ext->reservoir = (quantile_reservoir *)
+		palloc(sizeof(quantile_reservoir));
+	state->ext->reservoir->size = size;
+	state->ext->reservoir->nvalues = 0;
+	state->ext->reservoir->next = 0;
+	state->ext->reservoir->w = 1.0;
+	state->ext->reservoir->seed = UINT64CONST(0x9E3779B97F4A7C15);
+
+	return state;
+}
+
+/* adds a value to the reservoir - until it's full, all the values are kept */
+static void
+quantile_sample_add(quantile_state *state, double value)
+{
+	quantile_reservoir *reservoir = state->ext->reservoir;
+	double			   *elements = (double *) state->elements;
+
+	if (state->nelements < reservoir->size)
+	{
+		QUANTILE_TRACK_ORDER(state, elements, value, FLOAT_LT);
+		elements[state->nelements++] = value;
+
+		if (state->nelements == reservoir->size)
+			quantile_reservoir_skip(reservoir);
+	}
+	else if (reservoir->nvalues == reservoir->next)
+	{
+		elements[quantile_reservoir_slot(reservoir)] = value;
+
+		state->nsorted = 0;
+		quantile_order_unknown(state);
+
+		quantile_reservoir_skip(reservoir);
+	}
+
+	reservoir->nvalues++;
+}
+
+Datum
+quantile_sample_append_double(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_sample_append_double", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_sample_create(fcinfo, PG_GETARG_INT32(3));
+
+		state->quantile = PG_GETARG_FLOAT8(2);
+		state->quantiles = &state->quantile;
+		state->nquantiles = 1;
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantile_sample_add(state, PG_GETARG_FLOAT8(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_sample_append_double_array(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_sample_append_double_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state = quantile_sample_create(fcinfo, PG_GETARG_INT32(3));
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, PG_GETARG_ARRAYTYPE_P(2),
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	quantile_sample_add(state, PG_GETARG_FLOAT8(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Adds all the values seen by another (not full) reservoir, replacing a random
+ * sampled value with probability size / nvalues (i.e. Algorithm R).
+ */
+static void
+quantile_sample_combine_values(quantile_state *state, double *values, int nvalues)
+{
+	int					i;
+	double			   *elements = (double *) state->elements;
+	quantile_reservoir *reservoir = state->ext->reservoir;
+
+	for (i = 0; i < nvalues; i++)
+	{
+		reservoir->nvalues++;
+
+		if (state->nelements < reservoir->size)
+			elements[state->nelements++] = values[i];
+		else if (quantile_reservoir_random(reservoir) * reservoir->nvalues < reservoir->size)
+			elements[quantile_reservoir_slot(reservoir)] = values[i];
+	}
+}
+
+/* random index in [i, n), for picking values without replacement */
+static int
+quantile_reservoir_pick(quantile_reservoir *reservoir, int i, int n)
+{
+	return i + Min((int) (quantile_reservoir_random(reservoir) * (n - i)),
+				   n - i - 1);
+}
+
+/*
+ * Combines two full reservoirs - each sampled value comes from the first one
+ * with probability proportional to the number of values it has seen, and is
+ * picked from it at random (without replacement, using Fisher-Yates).
+ */
+static void
+quantile_sample_combine_samples(quantile_state *state1, quantile_state *state2)
+{
+	int					i;
+	int					n1 = 0;
+	quantile_reservoir *reservoir = state1->ext->reservoir;
+	int					size = reservoir->size;
+	int64				nvalues = reservoir->nvalues +
+		state2->ext->reservoir->nvalues;
+	double			   *elements1 = (double *) state1->elements;
+	double			   *elements2 = (double *) state2->elements;
+
+	/* how many of the sampled values come from the first reservoir */
+	for (i = 0; i < size; i++)
+		if (quantile_reservoir_random(reservoir) * nvalues < reservoir->nvalues)
+			n1++;
+
+	/* move a random subset of n1 values to the beginning */
+	for (i = 0; i < n1; i++)
+	{
+		int		j = quantile_reservoir_pick(reservoir, i, size);
+		double	value = elements1[j];
+
+		elements1[j] = elements1[i];
+		elements1[i] = value;
+	}
+
+	/* and pick the rest from the second reservoir */
+	for (i = n1; i < size; i++)
+	{
+		int		j = quantile_reservoir_pick(reservoir, i, size);
+		double	value = elements2[j];
+
+		elements2[j] = elements2[i];
+		elements2[i] = value;
+
+		elements1[i] = value;
+	}
+
+	reservoir->nvalues = nvalues;
+}
+
+/*
+ * Combines two sampling states (the first one is in the aggregate context,
+ * so the result is always built in it).
+ */
+Datum
+quantile_sample_combine(PG_FUNCTION_ARGS)
+{
+	quantile_state *state1;
+	quantile_state *state2;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	GET_AGG_CONTEXT("quantile_sample_combine", fcinfo, aggcontext);
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	state2 = (quantile_state *) PG_GETARG_POINTER(1);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state1 = quantile_sample_create(fcinfo, state2->ext->reservoir->size);
+
+		quantile_state_set_quantiles(fcinfo, state1, state2->quantiles,
+									 state2->nquantiles);
+	}
+	else
+	{
+		state1 = (quantile_state *) PG_GETARG_POINTER(0);
+
+		/* both states have to be built for the same quantiles and size */
+		if ((state1->nquantiles != state2->nquantiles) ||
+			(memcmp(state1->quantiles, state2->quantiles,
+					sizeof(double) * state1->nquantiles) != 0))
+			elog(ERROR, "quantile_sample_combine: cannot combine states with different quantiles");
+
+		if (state1->ext->reservoir->size != state2->ext->reservoir->size)
+			elog(ERROR, "quantile_sample_combine: cannot combine states with different sample sizes");
+	}
+
+	if (state2->nelements < state2->ext->reservoir->nvalues)
+	{
+		/* the first state has all its values, so add them to the second one */
+		if (state1->nelements == state1->ext->reservoir->nvalues)
+		{
+			int		nelements = state1->nelements;
+			double *values = (double *) palloc(sizeof(double) * Max(1, nelements));
+
+			memcpy(values, state1->elements, sizeof(double) * nelements);
+			memcpy(state1->elements, state2->elements,
+				   sizeof(double) * state2->nelements);
+
+			state1->nelements = state2->nelements;
+			state1->ext->reservoir->nvalues = state2->ext->reservoir->nvalues;
+
+			quantile_sample_combine_values(state1, values, nelements);
+
+			pfree(values);
+		}
+		else
+			quantile_sample_combine_samples(state1, state2);
+	}
+	else
+		quantile_sample_combine_values(state1, (double *) state2->elements,
+									   state2->nelements);
+
+	/*
+	 * The order is unknown, and new values would be sampled as usual (the
+	 * weight is about size / nvalues after nvalues, close enough).
+	 */
+	state1->nsorted = 0;
+	quantile_order_unknown(state1);
+
+	if (state1->nelements == state1->ext->reservoir->size)
+	{
+		state1->ext->reservoir->w = (double) state1->ext->reservoir->size /
+							   state1->ext->reservoir->nvalues;
+		quantile_reservoir_skip(state1->ext->reservoir);
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * The serialized sample is the serialized state (quantiles and the sampled
+ * values), followed by the reservoir.
+ */
+Datum
+quantile_sample_serialize(PG_FUNCTION_ARGS)
+{
+	quantile_state *state;
+	bytea		   *result;
+	char		   *ptr;
+
+	CHECK_AGG_CONTEXT("quantile_sample_serialize", fcinfo);
+
+	state = (quantile_state *) PG_GETARG_POINTER(0);
+
+	ptr = quantile_serialize_header(state, QUANTILE_ENCODING_RAW,
+									sizeof(double) * state->nelements +
+									sizeof(quantile_reservoir),
+									&result);
+
+	memcpy(ptr, state->elements, sizeof(double) * state->nelements);
+	ptr += sizeof(double) * state->nelements;
+
+	memcpy(ptr, state->ext->reservoir, sizeof(quantile_reservoir));
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+Datum
+quantile_sample_deserialize(PG_FUNCTION_ARGS)
+{
+	quantile_state	   *state;
+	quantile_reservoir	reservoir;
+	Size				datalen;
+	char			   *ptr;
+
+	CHECK_AGG_CONTEXT("quantile_sample_deserialize", fcinfo);
+
+	ptr = quantile_deserialize_header(fcinfo, PG_GETARG_BYTEA_PP(0),
+									  sizeof(double), false, &state, NULL,
+									  &datalen, NULL);
+
+	if (datalen != sizeof(double) * state->nelements + sizeof(quantile_reservoir))
+		elog(ERROR, "invalid serialized quantile sample");
+
+	memcpy(&reservoir, ptr + sizeof(double) * state->nelements,
+		   sizeof(quantile_reservoir));
+
+	quantile_sample_check_size(reservoir.size);
+
+	if ((state->nelements > reservoir.size) ||
+		(state->nelements > reservoir.nvalues) ||
+		((state->nelements < reservoir.size) &&
+		 (state->nelements != reservoir.nvalues)))
+		elog(ERROR, "invalid serialized quantile sample");
+
+	memcpy(state->elements, ptr, sizeof(double) * state->nelements);
+
+	state->counting = false;
+
+	quantile_state_ext_alloc(state);
+
+	state->ext->reservoir = (quantile_reservoir *)
+		palloc(sizeof(quantile_reservoir));
+	memcpy(state->ext->reservoir, &reservoir, sizeof(quantile_reservoir));
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * HDR histograms - the values are counted in log-linear buckets, so the
+ * state has a fixed (and small) size, adding a value does not need any
+ * comparisons, and combining the states just adds the counts.
+ */
+static void
+hdr_check_digits(int digits)
+{
+	if ((digits < HDR_MIN_DIGITS) || (digits > HDR_MAX_DIGITS))
+		elog(ERROR, "invalid number of significant digits %d - needs to be in [%d,%d]",
+			 digits, HDR_MIN_DIGITS, HDR_MAX_DIGITS);
+}
+
+static hdr_state *
+hdr_state_create(int digits)
+{
+	int			i;
+	int64		limit = 1;
+	hdr_state  *state = (hdr_state *) palloc0(sizeof(hdr_state));
+
+	hdr_check_digits(digits);
+
+	state->digits = digits;
+
+	/* the smallest power of two >= 10^digits */
+	for (i = 0; i < digits; i++)
+		limit *= 10;
+
+	while ((INT64CONST(1) << state->magnitude) < limit)
+		state->magnitude++;
+
+	state->min = PG_INT64_MAX;
+	state->max = PG_INT64_MIN;
+
+	/* the first bucket, with the exact small values */
+	state->ncounts = 2 << state->magnitude;
+	state->counts = (int64 *) palloc0(sizeof(int64) * state->ncounts);
+
+	return state;
+}
+
+/* index of the counter for the value (the bucket is zero for small values) */
+static inline int
+hdr_index(int magnitude, int64 value)
+{
+	uint64	v = (uint64) value | ((UINT64CONST(2) << magnitude) - 1);
+	int		bucket = 63 - __builtin_clzll(v) - magnitude;
+
+	return (bucket << magnitude) + (int) ((uint64) value >> bucket);
+}
+
+/* the largest value counted by the counter */
+static inline int64
+hdr_value(int magnitude, int index)
+{
+	int		bucket = Max((index >> magnitude) - 1, 0);
+	int64	lowest = (int64) (index - (bucket << magnitude)) << bucket;
+
+	return lowest + (((int64) 1 << bucket) - 1);
+}
+
+/* extends the counts array to (at least) ncounts, in whole buckets */
+static void
+hdr_grow(hdr_state *state, int ncounts)
+{
+	int		half = 1 << state->magnitude;
+
+	ncounts = (ncounts + half - 1) & ~(half - 1);
+
+	if (ncounts <= state->ncounts)
+		return;
+
+	Assert(ncounts <= HDR_MAX_COUNTS(state->magnitude));
+
+	state->counts = (int64 *) repalloc(state->counts, sizeof(int64) * ncounts);
+	memset(state->counts + state->ncounts, 0,
+		   sizeof(int64) * (ncounts - state->ncounts));
+
+	state->ncounts = ncounts;
+}
+
+static void
+hdr_add(hdr_state *state, int64 value)
+{
+	int		index;
+
+	if (value < 0)
+		elog(ERROR, "quantile_hdr: negative values are not supported");
+
+	index = hdr_index(state->magnitude, value);
+
+	if (index >= state->ncounts)
+		hdr_grow(state, index + 1);
+
+	state->counts[index]++;
+	state->count++;
+
+	state->min = Min(state->min, value);
+	state->max = Max(state->max, value);
+}
+
+/*
+ * The value at the same position as quantile returns - the largest value of
+ * the counter, but at most the maximum (and the first value is the minimum),
+ * so that the results are within the precision of the actual values.
+ */
+static int64
+hdr_estimate(hdr_state *state, double quantile)
+{
+	int		i;
+	int64	idx = 0;
+	int64	count = 0;
+
+	if (quantile > 0)
+		idx = (int64) ceil(state->count * quantile) - 1;
+
+	if (idx == 0)
+		return state->min;
+
+	for (i = 0; i < state->ncounts - 1; i++)
+	{
+		count += state->counts[i];
+
+		if (count > idx)
+			break;
+	}
+
+	return Max(state->min, Min(hdr_value(state->magnitude, i), state->max));
+}
+
+Datum
+quantile_hdr_append(PG_FUNCTION_ARGS)
+{
+	hdr_state	   *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_hdr_append", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		int		digits = HDR_DEFAULT_DIGITS;
+
+		if (PG_NARGS() > 3)
+			digits = PG_GETARG_INT32(3);
+
+		state = hdr_state_create(digits);
+
+		state->quantiles = (double *) palloc(sizeof(double));
+		state->quantiles[0] = PG_GETARG_FLOAT8(2);
+		state->nquantiles = 1;
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (hdr_state *) PG_GETARG_POINTER(0);
+
+	hdr_add(state, PG_GETARG_INT64(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_hdr_append_array(PG_FUNCTION_ARGS)
+{
+	hdr_state	   *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	ArrayType	   *quantiles;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_hdr_append_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		int		digits = HDR_DEFAULT_DIGITS;
+
+		if (PG_NARGS() > 3)
+			digits = PG_GETARG_INT32(3);
+
+		state = hdr_state_create(digits);
+
+		/* read the array of quantiles */
+		state->quantiles = array_to_double(fcinfo, quantiles,
+										   &state->nquantiles);
+
+		check_quantiles(state->nquantiles, state->quantiles);
+	}
+	else
+		state = (hdr_state *) PG_GETARG_POINTER(0);
+
+	hdr_add(state, PG_GETARG_INT64(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_hdr_int64(PG_FUNCTION_ARGS)
+{
+	hdr_state	   *state;
+
+	CHECK_AGG_CONTEXT("quantile_hdr_int64", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (hdr_state *) PG_GETARG_POINTER(0);
+
+	/* only NULL values (combined) */
+	if (state->count == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT64(hdr_estimate(state, state->quantiles[0]));
+}
+
+Datum
+quantile_hdr_int64_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int64		   *result;
+	hdr_state	   *state;
+
+	CHECK_AGG_CONTEXT("quantile_hdr_int64_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (hdr_state *) PG_GETARG_POINTER(0);
+
+	if (state->count == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(state->nquantiles * sizeof(int64));
+
+	for (i = 0; i < state->nquantiles; i++)
+		result[i] = hdr_estimate(state, state->quantiles[i]);
+
+	return int64_to_array(fcinfo, result, state->nquantiles);
+}
+
+Datum
+quantile_hdr_combine(PG_FUNCTION_ARGS)
+{
+	int				i;
+	hdr_state	   *state1;
+	hdr_state	   *state2;
+	int64		   *counts1;
+	const int64	   *counts2;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	GET_AGG_CONTEXT("quantile_hdr_combine", fcinfo, aggcontext);
+
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	state2 = (hdr_state *) PG_GETARG_POINTER(1);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		state1 = hdr_state_create(state2->digits);
+
+		state1->nquantiles = state2->nquantiles;
+		state1->quantiles = (double *) palloc(sizeof(double) * state2->nquantiles);
+		memcpy(state1->quantiles, state2->quantiles,
+			   sizeof(double) * state2->nquantiles);
+	}
+	else
+	{
+		state1 = (hdr_state *) PG_GETARG_POINTER(0);
+
+		/* both states have to be built for the same quantiles and digits */
+		if ((state1->nquantiles != state2->nquantiles) ||
+			(memcmp(state1->quantiles, state2->quantiles,
+					sizeof(double) * state1->nquantiles) != 0))
+			elog(ERROR, "quantile_hdr_combine: cannot combine states with different quantiles");
+
+		if (state1->digits != state2->digits)
+			elog(ERROR, "quantile_hdr_combine: cannot combine states with different significant digits");
+	}
+
+	hdr_grow(state1, state2->ncounts);
+
+	/* the buckets are the same, so just add the counts (vectorized) */
+	counts1 = state1->counts;
+	counts2 = state2->counts;
+
+	for (i = 0; i < state2->ncounts; i++)
+		counts1[i] += counts2[i];
+
+	state1->count += state2->count;
+	state1->min = Min(state1->min, state2->min);
+	state1->max = Max(state1->max, state2->max);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state1);
+}
+
+/*
+ * The serialized histogram has a fixed header, followed by the quantiles and
+ * the counts up to the last non-zero one. The counts are varints, except that
+ * a zero is followed by the length of a run of zero counts, so the empty
+ * parts of the histogram take only a couple bytes.
+ */
+typedef struct hdr_serial_header
+{
+	int32	nquantiles;
+	int32	digits;
+	int32	ncounts;
+	int64	count;
+	int64	min;
+	int64	max;
+} hdr_serial_header;
+
+/* encodes the counts into ptr, or just computes the length (ptr is NULL) */
+static Size
+hdr_pack(const int64 *counts, int ncounts, char *ptr)
+{
+	int		i;
+	int		j;
+	Size	len = 0;
+
+	for (i = 0; i < ncounts; i = j)
+	{
+		j = i + 1;
+
+		if (counts[i] > 0)
+		{
+			len += quantile_varint_size(counts[i]);
+			if (ptr != NULL)
+				ptr = quantile_varint_write(ptr, counts[i]);
+
+			continue;
+		}
+
+		/* the run of zero counts */
+		while ((j < ncounts) && (counts[j] == 0))
+			j++;
+
+		len += 1 + quantile_varint_size(j - i);
+		if (ptr != NULL)
+		{
+			ptr = quantile_varint_write(ptr, 0);
+			ptr = quantile_varint_write(ptr, j - i);
+		}
+	}
+
+	return len;
+}
+
+Datum
+quantile_hdr_serialize(PG_FUNCTION_ARGS)
+{
+	hdr_state		   *state;
+	hdr_serial_header	header;
+	bytea			   *result;
+	char			   *ptr;
+	int					ncounts;
+	Size				len;
+
+	CHECK_AGG_CONTEXT("quantile_hdr_serialize", fcinfo);
+
+	state = (hdr_state *) PG_GETARG_POINTER(0);
+
+	/* the trailing zero counts are not needed */
+	ncounts = state->ncounts;
+	while ((ncounts > 0) && (state->counts[ncounts - 1] == 0))
+		ncounts--;
+
+	header.nquantiles = state->nquantiles;
+	header.digits = state->digits;
+	header.ncounts = ncounts;
+	header.count = state->count;
+	header.min = state->min;
+	header.max = state->max;
+
+	len = VARHDRSZ + sizeof(hdr_serial_header) +
+		state->nquantiles * sizeof(double) +
+		hdr_pack(state->counts, ncounts, NULL);
+
+	result = (bytea *) palloc(len);
+	SET_VARSIZE(result, len);
+
+	ptr = VARDATA(result);
+
+	memcpy(ptr, &header, sizeof(hdr_serial_header));
+	ptr += sizeof(hdr_serial_header);
+
+	memcpy(ptr, state->quantiles, state->nquantiles * sizeof(double));
+	ptr += state->nquantiles * sizeof(double);
+
+	hdr_pack(state->counts, ncounts, ptr);
+
+	PG_RETURN_BYTEA_P(result);
+}
+
+Datum
+quantile_hdr_deserialize(PG_FUNCTION_ARGS)
+{
+	bytea			   *data;
+	hdr_state		   *state;
+	hdr_serial_header	header;
+	const char		   *ptr;
+	const char		   *end;
+	Size				len;
+	int					n = 0;
+	int64				count = 0;
+
+	CHECK_AGG_CONTEXT("quantile_hdr_deserialize", fcinfo);
+
+	data = PG_GETARG_BYTEA_PP(0);
+	ptr = VARDATA_ANY(data);
+	len = VARSIZE_ANY_EXHDR(data);
+	end = ptr + len;
+
+	if (len < sizeof(hdr_serial_header))
+		elog(ERROR, "invalid serialized HDR histogram (length %zu)", len);
+
+	memcpy(&header, ptr, sizeof(hdr_serial_header));
+	ptr += sizeof(hdr_serial_header);
+
+	hdr_check_digits(header.digits);
+
+	state = hdr_state_create(header.digits);
+
+	if ((header.nquantiles < 0) || (header.ncounts < 0) ||
+		(header.ncounts > HDR_MAX_COUNTS(state->magnitude)) ||
+		(len < sizeof(hdr_serial_header) + header.nquantiles * sizeof(double)))
+		elog(ERROR, "invalid serialized HDR histogram");
+
+	state->nquantiles = header.nquantiles;
+	state->quantiles = (double *) palloc(state->nquantiles * sizeof(double));
+	memcpy(state->quantiles, ptr, state->nquantiles * sizeof(double));
+	ptr += state->nquantiles * sizeof(double);
+
+	hdr_grow(state, header.ncounts);
+
+	while (ptr < end)
+	{
+		uint64	value;
+		uint64	nzeros;
+
+		if (!quantile_varint_read(&ptr, end, &value) || (n == header.ncounts))
+			elog(ERROR, "invalid serialized HDR histogram (counts)");
+
+		if (value > 0)
+		{
+			if (value > (uint64) (PG_INT64_MAX - count))
+				elog(ERROR, "invalid serialized HDR histogram (counts)");
+
+			state->counts[n++] = (int64) value;
+			count += (int64) value;
+			continue;
+		}
+
+		if (!quantile_varint_read(&ptr, end, &nzeros) || (nzeros == 0) ||
+			(nzeros > (uint64) (header.ncounts - n)))
+			elog(ERROR, "invalid serialized HDR histogram (counts)");
+
+		n += (int) nzeros;
+	}
+
+	if ((n != header.ncounts) || (count != header.count) ||
+		((count > 0) && ((header.min < 0) || (header.min > header.max))))
+		elog(ERROR, "invalid serialized HDR histogram (counts)");
+
+	state->count = header.count;
+	state->min = header.min;
+	state->max = header.max;
+
+	PG_RETURN_POINTER(state);
+}
+
+/*
+ * Aggregates on presorted input (quantile_presorted). The aggregates are
+ * meant to be called with ORDER BY in the arguments, and with the number of
+ * values known upfront (e.g. from a count in a subquery). The executor (or
+ * an index scan, when the planner can use it) then delivers the values in
+ * sorted order, so each value only needs to be compared to the previous one,
+ * and the values at the positions of the quantiles are simply remembered.
+ * So the memory does not depend on the number of values, and nothing gets
+ * sorted in the extension.
+ */
+static bool
+presorted_double_lt(Datum a, Datum b)
+{
+	return FLOAT_LT(DatumGetFloat8(a), DatumGetFloat8(b));
+}
+
+static bool
+presorted_float4_lt(Datum a, Datum b)
+{
+	return FLOAT_LT(DatumGetFloat4(a), DatumGetFloat4(b));
+}
+
+static bool
+presorted_int16_lt(Datum a, Datum b)
+{
+	return DatumGetInt16(a) < DatumGetInt16(b);
+}
+
+static bool
+presorted_int32_lt(Datum a, Datum b)
+{
+	return DatumGetInt32(a) < DatumGetInt32(b);
+}
+
+static bool
+presorted_int64_lt(Datum a, Datum b)
+{
+	return DatumGetInt64(a) < DatumGetInt64(b);
+}
+
+static bool
+presorted_numeric_lt(Datum a, Datum b)
+{
+	return DatumGetInt32(DirectFunctionCall2(numeric_cmp, a, b)) < 0;
+}
+
+static presorted_state *
+presorted_state_create(FunctionCallInfo fcinfo, double *quantiles,
+					   int nquantiles, int64 count)
+{
+	int				i;
+	int				n = 0;
+	presorted_state *state;
+
+	check_quantiles(nquantiles, quantiles);
+
+	if (count <= 0)
+		elog(ERROR, "quantile_presorted: invalid number of values " INT64_FORMAT " - needs to be positive",
+			 count);
+
+	state = (presorted_state *) palloc0(sizeof(presorted_state));
+
+	state->elemtype = get_fn_expr_argtype(fcinfo->flinfo, 1);
+
+	switch (state->elemtype)
+	{
+		case FLOAT8OID:
+			state->lt = presorted_double_lt;
+			break;
+		case FLOAT4OID:
+			state->lt = presorted_float4_lt;
+			break;
+		case INT2OID:
+			state->lt = presorted_int16_lt;
+			break;
+		case INT4OID:
+		case DATEOID:
+			state->lt = presorted_int32_lt;
+			break;
+		case INT8OID:
+		case TIMESTAMPOID:
+		case TIMESTAMPTZOID:
+			state->lt = presorted_int64_lt;
+			break;
+		case NUMERICOID:
+			state->lt = presorted_numeric_lt;
+			break;
+		default:
+			elog(ERROR, "quantile_presorted: unsupported value type (OID %u)",
+				 state->elemtype);
+	}
+
+	get_typlenbyvalalign(state->elemtype, &state->typlen, &state->typbyval,
+						 &state->typalign);
+
+	state->quantiles = quantiles;
+	state->nquantiles = nquantiles;
+	state->count = count;
+
+	/* the positions (the same as with the other aggregates), deduplicated */
+	state->indexes = (int *) palloc(sizeof(int) * nquantiles);
+	state->positions = (int64 *) palloc(sizeof(int64) * nquantiles);
+
+	for (i = 0; i < nquantiles; i++)
+	{
+		int64	idx = 0;
+
+		if (quantiles[i] > 0)
+			idx = (int64) ceil(count * quantiles[i]) - 1;
+
+		state->positions[i] = idx;
+	}
+
+	qsort(state->positions, nquantiles, sizeof(int64), &int64_comparator);
+
+	for (i = 0; i < nquantiles; i++)
+	{
+		if ((n == 0) || (state->positions[n-1] != state->positions[i]))
+			state->positions[n++] = state->positions[i];
+	}
+
+	state->npositions = n;
+	state->values = (Datum *) palloc(sizeof(Datum) * n);
+
+	/* map the quantiles to the deduplicated positions */
+	for (i = 0; i < nquantiles; i++)
+	{
+		int64	idx = 0;
+		int		j = 0;
+
+		if (quantiles[i] > 0)
+			idx = (int64) ceil(count * quantiles[i]) - 1;
+
+		while (state->positions[j] != idx)
+			j++;
+
+		state->indexes[i] = j;
+	}
+
+	return state;
+}
+
+/*
+ * Checks that the value is not smaller than the previous one, and remembers
+ * it if it's at one of the positions. Must be called in the aggregate memory
+ * context (the values get copied).
+ */
+static void
+presorted_add(presorted_state *state, Datum value)
+{
+	if ((state->nvalues > 0) && state->lt(value, state->last))
+		elog(ERROR, "quantile_presorted: values are not sorted (add ORDER BY for the value to the aggregate arguments)");
+
+	if (state->nvalues == state->count)
+		elog(ERROR, "quantile_presorted: more values than expected (" INT64_FORMAT ")",
+			 state->count);
+
+	if ((state->next < state->npositions) &&
+		(state->positions[state->next] == state->nvalues))
+		state->values[state->next++] = datumCopy(value, state->typbyval,
+												 state->typlen);
+
+	/* the by-reference values (numeric) are copied into a reused buffer */
+	if (state->typbyval)
+		state->last = value;
+	else
+	{
+		Size	len = datumGetSize(value, false, state->typlen);
+
+		if (len > state->lastsize)
+		{
+			state->lastsize = Max(len, 64);
+			state->lastbuf = (state->lastbuf == NULL) ?
+				palloc(state->lastsize) :
+				repalloc(state->lastbuf, state->lastsize);
+		}
+
+		memcpy(state->lastbuf, DatumGetPointer(value), len);
+		state->last = PointerGetDatum(state->lastbuf);
+	}
+
+	state->nvalues++;
+}
+
+Datum
+quantile_presorted_append(PG_FUNCTION_ARGS)
+{
+	presorted_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	GET_AGG_CONTEXT("quantile_presorted_append", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		double *quantiles = (double *) palloc(sizeof(double));
+
+		if (PG_ARGISNULL(3))
+			elog(ERROR, "quantile_presorted: the number of values must not be NULL");
+
+		quantiles[0] = PG_GETARG_FLOAT8(2);
+
+		state = presorted_state_create(fcinfo, quantiles, 1,
+									   PG_GETARG_INT64(3));
+	}
+	else
+		state = (presorted_state *) PG_GETARG_POINTER(0);
+
+	presorted_add(state, PG_GETARG_DATUM(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+Datum
+quantile_presorted_append_array(PG_FUNCTION_ARGS)
+{
+	presorted_state *state;
+
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	ArrayType	   *quantiles;
+
+	/* OK, we do want to skip NULL values altogether */
+	if (PG_ARGISNULL(1))
+	{
+		if (PG_ARGISNULL(0))
+			PG_RETURN_NULL();
+		else
+			/* if there already is a state accumulated, don't forget it */
+			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+	}
+
+	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+
+	GET_AGG_CONTEXT("quantile_presorted_append_array", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (PG_ARGISNULL(0))
+	{
+		int		nquantiles;
+		double *values;
+
+		if (PG_ARGISNULL(3))
+			elog(ERROR, "quantile_presorted: the number of values must not be NULL");
+
+		/* read the array of quantiles */
+		values = array_to_double(fcinfo, quantiles, &nquantiles);
+
+		state = presorted_state_create(fcinfo, values, nquantiles,
+									   PG_GETARG_INT64(3));
+	}
+	else
+		state = (presorted_state *) PG_GETARG_POINTER(0);
+
+	presorted_add(state, PG_GETARG_DATUM(1));
+
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_RETURN_POINTER(state);
+}
+
+/* all the expected values have to be there, otherwise the positions are wrong */
+static void
+presorted_check_count(presorted_state *state)
+{
+	if (state->nvalues != state->count)
+		elog(ERROR, "quantile_presorted: expected " INT64_FORMAT " values, got " INT64_FORMAT,
+			 state->count, state->nvalues);
+}
+
+Datum
+quantile_presorted(PG_FUNCTION_ARGS)
+{
+	presorted_state *state;
+
+	CHECK_AGG_CONTEXT("quantile_presorted", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (presorted_state *) PG_GETARG_POINTER(0);
+
+	presorted_check_count(state);
+
+	PG_RETURN_DATUM(state->values[state->indexes[0]]);
+}
+
+Datum
+quantile_presorted_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	Datum		   *result;
+	presorted_state *state;
+
+	CHECK_AGG_CONTEXT("quantile_presorted_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	state = (presorted_state *) PG_GETARG_POINTER(0);
+
+	presorted_check_count(state);
+
+	result = (Datum *) palloc(sizeof(Datum) * Max(state->nquantiles, 1));
+
+	for (i = 0; i < state->nquantiles; i++)
+		result[i] = state->values[state->indexes[i]];
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(result, state->nquantiles,
+										  state->elemtype, state->typlen,
+										  state->typbyval, state->typalign));
+}
+
+/*
+ * Moving aggregates, used for sliding window frames. The values in the frame
+ * are kept in a treap (a binary search tree balanced by random priorities),
+ * with subtree sizes in the nodes, so adding a value, removing a value and
+ * looking up the k-th smallest value are all O(log n), and the final function
+ * does not need to sort (or even copy) the values.
+ *
+ * The nodes are allocated from an array (linked by indexes), with index 0
+ * used as the empty tree, and removed nodes are kept in a free list.
+ */
+static quantile_tree *
+quantile_tree_create(int (*compare) (const void *a, const void *b),
+					 bool copy_numerics)
+{
+	quantile_tree  *tree = (quantile_tree *) palloc(sizeof(quantile_tree));
+
+	tree->nquantiles = 0;
+	tree->quantiles = NULL;
+
+	tree->compare = compare;
+	tree->copy_numerics = copy_numerics;
+
+	tree->root = 0;
+	tree->freelist = 0;
+	tree->nnodes = 1;
+	tree->maxnodes = QUANTILE_MIN_ELEMENTS;
+	tree->seed = 0x9E3779B9;
+
+	tree->maxbytes = 0;
+	tree->numericbytes = 0;
+
+	if ((quantile_on_overflow != QUANTILE_OVERFLOW_SPILL) &&
+		(QUANTILE_WORK_MEM > 0))
+		tree->maxbytes = (Size) QUANTILE_WORK_MEM * 1024;
+
+	tree->nodes = (quantile_tree_node *)
+		palloc(sizeof(quantile_tree_node) * tree->maxnodes);
+
+	/* the empty tree */
+	memset(&tree->nodes[0], 0, sizeof(quantile_tree_node));
+
+	return tree;
+}
+
+#define TREE_NODE(tree, idx)	(&(tree)->nodes[(idx)])
+#define TREE_SIZE(tree, idx)	((tree)->nodes[(idx)].size)
+
+/* fails when the nodes (maxnodes of them) and numerics exceed the limit */
+static void
+quantile_tree_check_memory(quantile_tree *tree, int maxnodes)
+{
+	if ((tree->maxbytes > 0) &&
+		((Size) maxnodes * sizeof(quantile_tree_node) + tree->numericbytes >
+		 tree->maxbytes))
+		elog(ERROR, "quantile window frame exceeds the memory limit (%d kB)",
+			 (int) (tree->maxbytes / 1024));
+}
+
+static inline void
+quantile_tree_update(quantile_tree *tree, int idx)
+{
+	quantile_tree_node *node = TREE_NODE(tree, idx);
+
+	node->size = 1 + TREE_SIZE(tree, node->left) + TREE_SIZE(tree, node->right);
+}
+
+/* splits the tree into values smaller than the value and the rest */
+static void
+quantile_tree_split(quantile_tree *tree, int idx, quantile_tree_value *value,
+					int *left, int *right)
+{
+	quantile_tree_node *node;
+
+	if (idx == 0)
+	{
+		*left = *right = 0;
+		return;
+	}
+
+	node = TREE_NODE(tree, idx);
+
+	if (tree->compare(&node->value, value) < 0)
+	{
+		quantile_tree_split(tree, node->right, value, &node->right, right);
+		*left = idx;
+	}
+	else
+	{
+		quantile_tree_split(tree, node->left, value, left, &node->left);
+		*right = idx;
+	}
+
+	quantile_tree_update(tree, idx);
+}
+
+/* merges two trees, with all values in the left one not greater */
+static int
+quantile_tree_merge(quantile_tree *tree, int left, int right)
+{
+	if (left == 0)
+		return right;
+
+	if (right == 0)
+		return left;
+
+	if (TREE_NODE(tree, left)->priority > TREE_NODE(tree, right)->priority)
+	{
+		TREE_NODE(tree, left)->right =
+			quantile_tree_merge(tree, TREE_NODE(tree, left)->right, right);
+		quantile_tree_update(tree, left);
+		return left;
+	}
+
+	TREE_NODE(tree, right)->left =
+		quantile_tree_merge(tree, left, TREE_NODE(tree, right)->left);
+	quantile_tree_update(tree, right);
+	return right;
+}
+
+static int
+quantile_tree_insert_node(quantile_tree *tree, int idx, int newidx)
+{
+	quantile_tree_node *node;
+	quantile_tree_node *newnode = TREE_NODE(tree, newidx);
+
+	if (idx == 0)
+		return newidx;
+
+	node = TREE_NODE(tree, idx);
+
+	if (newnode->priority > node->priority)
+	{
+		quantile_tree_split(tree, idx, &newnode->value,
+							&newnode->left, &newnode->right);
+		quantile_tree_update(tree, newidx);
+		return newidx;
+	}
+
+	if (tree->compare(&newnode->value, &node->value) < 0)
+		node->left = quantile_tree_insert_node(tree, node->left, newidx);
+	else
+		node->right = quantile_tree_insert_node(tree, node->right, newidx);
+
+	quantile_tree_update(tree, idx);
+
+	return idx;
+}
+
+/*
+ * Removes a node with the value from the tree. All values equal to the value
+ * are on the search path (or in subtrees in the direction of the search), so
+ * when there is such value, it's always found.
+ */
+static int
+quantile_tree_delete_node(quantile_tree *tree, int idx,
+						  quantile_tree_value *value, int *deleted)
+{
+	int					cmp;
+	quantile_tree_node *node;
+
+	if (idx == 0)
+		return 0;
+
+	node = TREE_NODE(tree, idx);
+	cmp = tree->compare(value, &node->value);
+
+	if (cmp == 0)
+	{
+		*deleted = idx;
+		return quantile_tree_merge(tree, node->left, node->right);
+	}
+
+	if (cmp < 0)
+		node->left = quantile_tree_delete_node(tree, node->left, value, deleted);
+	else
+		node->right = quantile_tree_delete_node(tree, node->right, value, deleted);
+
+	quantile_tree_update(tree, idx);
+
+	return idx;
+}
+
+static void
+quantile_tree_insert(quantile_tree *tree, quantile_tree_value value)
+{
+	int					idx;
+	quantile_tree_node *node;
+
+	if (tree->freelist != 0)
+	{
+		idx = tree->freelist;
+		tree->freelist = TREE_NODE(tree, idx)->left;
+	}
+	else
+	{
+		if (tree->nnodes == tree->maxnodes)
+		{
+			if (tree->maxnodes > INT_MAX / 2)
+				elog(ERROR, "too many values in a quantile window frame");
+
+			quantile_tree_check_memory(tree, tree->maxnodes * 2);
+
+			tree->maxnodes *= 2;
+			tree->nodes = (quantile_tree_node *)
+				repalloc_huge(tree->nodes,
+							  sizeof(quantile_tree_node) * tree->maxnodes);
+		}
+
+		idx = tree->nnodes++;
+	}
+
+	/* xorshift, random enough for the priorities */
+	tree->seed ^= tree->seed << 13;
+	tree->seed ^= tree->seed >> 17;
+	tree->seed ^= tree->seed << 5;
+
+	node = TREE_NODE(tree, idx);
+	node->value = value;
+	node->priority = tree->seed;
+	node->size = 1;
+	node->left = 0;
+	node->right = 0;
+
+	tree->root = quantile_tree_insert_node(tree, tree->root, idx);
+}
+
+/* returns false when the value is not in the tree */
+static bool
+quantile_tree_delete(quantile_tree *tree, quantile_tree_value value)
+{
+	int		deleted = 0;
+
+	tree->root = quantile_tree_delete_node(tree, tree->root, &value, &deleted);
+
+	if (deleted == 0)
+		return false;
+
+	if (tree->copy_numerics)
+	{
+		tree->numericbytes -= VARSIZE(TREE_NODE(tree, deleted)->value.n);
+		pfree(TREE_NODE(tree, deleted)->value.n);
+	}
+
+	TREE_NODE(tree, deleted)->left = tree->freelist;
+	tree->freelist = deleted;
+
+	return true;
+}
+
+/* returns the k-th smallest value (counting from 0) */
+static quantile_tree_value
+quantile_tree_select(quantile_tree *tree, int k)
+{
+	int		idx = tree->root;
+
+	Assert((k >= 0) && (k < TREE_SIZE(tree, tree->root)));
+
+	for (;;)
+	{
+		quantile_tree_node *node = TREE_NODE(tree, idx);
+		int					nleft = TREE_SIZE(tree, node->left);
+
+		if (k < nleft)
+			idx = node->left;
+		else if (k == nleft)
+			return node->value;
+		else
+		{
+			k -= (nleft + 1);
+			idx = node->right;
+		}
+	}
+}
+
+/* index of the value for the given quantile (the same as in the final functions) */
+static inline int
+quantile_tree_index(quantile_tree *tree, double quantile)
+{
+	if (quantile > 0)
+		return (int) ceil(TREE_SIZE(tree, tree->root) * quantile) - 1;
+
+	return 0;
+}
+
+static int
+numeric_value_comparator(const void *a, const void *b)
+{
+	return DatumGetInt32(DirectFunctionCall2(numeric_cmp,
+											 NumericGetDatum(*(Numeric *) a),
+											 NumericGetDatum(*(Numeric *) b)));
+}
+
+/*
+ * Common part of the moving transition functions. The forward function
+ * must not return NULL, so an empty tree is created even for NULL values.
+ */
+static quantile_tree *
+quantile_moving_state(FunctionCallInfo fcinfo, const char *fname,
+					  int (*compare) (const void *a, const void *b),
+					  bool copy_numerics, bool array)
+{
+	quantile_tree  *tree;
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	GET_AGG_CONTEXT(fname, fcinfo, aggcontext);
+
+	if (!PG_ARGISNULL(0))
+		return (quantile_tree *) PG_GETARG_POINTER(0);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	tree = quantile_tree_create(compare, copy_numerics);
+
+	if (array)
+		tree->quantiles = array_to_double(fcinfo, PG_GETARG_ARRAYTYPE_P(2),
+										  &tree->nquantiles);
+	else
+	{
+		tree->quantiles = (double *) palloc(sizeof(double));
+		tree->quantiles[0] = PG_GETARG_FLOAT8(2);
+		tree->nquantiles = 1;
+	}
+
+	check_quantiles(tree->nquantiles, tree->quantiles);
+
+	MemoryContextSwitchTo(oldcontext);
+
+	return tree;
+}
+
+static void
+quantile_moving_add(FunctionCallInfo fcinfo, quantile_tree *tree,
+					quantile_tree_value value)
+{
+	MemoryContext	oldcontext;
+	MemoryContext	aggcontext;
+
+	GET_AGG_CONTEXT("quantile_moving_add", fcinfo, aggcontext);
+
+	oldcontext = MemoryContextSwitchTo(aggcontext);
+
+	if (tree->copy_numerics)
+	{
+		Numeric	copy;
+
+		tree->numericbytes += VARSIZE(value.n);
+		quantile_tree_check_memory(tree, tree->maxnodes);
+
+		copy = (Numeric) palloc(VARSIZE(value.n));
+		memcpy(copy, value.n, VARSIZE(value.n));
+		value.n = copy;
+	}
+
+	quantile_tree_insert(tree, value);
+
+	MemoryContextSwitchTo(oldcontext);
+}
+
+static void
+quantile_moving_remove(FunctionCallInfo fcinfo, const char *fname,
+					   quantile_tree *tree, quantile_tree_value value)
+{
+	if (!quantile_tree_delete(tree, value))
+		elog(ERROR, "%s: value not found in the moving state", fname);
+}
+
+Datum
+quantile_moving_append_double(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_double",
+								 double_comparator, false, false);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.d = PG_GETARG_FLOAT8(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_double_array(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_double_array",
+								 double_comparator, false, true);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.d = PG_GETARG_FLOAT8(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_remove_double(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	CHECK_AGG_CONTEXT("quantile_moving_remove_double", fcinfo);
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.d = PG_GETARG_FLOAT8(1);
+		quantile_moving_remove(fcinfo, "quantile_moving_remove_double",
+							   tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_float4(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_float4",
+								 float4_comparator, false, false);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.f4 = PG_GETARG_FLOAT4(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_float4_array(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_float4_array",
+								 float4_comparator, false, true);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.f4 = PG_GETARG_FLOAT4(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_remove_float4(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	CHECK_AGG_CONTEXT("quantile_moving_remove_float4", fcinfo);
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.f4 = PG_GETARG_FLOAT4(1);
+		quantile_moving_remove(fcinfo, "quantile_moving_remove_float4",
+							   tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_int32(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_int32",
+								 int32_comparator, false, false);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i4 = PG_GETARG_INT32(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_int32_array(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_int32_array",
+								 int32_comparator, false, true);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i4 = PG_GETARG_INT32(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_remove_int32(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	CHECK_AGG_CONTEXT("quantile_moving_remove_int32", fcinfo);
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i4 = PG_GETARG_INT32(1);
+		quantile_moving_remove(fcinfo, "quantile_moving_remove_int32",
+							   tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_int16(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_int16",
+								 int16_comparator, false, false);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i2 = PG_GETARG_INT16(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_int16_array(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_int16_array",
+								 int16_comparator, false, true);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i2 = PG_GETARG_INT16(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_remove_int16(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	CHECK_AGG_CONTEXT("quantile_moving_remove_int16", fcinfo);
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i2 = PG_GETARG_INT16(1);
+		quantile_moving_remove(fcinfo, "quantile_moving_remove_int16",
+							   tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_int64(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_int64",
+								 int64_comparator, false, false);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i8 = PG_GETARG_INT64(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_int64_array(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_int64_array",
+								 int64_comparator, false, true);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i8 = PG_GETARG_INT64(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_remove_int64(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	CHECK_AGG_CONTEXT("quantile_moving_remove_int64", fcinfo);
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.i8 = PG_GETARG_INT64(1);
+		quantile_moving_remove(fcinfo, "quantile_moving_remove_int64",
+							   tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_numeric(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_numeric",
+								 numeric_value_comparator, true, false);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.n = PG_GETARG_NUMERIC(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_append_numeric_array(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	tree = quantile_moving_state(fcinfo, "quantile_moving_append_numeric_array",
+								 numeric_value_comparator, true, true);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.n = PG_GETARG_NUMERIC(1);
+		quantile_moving_add(fcinfo, tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_remove_numeric(PG_FUNCTION_ARGS)
+{
+	quantile_tree	   *tree;
+	quantile_tree_value	value;
+
+	CHECK_AGG_CONTEXT("quantile_moving_remove_numeric", fcinfo);
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (!PG_ARGISNULL(1))
+	{
+		value.n = PG_GETARG_NUMERIC(1);
+		quantile_moving_remove(fcinfo, "quantile_moving_remove_numeric",
+							   tree, value);
+	}
+
+	PG_RETURN_POINTER(tree);
+}
+
+Datum
+quantile_moving_double(PG_FUNCTION_ARGS)
+{
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_double", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	/* no values in the frame (or only NULLs) */
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT8(quantile_tree_select(tree,
+				quantile_tree_index(tree, tree->quantiles[0])).d);
+}
+
+Datum
+quantile_moving_double_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	double		   *result;
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_double_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(tree->nquantiles * sizeof(double));
+
+	for (i = 0; i < tree->nquantiles; i++)
+		result[i] = quantile_tree_select(tree,
+					quantile_tree_index(tree, tree->quantiles[i])).d;
+
+	return double_to_array(fcinfo, result, tree->nquantiles);
+}
+
+Datum
+quantile_moving_float4(PG_FUNCTION_ARGS)
+{
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_float4", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	/* no values in the frame (or only NULLs) */
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_FLOAT4(quantile_tree_select(tree,
+				quantile_tree_index(tree, tree->quantiles[0])).f4);
+}
+
+Datum
+quantile_moving_float4_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	float4		   *result;
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_float4_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(tree->nquantiles * sizeof(float4));
+
+	for (i = 0; i < tree->nquantiles; i++)
+		result[i] = quantile_tree_select(tree,
+					quantile_tree_index(tree, tree->quantiles[i])).f4;
+
+	return float4_to_array(fcinfo, result, tree->nquantiles);
+}
+
+Datum
+quantile_moving_int32(PG_FUNCTION_ARGS)
+{
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_int32", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT32(quantile_tree_select(tree,
+				quantile_tree_index(tree, tree->quantiles[0])).i4);
+}
+
+Datum
+quantile_moving_int32_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int32		   *result;
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_int32_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(tree->nquantiles * sizeof(int32));
+
+	for (i = 0; i < tree->nquantiles; i++)
+		result[i] = quantile_tree_select(tree,
+					quantile_tree_index(tree, tree->quantiles[i])).i4;
+
+	return int32_to_array(fcinfo, result, tree->nquantiles);
+}
+
+Datum
+quantile_moving_int16(PG_FUNCTION_ARGS)
+{
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_int16", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT16(quantile_tree_select(tree,
+				quantile_tree_index(tree, tree->quantiles[0])).i2);
+}
+
+Datum
+quantile_moving_int16_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int16		   *result;
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_int16_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(tree->nquantiles * sizeof(int16));
+
+	for (i = 0; i < tree->nquantiles; i++)
+		result[i] = quantile_tree_select(tree,
+					quantile_tree_index(tree, tree->quantiles[i])).i2;
+
+	return int16_to_array(fcinfo, result, tree->nquantiles);
+}
+
+Datum
+quantile_moving_int64(PG_FUNCTION_ARGS)
+{
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_int64", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT64(quantile_tree_select(tree,
+				quantile_tree_index(tree, tree->quantiles[0])).i8);
+}
+
+Datum
+quantile_moving_int64_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	int64		   *result;
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_int64_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(tree->nquantiles * sizeof(int64));
+
+	for (i = 0; i < tree->nquantiles; i++)
+		result[i] = quantile_tree_select(tree,
+					quantile_tree_index(tree, tree->quantiles[i])).i8;
+
+	return int64_to_array(fcinfo, result, tree->nquantiles);
+}
+
+Datum
+quantile_moving_numeric(PG_FUNCTION_ARGS)
+{
+	Numeric			value;
+	Numeric			result;
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_numeric", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	value = quantile_tree_select(tree,
+				quantile_tree_index(tree, tree->quantiles[0])).n;
+
+	/* the value may get removed from the frame, so return a copy */
+	result = (Numeric) palloc(VARSIZE(value));
+	memcpy(result, value, VARSIZE(value));
+
+	PG_RETURN_NUMERIC(result);
+}
+
+Datum
+quantile_moving_numeric_array(PG_FUNCTION_ARGS)
+{
+	int				i;
+	Numeric		   *result;
+	quantile_tree  *tree;
+
+	CHECK_AGG_CONTEXT("quantile_moving_numeric_array", fcinfo);
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+
+	tree = (quantile_tree *) PG_GETARG_POINTER(0);
+
+	if (TREE_SIZE(tree, tree->root) == 0)
+		PG_RETURN_NULL();
+
+	result = palloc(tree->nquantiles * sizeof(Numeric));
+
+	/* the array gets built from copies of the values */
+	for (i = 0; i < tree->nquantiles; i++)
+		result[i] = quantile_tree_select(tree,
+					quantile_tree_index(tree, tree->quantiles[i])).n;
+
+	return numeric_to_array(fcinfo, result, tree->nquantiles);
+}
+
+/* Comparators for the qsort() calls. */
+
+static int
+double_comparator(const void *a, const void *b)
+{
+	double af = (* (double*) a);
+	double bf = (* (double*) b);
+
+	/* NaN values are considered equal to each other, and larger than others */
+	if (isnan(af))
+		return isnan(bf) ? 0 : 1;
+	else if (isnan(bf))
+		return -1;
+
+	return (af > bf) - (af < bf);
+}
+
+static int
+float4_comparator(const void *a, const void *b)
+{
+	float4 af = (* (float4*) a);
+	float4 bf = (* (float4*) b);
+
+	/* NaN values are considered equal to each other, and larger than others */
+	if (isnan(af))
+		return isnan(bf) ? 0 : 1;
+	else if (isnan(bf))
+		return -1;
+
+	return (af > bf) - (af < bf);
+}
+
+static int
+int32_comparator(const void *a, const void *b)
+{
+	int32 af = (* (int32 *) a);
+	int32 bf = (* (int32 *) b);
+	return (af > bf) - (af < bf);
+}
+
+static int
+int16_comparator(const void *a, const void *b)
+{
+	int16 af = (* (int16 *) a);
+	int16 bf = (* (int16 *) b);
+	return (af > bf) - (af < bf);
+}
+
+static int
+int64_comparator(const void *a, const void *b)
+{
+	int64 af = (* (int64 *) a);
+	int64 bf = (* (int64 *) b);
+	return (af > bf) - (af < bf);
+}
+
+static int
+tdigest_centroid_comparator(const void *a, const void *b)
+{
+	double af = ((tdigest_centroid *) a)->mean;
+	double bf = ((tdigest_centroid *) b)->mean;
+	return (af > bf) - (af < bf);
+}
+
+static int
+numeric_key_comparator(const void *a, const void *b, void *arg)
+{
+	return numeric_key_compare((const numeric_key *) a,
+							   (const numeric_key *) b,
+							   (SortSupport) arg);
+}
+
+/*
+ * Builds the keys for the numeric values of the state (starting at the first
+ * one), using abbreviated keys if the sort support provides them. Just like
+ * in tuplesort, the abbreviation is abandoned when it does not seem effective
+ * (e.g. when most values share the same abbreviated key), and the full values
+ * are compared instead.
+ */
+static numeric_key *
+numeric_sort_keys(quantile_state *state, int first, SortSupport ssup)
+{
+	int				i;
+	int				nelements = state->nelements - first;
+	int64			check = 10000;	/* when to check the abbreviation next */
+	Numeric		   *elements = (Numeric *) state->elements + first;
+	numeric_key	   *keys;
+
+	keys = (numeric_key *) MemoryContextAllocHuge(CurrentMemoryContext,
+												  sizeof(numeric_key) *
+												  Max(1, nelements));
+
+	memset(ssup, 0, sizeof(SortSupportData));
+	ssup->ssup_cxt = CurrentMemoryContext;
+	ssup->ssup_collation = InvalidOid;
+	ssup->abbreviate = true;
+
+	DirectFunctionCall1(numeric_sortsupport, PointerGetDatum(ssup));
+
+	for (i = 0; i < nelements; i++)
+	{
+		keys[i].value = elements[i];
+		keys[i].abbrev = NumericGetDatum(elements[i]);
+
+		if (ssup->abbrev_converter == NULL)
+			continue;
+
+		keys[i].abbrev = ssup->abbrev_converter(keys[i].abbrev, ssup);
+
+		if (i + 1 == check)
+		{
+			check *= 2;
+
+			if (ssup->abbrev_abort(i + 1, ssup))
+			{
+				int	j;
+
+				/* compare the full values from now on */
+				ssup->comparator = ssup->abbrev_full_comparator;
+				ssup->abbrev_converter = NULL;
+
+				for (j = 0; j <= i; j++)
+					keys[j].abbrev = NumericGetDatum(keys[j].value);
+			}
+		}
+	}
+
+	return keys;
+}
+
+/* stores the (sorted) values from the keys back into the elements array */
+static void
+numeric_store_keys(quantile_state *state, numeric_key *keys)
+{
+	int		i;
+	Numeric *elements = (Numeric *) state->elements;
+
+	for (i = 0; i < state->nelements; i++)
+		elements[i] = keys[i].value;
+
+	quantile_mark_sorted(state);
+}
+
+/*
+ * Moves all the NaN values to the end of the array (which is where the
+ * comparator sorts them) and returns the number of the remaining values.
+ */
+static int
+double_partition_nans(double *elements, int nelements)
+{
+	int	i = 0;
+	int	nvalues = nelements;
+
+	/* the element swapped from the end may be a NaN too, so check it again */
+	while ((i += double_find_nan_kernel(elements + i, nvalues - i)) < nvalues)
+	{
+		double	tmp = elements[--nvalues];
+
+		elements[nvalues] = elements[i];
+		elements[i] = tmp;
+	}
+
+	return nvalues;
+}
+
+static int
+float4_partition_nans(float4 *elements, int nelements)
+{
+	int	i = 0;
+	int	nvalues = nelements;
+
+	/* the element swapped from the end may be a NaN too, so check it again */
+	while ((i += float4_find_nan_kernel(elements + i, nvalues - i)) < nvalues)
+	{
+		float4	tmp = elements[--nvalues];
+
+		elements[nvalues] = elements[i];
+		elements[i] = tmp;
+	}
+
+	return nvalues;
+}
+
+/*
+ * Sorting the runs before spilling them to a temporary file. For double the
+ * NaN values are moved to the end first, as the radix sort can't handle them.
+ */
+static void
+double_sort_run(void *elements, int nelements)
+{
+	double_sort((double *) elements,
+				double_partition_nans((double *) elements, nelements));
+}
+
+static void
+float4_sort_run(void *elements, int nelements)
+{
+	float4_sort((float4 *) elements,
+				float4_partition_nans((float4 *) elements, nelements));
+}
+
+static void
+int32_sort_run(void *elements, int nelements)
+{
+	int32_sort((int32 *) elements, nelements);
+}
+
+static void
+int16_sort_run(void *elements, int nelements)
+{
+	int16_sort((int16 *) elements, nelements);
+}
+
+static void
+int64_sort_run(void *elements, int nelements)
+{
+	int64_sort((int64 *) elements, nelements);
+}
+
+/* merging sorted runs (e.g. when combining sorted serialized states) */
+static void
+double_merge_run(void *a, int na, void *b, int nb)
+{
+	double_merge((double *) a, na, (double *) b, nb);
+}
+
+static void
+float4_merge_run(void *a, int na, void *b, int nb)
+{
+	float4_merge((float4 *) a, na, (float4 *) b, nb);
+}
+
+static void
+int16_merge_run(void *a, int na, void *b, int nb)
+{
+	int16_merge((int16 *) a, na, (int16 *) b, nb);
+}
+
+static void
+int32_merge_run(void *a, int na, void *b, int nb)
+{
+	int32_merge((int32 *) a, na, (int32 *) b, nb);
+}
+
+static void
+int64_merge_run(void *a, int na, void *b, int nb)
+{
+	int64_merge((int64 *) a, na, (int64 *) b, nb);
+}
+
+/*
+ * Partitioning the elements around the k-th smallest one (for the pruning
+ * for extreme quantiles). The NaN values are the largest ones, so they're
+ * moved to the end first - if k is among them, the elements are partitioned
+ * already.
+ */
+static void
+double_select_run(void *elements, int nelements, int k)
+{
+	int		nvalues = double_partition_nans((double *) elements, nelements);
+
+	if (k < nvalues)
+		double_select((double *) elements, nvalues, k);
+}
+
+static void
+float4_select_run(void *elements, int nelements, int k)
+{
+	int		nvalues = float4_partition_nans((float4 *) elements, nelements);
+
+	if (k < nvalues)
+		float4_select((float4 *) elements, nvalues, k);
+}
+
+static void
+int16_select_run(void *elements, int nelements, int k)
+{
+	int16_select((int16 *) elements, nelements, k);
+}
+
+static void
+int32_select_run(void *elements, int nelements, int k)
+{
+	int32_select((int32 *) elements, nelements, k);
+}
+
+static void
+int64_select_run(void *elements, int nelements, int k)
+{
+	int64_select((int64 *) elements, nelements, k);
+}
+
+/* range of the elements, for the dense counting */
+static void
+int16_minmax(const void *elements, int nelements, int64 *min, int64 *max)
+{
+	int16_minmax_kernel((const int16 *) elements, nelements, min, max);
+}
+
+static void
+int32_minmax(const void *elements, int nelements, int64 *min, int64 *max)
+{
+	int32_minmax_kernel((const int32 *) elements, nelements, min, max);
+}
+
+static void
+int64_minmax(const void *elements, int nelements, int64 *min, int64 *max)
+{
+	int64_minmax_kernel((const int64 *) elements, nelements, min, max);
+}
+
+/* adding the elements to the t-digest of a state over the memory limit */
+static void
+double_approximate(tdigest_state *digest, const void *elements, int nelements)
+{
+	int		i;
+
+	for (i = 0; i < nelements; i++)
+		tdigest_add(digest, ((const double *) elements)[i]);
+}
+
+static void
+float4_approximate(tdigest_state *digest, const void *elements, int nelements)
+{
+	int		i;
+
+	for (i = 0; i < nelements; i++)
+		tdigest_add(digest, ((const float4 *) elements)[i]);
+}
+
+static void
+int16_approximate(tdigest_state *digest, const void *elements, int nelements)
+{
+	int		i;
+
+	for (i = 0; i < nelements; i++)
+		tdigest_add(digest, ((const int16 *) elements)[i]);
+}
+
+static void
+int32_approximate(tdigest_state *digest, const void *elements, int nelements)
+{
+	int		i;
+
+	for (i = 0; i < nelements; i++)
+		tdigest_add(digest, ((const int32 *) elements)[i]);
+}
+
+static void
+int64_approximate(tdigest_state *digest, const void *elements, int nelements)
+{
+	int		i;
+
+	for (i = 0; i < nelements; i++)
+		tdigest_add(digest, (double) ((const int64 *) elements)[i]);
+}
+
+/*
+ * Converting the estimates back to the element type - the integer values
+ * are rounded (and clamped to the range of the type).
+ */
+static void
+double_estimate(double value, void *element)
+{
+	*(double *) element = value;
+}
 
-	/* the value has to be copied into the right memory context */
-	value = (Numeric) palloc(VARSIZE(num));
-	memcpy(value, num, VARSIZE(num));
+static void
+float4_estimate(double value, void *element)
+{
+	*(float4 *) element = (float4) value;
+}
 
-	/* make sure to cast the array to (Numeric *) before updating it */
-	elements = (Numeric *) state->elements;
-	elements[state->nelements++] = value;
+static void
+int16_estimate(double value, void *element)
+{
+	*(int16 *) element = (int16) Max(PG_INT16_MIN, Min(PG_INT16_MAX, rint(value)));
+}
 
-	MemoryContextSwitchTo(oldcontext);
+static void
+int32_estimate(double value, void *element)
+{
+	*(int32 *) element = (int32) Max(PG_INT32_MIN, Min(PG_INT32_MAX, rint(value)));
+}
 
-	PG_RETURN_POINTER(state);
+static void
+int64_estimate(double value, void *element)
+{
+	value = rint(value);
+
+	/* the range of int64 is not exactly representable as double */
+	if (value >= (double) PG_INT64_MAX)
+		*(int64 *) element = PG_INT64_MAX;
+	else if (value <= (double) PG_INT64_MIN)
+		*(int64 *) element = PG_INT64_MIN;
+	else
+		*(int64 *) element = (int64) value;
 }
 
-Datum
-quantile_append_numeric_array(PG_FUNCTION_ARGS)
+/*
+ * Finds the elements at the requested positions (sorted and distinct) when a
+ * prefix of the elements was sorted by a previous final function call, and
+ * only a tail was added since then (e.g. in a window with a growing frame).
+ * A short tail is sorted separately (using insertion sort, which is cheap
+ * when only a couple elements were added since the previous call), and the
+ * positions are looked up in the two sorted parts. A longer tail gets sorted
+ * and merged into the prefix.
+ */
+static void
+double_select_tail(quantile_state *state, int *positions, int npositions,
+				   double *values)
 {
-	quantile_state *state;
+	int		i;
+	int		nprefix;
+	int		ntail;
+	int		lo = 0,
+			hi = state->nsorted;
+	double *elements = (double *) state->elements;
+	double *tail = elements + state->nsorted;
+	double *buffer;
 
-	MemoryContext	oldcontext;
-	MemoryContext	aggcontext;
+	QUANTILE_STATS_PATH(state, "tail");
 
-	Numeric			num;
-	Numeric			value;
-	ArrayType	   *quantiles;
-	Numeric		   *elements;
+	Assert((state->nsorted > 0) && (state->nsorted < state->nelements));
 
-	/* OK, we do want to skip NULL values altogether */
-	if (PG_ARGISNULL(1))
+	/* the NaN values sort last, so find the first one in the prefix */
+	while (lo < hi)
 	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+		int	mid = lo + (hi - lo) / 2;
+
+		if (isnan(elements[mid]))
+			hi = mid;
 		else
-			/* if there already is a state accumulated, don't forget it */
-			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+			lo = mid + 1;
 	}
 
-	num = PG_GETARG_NUMERIC(1);
-	quantiles = PG_GETARG_ARRAYTYPE_P(2);
-
-	GET_AGG_CONTEXT("quantile_append_numeric_array", fcinfo, aggcontext);
+	nprefix = lo;
 
-	oldcontext = MemoryContextSwitchTo(aggcontext);
+	/* and move the NaN values in the tail out of the way too */
+	ntail = double_partition_nans(tail, state->nelements - state->nsorted);
 
-	if (PG_ARGISNULL(0))
+	if (ntail <= QUANTILE_TAIL_SIZE(state->nsorted))
 	{
-		state = (quantile_state *) palloc(sizeof(quantile_state));
-		state->elements  = palloc(QUANTILE_MIN_ELEMENTS * sizeof(Numeric));
-		state->maxelements = QUANTILE_MIN_ELEMENTS;
-		state->nelements = 0;
-
-		/* read the array of quantiles */
-		state->quantiles = array_to_double(fcinfo, quantiles,
-										   &state->nquantiles);
-
-		check_quantiles(state->nquantiles, state->quantiles);
+		double_insertion_sort(tail, 0, ntail - 1);
+
+		for (i = 0; i < npositions; i++)
+		{
+			if (positions[i] < nprefix + ntail)
+				values[i] = double_merged_select(elements, nprefix, tail, ntail,
+												 positions[i]);
+			else
+				values[i] = get_float8_nan();
+		}
+
+		return;
 	}
-	else
-		state = (quantile_state *) PG_GETARG_POINTER(0);
 
-	/* we can be sure the value is not null (see the check above) */
-	if (state->nelements == state->maxelements)
-	{
-		state->maxelements *= 2;
-		state->elements = repalloc(state->elements,
-								   sizeof(Numeric) * state->maxelements);
-	}
+	buffer = (double *) palloc(sizeof(double) * ntail);
+	memcpy(buffer, tail, sizeof(double) * ntail);
 
-	/* the value has to be copied into the right memory context */
-	value = (Numeric) palloc(VARSIZE(num));
-	memcpy(value, num, VARSIZE(num));
+	double_sort(buffer, ntail);
 
-	/* make sure to cast the array to (Numeric *) before updating it */
-	elements = (Numeric *) state->elements;
-	elements[state->nelements++] = value;
+	/* the merged values only move towards the end, the NaN values go last */
+	for (i = nprefix + ntail; i < state->nelements; i++)
+		elements[i] = get_float8_nan();
 
-	MemoryContextSwitchTo(oldcontext);
+	double_merge(elements, nprefix, buffer, ntail);
+	quantile_mark_sorted(state);
 
-	PG_RETURN_POINTER(state);
+	pfree(buffer);
+
+	for (i = 0; i < npositions; i++)
+		values[i] = elements[positions[i]];
 }
 
-Datum
-quantile_append_int32(PG_FUNCTION_ARGS)
+static void
+float4_select_tail(quantile_state *state, int *positions, int npositions,
+				   float4 *values)
 {
-	quantile_state *state;
+	int		i;
+	int		nprefix;
+	int		ntail;
+	int		lo = 0,
+			hi = state->nsorted;
+	float4 *elements = (float4 *) state->elements;
+	float4 *tail = elements + state->nsorted;
+	float4 *buffer;
 
-	MemoryContext	oldcontext;
-	MemoryContext	aggcontext;
+	QUANTILE_STATS_PATH(state, "tail");
 
-	int32		   *elements;
+	Assert((state->nsorted > 0) && (state->nsorted < state->nelements));
 
-	/* OK, we do want to skip NULL values altogether */
-	if (PG_ARGISNULL(1))
+	/* the NaN values sort last, so find the first one in the prefix */
+	while (lo < hi)
 	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
+		int	mid = lo + (hi - lo) / 2;
+
+		if (isnan(elements[mid]))
+			hi = mid;
 		else
-			/* if there already is a state accumulated, don't forget it */
-			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+			lo = mid + 1;
 	}
 
-	GET_AGG_CONTEXT("quantile_append_int32", fcinfo, aggcontext);
+	nprefix = lo;
 
-	oldcontext = MemoryContextSwitchTo(aggcontext);
+	/* and move the NaN values in the tail out of the way too */
+	ntail = float4_partition_nans(tail, state->nelements - state->nsorted);
 
-	if (PG_ARGISNULL(0))
+	if (ntail <= QUANTILE_TAIL_SIZE(state->nsorted))
 	{
-		state = (quantile_state *) palloc(sizeof(quantile_state));
-
-		state->elements  = palloc(QUANTILE_MIN_ELEMENTS * sizeof(int32));
-		state->maxelements = QUANTILE_MIN_ELEMENTS;
-		state->nelements = 0;
-
-		state->quantiles = (double *) palloc(sizeof(double));
-		state->quantiles[0] = PG_GETARG_FLOAT8(2);
-		state->nquantiles = 1;
-
-		check_quantiles(state->nquantiles, state->quantiles);
+		float4_insertion_sort(tail, 0, ntail - 1);
+
+		for (i = 0; i < npositions; i++)
+		{
+			if (positions[i] < nprefix + ntail)
+				values[i] = float4_merged_select(elements, nprefix, tail, ntail,
+												 positions[i]);
+			else
+				values[i] = get_float4_nan();
+		}
+
+		return;
 	}
-	else
-		state = (quantile_state *) PG_GETARG_POINTER(0);
 
-	AssertCheckQuantileState(state);
+	buffer = (float4 *) palloc(sizeof(float4) * ntail);
+	memcpy(buffer, tail, sizeof(float4) * ntail);
 
-	/* we can be sure the value is not null (see the check above) */
-	if (state->nelements == state->maxelements)
-	{
-		state->maxelements *= 2;
-		state->elements = repalloc(state->elements,
-								   sizeof(int32) * state->maxelements);
-	}
+	float4_sort(buffer, ntail);
 
-	Assert(state->nelements < state->maxelements);
+	/* the merged values only move towards the end, the NaN values go last */
+	for (i = nprefix + ntail; i < state->nelements; i++)
+		elements[i] = get_float4_nan();
 
-	/* make sure to cast the array to (int32 *) before updating it */
-	elements = (int32 *) state->elements;
-	elements[state->nelements++] = PG_GETARG_INT32(1);
+	float4_merge(elements, nprefix, buffer, ntail);
+	quantile_mark_sorted(state);
 
-	MemoryContextSwitchTo(oldcontext);
+	pfree(buffer);
 
-	PG_RETURN_POINTER(state);
+	for (i = 0; i < npositions; i++)
+		values[i] = elements[positions[i]];
 }
 
-Datum
-quantile_append_int32_array(PG_FUNCTION_ARGS)
+static void
+int32_select_tail(quantile_state *state, int *positions, int npositions,
+				  int32 *values)
 {
-	quantile_state *state;
+	int		i;
+	int		ntail = state->nelements - state->nsorted;
+	int32  *elements = (int32 *) state->elements;
+	int32  *tail = elements + state->nsorted;
+	int32  *buffer;
 
-	MemoryContext	oldcontext;
-	MemoryContext	aggcontext;
+	QUANTILE_STATS_PATH(state, "tail");
 
-	ArrayType	   *quantiles;
-	int32		   *elements;
+	Assert((state->nsorted > 0) && (state->nsorted < state->nelements));
 
-	/* OK, we do want to skip NULL values altogether */
-	if (PG_ARGISNULL(1))
+	if (ntail <= QUANTILE_TAIL_SIZE(state->nsorted))
 	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
-		else
-			/* if there already is a state accumulated, don't forget it */
-			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+		int32_insertion_sort(tail, 0, ntail - 1);
+
+		for (i = 0; i < npositions; i++)
+			values[i] = int32_merged_select(elements, state->nsorted,
+											tail, ntail, positions[i]);
+
+		return;
 	}
 
-	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+	buffer = (int32 *) palloc(sizeof(int32) * ntail);
+	memcpy(buffer, tail, sizeof(int32) * ntail);
 
-	GET_AGG_CONTEXT("quantile_append_int32_array", fcinfo, aggcontext);
+	int32_sort(buffer, ntail);
 
-	oldcontext = MemoryContextSwitchTo(aggcontext);
+	int32_merge(elements, state->nsorted, buffer, ntail);
+	quantile_mark_sorted(state);
 
-	if (PG_ARGISNULL(0))
-	{
-		state = (quantile_state *) palloc(sizeof(quantile_state));
+	pfree(buffer);
 
-		state->elements  = palloc(QUANTILE_MIN_ELEMENTS * sizeof(int32));
-		state->maxelements = QUANTILE_MIN_ELEMENTS;
-		state->nelements = 0;
+	for (i = 0; i < npositions; i++)
+		values[i] = elements[positions[i]];
+}
 
-		/* read the array of quantiles */
-		state->quantiles = array_to_double(fcinfo, quantiles,
-										   &state->nquantiles);
+static void
+int16_select_tail(quantile_state *state, int *positions, int npositions,
+				  int16 *values)
+{
+	int		i;
+	int		ntail = state->nelements - state->nsorted;
+	int16  *elements = (int16 *) state->elements;
+	int16  *tail = elements + state->nsorted;
+	int16  *buffer;
 
-		check_quantiles(state->nquantiles, state->quantiles);
-	}
-	else
-		state = (quantile_state *) PG_GETARG_POINTER(0);
+	QUANTILE_STATS_PATH(state, "tail");
 
-	AssertCheckQuantileState(state);
+	Assert((state->nsorted > 0) && (state->nsorted < state->nelements));
 
-	/* we can be sure the value is not null (see the check above) */
-	if (state->nelements == state->maxelements)
+	if (ntail <= QUANTILE_TAIL_SIZE(state->nsorted))
 	{
-		state->maxelements *= 2;
-		state->elements = repalloc(state->elements,
-								   sizeof(int32) * state->maxelements);
+		int16_insertion_sort(tail, 0, ntail - 1);
+
+		for (i = 0; i < npositions; i++)
+			values[i] = int16_merged_select(elements, state->nsorted,
+											tail, ntail, positions[i]);
+
+		return;
 	}
 
-	Assert(state->nelements < state->maxelements);
+	buffer = (int16 *) palloc(sizeof(int16) * ntail);
+	memcpy(buffer, tail, sizeof(int16) * ntail);
 
-	/* make sure to cast the array to (int32 *) before updating it */
-	elements = (int32 *) state->elements;
-	elements[state->nelements++] = PG_GETARG_INT32(1);
+	int16_sort(buffer, ntail);
 
-	MemoryContextSwitchTo(oldcontext);
+	int16_merge(elements, state->nsorted, buffer, ntail);
+	quantile_mark_sorted(state);
 
-	PG_RETURN_POINTER(state);
+	pfree(buffer);
+
+	for (i = 0; i < npositions; i++)
+		values[i] = elements[positions[i]];
 }
 
-Datum
-quantile_append_int64(PG_FUNCTION_ARGS)
+static void
+int64_select_tail(quantile_state *state, int *positions, int npositions,
+				  int64 *values)
 {
-	quantile_state *state;
+	int		i;
+	int		ntail = state->nelements - state->nsorted;
+	int64  *elements = (int64 *) state->elements;
+	int64  *tail = elements + state->nsorted;
+	int64  *buffer;
 
-	MemoryContext	oldcontext;
-	MemoryContext	aggcontext;
+	QUANTILE_STATS_PATH(state, "tail");
 
-	int64		   *elements;
+	Assert((state->nsorted > 0) && (state->nsorted < state->nelements));
 
-	/* OK, we do want to skip NULL values altogether */
-	if (PG_ARGISNULL(1))
+	if (ntail <= QUANTILE_TAIL_SIZE(state->nsorted))
 	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
-		else
-			/* if there already is a state accumulated, don't forget it */
-			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
+		int64_insertion_sort(tail, 0, ntail - 1);
+
+		for (i = 0; i < npositions; i++)
+			values[i] = int64_merged_select(elements, state->nsorted,
+											tail, ntail, positions[i]);
+
+		return;
 	}
 
-	GET_AGG_CONTEXT("quantile_append_int64", fcinfo, aggcontext);
+	buffer = (int64 *) palloc(sizeof(int64) * ntail);
+	memcpy(buffer, tail, sizeof(int64) * ntail);
 
-	oldcontext = MemoryContextSwitchTo(aggcontext);
+	int64_sort(buffer, ntail);
 
-	if (PG_ARGISNULL(0))
+	int64_merge(elements, state->nsorted, buffer, ntail);
+	quantile_mark_sorted(state);
+
+	pfree(buffer);
+
+	for (i = 0; i < npositions; i++)
+		values[i] = elements[positions[i]];
+}
+
+/*
+ * Sorts the elements added in nearly sorted order (as counted by the append
+ * functions), by moving the few elements out of order aside, sorting them
+ * separately and merging them back. Elements added in (nearly) descending
+ * order get reversed first. Returns false, leaving the elements to the usual
+ * sort or selection, when the elements are not nearly sorted (or when too
+ * many of them would have to be moved aside).
+ */
+static bool
+double_sort_presorted(quantile_state *state)
+{
+	int		i;
+	int		nkept;
+	int		first = state->nsorted;
+	int		limit = QUANTILE_PRESORTED_LIMIT(state->nelements);
+	double *elements = (double *) state->elements;
+	double *buffer;
+
+	QUANTILE_STATS_PATH(state, "presorted");
+
+	if (state->ndescents > limit / 2)
 	{
-		state = (quantile_state *) palloc(sizeof(quantile_state));
+		if (state->nascents > limit / 2)
+			return false;
 
-		state->elements  = palloc(QUANTILE_MIN_ELEMENTS * sizeof(int64));
-		state->maxelements = QUANTILE_MIN_ELEMENTS;
-		state->nelements = 0;
+		for (i = 0; i < state->nelements / 2; i++)
+		{
+			double	tmp = elements[i];
 
-		state->quantiles = (double *) palloc(sizeof(double));
-		state->quantiles[0] = PG_GETARG_FLOAT8(2);
-		state->nquantiles = 1;
+			elements[i] = elements[state->nelements - 1 - i];
+			elements[state->nelements - 1 - i] = tmp;
+		}
 
-		check_quantiles(state->nquantiles, state->quantiles);
+		first = 0;
 	}
-	else
-		state = (quantile_state *) PG_GETARG_POINTER(0);
 
-	AssertCheckQuantileState(state);
+	buffer = (double *) palloc(sizeof(double) * Max(limit, 1));
 
-	/* we can be sure the value is not null (see the check above) */
-	if (state->nelements == state->maxelements)
+	nkept = double_split_sorted(elements, state->nelements, first, buffer, limit);
+
+	if (nkept < 0)
 	{
-		state->maxelements *= 2;
-		state->elements = repalloc(state->elements,
-								   sizeof(int64) * state->maxelements);
+		pfree(buffer);
+
+		state->nsorted = 0;
+		quantile_order_unknown(state);
+
+		return false;
 	}
 
-	Assert(state->nelements < state->maxelements);
+	/* the NaN values sort last, in the merge too */
+	double_sort_run(buffer, state->nelements - nkept);
 
-	/* make sure to cast the array to (int64 *) before updating it */
-	elements = (int64 *) state->elements;
-	elements[state->nelements++] = PG_GETARG_INT64(1);
+	double_merge(elements, nkept, buffer, state->nelements - nkept);
+	quantile_mark_sorted(state);
 
-	MemoryContextSwitchTo(oldcontext);
+	pfree(buffer);
 
-	PG_RETURN_POINTER(state);
+	return true;
 }
 
-Datum
-quantile_append_int64_array(PG_FUNCTION_ARGS)
+static bool
+float4_sort_presorted(quantile_state *state)
 {
-	quantile_state *state;
-
-	MemoryContext	oldcontext;
-	MemoryContext	aggcontext;
+	int		i;
+	int		nkept;
+	int		first = state->nsorted;
+	int		limit = QUANTILE_PRESORTED_LIMIT(state->nelements);
+	float4 *elements = (float4 *) state->elements;
+	float4 *buffer;
 
-	ArrayType	   *quantiles;
-	int64		   *elements;
+	QUANTILE_STATS_PATH(state, "presorted");
 
-	/* OK, we do want to skip NULL values altogether */
-	if (PG_ARGISNULL(1))
+	if (state->ndescents > limit / 2)
 	{
-		if (PG_ARGISNULL(0))
-			PG_RETURN_NULL();
-		else
-			/* if there already is a state accumulated, don't forget it */
-			PG_RETURN_DATUM(PG_GETARG_DATUM(0));
-	}
+		if (state->nascents > limit / 2)
+			return false;
 
-	quantiles = PG_GETARG_ARRAYTYPE_P(2);
+		for (i = 0; i < state->nelements / 2; i++)
+		{
+			float4	tmp = elements[i];
 
-	GET_AGG_CONTEXT("quantile_append_int64_array", fcinfo, aggcontext);
+			elements[i] = elements[state->nelements - 1 - i];
+			elements[state->nelements - 1 - i] = tmp;
+		}
 
-	oldcontext = MemoryContextSwitchTo(aggcontext);
+		first = 0;
+	}
 
-	if (PG_ARGISNULL(0))
-	{
-		state = (quantile_state *) palloc(sizeof(quantile_state));
-		state->elements = palloc(QUANTILE_MIN_ELEMENTS * sizeof(int64));
-		state->maxelements = QUANTILE_MIN_ELEMENTS;
-		state->nelements = 0;
+	buffer = (float4 *) palloc(sizeof(float4) * Max(limit, 1));
 
-		/* read the array of quantiles */
-		state->quantiles = array_to_double(fcinfo, quantiles,
-										   &state->nquantiles);
+	nkept = float4_split_sorted(elements, state->nelements, first, buffer, limit);
 
-		check_quantiles(state->nquantiles, state->quantiles);
-	}
-	else
-		state = (quantile_state *) PG_GETARG_POINTER(0);
+	if (nkept < 0)
+	{
+		pfree(buffer);
 
-	AssertCheckQuantileState(state);
+		state->nsorted = 0;
+		quantile_order_unknown(state);
 
-	/* we can be sure the value is not null (see the check above) */
-	if (state->nelements == state->maxelements)
-	{
-		state->maxelements *= 2;
-		state->elements = repalloc(state->elements,
-								   sizeof(int64) * state->maxelements);
+		return false;
 	}
 
-	Assert(state->nelements < state->maxelements);
+	/* the NaN values sort last, in the merge too */
+	float4_sort_run(buffer, state->nelements - nkept);
 
-	/* make sure to cast the array to (int64 *) before updating it */
-	elements = (int64 *) state->elements;
-	elements[state->nelements++] = PG_GETARG_INT64(1);
+	float4_merge(elements, nkept, buffer, state->nelements - nkept);
+	quantile_mark_sorted(state);
 
-	MemoryContextSwitchTo(oldcontext);
+	pfree(buffer);
 
-	PG_RETURN_POINTER(state);
+	return true;
 }
 
-Datum
-quantile_double(PG_FUNCTION_ARGS)
+static bool
+int32_sort_presorted(quantile_state *state)
 {
-	int				idx = 0;
-	quantile_state *state;
-	double		   *elements;
+	int		i;
+	int		nkept;
+	int		first = state->nsorted;
+	int		limit = QUANTILE_PRESORTED_LIMIT(state->nelements);
+	int32   *elements = (int32 *) state->elements;
+	int32   *buffer;
 
-	CHECK_AGG_CONTEXT("quantile_double", fcinfo);
+	QUANTILE_STATS_PATH(state, "presorted");
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	if (state->ndescents > limit / 2)
+	{
+		if (state->nascents > limit / 2)
+			return false;
 
-	state = (quantile_state *) PG_GETARG_POINTER(0);
-	elements = (double *) state->elements;
+		for (i = 0; i < state->nelements / 2; i++)
+		{
+			int32	tmp = elements[i];
 
-	qsort(state->elements, state->nelements, sizeof(double), &double_comparator);
+			elements[i] = elements[state->nelements - 1 - i];
+			elements[state->nelements - 1 - i] = tmp;
+		}
 
-	if (state->quantiles[0] > 0)
-		idx = (int) ceil(state->nelements * state->quantiles[0]) - 1;
+		first = 0;
+	}
 
-	PG_RETURN_FLOAT8(elements[idx]);
-}
+	buffer = (int32 *) palloc(sizeof(int32) * Max(limit, 1));
 
-Datum
-quantile_double_array(PG_FUNCTION_ARGS)
-{
-	int				i;
-	double		   *result;
-	quantile_state *state;
-	double		   *elements;
+	nkept = int32_split_sorted(elements, state->nelements, first, buffer, limit);
 
-	CHECK_AGG_CONTEXT("quantile_double_array", fcinfo);
+	if (nkept < 0)
+	{
+		pfree(buffer);
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+		state->nsorted = 0;
+		quantile_order_unknown(state);
+
+		return false;
+	}
+
+	int32_sort(buffer, state->nelements - nkept);
+
+	int32_merge(elements, nkept, buffer, state->nelements - nkept);
+	quantile_mark_sorted(state);
+
+	pfree(buffer);
 
-	state = (quantile_state *) PG_GETARG_POINTER(0);
+	return true;
+}
 
-	result = palloc(state->nquantiles * sizeof(double));
-	elements = (double *) state->elements;
+static bool
+int16_sort_presorted(quantile_state *state)
+{
+	int		i;
+	int		nkept;
+	int		first = state->nsorted;
+	int		limit = QUANTILE_PRESORTED_LIMIT(state->nelements);
+	int16   *elements = (int16 *) state->elements;
+	int16   *buffer;
 
-	qsort(state->elements, state->nelements, sizeof(double), &double_comparator);
+	QUANTILE_STATS_PATH(state, "presorted");
 
-	for (i = 0; i < state->nquantiles; i++)
+	if (state->ndescents > limit / 2)
 	{
-		int	idx = 0;
+		if (state->nascents > limit / 2)
+			return false;
+
+		for (i = 0; i < state->nelements / 2; i++)
+		{
+			int16	tmp = elements[i];
 
-		if (state->quantiles[i] > 0)
-			idx = (int) ceil(state->nelements * state->quantiles[i]) - 1;
+			elements[i] = elements[state->nelements - 1 - i];
+			elements[state->nelements - 1 - i] = tmp;
+		}
 
-		result[i] = elements[idx];
+		first = 0;
 	}
 
-	return double_to_array(fcinfo, result, state->nquantiles);
-}
+	buffer = (int16 *) palloc(sizeof(int16) * Max(limit, 1));
 
-Datum
-quantile_int32(PG_FUNCTION_ARGS)
-{
-	int				idx = 0;
-	quantile_state *state;
-	int32		   *elements;
+	nkept = int16_split_sorted(elements, state->nelements, first, buffer, limit);
 
-	CHECK_AGG_CONTEXT("quantile_int32", fcinfo);
+	if (nkept < 0)
+	{
+		pfree(buffer);
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+		state->nsorted = 0;
+		quantile_order_unknown(state);
 
-	state = (quantile_state *) PG_GETARG_POINTER(0);
-	elements = (int32 *) state->elements;
+		return false;
+	}
+
+	int16_sort(buffer, state->nelements - nkept);
 
-	qsort(state->elements, state->nelements, sizeof(int32), &int32_comparator);
+	int16_merge(elements, nkept, buffer, state->nelements - nkept);
+	quantile_mark_sorted(state);
 
-	if (state->quantiles[0] > 0)
-		idx = (int) ceil(state->nelements * state->quantiles[0]) - 1;
+	pfree(buffer);
 
-	PG_RETURN_INT32(elements[idx]);
+	return true;
 }
 
-Datum
-quantile_int32_array(PG_FUNCTION_ARGS)
+static bool
+int64_sort_presorted(quantile_state *state)
 {
-	int				i;
-	quantile_state *state;
-	int32		   *result;
-	int32		   *elements;
-
-	CHECK_AGG_CONTEXT("quantile_int32_array", fcinfo);
+	int		i;
+	int		nkept;
+	int		first = state->nsorted;
+	int		limit = QUANTILE_PRESORTED_LIMIT(state->nelements);
+	int64   *elements = (int64 *) state->elements;
+	int64   *buffer;
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
-
-	state = (quantile_state *) PG_GETARG_POINTER(0);
+	QUANTILE_STATS_PATH(state, "presorted");
 
-	result = palloc(state->nquantiles * sizeof(int32));
-	elements = (int32 *) state->elements;
+	if (state->ndescents > limit / 2)
+	{
+		if (state->nascents > limit / 2)
+			return false;
 
-	qsort(state->elements, state->nelements, sizeof(int32), &int32_comparator);
+		for (i = 0; i < state->nelements / 2; i++)
+		{
+			int64	tmp = elements[i];
 
-	for (i = 0; i < state->nquantiles; i++)
-	{
-		int	idx = 0;
-		if (state->quantiles[i] > 0)
-			idx = (int) ceil(state->nelements * state->quantiles[i]) - 1;
+			elements[i] = elements[state->nelements - 1 - i];
+			elements[state->nelements - 1 - i] = tmp;
+		}
 
-		result[i] = elements[idx];
+		first = 0;
 	}
 
-	return int32_to_array(fcinfo, result, state->nquantiles);
-}
+	buffer = (int64 *) palloc(sizeof(int64) * Max(limit, 1));
 
-Datum
-quantile_int64(PG_FUNCTION_ARGS)
-{
-	int				idx = 0;
-	quantile_state *state;
-	int64		   *elements;
+	nkept = int64_split_sorted(elements, state->nelements, first, buffer, limit);
 
-	CHECK_AGG_CONTEXT("quantile_int64", fcinfo);
+	if (nkept < 0)
+	{
+		pfree(buffer);
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+		state->nsorted = 0;
+		quantile_order_unknown(state);
 
-	state = (quantile_state *) PG_GETARG_POINTER(0);
+		return false;
+	}
 
-	elements = (int64 *) state->elements;
+	int64_sort(buffer, state->nelements - nkept);
 
-	qsort(state->elements, state->nelements, sizeof(int64), &int64_comparator);
+	int64_merge(elements, nkept, buffer, state->nelements - nkept);
+	quantile_mark_sorted(state);
 
-	if (state->quantiles[0] > 0)
-		idx = (int) ceil(state->nelements * state->quantiles[0]) - 1;
+	pfree(buffer);
 
-	PG_RETURN_INT64(elements[idx]);
+	return true;
 }
 
-Datum
-quantile_int64_array(PG_FUNCTION_ARGS)
+/*
+ * The numeric tail is sorted using the abbreviated keys, but the sorted
+ * prefix has no keys, so the two parts are compared using the full values.
+ */
+static void
+numeric_select_tail(quantile_state *state, int *positions, int npositions,
+					Numeric *values)
 {
 	int				i;
-	quantile_state *state;
-	int64		   *result;
-	int64		   *elements;
+	int				ntail = state->nelements - state->nsorted;
+	Numeric		   *elements = (Numeric *) state->elements;
+	Numeric		   *tail = elements + state->nsorted;
+	Numeric		   *buffer;
+	numeric_key	   *keys;
+	SortSupportData	ssup;
 
-	CHECK_AGG_CONTEXT("quantile_int64_array", fcinfo);
+	QUANTILE_STATS_PATH(state, "tail");
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	Assert((state->nsorted > 0) && (state->nsorted < state->nelements));
 
-	state = (quantile_state *) PG_GETARG_POINTER(0);
+	keys = numeric_sort_keys(state, state->nsorted, &ssup);
 
-	elements = (int64 *) state->elements;
+	qsort_arg(keys, ntail, sizeof(numeric_key), numeric_key_comparator, &ssup);
 
-	result = palloc(state->nquantiles * sizeof(int64));
+	for (i = 0; i < ntail; i++)
+		tail[i] = keys[i].value;
 
-	qsort(state->elements, state->nelements, sizeof(int64), &int64_comparator);
+	pfree(keys);
 
-	for (i = 0; i < state->nquantiles; i++)
+	if (ntail <= QUANTILE_TAIL_SIZE(state->nsorted))
 	{
-		int	idx = 0;
-		if (state->quantiles[i] > 0)
-			idx = (int) ceil(state->nelements * state->quantiles[i]) - 1;
+		for (i = 0; i < npositions; i++)
+			values[i] = numeric_merged_select(elements, state->nsorted,
+											  tail, ntail, positions[i],
+											  &ssup);
 
-		result[i] = elements[idx];
+		return;
 	}
 
-	return int64_to_array(fcinfo, result, state->nquantiles);
+	buffer = (Numeric *) palloc(sizeof(Numeric) * ntail);
+	memcpy(buffer, tail, sizeof(Numeric) * ntail);
+
+	numeric_merge(elements, state->nsorted, buffer, ntail, &ssup);
+	quantile_mark_sorted(state);
+
+	pfree(buffer);
+
+	for (i = 0; i < npositions; i++)
+		values[i] = elements[positions[i]];
 }
 
-Datum
-quantile_numeric(PG_FUNCTION_ARGS)
+/*
+ * Computes the positions of the requested quantiles in the sorted array of
+ * elements. Returns the position for each quantile (in the same order as the
+ * quantiles), and also a sorted array of distinct positions, which is what
+ * the multi-select expects.
+ */
+static int *
+quantile_positions(quantile_state *state, double *quantiles, int nquantiles,
+				   int **positions, int *npositions)
 {
-	int				idx = 0;
-	quantile_state *state;
-	Numeric		   *elements;
+	return quantile_count_positions(QUANTILE_COUNT(state), quantiles,
+									nquantiles, positions, npositions);
+}
 
-	CHECK_AGG_CONTEXT("quantile_numeric", fcinfo);
+/* the same, for the given number of elements */
+static int *
+quantile_count_positions(int nelements, double *quantiles, int nquantiles,
+						 int **positions, int *npositions)
+{
+	int	i;
+	int	n = 0;
+	int	*indexes = (int *) palloc(nquantiles * sizeof(int));
+	int	*sorted = (int *) palloc(nquantiles * sizeof(int));
 
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	for (i = 0; i < nquantiles; i++)
+	{
+		int	idx = 0;
 
-	state = (quantile_state *) PG_GETARG_POINTER(0);
+		if (quantiles[i] > 0)
+			idx = (int) ceil(nelements * quantiles[i]) - 1;
 
-	elements = (Numeric *) state->elements;
+		indexes[i] = idx;
+		sorted[i] = idx;
+	}
+
+	qsort(sorted, nquantiles, sizeof(int), &int32_comparator);
 
-	qsort(state->elements, state->nelements, sizeof(Numeric), &numeric_comparator);
+	/* remove duplicate positions */
+	for (i = 0; i < nquantiles; i++)
+	{
+		if ((n == 0) || (sorted[n-1] != sorted[i]))
+			sorted[n++] = sorted[i];
+	}
 
-	if (state->quantiles[0] > 0)
-		idx = (int) ceil(state->nelements * state->quantiles[0]) - 1;
+	*positions = sorted;
+	*npositions = n;
 
-	PG_RETURN_NUMERIC(elements[idx]);
+	return indexes;
 }
 
-Datum
-quantile_numeric_array(PG_FUNCTION_ARGS)
+/*
+ * Returns the quantiles requested from a final function. The regular
+ * aggregates keep them in the state, while the ordered-set aggregates
+ * (quantile_disc) pass them to the final function as a direct argument,
+ * so that multiple aggregates on the same column may share a single state.
+ * Returns NULL when the direct argument is NULL, or when the state has no
+ * values at all.
+ */
+static double *
+quantile_final_quantiles(FunctionCallInfo fcinfo, quantile_state *state,
+						 bool array, int *nquantiles)
 {
-	int				i;
-	quantile_state *state;
-	Numeric		   *result;
-	Numeric		   *elements;
-
-	CHECK_AGG_CONTEXT("quantile_numeric_array", fcinfo);
-
-	if (PG_ARGISNULL(0))
-		PG_RETURN_NULL();
+	double *quantiles;
 
-	state = (quantile_state *) PG_GETARG_POINTER(0);
+	/* no values (e.g. only empty arrays, or arrays of NULLs, were added) */
+	if ((QUANTILE_COUNT(state) == 0) && (state->ext->digest == NULL))
+		return NULL;
 
-	elements = (Numeric *) state->elements;
+	if (PG_NARGS() == 1)
+	{
+		*nquantiles = state->nquantiles;
 
-	result = palloc(state->nquantiles * sizeof(Numeric));
+		if (state->ext->stats != NULL)
+			quantile_stats_final_start(state);
 
-	elements = (Numeric *) state->elements;
+		return state->quantiles;
+	}
 
-	qsort(elements, state->nelements, sizeof(Numeric), &numeric_comparator);
+	if (PG_ARGISNULL(1))
+		return NULL;
 
-	for (i = 0; i < state->nquantiles; i++)
+	if (array)
+		quantiles = array_to_double(fcinfo, PG_GETARG_ARRAYTYPE_P(1),
+									nquantiles);
+	else
 	{
-		int	idx = 0;
-
-		if (state->quantiles[i] > 0)
-			idx = (int) ceil(state->nelements * state->quantiles[i]) - 1;
-
-		result[i] = elements[idx];
+		quantiles = (double *) palloc(sizeof(double));
+		quantiles[0] = PG_GETARG_FLOAT8(1);
+		*nquantiles = 1;
 	}
 
-	return numeric_to_array(fcinfo, result, state->nquantiles);
-}
+	check_quantiles(*nquantiles, quantiles);
 
-/* Comparators for the qsort() calls. */
+	if (state->ext->stats != NULL)
+		quantile_stats_final_start(state);
 
-static int
-double_comparator(const void *a, const void *b)
-{
-	double af = (* (double*) a);
-	double bf = (* (double*) b);
-	return (af > bf) - (af < bf);
+	return quantiles;
 }
 
-static int
-int32_comparator(const void *a, const void *b)
+/*
+ * Decides whether a final function should sort all the elements, instead of
+ * selecting just the requested positions. The first call on a state only
+ * selects, which is cheaper - but when called again on the same state (e.g.
+ * for multiple aggregates sharing it), the array gets sorted, so that all
+ * the following calls simply read the values. Either way, the elements get
+ * reordered, so the caller has to set the sorted prefix after a sort.
+ */
+static bool
+quantile_final_sort(quantile_state *state)
 {
-	int32 af = (* (int32 *) a);
-	int32 bf = (* (int32 *) b);
-	return (af > bf) - (af < bf);
+	bool	sort = state->finalized;
+
+	state->finalized = true;
+	state->nsorted = 0;
+	quantile_order_unknown(state);
+
+	return sort;
 }
 
-static int
-int64_comparator(const void *a, const void *b)
+/*
+ * Copies the values found for the (sorted and distinct) positions into the
+ * result, with one element for each quantile (using the indexes).
+ */
+static void
+quantile_copy_results(int *indexes, int nquantiles, int *positions,
+					  int npositions, const char *values, int elemsize,
+					  void *result)
 {
-	int64 af = (* (int64 *) a);
-	int64 bf = (* (int64 *) b);
-	return (af > bf) - (af < bf);
+	int	i;
+
+	for (i = 0; i < nquantiles; i++)
+	{
+		int	   *found = bsearch(&indexes[i], positions, npositions,
+								sizeof(int), int32_comparator);
+
+		memcpy((char *) result + (Size) elemsize * i,
+			   values + (Size) elemsize * (found - positions), elemsize);
+	}
 }
 
-static int
-numeric_comparator(const void *a, const void *b)
+/*
+ * The quantiles parsed by array_to_double are cached in fn_extra. The states
+ * of all the groups usually get the same (constant) array of quantiles, so
+ * they simply share a single read-only copy, allocated in fn_mcxt (which
+ * outlives the states). Only the first array is cached - if the states get
+ * different arrays (e.g. from a column), each gets a private copy.
+ */
+typedef struct quantile_array_cache
 {
-	Numeric	na = (* (Numeric *) a);
-	Numeric	nb = (* (Numeric *) b);
+	ArrayMetaState	meta;		/* info about the element type */
+	ArrayType	   *array;		/* array the quantiles were parsed from */
+	int				nquantiles;
+	double		   *quantiles;	/* shared quantiles (or NULL) */
+} quantile_array_cache;
+
+static quantile_array_cache *
+quantile_array_cache_get(FunctionCallInfo fcinfo)
+{
+	quantile_array_cache *cache;
 
-	return DatumGetInt32(DirectFunctionCall2(numeric_cmp,
-											 NumericGetDatum(na),
-											 NumericGetDatum(nb)));
+	cache = (quantile_array_cache *) fcinfo->flinfo->fn_extra;
+	if (cache == NULL)
+	{
+		cache = MemoryContextAllocZero(fcinfo->flinfo->fn_mcxt,
+									   sizeof(quantile_array_cache));
+		cache->meta.element_type = ~FLOAT8OID;
+
+		fcinfo->flinfo->fn_extra = cache;
+	}
+
+	return cache;
 }
 
 /*
  * Reading quantiles from an input array, based mostly on
  * array_to_text_internal (it's a modified copy). This expects
  * to receive a single-dimensional float8 array as input, fails
- * otherwise.
+ * otherwise. The result may be shared, so it must not be modified.
  */
 static double *
 array_to_double(FunctionCallInfo fcinfo, ArrayType *array, int *arraylen)
@@ -978,7 +11355,9 @@ array_to_double(FunctionCallInfo fcinfo, ArrayType *array, int *arraylen)
 	bool		typbyval;
 	char		typalign;
 
+	quantile_array_cache *cache;
 	ArrayMetaState *my_extra;
+	MemoryContext	oldcontext = CurrentMemoryContext;
 
 	/* result */
 	double	   *result;
@@ -988,19 +11367,23 @@ array_to_double(FunctionCallInfo fcinfo, ArrayType *array, int *arraylen)
 	if (element_type != FLOAT8OID)
 		elog(ERROR, "array expected to be double precision[]");
 
+	cache = quantile_array_cache_get(fcinfo);
+
+	/* the same array as the cached one, so share the quantiles */
+	if ((cache->array != NULL) &&
+		(VARSIZE(array) == VARSIZE(cache->array)) &&
+		(memcmp(array, cache->array, VARSIZE(array)) == 0))
+	{
+		*arraylen = cache->nquantiles;
+		return cache->quantiles;
+	}
+
 	/*
 	 * We arrange to look up info about element type, including its output
 	 * conversion proc, only once per series of calls, assuming the element
 	 * type doesn't change underneath us.
 	 */
-	my_extra = (ArrayMetaState *) fcinfo->flinfo->fn_extra;
-	if (my_extra == NULL)
-	{
-		fcinfo->flinfo->fn_extra = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
-													  sizeof(ArrayMetaState));
-		my_extra = (ArrayMetaState *) fcinfo->flinfo->fn_extra;
-		my_extra->element_type = ~element_type;
-	}
+	my_extra = &cache->meta;
 
 	/*
 	 * Get info about element type, including its output conversion proc, if
@@ -1021,6 +11404,10 @@ array_to_double(FunctionCallInfo fcinfo, ArrayType *array, int *arraylen)
 	typbyval = my_extra->typbyval;
 	typalign = my_extra->typalign;
 
+	/* the first array is parsed directly into the cache */
+	if (cache->array == NULL)
+		MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+
 	/* Extract data from array of int16 */
 	deconstruct_array(array, FLOAT8OID, typlen, typbyval, typalign,
 					  &keys, NULL, &nkeys);
@@ -1030,11 +11417,66 @@ array_to_double(FunctionCallInfo fcinfo, ArrayType *array, int *arraylen)
 	for (i = 0; i < nkeys; i++)
 		result[i] = DatumGetFloat8(keys[i]);
 
+	pfree(keys);
+
+	if (cache->array == NULL)
+	{
+		cache->array = (ArrayType *) palloc(VARSIZE(array));
+		memcpy(cache->array, array, VARSIZE(array));
+
+		cache->nquantiles = nkeys;
+		cache->quantiles = result;
+	}
+
+	MemoryContextSwitchTo(oldcontext);
+
 	*arraylen = nkeys;
 
 	return result;
 }
 
+/*
+ * Sets the quantiles of a state (e.g. from the other state being combined,
+ * or from a serialized state, so possibly not aligned). A single quantile is
+ * kept in the state itself, otherwise the quantiles are shared with the other
+ * states through the cache, if possible.
+ */
+static void
+quantile_state_set_quantiles(FunctionCallInfo fcinfo, quantile_state *state,
+							 const void *quantiles, int nquantiles)
+{
+	quantile_array_cache *cache = quantile_array_cache_get(fcinfo);
+	Size	len = sizeof(double) * nquantiles;
+
+	state->nquantiles = nquantiles;
+
+	if (nquantiles == 1)
+	{
+		memcpy(&state->quantile, quantiles, sizeof(double));
+		state->quantiles = &state->quantile;
+		return;
+	}
+
+	/* the first quantiles get cached (no array, so never matched there) */
+	if (cache->quantiles == NULL)
+	{
+		cache->nquantiles = nquantiles;
+		cache->quantiles = MemoryContextAlloc(fcinfo->flinfo->fn_mcxt,
+											  Max(len, 1));
+		memcpy(cache->quantiles, quantiles, len);
+	}
+
+	if ((cache->nquantiles == nquantiles) &&
+		(memcmp(cache->quantiles, quantiles, len) == 0))
+	{
+		state->quantiles = cache->quantiles;
+		return;
+	}
+
+	state->quantiles = (double *) palloc(Max(len, 1));
+	memcpy(state->quantiles, quantiles, len);
+}
+
 /*
  * Helper functions used to prepare the resulting array (when there's
  * an array of quantiles).
@@ -1059,11 +11501,47 @@ double_to_array(FunctionCallInfo fcinfo, double * d, int len)
 										  CurrentMemoryContext));
 }
 
+static Datum
+float4_to_array(FunctionCallInfo fcinfo, float4 * d, int len)
+{
+	ArrayBuildState *astate = NULL;
+	int		 i;
+
+	for (i = 0; i < len; i++)
+	{
+		/* stash away this field */
+		astate = accumArrayResult(astate,
+								  Float4GetDatum(d[i]),
+								  false,
+								  FLOAT4OID,
+								  CurrentMemoryContext);
+	}
+
+	PG_RETURN_ARRAYTYPE_P(makeArrayResult(astate,
+										  CurrentMemoryContext));
+}
+
+/*
+ * The int32 and int64 final functions are shared with the date and timestamp
+ * aggregates (the values are stored the same way), so the element type of
+ * the result comes from the declared return type of the final function. It
+ * is not cached in fn_extra, which array_to_double may use for the quantiles
+ * (and it's looked up only once per group anyway).
+ */
+static Oid
+quantile_result_elemtype(FunctionCallInfo fcinfo, Oid deftype)
+{
+	Oid		elemtype = get_element_type(get_fn_expr_rettype(fcinfo->flinfo));
+
+	return OidIsValid(elemtype) ? elemtype : deftype;
+}
+
 static Datum
 int32_to_array(FunctionCallInfo fcinfo, int32 * d, int len)
 {
 	ArrayBuildState *astate = NULL;
 	int		 i;
+	Oid		 elemtype = quantile_result_elemtype(fcinfo, INT4OID);
 
 	for (i = 0; i < len; i++)
 	{
@@ -1071,7 +11549,27 @@ int32_to_array(FunctionCallInfo fcinfo, int32 * d, int len)
 		astate = accumArrayResult(astate,
 								  Int32GetDatum(d[i]),
 								  false,
-								  INT4OID,
+								  elemtype,
+								  CurrentMemoryContext);
+	}
+
+	PG_RETURN_ARRAYTYPE_P(makeArrayResult(astate,
+										  CurrentMemoryContext));
+}
+
+static Datum
+int16_to_array(FunctionCallInfo fcinfo, int16 * d, int len)
+{
+	ArrayBuildState *astate = NULL;
+	int		 i;
+
+	for (i = 0; i < len; i++)
+	{
+		/* stash away this field */
+		astate = accumArrayResult(astate,
+								  Int16GetDatum(d[i]),
+								  false,
+								  INT2OID,
 								  CurrentMemoryContext);
 	}
 
@@ -1085,6 +11583,7 @@ int64_to_array(FunctionCallInfo fcinfo, int64 * d, int len)
 
 	ArrayBuildState *astate = NULL;
 	int		 i;
+	Oid		 elemtype = quantile_result_elemtype(fcinfo, INT8OID);
 
 	for (i = 0; i < len; i++)
 	{
@@ -1092,7 +11591,7 @@ int64_to_array(FunctionCallInfo fcinfo, int64 * d, int len)
 		astate = accumArrayResult(astate,
 								  Int64GetDatum(d[i]),
 								  false,
-								  INT8OID,
+								  elemtype,
 								  CurrentMemoryContext);
 	}
 
@@ -1128,3 +11627,74 @@ check_quantiles(int nquantiles, double * quantiles)
 		if (quantiles[i] < 0 || quantiles[i] > 1)
 			elog(ERROR, "invalid percentile value %f - needs to be in [0,1]", quantiles[i]);
 }
+
+/*
+ * Returns the statistics of the states that shut down recently in this
+ * backend (with quantile.track_stats enabled), oldest first.
+ */
+Datum
+quantile_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext	oldcontext;
+		TupleDesc		tupdesc;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+		funcctx->max_calls = quantile_stats_count;
+
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		int			idx;
+		Datum		values[10];
+		bool		nulls[10];
+		HeapTuple	tuple;
+		quantile_state_stats *stats;
+
+		idx = (quantile_stats_next - quantile_stats_count + (int) funcctx->call_cntr +
+			   QUANTILE_STATS_HISTORY) % QUANTILE_STATS_HISTORY;
+		stats = &quantile_stats_history[idx];
+
+		memset(nulls, 0, sizeof(nulls));
+
+		values[0] = ObjectIdGetDatum(stats->func);
+		values[1] = Int64GetDatum(stats->nvalues);
+		values[2] = Int32GetDatum(stats->nreallocs);
+		values[3] = Int64GetDatum((int64) stats->peakbytes);
+		values[4] = Int32GetDatum(stats->nruns);
+		values[5] = Int64GetDatum(stats->nspilled);
+		values[6] = Int64GetDatum(stats->ncounted);
+		values[7] = Int32GetDatum(stats->nfinals);
+		values[8] = Float8GetDatum(stats->finaltime);
+		values[9] = CStringGetTextDatum(stats->path);
+
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/* discards the statistics returned by quantile_stats() */
+Datum
+quantile_stats_reset(PG_FUNCTION_ARGS)
+{
+	quantile_stats_count = 0;
+	quantile_stats_next = 0;
+
+	PG_RETURN_VOID();
+}
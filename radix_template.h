@@ -0,0 +1,343 @@
+/*
+ * radix_template.h - radix sort for fixed-width element types
+ *
+ * Copyright (C) Tomas Vondra, 2011
+ *
+ * This is a template, included once for each element type. It generates a
+ * sort function, which uses LSD radix sort (with 8-bit digits) for large
+ * arrays and qsort() with the supplied comparator for small ones, where the
+ * fixed costs of the radix sort (histograms, temporary buffer) dominate.
+ *
+ * The caller has to define:
+ *
+ *     RS_PREFIX       prefix of the generated functions (e.g. double)
+ *     RS_ELEMENT_TYPE type of the array elements
+ *     RS_KEY_TYPE     unsigned integer type of the same width (uint32, uint64)
+ *     RS_KEY(x)       maps an element to a key, so that the unsigned order of
+ *                     the keys matches the order of the elements
+ *     RS_COMPARATOR   comparator to use with qsort() for small arrays
+ *
+ * All the counts are collected in a single pass over the input, and passes
+ * where all the elements share the same digit (e.g. the upper bytes of small
+ * integers) are skipped entirely.
+ *
+ * Optionally, large arrays are sorted by multiple threads (sample sort). The
+ * elements are split into one bucket per thread using splitters picked from
+ * a sample, and the buckets are then radix-sorted independently. The
+ * threads only touch the arrays - all the memory is allocated upfront by the
+ * calling thread. To enable it, also define:
+ *
+ *     RS_PARALLEL_THREADS(n)  number of threads to use for n elements
+ *     RS_PARALLEL_MAX_THREADS maximum number of threads
+ *     RS_PARALLEL_RUN(f,a,n)  runs f(a, i) for i in [0,n), each in a thread
+ *
+ * All the parameters are undefined at the end, so the file can be included
+ * repeatedly.
+ */
+
+#define RS_MAKE_PREFIX(a)		CppConcat(a,_)
+#define RS_MAKE_NAME(a,b)		RS_MAKE_NAME_(RS_MAKE_PREFIX(a),b)
+#define RS_MAKE_NAME_(a,b)		CppConcat(a,b)
+
+#define RS_RADIX_SORT	RS_MAKE_NAME(RS_PREFIX, radix_sort)
+#define RS_RADIX_SORT_BUFFER	RS_MAKE_NAME(RS_PREFIX, radix_sort_buffer)
+#define RS_SORT			RS_MAKE_NAME(RS_PREFIX, sort)
+
+/* number of 8-bit digits in the key */
+#define RS_DIGITS		((int) sizeof(RS_KEY_TYPE))
+
+/* below this number of elements, qsort() is used */
+#ifndef RS_THRESHOLD
+#define RS_THRESHOLD	256
+#endif
+
+/*
+ * Sorts the array using a buffer of the same size, and returns the one with
+ * the sorted elements (either of them, depending on the number of passes).
+ * Does not allocate anything, so it's safe to call from the sort threads.
+ */
+static RS_ELEMENT_TYPE *
+RS_RADIX_SORT_BUFFER(RS_ELEMENT_TYPE *a, int n, RS_ELEMENT_TYPE *buffer)
+{
+	int				i, d;
+	uint32			counts[sizeof(RS_KEY_TYPE)][256];
+	RS_ELEMENT_TYPE *src = a;
+	RS_ELEMENT_TYPE *dst = buffer;
+
+	memset(counts, 0, sizeof(counts));
+
+	/* build histograms for all the digits at once */
+	for (i = 0; i < n; i++)
+	{
+		RS_KEY_TYPE	key = RS_KEY(a[i]);
+
+		for (d = 0; d < RS_DIGITS; d++)
+			counts[d][(key >> (8 * d)) & 0xFF]++;
+	}
+
+	for (d = 0; d < RS_DIGITS; d++)
+	{
+		uint32			offset = 0;
+		int				shift = 8 * d;
+		RS_ELEMENT_TYPE *tmp;
+
+		/* all elements have the same digit, so this pass would be a no-op */
+		if (counts[d][(RS_KEY(src[0]) >> shift) & 0xFF] == (uint32) n)
+			continue;
+
+		/* turn the counts into starting offsets */
+		for (i = 0; i < 256; i++)
+		{
+			uint32	count = counts[d][i];
+
+			counts[d][i] = offset;
+			offset += count;
+		}
+
+		for (i = 0; i < n; i++)
+			dst[counts[d][(RS_KEY(src[i]) >> shift) & 0xFF]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	return src;
+}
+
+static void
+RS_RADIX_SORT(RS_ELEMENT_TYPE *a, int n)
+{
+	RS_ELEMENT_TYPE *buffer;
+	RS_ELEMENT_TYPE *sorted;
+
+	buffer = (RS_ELEMENT_TYPE *) MemoryContextAllocHuge(CurrentMemoryContext,
+												sizeof(RS_ELEMENT_TYPE) * n);
+
+	sorted = RS_RADIX_SORT_BUFFER(a, n, buffer);
+
+	/* after an odd number of passes the sorted data is in the other buffer */
+	if (sorted != a)
+		memcpy(a, sorted, sizeof(RS_ELEMENT_TYPE) * n);
+
+	pfree(buffer);
+}
+
+#ifdef RS_PARALLEL_THREADS
+
+#define RS_PARALLEL_STATE	RS_MAKE_NAME(RS_PREFIX, parallel_sort_state)
+#define RS_PARALLEL_TASK	RS_MAKE_NAME(RS_PREFIX, parallel_sort_task)
+#define RS_PARALLEL_SORT	RS_MAKE_NAME(RS_PREFIX, parallel_sort)
+#define RS_BUCKET			RS_MAKE_NAME(RS_PREFIX, parallel_sort_bucket)
+#define RS_KEY_COMPARATOR	RS_MAKE_NAME(RS_PREFIX, key_comparator)
+
+/* number of sampled elements per thread (bucket) */
+#define RS_SAMPLE_SIZE		64
+
+/* the steps of the parallel sort, each done by all the threads at once */
+#define RS_PHASE_COUNT		0	/* count the elements of each bucket */
+#define RS_PHASE_SCATTER	1	/* copy the elements into the buckets */
+#define RS_PHASE_SORT		2	/* sort the buckets */
+
+typedef struct RS_PARALLEL_STATE
+{
+	int				phase;
+	int				nthreads;		/* number of threads (and buckets) */
+	int				n;
+	RS_ELEMENT_TYPE *a;				/* the elements (and the result) */
+	RS_ELEMENT_TYPE *buckets;		/* the elements split into buckets */
+
+	/* bucket i gets keys in (splitters[i-1], splitters[i]] */
+	RS_KEY_TYPE		splitters[RS_PARALLEL_MAX_THREADS];
+
+	/* [thread][bucket] counts, turned into offsets for the scatter */
+	int			   *counts;
+
+	/* offsets of the buckets (nthreads + 1 of them) */
+	int				starts[RS_PARALLEL_MAX_THREADS + 1];
+} RS_PARALLEL_STATE;
+
+static int
+RS_KEY_COMPARATOR(const void *a, const void *b)
+{
+	RS_KEY_TYPE ka = *(const RS_KEY_TYPE *) a;
+	RS_KEY_TYPE kb = *(const RS_KEY_TYPE *) b;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/* the first bucket with a splitter >= key (binary search) */
+static inline int
+RS_BUCKET(const RS_PARALLEL_STATE *state, RS_KEY_TYPE key)
+{
+	int		lo = 0;
+	int		hi = state->nthreads - 1;
+
+	while (lo < hi)
+	{
+		int		mid = (lo + hi) / 2;
+
+		if (state->splitters[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+static void
+RS_PARALLEL_TASK(void *arg, int task)
+{
+	RS_PARALLEL_STATE *state = (RS_PARALLEL_STATE *) arg;
+	int		   *counts = state->counts + task * state->nthreads;
+	int			i;
+
+	/* the part of the input processed by the task (in the first phases) */
+	int			lo = (int) ((int64) state->n * task / state->nthreads);
+	int			hi = (int) ((int64) state->n * (task + 1) / state->nthreads);
+
+	switch (state->phase)
+	{
+		case RS_PHASE_COUNT:
+			for (i = lo; i < hi; i++)
+				counts[RS_BUCKET(state, RS_KEY(state->a[i]))]++;
+			break;
+
+		case RS_PHASE_SCATTER:
+			for (i = lo; i < hi; i++)
+			{
+				RS_ELEMENT_TYPE	value = state->a[i];
+
+				state->buckets[counts[RS_BUCKET(state, RS_KEY(value))]++] = value;
+			}
+			break;
+
+		case RS_PHASE_SORT:
+		{
+			/* bucket of the task, with the input array as the buffer */
+			int				start = state->starts[task];
+			int				count = state->starts[task + 1] - start;
+			RS_ELEMENT_TYPE *bucket = state->buckets + start;
+			RS_ELEMENT_TYPE *sorted = bucket;
+
+			if (count < RS_THRESHOLD)
+				qsort(bucket, count, sizeof(RS_ELEMENT_TYPE), RS_COMPARATOR);
+			else
+				sorted = RS_RADIX_SORT_BUFFER(bucket, count, state->a + start);
+
+			if (sorted != state->a + start)
+				memcpy(state->a + start, sorted, sizeof(RS_ELEMENT_TYPE) * count);
+			break;
+		}
+	}
+}
+
+static void
+RS_PARALLEL_SORT(RS_ELEMENT_TYPE *a, int n, int nthreads)
+{
+	int				i, j;
+	int				offset = 0;
+	int				nsample = nthreads * RS_SAMPLE_SIZE;
+	RS_KEY_TYPE	   *sample;
+	RS_PARALLEL_STATE state;
+
+	Assert((nthreads > 1) && (nthreads <= RS_PARALLEL_MAX_THREADS));
+
+	state.nthreads = nthreads;
+	state.n = n;
+	state.a = a;
+	state.buckets = (RS_ELEMENT_TYPE *) MemoryContextAllocHuge(CurrentMemoryContext,
+												sizeof(RS_ELEMENT_TYPE) * n);
+	state.counts = (int *) palloc0(sizeof(int) * nthreads * nthreads);
+
+	/* pick the splitters from a sample of evenly spaced elements */
+	sample = (RS_KEY_TYPE *) palloc(sizeof(RS_KEY_TYPE) * nsample);
+
+	for (i = 0; i < nsample; i++)
+		sample[i] = RS_KEY(a[(int64) n * i / nsample]);
+
+	qsort(sample, nsample, sizeof(RS_KEY_TYPE), RS_KEY_COMPARATOR);
+
+	for (i = 0; i < nthreads - 1; i++)
+		state.splitters[i] = sample[(i + 1) * RS_SAMPLE_SIZE - 1];
+
+	pfree(sample);
+
+	state.phase = RS_PHASE_COUNT;
+	RS_PARALLEL_RUN(RS_PARALLEL_TASK, &state, nthreads);
+
+	/* turn the counts into offsets, the buckets one after another */
+	for (j = 0; j < nthreads; j++)
+	{
+		state.starts[j] = offset;
+
+		for (i = 0; i < nthreads; i++)
+		{
+			int		count = state.counts[i * nthreads + j];
+
+			state.counts[i * nthreads + j] = offset;
+			offset += count;
+		}
+	}
+
+	state.starts[nthreads] = offset;
+	Assert(offset == n);
+
+	state.phase = RS_PHASE_SCATTER;
+	RS_PARALLEL_RUN(RS_PARALLEL_TASK, &state, nthreads);
+
+	state.phase = RS_PHASE_SORT;
+	RS_PARALLEL_RUN(RS_PARALLEL_TASK, &state, nthreads);
+
+	pfree(state.counts);
+	pfree(state.buckets);
+}
+
+#endif							/* RS_PARALLEL_THREADS */
+
+static void
+RS_SORT(RS_ELEMENT_TYPE *a, int n)
+{
+#ifdef RS_PARALLEL_THREADS
+	int		nthreads = RS_PARALLEL_THREADS(n);
+
+	if (nthreads > 1)
+	{
+		RS_PARALLEL_SORT(a, n, Min(nthreads, RS_PARALLEL_MAX_THREADS));
+		return;
+	}
+#endif
+
+	if (n < RS_THRESHOLD)
+		qsort(a, n, sizeof(RS_ELEMENT_TYPE), RS_COMPARATOR);
+	else
+		RS_RADIX_SORT(a, n);
+}
+
+#undef RS_MAKE_PREFIX
+#undef RS_MAKE_NAME
+#undef RS_MAKE_NAME_
+#undef RS_RADIX_SORT
+#undef RS_RADIX_SORT_BUFFER
+#ifdef RS_PARALLEL_THREADS
+#undef RS_PARALLEL_STATE
+#undef RS_PARALLEL_TASK
+#undef RS_PARALLEL_SORT
+#undef RS_BUCKET
+#undef RS_KEY_COMPARATOR
+#undef RS_SAMPLE_SIZE
+#undef RS_PHASE_COUNT
+#undef RS_PHASE_SCATTER
+#undef RS_PHASE_SORT
+#undef RS_PARALLEL_THREADS
+#undef RS_PARALLEL_MAX_THREADS
+#undef RS_PARALLEL_RUN
+#endif
+#undef RS_SORT
+#undef RS_DIGITS
+#undef RS_PREFIX
+#undef RS_ELEMENT_TYPE
+#undef RS_KEY_TYPE
+#undef RS_KEY
+#undef RS_COMPARATOR
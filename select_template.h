@@ -0,0 +1,320 @@
+/*
+ * select_template.h - type-specialized selection of order statistics
+ *
+ * Copyright (C) Tomas Vondra, 2011
+ *
+ * This is a template, included once for each element type. It generates
+ * functions finding the k-th smallest element of an array in place, i.e.
+ * after the call the array is partitioned so that
+ *
+ *     a[i] <= a[k] for i < k   and   a[k] <= a[i] for i > k
+ *
+ * The caller has to define:
+ *
+ *     QS_PREFIX       prefix of the generated functions (e.g. double)
+ *     QS_ELEMENT_TYPE type of the array elements
+ *     QS_LT(a, b)     strict "less than" for two elements (has to define
+ *                     a strict weak ordering, so NaNs have to be handled
+ *                     by the caller)
+ *
+ * Optionally, QS_ARG_TYPE may be defined, in which case all the generated
+ * functions accept an additional argument 'arg' of that type, which QS_LT
+ * may use (e.g. sort support for the type).
+ *
+ * Optionally, QS_PARTITION may be defined as a pointer to a (vectorized)
+ * partition function, with the signature of the functions generated by
+ * partition_template.h. When it's not NULL at runtime, it's used instead of
+ * the Hoare partition.
+ *
+ * The selection is a quickselect with median-of-three pivots, switching to
+ * median-of-medians pivots when the partitioning does not shrink the
+ * interval fast enough (introselect), so the worst case remains O(n).
+ * A Hoare partition is used, which splits runs of duplicate values evenly,
+ * so inputs with many duplicates do not degrade the performance.
+ *
+ * When multiple order statistics are needed at once (e.g. for an array of
+ * quantiles), a multi-select variant accepts a sorted array of distinct
+ * positions. It selects the middle position, which partitions the array, and
+ * then recurses into the two halves with the remaining positions, so only
+ * the segments actually containing a requested position get partitioned.
+ * The cost is O(n log k) for k positions, compared to O(n log n) for a sort.
+ *
+ * All the parameters are undefined at the end, so the file can be included
+ * repeatedly.
+ */
+
+#define QS_MAKE_PREFIX(a)		CppConcat(a,_)
+#define QS_MAKE_NAME(a,b)		QS_MAKE_NAME_(QS_MAKE_PREFIX(a),b)
+#define QS_MAKE_NAME_(a,b)		CppConcat(a,b)
+
+#define QS_SWAP			QS_MAKE_NAME(QS_PREFIX, swap)
+#define QS_INSERTION	QS_MAKE_NAME(QS_PREFIX, insertion_sort)
+#define QS_MEDIAN3		QS_MAKE_NAME(QS_PREFIX, median3)
+#define QS_MEDIANS		QS_MAKE_NAME(QS_PREFIX, median_of_medians)
+#define QS_SELECT		QS_MAKE_NAME(QS_PREFIX, select)
+#define QS_MULTISELECT	QS_MAKE_NAME(QS_PREFIX, multiselect)
+
+#ifdef QS_ARG_TYPE
+#define QS_ARG_DECL		, QS_ARG_TYPE arg
+#define QS_ARG			, arg
+#else
+#define QS_ARG_DECL
+#define QS_ARG
+#endif
+
+/* below this size, the intervals are simply sorted */
+#ifndef QS_INSERTION_THRESHOLD
+#define QS_INSERTION_THRESHOLD	16
+#endif
+
+/* partitioned elements (as a multiple of n) before using median of medians */
+#ifndef QS_WORK_LIMIT
+#define QS_WORK_LIMIT	8
+#endif
+
+static void QS_SELECT(QS_ELEMENT_TYPE *a, int n, int k QS_ARG_DECL);
+
+static inline void
+QS_SWAP(QS_ELEMENT_TYPE *a, int i, int j)
+{
+	QS_ELEMENT_TYPE tmp = a[i];
+	a[i] = a[j];
+	a[j] = tmp;
+}
+
+/* insertion sort of the interval [lo, hi] */
+static void
+QS_INSERTION(QS_ELEMENT_TYPE *a, int lo, int hi QS_ARG_DECL)
+{
+	int	i, j;
+
+	for (i = lo + 1; i <= hi; i++)
+	{
+		QS_ELEMENT_TYPE tmp = a[i];
+
+		for (j = i; j > lo && QS_LT(tmp, a[j-1]); j--)
+			a[j] = a[j-1];
+
+		a[j] = tmp;
+	}
+}
+
+/*
+ * Median of the first, middle and last element of the interval, which is
+ * then moved to the first position of the interval.
+ */
+static inline void
+QS_MEDIAN3(QS_ELEMENT_TYPE *a, int lo, int hi QS_ARG_DECL)
+{
+	int	mid = lo + (hi - lo) / 2;
+
+	if (QS_LT(a[mid], a[lo]))
+		QS_SWAP(a, mid, lo);
+
+	if (QS_LT(a[hi], a[mid]))
+	{
+		QS_SWAP(a, hi, mid);
+
+		if (QS_LT(a[mid], a[lo]))
+			QS_SWAP(a, mid, lo);
+	}
+
+	QS_SWAP(a, lo, mid);
+}
+
+/*
+ * Median of medians of groups of five elements of the interval [lo, hi]. The
+ * group medians are moved to the beginning of the interval, the median of
+ * those is found by a recursive selection and then moved to the first
+ * position of the interval.
+ */
+static void
+QS_MEDIANS(QS_ELEMENT_TYPE *a, int lo, int hi QS_ARG_DECL)
+{
+	int	i;
+	int	ngroups = 0;
+
+	for (i = lo; i <= hi; i += 5)
+	{
+		int	end = Min(i + 4, hi);
+
+		QS_INSERTION(a, i, end QS_ARG);
+		QS_SWAP(a, lo + ngroups, i + (end - i) / 2);
+
+		ngroups++;
+	}
+
+	QS_SELECT(a + lo, ngroups, ngroups / 2 QS_ARG);
+
+	QS_SWAP(a, lo, lo + ngroups / 2);
+}
+
+/*
+ * Rearrange the array so that the k-th element (counting from 0) is at the
+ * position it would be in a sorted array.
+ */
+static void
+QS_SELECT(QS_ELEMENT_TYPE *a, int n, int k QS_ARG_DECL)
+{
+	int		lo = 0,
+			hi = n - 1;
+
+	/* elements partitioned so far (the work done by the cheap pivots) */
+	int64	work = 0;
+	bool	use_medians = false;
+
+	Assert((k >= 0) && (k < n));
+
+	while (hi - lo >= QS_INSERTION_THRESHOLD)
+	{
+		int				i, j;
+		QS_ELEMENT_TYPE	pivot;
+
+		/*
+		 * If the partitioning already went through many more elements than
+		 * a quickselect with median-of-three pivots would (about 3n on
+		 * average), the input is adversarial for the cheap pivot choice, so
+		 * use the median of medians from now on (which guarantees linear
+		 * time). Checking just the last couple iterations would switch far
+		 * too often for random inputs, and the medians are expensive.
+		 */
+		work += (hi - lo + 1);
+
+		if (work > QS_WORK_LIMIT * (int64) n)
+			use_medians = true;
+
+		if (use_medians)
+			QS_MEDIANS(a, lo, hi QS_ARG);
+		else
+			QS_MEDIAN3(a, lo, hi QS_ARG);
+
+		/*
+		 * Hoare partition around the pivot (at the first position), so that
+		 * [lo, j] <= pivot <= [j+1, hi]. Elements equal to the pivot stop
+		 * both scans, so duplicates end up spread evenly on both sides. With
+		 * the pivot at the first position, j < hi so the interval shrinks.
+		 */
+		pivot = a[lo];
+
+#ifdef QS_PARTITION
+		if (QS_PARTITION != NULL)
+		{
+			/*
+			 * Split the elements after the pivot into those smaller than the
+			 * pivot and the rest, and swap the pivot between the two parts
+			 * (to the position j). If no element is smaller, the elements
+			 * equal to the pivot get moved next to it, so that inputs with
+			 * many duplicates do not remove just the pivot in each step.
+			 */
+			j = lo + QS_PARTITION(a + lo + 1, hi - lo, pivot, false);
+			QS_SWAP(a, lo, j);
+
+			if (j == lo)
+			{
+				/* [lo, j] are all equal to the pivot, [j+1, hi] are larger */
+				j = lo + QS_PARTITION(a + lo + 1, hi - lo, pivot, true);
+
+				if (k <= j)
+					return;
+
+				lo = j + 1;
+				continue;
+			}
+
+			if (k == j)
+				return;
+			else if (k < j)
+				hi = j - 1;
+			else
+				lo = j + 1;
+
+			continue;
+		}
+#endif
+
+		i = lo - 1;
+		j = hi + 1;
+
+		for (;;)
+		{
+			do { i++; } while (QS_LT(a[i], pivot));
+			do { j--; } while (QS_LT(pivot, a[j]));
+
+			if (i >= j)
+				break;
+
+			QS_SWAP(a, i, j);
+		}
+
+		if (k <= j)
+			hi = j;
+		else
+			lo = j + 1;
+	}
+
+	QS_INSERTION(a, lo, hi QS_ARG);
+}
+
+/*
+ * Rearrange the array so that all elements at the requested positions (an
+ * array of distinct positions in ascending order) are where they would be
+ * in a sorted array.
+ */
+static void
+QS_MULTISELECT(QS_ELEMENT_TYPE *a, int n, int *positions, int npositions
+			   QS_ARG_DECL)
+{
+	int	mid;
+
+	if (npositions == 0)
+		return;
+
+	/* small intervals are simply sorted */
+	if (n <= QS_INSERTION_THRESHOLD)
+	{
+		QS_INSERTION(a, 0, n - 1 QS_ARG);
+		return;
+	}
+
+	mid = npositions / 2;
+
+	Assert((positions[mid] >= 0) && (positions[mid] < n));
+
+	QS_SELECT(a, n, positions[mid] QS_ARG);
+
+	/* positions before the middle one are in the left part, unchanged */
+	QS_MULTISELECT(a, positions[mid], positions, mid QS_ARG);
+
+	/* the positions after it have to be shifted for the right part */
+	if (mid + 1 < npositions)
+	{
+		int	i;
+		int	offset = positions[mid] + 1;
+
+		for (i = mid + 1; i < npositions; i++)
+			positions[i] -= offset;
+
+		QS_MULTISELECT(a + offset, n - offset,
+					   positions + mid + 1, npositions - mid - 1 QS_ARG);
+
+		for (i = mid + 1; i < npositions; i++)
+			positions[i] += offset;
+	}
+}
+
+#undef QS_MAKE_PREFIX
+#undef QS_MAKE_NAME
+#undef QS_MAKE_NAME_
+#undef QS_SWAP
+#undef QS_INSERTION
+#undef QS_MEDIAN3
+#undef QS_MEDIANS
+#undef QS_SELECT
+#undef QS_MULTISELECT
+#undef QS_ARG_DECL
+#undef QS_ARG
+#undef QS_PREFIX
+#undef QS_ELEMENT_TYPE
+#undef QS_LT
+#undef QS_ARG_TYPE
+#undef QS_PARTITION
@@ -0,0 +1,558 @@
+/*
+ * simd_kernels.h - vectorized kernels for the fixed-width element types
+ *
+ * Copyright (C) Tomas Vondra, 2011
+ *
+ * The inner loops of the selection and of the counting modes, implemented
+ * with AVX2 and AVX-512 instructions:
+ *
+ *     partition       partitions the array around a pivot (see
+ *                     partition_template.h), used by the selection of the
+ *                     double, int32 and int64 elements
+ *
+ *     minmax          range of int16, int32 and int64 elements, used by the
+ *                     dense counting
+ *
+ *     find_nan        position of the first NaN in double and float4
+ *                     elements, used when moving the NaNs out of the way
+ *
+ * The kernels are called through function pointers, set by _PG_init (see
+ * quantile_simd_init) depending on the instruction sets supported by the
+ * CPU, so the extension does not need to be built with any special flags.
+ * Without AVX2 (or on other platforms) the partition pointers are NULL, and
+ * the selection uses the usual Hoare partition, while the other kernels use
+ * plain loops.
+ *
+ * This is included once, by quantile.c.
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define QUANTILE_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/* partition kernels (NULL means no vectorized partition available) */
+static int	(*double_partition_kernel) (double *a, int n, double pivot, bool le) = NULL;
+static int	(*int32_partition_kernel) (int32 *a, int n, int32 pivot, bool le) = NULL;
+static int	(*int64_partition_kernel) (int64 *a, int n, int64 pivot, bool le) = NULL;
+
+/*
+ * Plain partition, used for short arrays by the vectorized ones. Moves the
+ * elements smaller (or not greater, with le) than the pivot to the beginning
+ * of the array, and returns the number of them.
+ */
+static int
+double_partition_scalar(double *a, int n, double pivot, bool le)
+{
+	int		i;
+	int		m = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((a[i] < pivot) || (le && (a[i] == pivot)))
+		{
+			double	tmp = a[m];
+
+			a[m++] = a[i];
+			a[i] = tmp;
+		}
+	}
+
+	return m;
+}
+
+static int
+int32_partition_scalar(int32 *a, int n, int32 pivot, bool le)
+{
+	int		i;
+	int		m = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((a[i] < pivot) || (le && (a[i] == pivot)))
+		{
+			int32	tmp = a[m];
+
+			a[m++] = a[i];
+			a[i] = tmp;
+		}
+	}
+
+	return m;
+}
+
+static int
+int64_partition_scalar(int64 *a, int n, int64 pivot, bool le)
+{
+	int		i;
+	int		m = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		if ((a[i] < pivot) || (le && (a[i] == pivot)))
+		{
+			int64	tmp = a[m];
+
+			a[m++] = a[i];
+			a[i] = tmp;
+		}
+	}
+
+	return m;
+}
+
+/* minimum and maximum of the elements (there has to be at least one) */
+static void
+int16_minmax_scalar(const int16 *a, int n, int64 *min, int64 *max)
+{
+	int		i;
+	int16	lo = a[0],
+			hi = a[0];
+
+	for (i = 1; i < n; i++)
+	{
+		lo = Min(lo, a[i]);
+		hi = Max(hi, a[i]);
+	}
+
+	*min = lo;
+	*max = hi;
+}
+
+static void
+int32_minmax_scalar(const int32 *a, int n, int64 *min, int64 *max)
+{
+	int		i;
+	int32	lo = a[0],
+			hi = a[0];
+
+	for (i = 1; i < n; i++)
+	{
+		lo = Min(lo, a[i]);
+		hi = Max(hi, a[i]);
+	}
+
+	*min = lo;
+	*max = hi;
+}
+
+static void
+int64_minmax_scalar(const int64 *a, int n, int64 *min, int64 *max)
+{
+	int		i;
+	int64	lo = a[0],
+			hi = a[0];
+
+	for (i = 1; i < n; i++)
+	{
+		lo = Min(lo, a[i]);
+		hi = Max(hi, a[i]);
+	}
+
+	*min = lo;
+	*max = hi;
+}
+
+/* position of the first NaN in the elements, or n if there are none */
+static int
+double_find_nan_scalar(const double *a, int n)
+{
+	int		i;
+
+	for (i = 0; i < n; i++)
+		if (isnan(a[i]))
+			break;
+
+	return i;
+}
+
+static int
+float4_find_nan_scalar(const float4 *a, int n)
+{
+	int		i;
+
+	for (i = 0; i < n; i++)
+		if (isnan(a[i]))
+			break;
+
+	return i;
+}
+
+static void (*int16_minmax_kernel) (const int16 *a, int n, int64 *min, int64 *max) = int16_minmax_scalar;
+static void (*int32_minmax_kernel) (const int32 *a, int n, int64 *min, int64 *max) = int32_minmax_scalar;
+static void (*int64_minmax_kernel) (const int64 *a, int n, int64 *min, int64 *max) = int64_minmax_scalar;
+
+static int	(*double_find_nan_kernel) (const double *a, int n) = double_find_nan_scalar;
+static int	(*float4_find_nan_kernel) (const float4 *a, int n) = float4_find_nan_scalar;
+
+#ifdef QUANTILE_SIMD_X86
+
+/*
+ * AVX2 has no instruction storing the selected elements of a vector, so the
+ * elements get moved to the front of the vector by a permutation (looked up
+ * by the bitmask of the selected elements), and then stored with a mask of
+ * the first elements. The permutations are for 32-bit lanes, the 64-bit
+ * elements move as pairs of them.
+ */
+static int32 avx2_permutations32[256][8];
+static int32 avx2_permutations64[16][8];
+
+static void
+avx2_build_permutations(void)
+{
+	int		mask;
+	int		i;
+
+	for (mask = 0; mask < 256; mask++)
+	{
+		int		n = 0;
+
+		memset(avx2_permutations32[mask], 0, sizeof(avx2_permutations32[mask]));
+
+		for (i = 0; i < 8; i++)
+			if (mask & (1 << i))
+				avx2_permutations32[mask][n++] = i;
+	}
+
+	for (mask = 0; mask < 16; mask++)
+	{
+		int		n = 0;
+
+		memset(avx2_permutations64[mask], 0, sizeof(avx2_permutations64[mask]));
+
+		for (i = 0; i < 4; i++)
+		{
+			if (mask & (1 << i))
+			{
+				avx2_permutations64[mask][n++] = 2 * i;
+				avx2_permutations64[mask][n++] = 2 * i + 1;
+			}
+		}
+	}
+}
+
+/* masks of the first n 32-bit / 64-bit lanes, for the masked loads/stores */
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_lanes32(int n)
+{
+	return _mm256_cmpgt_epi32(_mm256_set1_epi32(n),
+							  _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+avx2_lanes64(int n)
+{
+	return _mm256_cmpgt_epi32(_mm256_set1_epi32(n),
+							  _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3));
+}
+
+__attribute__((target("avx2")))
+static inline void
+avx2_store32(int32 *p, __m256i v, unsigned int mask)
+{
+	__m256i	perm = _mm256_loadu_si256((const __m256i *) avx2_permutations32[mask]);
+
+	_mm256_maskstore_epi32((int *) p, avx2_lanes32(__builtin_popcount(mask)),
+						   _mm256_permutevar8x32_epi32(v, perm));
+}
+
+__attribute__((target("avx2")))
+static inline void
+avx2_store64(void *p, __m256i v, unsigned int mask)
+{
+	__m256i	perm = _mm256_loadu_si256((const __m256i *) avx2_permutations64[mask]);
+
+	_mm256_maskstore_epi64((long long *) p, avx2_lanes64(__builtin_popcount(mask)),
+						   _mm256_permutevar8x32_epi32(v, perm));
+}
+
+/* double, AVX2 */
+#define PT_PREFIX			double_avx2
+#define PT_TARGET			"avx2"
+#define PT_ELEMENT_TYPE		double
+#define PT_VECTOR			__m256d
+#define PT_LANES			4
+#define PT_SET1(x)			_mm256_set1_pd(x)
+#define PT_LOAD(p)			_mm256_loadu_pd(p)
+#define PT_LOAD_PART(p, n)	_mm256_maskload_pd((p), avx2_lanes64(n))
+#define PT_CMP(v, pivot, le) \
+	((unsigned int) _mm256_movemask_pd((le) ? \
+		_mm256_cmp_pd((v), (pivot), _CMP_LE_OQ) : \
+		_mm256_cmp_pd((v), (pivot), _CMP_LT_OQ)))
+#define PT_STORE(p, v, mask) avx2_store64((p), _mm256_castpd_si256(v), (mask))
+#define PT_SCALAR			double_partition_scalar
+#include "partition_template.h"
+
+/* int64, AVX2 (not greater is the negation of greater) */
+#define PT_PREFIX			int64_avx2
+#define PT_TARGET			"avx2"
+#define PT_ELEMENT_TYPE		int64
+#define PT_VECTOR			__m256i
+#define PT_LANES			4
+#define PT_SET1(x)			_mm256_set1_epi64x(x)
+#define PT_LOAD(p)			_mm256_loadu_si256((const __m256i *) (p))
+#define PT_LOAD_PART(p, n)	_mm256_maskload_epi64((const long long *) (p), avx2_lanes64(n))
+#define PT_CMP(v, pivot, le) \
+	((le) ? \
+	 ~(unsigned int) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64((v), (pivot)))) : \
+	 (unsigned int) _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64((pivot), (v)))))
+#define PT_STORE(p, v, mask) avx2_store64((p), (v), (mask))
+#define PT_SCALAR			int64_partition_scalar
+#include "partition_template.h"
+
+/* int32, AVX2 */
+#define PT_PREFIX			int32_avx2
+#define PT_TARGET			"avx2"
+#define PT_ELEMENT_TYPE		int32
+#define PT_VECTOR			__m256i
+#define PT_LANES			8
+#define PT_SET1(x)			_mm256_set1_epi32(x)
+#define PT_LOAD(p)			_mm256_loadu_si256((const __m256i *) (p))
+#define PT_LOAD_PART(p, n)	_mm256_maskload_epi32((const int *) (p), avx2_lanes32(n))
+#define PT_CMP(v, pivot, le) \
+	((le) ? \
+	 ~(unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32((v), (pivot)))) : \
+	 (unsigned int) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32((pivot), (v)))))
+#define PT_STORE(p, v, mask) avx2_store32((p), (v), (mask))
+#define PT_SCALAR			int32_partition_scalar
+#include "partition_template.h"
+
+/* double, AVX-512 (which can store the selected elements directly) */
+#define PT_PREFIX			double_avx512
+#define PT_TARGET			"avx512f"
+#define PT_ELEMENT_TYPE		double
+#define PT_VECTOR			__m512d
+#define PT_LANES			8
+#define PT_SET1(x)			_mm512_set1_pd(x)
+#define PT_LOAD(p)			_mm512_loadu_pd(p)
+#define PT_LOAD_PART(p, n)	_mm512_maskz_loadu_pd((__mmask8) ((1 << (n)) - 1), (p))
+#define PT_CMP(v, pivot, le) \
+	((unsigned int) ((le) ? \
+		_mm512_cmp_pd_mask((v), (pivot), _CMP_LE_OQ) : \
+		_mm512_cmp_pd_mask((v), (pivot), _CMP_LT_OQ)))
+#define PT_STORE(p, v, mask) _mm512_mask_storeu_pd((p), (__mmask8) ((1 << __builtin_popcount(mask)) - 1), _mm512_maskz_compress_pd((__mmask8) (mask), (v)))
+#define PT_SCALAR			double_partition_scalar
+#include "partition_template.h"
+
+/* int64, AVX-512 */
+#define PT_PREFIX			int64_avx512
+#define PT_TARGET			"avx512f"
+#define PT_ELEMENT_TYPE		int64
+#define PT_VECTOR			__m512i
+#define PT_LANES			8
+#define PT_SET1(x)			_mm512_set1_epi64(x)
+#define PT_LOAD(p)			_mm512_loadu_si512(p)
+#define PT_LOAD_PART(p, n)	_mm512_maskz_loadu_epi64((__mmask8) ((1 << (n)) - 1), (p))
+#define PT_CMP(v, pivot, le) \
+	((unsigned int) ((le) ? \
+		_mm512_cmple_epi64_mask((v), (pivot)) : \
+		_mm512_cmplt_epi64_mask((v), (pivot))))
+#define PT_STORE(p, v, mask) _mm512_mask_storeu_epi64((p), (__mmask8) ((1 << __builtin_popcount(mask)) - 1), _mm512_maskz_compress_epi64((__mmask8) (mask), (v)))
+#define PT_SCALAR			int64_partition_scalar
+#include "partition_template.h"
+
+/* int32, AVX-512 */
+#define PT_PREFIX			int32_avx512
+#define PT_TARGET			"avx512f"
+#define PT_ELEMENT_TYPE		int32
+#define PT_VECTOR			__m512i
+#define PT_LANES			16
+#define PT_SET1(x)			_mm512_set1_epi32(x)
+#define PT_LOAD(p)			_mm512_loadu_si512(p)
+#define PT_LOAD_PART(p, n)	_mm512_maskz_loadu_epi32((__mmask16) ((1 << (n)) - 1), (p))
+#define PT_CMP(v, pivot, le) \
+	((unsigned int) ((le) ? \
+		_mm512_cmple_epi32_mask((v), (pivot)) : \
+		_mm512_cmplt_epi32_mask((v), (pivot))))
+#define PT_STORE(p, v, mask) _mm512_mask_storeu_epi32((p), (__mmask16) ((1 << __builtin_popcount(mask)) - 1), _mm512_maskz_compress_epi32((__mmask16) (mask), (v)))
+#define PT_SCALAR			int32_partition_scalar
+#include "partition_template.h"
+
+/*
+ * The min/max and NaN scans only need AVX2 - they're limited by the memory
+ * bandwidth, so wider vectors would not help much.
+ */
+__attribute__((target("avx2")))
+static void
+int16_minmax_avx2(const int16 *a, int n, int64 *min, int64 *max)
+{
+	int		i;
+	int16	lo[16],
+			hi[16];
+	__m256i	vlo = _mm256_set1_epi16(a[0]);
+	__m256i	vhi = vlo;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		__m256i	v = _mm256_loadu_si256((const __m256i *) (a + i));
+
+		vlo = _mm256_min_epi16(vlo, v);
+		vhi = _mm256_max_epi16(vhi, v);
+	}
+
+	_mm256_storeu_si256((__m256i *) lo, vlo);
+	_mm256_storeu_si256((__m256i *) hi, vhi);
+
+	*min = *max = a[0];
+
+	for (i = 0; i < 16; i++)
+	{
+		*min = Min(*min, lo[i]);
+		*max = Max(*max, hi[i]);
+	}
+
+	for (i = n - n % 16; i < n; i++)
+	{
+		*min = Min(*min, a[i]);
+		*max = Max(*max, a[i]);
+	}
+}
+
+__attribute__((target("avx2")))
+static void
+int32_minmax_avx2(const int32 *a, int n, int64 *min, int64 *max)
+{
+	int		i;
+	int32	lo[8],
+			hi[8];
+	__m256i	vlo = _mm256_set1_epi32(a[0]);
+	__m256i	vhi = vlo;
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		__m256i	v = _mm256_loadu_si256((const __m256i *) (a + i));
+
+		vlo = _mm256_min_epi32(vlo, v);
+		vhi = _mm256_max_epi32(vhi, v);
+	}
+
+	_mm256_storeu_si256((__m256i *) lo, vlo);
+	_mm256_storeu_si256((__m256i *) hi, vhi);
+
+	*min = *max = a[0];
+
+	for (i = 0; i < 8; i++)
+	{
+		*min = Min(*min, lo[i]);
+		*max = Max(*max, hi[i]);
+	}
+
+	for (i = n - n % 8; i < n; i++)
+	{
+		*min = Min(*min, a[i]);
+		*max = Max(*max, a[i]);
+	}
+}
+
+/* there's no 64-bit min/max in AVX2, so compare and blend */
+__attribute__((target("avx2")))
+static void
+int64_minmax_avx2(const int64 *a, int n, int64 *min, int64 *max)
+{
+	int		i;
+	int64	lo[4],
+			hi[4];
+	__m256i	vlo = _mm256_set1_epi64x(a[0]);
+	__m256i	vhi = vlo;
+
+	for (i = 0; i + 4 <= n; i += 4)
+	{
+		__m256i	v = _mm256_loadu_si256((const __m256i *) (a + i));
+
+		vlo = _mm256_blendv_epi8(vlo, v, _mm256_cmpgt_epi64(vlo, v));
+		vhi = _mm256_blendv_epi8(vhi, v, _mm256_cmpgt_epi64(v, vhi));
+	}
+
+	_mm256_storeu_si256((__m256i *) lo, vlo);
+	_mm256_storeu_si256((__m256i *) hi, vhi);
+
+	*min = *max = a[0];
+
+	for (i = 0; i < 4; i++)
+	{
+		*min = Min(*min, lo[i]);
+		*max = Max(*max, hi[i]);
+	}
+
+	for (i = n - n % 4; i < n; i++)
+	{
+		*min = Min(*min, a[i]);
+		*max = Max(*max, a[i]);
+	}
+}
+
+/* NaN is the only value not equal to itself (unordered compare) */
+__attribute__((target("avx2")))
+static int
+double_find_nan_avx2(const double *a, int n)
+{
+	int		i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+	{
+		__m256d	v = _mm256_loadu_pd(a + i);
+		int		mask = _mm256_movemask_pd(_mm256_cmp_pd(v, v, _CMP_UNORD_Q));
+
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + double_find_nan_scalar(a + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static int
+float4_find_nan_avx2(const float4 *a, int n)
+{
+	int		i;
+
+	for (i = 0; i + 8 <= n; i += 8)
+	{
+		__m256	v = _mm256_loadu_ps(a + i);
+		int		mask = _mm256_movemask_ps(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+
+	return i + float4_find_nan_scalar(a + i, n - i);
+}
+
+#endif							/* QUANTILE_SIMD_X86 */
+
+/*
+ * Picks the kernels for the instruction sets supported by the CPU (and the
+ * OS, which has to save the wider registers).
+ */
+static void
+quantile_simd_init(void)
+{
+#ifdef QUANTILE_SIMD_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		avx2_build_permutations();
+
+		double_partition_kernel = double_avx2_partition;
+		int32_partition_kernel = int32_avx2_partition;
+		int64_partition_kernel = int64_avx2_partition;
+
+		int16_minmax_kernel = int16_minmax_avx2;
+		int32_minmax_kernel = int32_minmax_avx2;
+		int64_minmax_kernel = int64_minmax_avx2;
+
+		double_find_nan_kernel = double_find_nan_avx2;
+		float4_find_nan_kernel = float4_find_nan_avx2;
+	}
+
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		double_partition_kernel = double_avx512_partition;
+		int32_partition_kernel = int32_avx512_partition;
+		int64_partition_kernel = int64_avx512_partition;
+	}
+#endif
+}
@@ -0,0 +1,1311 @@
+/* the aggregates are replaced in place, which needs PostgreSQL 12 */
+DO $$
+BEGIN
+    IF current_setting('server_version_num')::int < 120000 THEN
+        RAISE EXCEPTION 'updating quantile to 1.2.0 requires PostgreSQL 12 or newer'
+            USING HINT = 'Drop the extension and create it again (DROP EXTENSION quantile; CREATE EXTENSION quantile).';
+    END IF;
+END;
+$$;
+
+/* parallel aggregation support (combine, serialize and deserialize functions) */
+
+ALTER FUNCTION quantile_append_double(internal, double precision, double precision) PARALLEL SAFE;
+ALTER FUNCTION quantile_append_double_array(internal, double precision, double precision[]) PARALLEL SAFE;
+ALTER FUNCTION quantile_double(internal) PARALLEL SAFE;
+ALTER FUNCTION quantile_double_array(internal) PARALLEL SAFE;
+
+ALTER FUNCTION quantile_append_numeric(internal, numeric, double precision) PARALLEL SAFE;
+ALTER FUNCTION quantile_append_numeric_array(internal, numeric, double precision[]) PARALLEL SAFE;
+ALTER FUNCTION quantile_numeric(internal) PARALLEL SAFE;
+ALTER FUNCTION quantile_numeric_array(internal) PARALLEL SAFE;
+
+ALTER FUNCTION quantile_append_int32(internal, int, double precision) PARALLEL SAFE;
+ALTER FUNCTION quantile_append_int32_array(internal, int, double precision[]) PARALLEL SAFE;
+ALTER FUNCTION quantile_int32(internal) PARALLEL SAFE;
+ALTER FUNCTION quantile_int32_array(internal) PARALLEL SAFE;
+
+ALTER FUNCTION quantile_append_int64(internal, bigint, double precision) PARALLEL SAFE;
+ALTER FUNCTION quantile_append_int64_array(internal, bigint, double precision[]) PARALLEL SAFE;
+ALTER FUNCTION quantile_int64(internal) PARALLEL SAFE;
+ALTER FUNCTION quantile_int64_array(internal) PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_combine_double(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_combine_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_serialize_double(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_serialize_double'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_deserialize_double(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_deserialize_double'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_combine_numeric(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_combine_numeric'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_serialize_numeric(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_serialize_numeric'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_deserialize_numeric(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_deserialize_numeric'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_combine_int32(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_combine_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_serialize_int32(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_serialize_int32'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_deserialize_int32(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_deserialize_int32'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_combine_int64(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_combine_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_serialize_int64(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_serialize_int64'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_deserialize_int64(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_deserialize_int64'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+/* moving aggregate (window frame) support functions */
+CREATE OR REPLACE FUNCTION quantile_moving_append_double(p_pointer internal, p_element double precision, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_double_array(p_pointer internal, p_element double precision, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_double_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_double(p_pointer internal, p_element double precision, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_double(p_pointer internal, p_element double precision, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_double(p_pointer internal)
+    RETURNS double precision
+    AS 'quantile', 'quantile_moving_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_double_array(p_pointer internal)
+    RETURNS double precision[]
+    AS 'quantile', 'quantile_moving_double_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_numeric(p_pointer internal, p_element numeric, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_numeric'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_numeric_array(p_pointer internal, p_element numeric, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_numeric_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_numeric(p_pointer internal, p_element numeric, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_numeric'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_numeric(p_pointer internal, p_element numeric, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_numeric'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_numeric(p_pointer internal)
+    RETURNS numeric
+    AS 'quantile', 'quantile_moving_numeric'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_numeric_array(p_pointer internal)
+    RETURNS numeric[]
+    AS 'quantile', 'quantile_moving_numeric_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_int32(p_pointer internal, p_element int, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_int32_array(p_pointer internal, p_element int, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int32_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_int32(p_pointer internal, p_element int, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_int32(p_pointer internal, p_element int, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_int32(p_pointer internal)
+    RETURNS int
+    AS 'quantile', 'quantile_moving_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_int32_array(p_pointer internal)
+    RETURNS int[]
+    AS 'quantile', 'quantile_moving_int32_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_int64(p_pointer internal, p_element bigint, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_int64_array(p_pointer internal, p_element bigint, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_int64(p_pointer internal, p_element bigint, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_int64(p_pointer internal, p_element bigint, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_int64(p_pointer internal)
+    RETURNS bigint
+    AS 'quantile', 'quantile_moving_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_int64_array(p_pointer internal)
+    RETURNS bigint[]
+    AS 'quantile', 'quantile_moving_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+/*
+ * The support functions have to be added to the existing aggregates without
+ * dropping them, as that would fail when views (or other objects) depend on
+ * the aggregates. That needs CREATE OR REPLACE AGGREGATE (PostgreSQL 12), so
+ * on older versions the extension has to be dropped and created again (the
+ * check is at the beginning of the script, so nothing gets changed).
+ */
+DO $$
+DECLARE
+    v_type record;
+    v_array record;
+BEGIN
+    FOR v_type IN SELECT * FROM (VALUES ('double precision', 'double'),
+                                        ('numeric', 'numeric'),
+                                        ('int', 'int32'),
+                                        ('bigint', 'int64')) AS t(name, suffix)
+    LOOP
+        FOR v_array IN SELECT * FROM (VALUES ('', ''),
+                                             ('[]', '_array')) AS a(name, suffix)
+        LOOP
+            EXECUTE format('CREATE OR REPLACE AGGREGATE quantile(%s, double precision%s) (
+                                SFUNC = quantile_append_%s%s,
+                                STYPE = internal,
+                                FINALFUNC = quantile_%s%s,
+                                COMBINEFUNC = quantile_combine_%s,
+                                SERIALFUNC = quantile_serialize_%s,
+                                DESERIALFUNC = quantile_deserialize_%s,
+                                MSFUNC = quantile_moving_append_%s%s,
+                                MINVFUNC = quantile_moving_remove_%s,
+                                MSTYPE = internal,
+                                MFINALFUNC = quantile_moving_%s%s,
+                                PARALLEL = SAFE
+                            )', v_type.name, v_array.name,
+                                v_type.suffix, v_array.suffix,
+                                v_type.suffix, v_array.suffix,
+                                v_type.suffix, v_type.suffix, v_type.suffix,
+                                v_type.suffix, v_array.suffix,
+                                v_type.suffix,
+                                v_type.suffix, v_array.suffix);
+        END LOOP;
+    END LOOP;
+END;
+$$;
+
+/* quantile for the float4 */
+CREATE OR REPLACE FUNCTION quantile_append_float4(p_pointer internal, p_element real, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_float4_array(p_pointer internal, p_element real, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_append_float4_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_float4(p_pointer internal)
+    RETURNS real
+    AS 'quantile', 'quantile_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_float4_array(p_pointer internal)
+    RETURNS real[]
+    AS 'quantile', 'quantile_float4_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_combine_float4(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_combine_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_serialize_float4(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_serialize_float4'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_deserialize_float4(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_deserialize_float4'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_float4(p_pointer internal, p_element real, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_float4_array(p_pointer internal, p_element real, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_float4_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_float4(p_pointer internal, p_element real, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_float4(p_pointer internal, p_element real, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_float4(p_pointer internal)
+    RETURNS real
+    AS 'quantile', 'quantile_moving_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_float4_array(p_pointer internal)
+    RETURNS real[]
+    AS 'quantile', 'quantile_moving_float4_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE quantile(real, double precision) (
+    SFUNC = quantile_append_float4,
+    STYPE = internal,
+    FINALFUNC = quantile_float4,
+    COMBINEFUNC = quantile_combine_float4,
+    SERIALFUNC = quantile_serialize_float4,
+    DESERIALFUNC = quantile_deserialize_float4,
+    MSFUNC = quantile_moving_append_float4,
+    MINVFUNC = quantile_moving_remove_float4,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_float4,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile(real, double precision[]) (
+    SFUNC = quantile_append_float4_array,
+    STYPE = internal,
+    FINALFUNC = quantile_float4_array,
+    COMBINEFUNC = quantile_combine_float4,
+    SERIALFUNC = quantile_serialize_float4,
+    DESERIALFUNC = quantile_deserialize_float4,
+    MSFUNC = quantile_moving_append_float4_array,
+    MINVFUNC = quantile_moving_remove_float4,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_float4_array,
+    PARALLEL = SAFE
+);
+
+/* quantile for the int16 */
+CREATE OR REPLACE FUNCTION quantile_append_int16(p_pointer internal, p_element smallint, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_int16_array(p_pointer internal, p_element smallint, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int16_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_int16(p_pointer internal)
+    RETURNS smallint
+    AS 'quantile', 'quantile_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_int16_array(p_pointer internal)
+    RETURNS smallint[]
+    AS 'quantile', 'quantile_int16_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_combine_int16(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_combine_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_serialize_int16(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_serialize_int16'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_deserialize_int16(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_deserialize_int16'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_int16(p_pointer internal, p_element smallint, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_int16_array(p_pointer internal, p_element smallint, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int16_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_int16(p_pointer internal, p_element smallint, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_int16(p_pointer internal, p_element smallint, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_int16(p_pointer internal)
+    RETURNS smallint
+    AS 'quantile', 'quantile_moving_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_int16_array(p_pointer internal)
+    RETURNS smallint[]
+    AS 'quantile', 'quantile_moving_int16_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE quantile(smallint, double precision) (
+    SFUNC = quantile_append_int16,
+    STYPE = internal,
+    FINALFUNC = quantile_int16,
+    COMBINEFUNC = quantile_combine_int16,
+    SERIALFUNC = quantile_serialize_int16,
+    DESERIALFUNC = quantile_deserialize_int16,
+    MSFUNC = quantile_moving_append_int16,
+    MINVFUNC = quantile_moving_remove_int16,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_int16,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile(smallint, double precision[]) (
+    SFUNC = quantile_append_int16_array,
+    STYPE = internal,
+    FINALFUNC = quantile_int16_array,
+    COMBINEFUNC = quantile_combine_int16,
+    SERIALFUNC = quantile_serialize_int16,
+    DESERIALFUNC = quantile_deserialize_int16,
+    MSFUNC = quantile_moving_append_int16_array,
+    MINVFUNC = quantile_moving_remove_int16,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_int16_array,
+    PARALLEL = SAFE
+);
+
+/* quantile for the date (sharing the int32 functions) */
+CREATE OR REPLACE FUNCTION quantile_append_date(p_pointer internal, p_element date, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_date_array(p_pointer internal, p_element date, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int32_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_date(p_pointer internal)
+    RETURNS date
+    AS 'quantile', 'quantile_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_date_array(p_pointer internal)
+    RETURNS date[]
+    AS 'quantile', 'quantile_int32_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_date(p_pointer internal, p_element date, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_date_array(p_pointer internal, p_element date, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int32_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_date(p_pointer internal, p_element date, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_date(p_pointer internal, p_element date, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_date(p_pointer internal)
+    RETURNS date
+    AS 'quantile', 'quantile_moving_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_date_array(p_pointer internal)
+    RETURNS date[]
+    AS 'quantile', 'quantile_moving_int32_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE quantile(date, double precision) (
+    SFUNC = quantile_append_date,
+    STYPE = internal,
+    FINALFUNC = quantile_date,
+    COMBINEFUNC = quantile_combine_int32,
+    SERIALFUNC = quantile_serialize_int32,
+    DESERIALFUNC = quantile_deserialize_int32,
+    MSFUNC = quantile_moving_append_date,
+    MINVFUNC = quantile_moving_remove_date,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_date,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile(date, double precision[]) (
+    SFUNC = quantile_append_date_array,
+    STYPE = internal,
+    FINALFUNC = quantile_date_array,
+    COMBINEFUNC = quantile_combine_int32,
+    SERIALFUNC = quantile_serialize_int32,
+    DESERIALFUNC = quantile_deserialize_int32,
+    MSFUNC = quantile_moving_append_date_array,
+    MINVFUNC = quantile_moving_remove_date,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_date_array,
+    PARALLEL = SAFE
+);
+
+/* quantile for the timestamp (sharing the int64 functions) */
+CREATE OR REPLACE FUNCTION quantile_append_timestamp(p_pointer internal, p_element timestamp, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_timestamp_array(p_pointer internal, p_element timestamp, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_timestamp(p_pointer internal)
+    RETURNS timestamp
+    AS 'quantile', 'quantile_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_timestamp_array(p_pointer internal)
+    RETURNS timestamp[]
+    AS 'quantile', 'quantile_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_timestamp(p_pointer internal, p_element timestamp, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_timestamp_array(p_pointer internal, p_element timestamp, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_timestamp(p_pointer internal, p_element timestamp, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_timestamp(p_pointer internal, p_element timestamp, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_timestamp(p_pointer internal)
+    RETURNS timestamp
+    AS 'quantile', 'quantile_moving_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_timestamp_array(p_pointer internal)
+    RETURNS timestamp[]
+    AS 'quantile', 'quantile_moving_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE quantile(timestamp, double precision) (
+    SFUNC = quantile_append_timestamp,
+    STYPE = internal,
+    FINALFUNC = quantile_timestamp,
+    COMBINEFUNC = quantile_combine_int64,
+    SERIALFUNC = quantile_serialize_int64,
+    DESERIALFUNC = quantile_deserialize_int64,
+    MSFUNC = quantile_moving_append_timestamp,
+    MINVFUNC = quantile_moving_remove_timestamp,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_timestamp,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile(timestamp, double precision[]) (
+    SFUNC = quantile_append_timestamp_array,
+    STYPE = internal,
+    FINALFUNC = quantile_timestamp_array,
+    COMBINEFUNC = quantile_combine_int64,
+    SERIALFUNC = quantile_serialize_int64,
+    DESERIALFUNC = quantile_deserialize_int64,
+    MSFUNC = quantile_moving_append_timestamp_array,
+    MINVFUNC = quantile_moving_remove_timestamp,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_timestamp_array,
+    PARALLEL = SAFE
+);
+
+/* quantile for the timestamptz (sharing the int64 functions) */
+CREATE OR REPLACE FUNCTION quantile_append_timestamptz(p_pointer internal, p_element timestamptz, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_timestamptz_array(p_pointer internal, p_element timestamptz, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_timestamptz(p_pointer internal)
+    RETURNS timestamptz
+    AS 'quantile', 'quantile_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_timestamptz_array(p_pointer internal)
+    RETURNS timestamptz[]
+    AS 'quantile', 'quantile_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_timestamptz(p_pointer internal, p_element timestamptz, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_append_timestamptz_array(p_pointer internal, p_element timestamptz, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_append_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_timestamptz(p_pointer internal, p_element timestamptz, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_remove_timestamptz(p_pointer internal, p_element timestamptz, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_moving_remove_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_timestamptz(p_pointer internal)
+    RETURNS timestamptz
+    AS 'quantile', 'quantile_moving_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_moving_timestamptz_array(p_pointer internal)
+    RETURNS timestamptz[]
+    AS 'quantile', 'quantile_moving_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE quantile(timestamptz, double precision) (
+    SFUNC = quantile_append_timestamptz,
+    STYPE = internal,
+    FINALFUNC = quantile_timestamptz,
+    COMBINEFUNC = quantile_combine_int64,
+    SERIALFUNC = quantile_serialize_int64,
+    DESERIALFUNC = quantile_deserialize_int64,
+    MSFUNC = quantile_moving_append_timestamptz,
+    MINVFUNC = quantile_moving_remove_timestamptz,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_timestamptz,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile(timestamptz, double precision[]) (
+    SFUNC = quantile_append_timestamptz_array,
+    STYPE = internal,
+    FINALFUNC = quantile_timestamptz_array,
+    COMBINEFUNC = quantile_combine_int64,
+    SERIALFUNC = quantile_serialize_int64,
+    DESERIALFUNC = quantile_deserialize_int64,
+    MSFUNC = quantile_moving_append_timestamptz_array,
+    MINVFUNC = quantile_moving_remove_timestamptz,
+    MSTYPE = internal,
+    MFINALFUNC = quantile_moving_timestamptz_array,
+    PARALLEL = SAFE
+);
+
+/* ordered-set variants, getting the quantiles in the final function (so that the state may be shared) */
+CREATE OR REPLACE FUNCTION quantile_append_double(p_pointer internal, p_element double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_double(p_pointer internal, p_quantile double precision)
+    RETURNS double precision
+    AS 'quantile', 'quantile_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_double_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS double precision[]
+    AS 'quantile', 'quantile_double_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_numeric(p_pointer internal, p_element numeric)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_numeric'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_numeric(p_pointer internal, p_quantile double precision)
+    RETURNS numeric
+    AS 'quantile', 'quantile_numeric'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_numeric_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS numeric[]
+    AS 'quantile', 'quantile_numeric_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_int32(p_pointer internal, p_element int)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_int32(p_pointer internal, p_quantile double precision)
+    RETURNS int
+    AS 'quantile', 'quantile_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_int32_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS int[]
+    AS 'quantile', 'quantile_int32_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_int64(p_pointer internal, p_element bigint)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_int64(p_pointer internal, p_quantile double precision)
+    RETURNS bigint
+    AS 'quantile', 'quantile_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_int64_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS bigint[]
+    AS 'quantile', 'quantile_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_float4(p_pointer internal, p_element real)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_float4(p_pointer internal, p_quantile double precision)
+    RETURNS real
+    AS 'quantile', 'quantile_float4'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_float4_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS real[]
+    AS 'quantile', 'quantile_float4_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_int16(p_pointer internal, p_element smallint)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_int16(p_pointer internal, p_quantile double precision)
+    RETURNS smallint
+    AS 'quantile', 'quantile_int16'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_int16_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS smallint[]
+    AS 'quantile', 'quantile_int16_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_date(p_pointer internal, p_element date)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_date(p_pointer internal, p_quantile double precision)
+    RETURNS date
+    AS 'quantile', 'quantile_int32'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_date_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS date[]
+    AS 'quantile', 'quantile_int32_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_timestamp(p_pointer internal, p_element timestamp)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_timestamp(p_pointer internal, p_quantile double precision)
+    RETURNS timestamp
+    AS 'quantile', 'quantile_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_timestamp_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS timestamp[]
+    AS 'quantile', 'quantile_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_timestamptz(p_pointer internal, p_element timestamptz)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_timestamptz(p_pointer internal, p_quantile double precision)
+    RETURNS timestamptz
+    AS 'quantile', 'quantile_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_timestamptz_array(p_pointer internal, p_quantiles double precision[])
+    RETURNS timestamptz[]
+    AS 'quantile', 'quantile_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+/*
+ * The aggregates with the same input share the state only when the final
+ * function is declared as shareable, but FINALFUNC_MODIFY is only supported
+ * since PostgreSQL 11.
+ */
+DO $$
+DECLARE
+    v_modify text := '';
+    v_type record;
+BEGIN
+    IF current_setting('server_version_num')::int >= 110000 THEN
+        v_modify := ', FINALFUNC_MODIFY = SHAREABLE';
+    END IF;
+
+    FOR v_type IN SELECT * FROM (VALUES ('double precision', 'double'),
+                                        ('numeric', 'numeric'),
+                                        ('int', 'int32'),
+                                        ('bigint', 'int64'),
+                                        ('real', 'float4'),
+                                        ('smallint', 'int16'),
+                                        ('date', 'date'),
+                                        ('timestamp', 'timestamp'),
+                                        ('timestamptz', 'timestamptz')) AS t(name, suffix)
+    LOOP
+        EXECUTE format('CREATE AGGREGATE quantile_disc(double precision ORDER BY %s) (
+                            SFUNC = quantile_append_%s,
+                            STYPE = internal,
+                            FINALFUNC = quantile_%s,
+                            PARALLEL = SAFE%s
+                        )', v_type.name, v_type.suffix, v_type.suffix, v_modify);
+
+        EXECUTE format('CREATE AGGREGATE quantile_disc(double precision[] ORDER BY %s) (
+                            SFUNC = quantile_append_%s,
+                            STYPE = internal,
+                            FINALFUNC = quantile_%s_array,
+                            PARALLEL = SAFE%s
+                        )', v_type.name, v_type.suffix, v_type.suffix, v_modify);
+    END LOOP;
+END;
+$$;
+
+/* approximate quantiles (t-digest), for all the types through double precision */
+CREATE OR REPLACE FUNCTION quantile_approx_append(p_pointer internal, p_element double precision, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_approx_append'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_approx_append(p_pointer internal, p_element double precision, p_quantile double precision, p_compression int)
+    RETURNS internal
+    AS 'quantile', 'quantile_approx_append'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_approx_append_array(p_pointer internal, p_element double precision, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_approx_append_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_approx_append_array(p_pointer internal, p_element double precision, p_quantiles double precision[], p_compression int)
+    RETURNS internal
+    AS 'quantile', 'quantile_approx_append_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_approx_double(p_pointer internal)
+    RETURNS double precision
+    AS 'quantile', 'quantile_approx_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_approx_double_array(p_pointer internal)
+    RETURNS double precision[]
+    AS 'quantile', 'quantile_approx_double_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_approx_combine(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_approx_combine'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_approx_serialize(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_approx_serialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_approx_deserialize(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_approx_deserialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE quantile_approx(double precision, double precision) (
+    SFUNC = quantile_approx_append,
+    STYPE = internal,
+    FINALFUNC = quantile_approx_double,
+    COMBINEFUNC = quantile_approx_combine,
+    SERIALFUNC = quantile_approx_serialize,
+    DESERIALFUNC = quantile_approx_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_approx(double precision, double precision, int) (
+    SFUNC = quantile_approx_append,
+    STYPE = internal,
+    FINALFUNC = quantile_approx_double,
+    COMBINEFUNC = quantile_approx_combine,
+    SERIALFUNC = quantile_approx_serialize,
+    DESERIALFUNC = quantile_approx_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_approx(double precision, double precision[]) (
+    SFUNC = quantile_approx_append_array,
+    STYPE = internal,
+    FINALFUNC = quantile_approx_double_array,
+    COMBINEFUNC = quantile_approx_combine,
+    SERIALFUNC = quantile_approx_serialize,
+    DESERIALFUNC = quantile_approx_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_approx(double precision, double precision[], int) (
+    SFUNC = quantile_approx_append_array,
+    STYPE = internal,
+    FINALFUNC = quantile_approx_double_array,
+    COMBINEFUNC = quantile_approx_combine,
+    SERIALFUNC = quantile_approx_serialize,
+    DESERIALFUNC = quantile_approx_deserialize,
+    PARALLEL = SAFE
+);
+
+/* persistent sketches (compressed t-digest), that can be stored and merged */
+CREATE TYPE quantile_sketch;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_in(p_value cstring)
+    RETURNS quantile_sketch
+    AS 'quantile', 'quantile_sketch_in'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_out(p_sketch quantile_sketch)
+    RETURNS cstring
+    AS 'quantile', 'quantile_sketch_out'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_send(p_sketch quantile_sketch)
+    RETURNS bytea
+    AS 'quantile', 'quantile_sketch_send'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_recv(p_buffer internal)
+    RETURNS quantile_sketch
+    AS 'quantile', 'quantile_sketch_recv'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE TYPE quantile_sketch (
+    INPUT = quantile_sketch_in,
+    OUTPUT = quantile_sketch_out,
+    SEND = quantile_sketch_send,
+    RECEIVE = quantile_sketch_recv,
+    INTERNALLENGTH = VARIABLE,
+    ALIGNMENT = double,
+    STORAGE = extended
+);
+
+CREATE OR REPLACE FUNCTION quantile_sketch_append(p_pointer internal, p_element double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_sketch_append'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_append(p_pointer internal, p_element double precision, p_compression int)
+    RETURNS internal
+    AS 'quantile', 'quantile_sketch_append'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_merge(p_pointer internal, p_sketch quantile_sketch)
+    RETURNS internal
+    AS 'quantile', 'quantile_sketch_merge'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_final(p_pointer internal)
+    RETURNS quantile_sketch
+    AS 'quantile', 'quantile_sketch_final'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_get(p_sketch quantile_sketch, p_quantile double precision)
+    RETURNS double precision
+    AS 'quantile', 'quantile_sketch_get'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sketch_get(p_sketch quantile_sketch, p_quantiles double precision[])
+    RETURNS double precision[]
+    AS 'quantile', 'quantile_sketch_get_array'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE quantile_sketch(double precision) (
+    SFUNC = quantile_sketch_append,
+    STYPE = internal,
+    FINALFUNC = quantile_sketch_final,
+    COMBINEFUNC = quantile_approx_combine,
+    SERIALFUNC = quantile_approx_serialize,
+    DESERIALFUNC = quantile_approx_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_sketch(double precision, int) (
+    SFUNC = quantile_sketch_append,
+    STYPE = internal,
+    FINALFUNC = quantile_sketch_final,
+    COMBINEFUNC = quantile_approx_combine,
+    SERIALFUNC = quantile_approx_serialize,
+    DESERIALFUNC = quantile_approx_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_merge(quantile_sketch) (
+    SFUNC = quantile_sketch_merge,
+    STYPE = internal,
+    FINALFUNC = quantile_sketch_final,
+    COMBINEFUNC = quantile_approx_combine,
+    SERIALFUNC = quantile_approx_serialize,
+    DESERIALFUNC = quantile_approx_deserialize,
+    PARALLEL = SAFE
+);
+
+-- runtime statistics of the aggregates (with quantile.track_stats enabled)
+CREATE OR REPLACE FUNCTION quantile_stats(OUT function regprocedure, OUT nvalues bigint,
+                                          OUT reallocations int, OUT peak_bytes bigint,
+                                          OUT runs int, OUT spilled bigint, OUT counted bigint,
+                                          OUT finals int, OUT final_ms double precision,
+                                          OUT path text)
+    RETURNS SETOF record
+    AS 'quantile', 'quantile_stats'
+    LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE OR REPLACE FUNCTION quantile_stats_reset()
+    RETURNS void
+    AS 'quantile', 'quantile_stats_reset'
+    LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+/* sampling aggregates (quantiles of a fixed-size random sample) */
+CREATE OR REPLACE FUNCTION quantile_sample_append_double(p_pointer internal, p_element double precision, p_quantile double precision, p_sample_size int)
+    RETURNS internal
+    AS 'quantile', 'quantile_sample_append_double'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sample_append_double_array(p_pointer internal, p_element double precision, p_quantiles double precision[], p_sample_size int)
+    RETURNS internal
+    AS 'quantile', 'quantile_sample_append_double_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sample_combine(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_sample_combine'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sample_serialize(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_sample_serialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_sample_deserialize(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_sample_deserialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE quantile_sample(double precision, double precision, int) (
+    SFUNC = quantile_sample_append_double,
+    STYPE = internal,
+    FINALFUNC = quantile_double,
+    COMBINEFUNC = quantile_sample_combine,
+    SERIALFUNC = quantile_sample_serialize,
+    DESERIALFUNC = quantile_sample_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_sample(double precision, double precision[], int) (
+    SFUNC = quantile_sample_append_double_array,
+    STYPE = internal,
+    FINALFUNC = quantile_double_array,
+    COMBINEFUNC = quantile_sample_combine,
+    SERIALFUNC = quantile_sample_serialize,
+    DESERIALFUNC = quantile_sample_deserialize,
+    PARALLEL = SAFE
+);
+
+/* HDR histograms (log-linear buckets with a fixed precision, for bigint values) */
+CREATE OR REPLACE FUNCTION quantile_hdr_append(p_pointer internal, p_element bigint, p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_hdr_append'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_hdr_append(p_pointer internal, p_element bigint, p_quantile double precision, p_significant_digits int)
+    RETURNS internal
+    AS 'quantile', 'quantile_hdr_append'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_hdr_append_array(p_pointer internal, p_element bigint, p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_hdr_append_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_hdr_append_array(p_pointer internal, p_element bigint, p_quantiles double precision[], p_significant_digits int)
+    RETURNS internal
+    AS 'quantile', 'quantile_hdr_append_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_hdr_int64(p_pointer internal)
+    RETURNS bigint
+    AS 'quantile', 'quantile_hdr_int64'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_hdr_int64_array(p_pointer internal)
+    RETURNS bigint[]
+    AS 'quantile', 'quantile_hdr_int64_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_hdr_combine(p_pointer internal, p_pointer2 internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_hdr_combine'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_hdr_serialize(p_pointer internal)
+    RETURNS bytea
+    AS 'quantile', 'quantile_hdr_serialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_hdr_deserialize(p_value bytea, p_dummy internal)
+    RETURNS internal
+    AS 'quantile', 'quantile_hdr_deserialize'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE AGGREGATE quantile_hdr(bigint, double precision) (
+    SFUNC = quantile_hdr_append,
+    STYPE = internal,
+    FINALFUNC = quantile_hdr_int64,
+    COMBINEFUNC = quantile_hdr_combine,
+    SERIALFUNC = quantile_hdr_serialize,
+    DESERIALFUNC = quantile_hdr_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_hdr(bigint, double precision, int) (
+    SFUNC = quantile_hdr_append,
+    STYPE = internal,
+    FINALFUNC = quantile_hdr_int64,
+    COMBINEFUNC = quantile_hdr_combine,
+    SERIALFUNC = quantile_hdr_serialize,
+    DESERIALFUNC = quantile_hdr_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_hdr(bigint, double precision[]) (
+    SFUNC = quantile_hdr_append_array,
+    STYPE = internal,
+    FINALFUNC = quantile_hdr_int64_array,
+    COMBINEFUNC = quantile_hdr_combine,
+    SERIALFUNC = quantile_hdr_serialize,
+    DESERIALFUNC = quantile_hdr_deserialize,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile_hdr(bigint, double precision[], int) (
+    SFUNC = quantile_hdr_append_array,
+    STYPE = internal,
+    FINALFUNC = quantile_hdr_int64_array,
+    COMBINEFUNC = quantile_hdr_combine,
+    SERIALFUNC = quantile_hdr_serialize,
+    DESERIALFUNC = quantile_hdr_deserialize,
+    PARALLEL = SAFE
+);
+
+/*
+ * aggregates on presorted input (with the number of values), meant to be
+ * called with ORDER BY, e.g. quantile_presorted(x, 0.99, n ORDER BY x)
+ */
+DO $$
+DECLARE
+    v_type record;
+BEGIN
+    FOR v_type IN SELECT * FROM (VALUES ('double precision', 'double'),
+                                        ('numeric', 'numeric'),
+                                        ('int', 'int32'),
+                                        ('bigint', 'int64'),
+                                        ('real', 'float4'),
+                                        ('smallint', 'int16'),
+                                        ('date', 'date'),
+                                        ('timestamp', 'timestamp'),
+                                        ('timestamptz', 'timestamptz')) AS t(name, suffix)
+    LOOP
+        EXECUTE format('CREATE OR REPLACE FUNCTION quantile_presorted_append(p_pointer internal, p_element %s, p_quantile double precision, p_count bigint)
+                            RETURNS internal
+                            AS ''quantile'', ''quantile_presorted_append''
+                            LANGUAGE C IMMUTABLE PARALLEL SAFE', v_type.name);
+
+        EXECUTE format('CREATE OR REPLACE FUNCTION quantile_presorted_append_array(p_pointer internal, p_element %s, p_quantiles double precision[], p_count bigint)
+                            RETURNS internal
+                            AS ''quantile'', ''quantile_presorted_append_array''
+                            LANGUAGE C IMMUTABLE PARALLEL SAFE', v_type.name);
+
+        EXECUTE format('CREATE OR REPLACE FUNCTION quantile_presorted_%s(p_pointer internal)
+                            RETURNS %s
+                            AS ''quantile'', ''quantile_presorted''
+                            LANGUAGE C IMMUTABLE PARALLEL SAFE', v_type.suffix, v_type.name);
+
+        EXECUTE format('CREATE OR REPLACE FUNCTION quantile_presorted_%s_array(p_pointer internal)
+                            RETURNS %s[]
+                            AS ''quantile'', ''quantile_presorted_array''
+                            LANGUAGE C IMMUTABLE PARALLEL SAFE', v_type.suffix, v_type.name);
+
+        EXECUTE format('CREATE AGGREGATE quantile_presorted(%s, double precision, bigint) (
+                            SFUNC = quantile_presorted_append,
+                            STYPE = internal,
+                            FINALFUNC = quantile_presorted_%s,
+                            PARALLEL = SAFE
+                        )', v_type.name, v_type.suffix);
+
+        EXECUTE format('CREATE AGGREGATE quantile_presorted(%s, double precision[], bigint) (
+                            SFUNC = quantile_presorted_append_array,
+                            STYPE = internal,
+                            FINALFUNC = quantile_presorted_%s_array,
+                            PARALLEL = SAFE
+                        )', v_type.name, v_type.suffix);
+    END LOOP;
+END;
+$$;
+
+/* aggregates over arrays of values (all the values of an array added at once) */
+CREATE OR REPLACE FUNCTION quantile_append_double_values(p_pointer internal, p_values double precision[], p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_double_values'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_double_values_array(p_pointer internal, p_values double precision[], p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_append_double_values_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_int64_values(p_pointer internal, p_values bigint[], p_quantile double precision)
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64_values'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_append_int64_values_array(p_pointer internal, p_values bigint[], p_quantiles double precision[])
+    RETURNS internal
+    AS 'quantile', 'quantile_append_int64_values_array'
+    LANGUAGE C IMMUTABLE PARALLEL SAFE;
+
+CREATE AGGREGATE quantile(double precision[], double precision) (
+    SFUNC = quantile_append_double_values,
+    STYPE = internal,
+    FINALFUNC = quantile_double,
+    COMBINEFUNC = quantile_combine_double,
+    SERIALFUNC = quantile_serialize_double,
+    DESERIALFUNC = quantile_deserialize_double,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile(double precision[], double precision[]) (
+    SFUNC = quantile_append_double_values_array,
+    STYPE = internal,
+    FINALFUNC = quantile_double_array,
+    COMBINEFUNC = quantile_combine_double,
+    SERIALFUNC = quantile_serialize_double,
+    DESERIALFUNC = quantile_deserialize_double,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile(bigint[], double precision) (
+    SFUNC = quantile_append_int64_values,
+    STYPE = internal,
+    FINALFUNC = quantile_int64,
+    COMBINEFUNC = quantile_combine_int64,
+    SERIALFUNC = quantile_serialize_int64,
+    DESERIALFUNC = quantile_deserialize_int64,
+    PARALLEL = SAFE
+);
+
+CREATE AGGREGATE quantile(bigint[], double precision[]) (
+    SFUNC = quantile_append_int64_values_array,
+    STYPE = internal,
+    FINALFUNC = quantile_int64_array,
+    COMBINEFUNC = quantile_combine_int64,
+    SERIALFUNC = quantile_serialize_int64,
+    DESERIALFUNC = quantile_deserialize_int64,
+    PARALLEL = SAFE
+);
+
+/* quantiles of the values in a single array (not an aggregate) */
+CREATE OR REPLACE FUNCTION quantile_of(p_values anyarray, p_quantile double precision)
+    RETURNS anyelement
+    AS 'quantile', 'quantile_of'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
+
+CREATE OR REPLACE FUNCTION quantile_of(p_values anyarray, p_quantiles double precision[])
+    RETURNS anyarray
+    AS 'quantile', 'quantile_of_array'
+    LANGUAGE C IMMUTABLE STRICT PARALLEL SAFE;
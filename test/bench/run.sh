@@ -0,0 +1,119 @@
+#!/bin/sh
+#
+# Benchmark of the quantile aggregates, compared to the built-in ordered-set
+# aggregates (percentile_disc, percentile_cont). Prints one CSV line per run
+#
+#   type,dist,rows,groups,quantiles,parallel,function,time_ms,memory_kb
+#
+# which may be summarized by summarize.sh. The memory is the increase of the
+# peak memory (VmHWM) of the backend during the query, so it includes
+# neither the parallel workers nor the memory used before the query started,
+# and is empty when the backend can't read its /proc status file (that needs
+# superuser, or the pg_read_server_files role).
+#
+# Each run uses a new connection. The extension has to be installed, and the
+# tables (bench_<dist>_<rows>) are created on the first run, and reused after
+# that. Options (with the defaults):
+#
+#   -d  database (from the environment, as for psql)
+#   -s  numbers of rows ("1000 100000 10000000", may go up to 100000000)
+#   -D  distributions ("uniform skewed sorted duplicates")
+#   -t  data types (all the supported ones)
+#   -r  repetitions of each run (3)
+#
+# For example
+#
+#   test/bench/run.sh -d bench -s "1000 1000000" -t "int8 float8" > results.csv
+#   test/bench/summarize.sh results.csv
+
+set -e
+
+SIZES="1000 100000 10000000"
+DISTS="uniform skewed sorted duplicates"
+TYPES="int2 int4 int8 float4 float8 numeric date timestamp timestamptz"
+REPEATS=3
+PSQL="psql -X -q -v ON_ERROR_STOP=1"
+
+while getopts "d:s:D:t:r:" opt; do
+	case $opt in
+		d) PSQL="$PSQL -d $OPTARG" ;;
+		s) SIZES="$OPTARG" ;;
+		D) DISTS="$OPTARG" ;;
+		t) TYPES="$OPTARG" ;;
+		r) REPEATS="$OPTARG" ;;
+		*) sed -n '2,/^$/s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+	esac
+done
+
+$PSQL -f "$(dirname "$0")/setup.sql"
+
+# expression of the aggregate (function, type, quantiles)
+aggregate() {
+	case $1 in
+		quantile)			echo "quantile(v_$2, $3)" ;;
+		quantile_disc)		echo "quantile_disc($3) WITHIN GROUP (ORDER BY v_$2)" ;;
+		percentile_disc)	echo "percentile_disc($3) WITHIN GROUP (ORDER BY v_$2)" ;;
+		percentile_cont)	echo "percentile_cont($3) WITHIN GROUP (ORDER BY v_$2::double precision)" ;;
+	esac
+}
+
+for dist in $DISTS; do
+	for rows in $SIZES; do
+
+		table=$($PSQL -A -t -c "SELECT bench_create('$dist', $rows)")
+
+		for type in $TYPES; do
+
+			# percentile_cont interpolates, which is not possible for dates
+			functions="quantile quantile_disc percentile_disc"
+			case $type in
+				date|timestamp*) ;;
+				*) functions="$functions percentile_cont" ;;
+			esac
+
+			for groups in one small; do
+				for quantiles in scalar array; do
+					for parallel in off on; do
+						for function in $functions; do
+
+							case $quantiles in
+								scalar) q="0.5" ;;
+								array) q="ARRAY[0.01, 0.1, 0.5, 0.9, 0.99]" ;;
+							esac
+
+							query="SELECT $(aggregate $function $type "$q") FROM $table"
+							if [ "$groups" = "small" ]; then
+								query="$query GROUP BY g"
+							fi
+
+							if [ "$parallel" = "on" ]; then
+								settings="SET max_parallel_workers_per_gather = 4;
+										  SET parallel_setup_cost = 0;
+										  SET parallel_tuple_cost = 0;
+										  SET min_parallel_table_scan_size = 0;"
+							else
+								settings="SET max_parallel_workers_per_gather = 0;"
+							fi
+
+							i=0
+							while [ $i -lt $REPEATS ]; do
+								$PSQL <<EOF
+$settings
+\o /dev/null
+SELECT count(v_$type) FROM $table;
+SELECT coalesce(bench_peak_memory()::text, '') AS mem, clock_timestamp() AS start \gset
+$query;
+SELECT round(extract(epoch FROM clock_timestamp() - :'start') * 1000, 3) AS time,
+       coalesce((bench_peak_memory() - nullif(:'mem', '')::bigint)::text, '') AS mem \gset
+\o
+\echo $type,$dist,$rows,$groups,$quantiles,$parallel,$function,:time,:mem
+EOF
+								i=$((i + 1))
+							done
+						done
+					done
+				done
+			done
+		done
+	done
+done
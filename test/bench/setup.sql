@@ -0,0 +1,60 @@
+-- helper functions for the benchmark (see run.sh)
+
+-- generates a table with n rows of the distribution, with a column for each
+-- supported data type (all derived from the same value in [0, 1e6)), and a
+-- group column with 100 rows per group
+CREATE OR REPLACE FUNCTION bench_create(p_dist text, p_rows bigint) RETURNS text AS $$
+DECLARE
+    v_table text := format('bench_%s_%s', p_dist, p_rows);
+    v_value text;
+BEGIN
+
+    IF to_regclass(v_table) IS NOT NULL THEN
+        RETURN v_table;
+    END IF;
+
+    v_value := CASE p_dist
+        -- uniform in [0, 1e6)
+        WHEN 'uniform' THEN 'random() * 1e6'
+        -- most values close to 0, with a long tail (e.g. latencies)
+        WHEN 'skewed' THEN 'least(-ln(1 - random()) * 1e4, 999999)'
+        -- ascending values (e.g. from an index scan)
+        WHEN 'sorted' THEN format('i * 1e6 / %s', p_rows)
+        -- only 100 distinct values
+        WHEN 'duplicates' THEN 'floor(random() * 100) * 1e4'
+    END;
+
+    IF v_value IS NULL THEN
+        RAISE EXCEPTION 'unknown distribution "%"', p_dist;
+    END IF;
+
+    EXECUTE format('CREATE TABLE %I AS
+        SELECT i / 100 AS g,
+               floor(x / 31)::smallint AS v_int2,
+               floor(x * 1000)::int AS v_int4,
+               floor(x * 1e6)::bigint AS v_int8,
+               x::real AS v_float4,
+               x AS v_float8,
+               round(x::numeric, 3) AS v_numeric,
+               date ''2000-01-01'' + floor(x / 100)::int AS v_date,
+               timestamp ''2000-01-01'' + x * interval ''1 second'' AS v_timestamp,
+               timestamptz ''2000-01-01 00:00:00+00'' + x * interval ''1 second'' AS v_timestamptz
+          FROM (SELECT i, (%s)::double precision AS x
+                  FROM generate_series(1, %s) s(i)) foo', v_table, v_value, p_rows);
+
+    EXECUTE format('VACUUM ANALYZE %I', v_table);
+
+    RETURN v_table;
+END;
+$$ LANGUAGE plpgsql;
+
+-- peak memory (VmHWM, in kB) of the backend, or NULL when it's not possible
+-- to read it (requires access to server files, and Linux)
+CREATE OR REPLACE FUNCTION bench_peak_memory() RETURNS bigint AS $$
+BEGIN
+    RETURN substring(pg_read_file('/proc/' || pg_backend_pid() || '/status')
+                     FROM 'VmHWM:\s+(\d+)')::bigint;
+EXCEPTION
+    WHEN others THEN RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
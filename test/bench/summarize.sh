@@ -0,0 +1,71 @@
+#!/bin/sh
+#
+# Summarizes the results of run.sh - for each combination of the parameters
+# prints the median time (ms) and the largest memory increase (kB) of the
+# functions, and the speedup of quantile compared to percentile_disc.
+#
+#   test/bench/summarize.sh results.csv
+
+sort -t, -k1,2 -k3,3n -k4,7 -k8,8n "$@" | awk -F, '
+function flush() {
+	if (nruns == 0)
+		return;
+	times[key, fn] = runs[int((nruns + 1) / 2)];
+	mems[key, fn] = maxmem;
+	nruns = 0;
+	maxmem = "";
+}
+
+BEGIN {
+	nfns = split("quantile quantile_disc percentile_disc percentile_cont", fns, " ");
+
+	printf("%-11s %-10s %10s %6s %6s %3s", "type", "dist", "rows", "groups", "quant", "par");
+	for (i = 1; i <= nfns; i++)
+		printf(" %22s", fns[i]);
+	printf(" %8s\n", "speedup");
+}
+
+NF == 9 {
+	k = $1 FS $2 FS $3 FS $4 FS $5 FS $6;
+
+	if ((k != key) || ($7 != fn))
+	{
+		flush();
+
+		if (k != key)
+			keys[nkeys++] = k;
+
+		key = k;
+		fn = $7;
+	}
+
+	runs[++nruns] = $8;
+
+	if (($9 != "") && ((maxmem == "") || ($9 + 0 > maxmem + 0)))
+		maxmem = $9;
+}
+
+END {
+	flush();
+
+	for (i = 0; i < nkeys; i++)
+	{
+		split(keys[i], p, FS);
+		printf("%-11s %-10s %10s %6s %6s %3s", p[1], p[2], p[3], p[4], p[5], p[6]);
+
+		for (j = 1; j <= nfns; j++)
+		{
+			if ((keys[i], fns[j]) in times)
+				printf(" %12.1f %7s kB", times[keys[i], fns[j]],
+					   (mems[keys[i], fns[j]] == "") ? "?" : mems[keys[i], fns[j]]);
+			else
+				printf(" %22s", "-");
+		}
+
+		if (((keys[i], "quantile") in times) && ((keys[i], "percentile_disc") in times) &&
+			(times[keys[i], "quantile"] > 0))
+			printf(" %7.2fx", times[keys[i], "percentile_disc"] / times[keys[i], "quantile"]);
+
+		printf("\n");
+	}
+}'
@@ -2,7 +2,7 @@
 
 -- disable the notices for the create script (shell types etc.)
 SET client_min_messages = 'WARNING';
-\i sql/quantile--1.1.7.sql
+\i sql/quantile--1.2.0.sql
 SET client_min_messages = 'NOTICE';
 
 \set ECHO all
@@ -67,6 +67,38 @@ SELECT quantile(x::numeric, ARRAY[1]) FROM generate_series(1,1000) s(x);
 
 SELECT quantile(x::numeric, ARRAY[0, 0.1, 0.5, 0.75, 1]) FROM generate_series(1,1000) s(x);
 
+-- selection on shuffled input
+SELECT quantile(x, 0.5) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile(x::bigint, 0.9) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile(x::double precision, 0.1) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile(x::numeric, 0.75) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+
+-- NaN values sort after all other values
+SELECT quantile(x, 0.5) FROM (VALUES (1::double precision), ('NaN'), (3)) v(x);
+SELECT quantile(x, 1) FROM (VALUES (1::double precision), ('NaN'), (3)) v(x);
+
+-- multi-select on shuffled input
+SELECT quantile(x, ARRAY[0.5, 0.9, 0.99, 0.999]) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile(x::bigint, ARRAY[0.999, 0.5, 0.5, 0]) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile(x::double precision, ARRAY[0.25, 0.5, 0.75]) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile(x::numeric, ARRAY[1, 0.1, 0.01]) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile(x, ARRAY[0, 0.5, 1]) FROM (VALUES (1::double precision), ('NaN'), (3)) v(x);
+
+-- all percentiles
+SELECT quantile(x, (SELECT array_agg((p / 100.0)::double precision ORDER BY p) FROM generate_series(1,100) p)) = (SELECT array_agg(ceil(1000 * (p / 100.0)::double precision)::int ORDER BY p) FROM generate_series(1,100) p) FROM (SELECT x FROM generate_series(1,1000) s(x) ORDER BY md5(x::text)) foo;
+
+-- sorting larger inputs with negative values
+SELECT quantile(x - 5000, ARRAY[0, 0.1, 0.25, 0.5, 0.75, 0.9, 1]) FROM (SELECT x FROM generate_series(1,10000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile((x - 5000)::bigint * 1000000000, ARRAY[0, 0.1, 0.25, 0.5, 0.75, 0.9, 1]) FROM (SELECT x FROM generate_series(1,10000) s(x) ORDER BY md5(x::text)) foo;
+SELECT quantile((x - 5000) / 4.0::double precision, ARRAY[0, 0.1, 0.25, 0.5, 0.75, 0.9, 1]) FROM (SELECT x FROM generate_series(1,10000) s(x) ORDER BY md5(x::text)) foo;
+
+-- numeric values of very different lengths
+SELECT length(quantile(x, 0.5)::text), length(quantile(x, 1)::text), length(array_to_string(quantile(x, ARRAY[0, 0.1]), ',')) FROM (SELECT repeat('9', i)::numeric AS x FROM generate_series(1, 3000) s(i) ORDER BY md5(i::text)) foo;
+
+-- numeric values with NaN, and with many duplicates
+SELECT quantile(x, ARRAY[0, 0.25, 0.5, 0.75, 1]) FROM (SELECT (CASE WHEN mod(i, 1000) = 0 THEN 'NaN' ELSE (i - 10000) * 1000000000000.0 END)::numeric AS x FROM generate_series(1, 20000) s(i) ORDER BY md5(i::text)) foo;
+SELECT quantile(mod(i, 3)::numeric, ARRAY[0.1, 0.5, 0.9]), quantile(mod(i, 3)::numeric, 0.5) FROM generate_series(1, 30000) s(i);
+
 -- test of correct NULL handling (skipping with all NULLS)
 CREATE TABLE parent_table (id int);
 CREATE TABLE child_table  (id int, val int);
@@ -98,3 +130,266 @@ SELECT quantile(val, array[0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9]) FROM (S
 SELECT quantile(val::bigint, array[0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9]) FROM (SELECT val FROM child_table ORDER BY id) AS foo;
 SELECT quantile(val::double precision, array[0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9]) FROM (SELECT val FROM child_table ORDER BY id) AS foo;
 SELECT quantile(val::numeric, array[0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9]) FROM (SELECT val FROM child_table ORDER BY id) AS foo;
+
+-- parallel aggregation (the results have to be the same with or without it)
+CREATE TABLE parallel_table (i int, g int);
+INSERT INTO parallel_table SELECT i, mod(i, 10) FROM generate_series(1,100000) s(i);
+ANALYZE parallel_table;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+
+SELECT quantile(i, 0.5), quantile(i::bigint, ARRAY[0.1, 0.9]), quantile(i::double precision, 0.99), quantile(i::numeric, ARRAY[0.25, 0.75]) FROM parallel_table;
+SELECT g, quantile(i, 0.5) FROM parallel_table GROUP BY g ORDER BY g;
+SELECT g, quantile(i::numeric, ARRAY[0.5]) FROM parallel_table GROUP BY g ORDER BY g;
+
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+
+-- spilling to temporary files (the results have to be the same)
+SET quantile.work_mem = 64;
+
+SELECT quantile(i, ARRAY[0, 0.25, 0.5, 0.75, 1]), quantile(i::bigint, 0.9), quantile(i::double precision, ARRAY[0.01, 0.99]), quantile(i::numeric, 0.5) FROM parallel_table;
+SELECT quantile(x, ARRAY[0.5, 1]) FROM (SELECT (CASE WHEN mod(i, 10) = 0 THEN 'NaN'::double precision ELSE i END) AS x FROM parallel_table) foo;
+SELECT g, quantile(i::bigint, ARRAY[0.5, 0.99]) FROM parallel_table GROUP BY g ORDER BY g;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+
+SELECT quantile(i::bigint, ARRAY[0.1, 0.5, 0.9]), quantile(i::double precision, 0.5) FROM parallel_table;
+
+-- few distinct values (the partial states are counted, not spilled)
+SELECT quantile(g, ARRAY[0, 0.5, 1]), quantile(g::bigint, 0.25), quantile(g / 4.0::double precision, 0.9) FROM parallel_table;
+
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+
+-- many small runs, merged in multiple passes
+SET quantile.work_mem = 1;
+
+SELECT quantile(i, ARRAY[0.1, 0.5, 0.9]) FROM parallel_table;
+
+RESET quantile.work_mem;
+
+-- approximate quantiles (small inputs are not compressed, so exact)
+SELECT quantile_approx(i, 0.5), quantile_approx(i::bigint, ARRAY[0, 0.25, 0.5, 0.75, 1]), quantile_approx(i::numeric, 0.9), quantile_approx(i::double precision, 0.1, 50) FROM generate_series(1,100) s(i);
+SELECT quantile_approx(x, ARRAY[0.5, 0.95]) FROM (SELECT (CASE WHEN mod(i, 10) = 0 THEN 'NaN'::double precision ELSE i END) AS x FROM generate_series(1,100) s(i)) foo;
+SELECT quantile_approx(i, 0.5) FROM generate_series(1,100) s(i) WHERE i > 100;
+SELECT quantile_approx(i, 0.5, 5) FROM generate_series(1,100) s(i);
+
+-- approximate quantiles (large inputs, the minimum and maximum are exact)
+SELECT quantile_approx(i, ARRAY[0, 1]), abs(quantile_approx(i, 0.5) - 50000) < 1000, abs(quantile_approx(i::numeric, 0.01) - 1000) < 100, abs(quantile_approx(i::bigint, 0.99, 10) - 99000) < 500 FROM parallel_table;
+SELECT g, abs(ln(quantile_approx(exp(i / 10000.0), 0.5)) - 5) < 0.1 FROM parallel_table GROUP BY g ORDER BY g;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+
+SELECT quantile_approx(i, ARRAY[0, 1]), abs(quantile_approx(i, 0.5) - 50000) < 1000, abs(quantile_approx(i, 0.99, 1000) - 99000) < 100 FROM parallel_table;
+
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+
+-- persistent sketches (small sketches are exact, and keep all the values)
+SELECT quantile_sketch(i) FROM generate_series(1,5) s(i);
+SELECT quantile_sketch_get(quantile_sketch(i, 50), 0.5), quantile_sketch_get(quantile_sketch(i::numeric), ARRAY[0, 0.9, 1]) FROM generate_series(1,100) s(i);
+SELECT quantile_sketch_get('compression 100 count 3 nans 1 min 1 max 3 centroids 2 (1,1) (3,2)'::quantile_sketch, ARRAY[0, 0.5, 1]);
+SELECT quantile_sketch_get(s::quantile_sketch, 0.5) FROM (VALUES ('compression 100 count 2 nans 0 min 1 max 3 centroids 1 (2,1)')) v(s);
+
+-- rollups from stored sketches
+CREATE TABLE sketch_table AS SELECT g, quantile_sketch(i) AS s FROM parallel_table GROUP BY g;
+
+SELECT quantile_sketch_get(quantile_merge(s), ARRAY[0, 1]), abs(quantile_sketch_get(quantile_merge(s), 0.5) - 50000) < 1000, abs(quantile_sketch_get(quantile_merge(s), 0.99) - 99000) < 200 FROM sketch_table;
+SELECT bool_and(quantile_sketch_get(s::text::quantile_sketch, 0.5) = quantile_sketch_get(s, 0.5)) FROM sketch_table;
+SELECT quantile_sketch_get(quantile_merge(s), 0.5) FROM sketch_table WHERE g < 0;
+
+SET parallel_setup_cost = 0;
+SET parallel_tuple_cost = 0;
+SET min_parallel_table_scan_size = 0;
+SET max_parallel_workers_per_gather = 2;
+
+SELECT quantile_sketch_get(quantile_sketch(i), ARRAY[0, 1]), abs(quantile_sketch_get(quantile_sketch(i), 0.5) - 50000) < 1000 FROM parallel_table;
+
+RESET parallel_setup_cost;
+RESET parallel_tuple_cost;
+RESET min_parallel_table_scan_size;
+RESET max_parallel_workers_per_gather;
+
+-- moving aggregates (sliding window frames, with NULLs and duplicates)
+SELECT i, x, quantile(x, 0.5) OVER w, quantile(x::bigint, ARRAY[0, 1]) OVER w, quantile(x::numeric, 0.75) OVER w, quantile(x::double precision, ARRAY[0.25]) OVER w FROM (SELECT i, (CASE WHEN mod(i, 4) = 0 THEN NULL ELSE mod(i * 7, 5) END) AS x FROM generate_series(1,10) s(i)) foo WINDOW w AS (ORDER BY i ROWS BETWEEN 2 PRECEDING AND CURRENT ROW) ORDER BY i;
+SELECT i, quantile(x, 0.5) OVER (ORDER BY i ROWS BETWEEN 1 PRECEDING AND 1 FOLLOWING) FROM (SELECT i, (CASE WHEN i > 2 THEN NULL ELSE i END) AS x FROM generate_series(1,5) s(i)) foo ORDER BY i;
+
+-- moving aggregates (the results have to match the plain aggregates)
+CREATE TABLE moving_table AS SELECT i, mod(i * 7919, 1000) AS x FROM generate_series(1,2000) s(i);
+
+SELECT count(*) FROM (SELECT i, quantile(x, 0.9) OVER (ORDER BY i ROWS BETWEEN 99 PRECEDING AND CURRENT ROW) AS q FROM moving_table) a WHERE q IS DISTINCT FROM (SELECT quantile(x, 0.9) FROM moving_table b WHERE b.i BETWEEN a.i - 99 AND a.i);
+SELECT count(*) FROM (SELECT i, quantile(x::double precision, ARRAY[0.1, 0.5]) OVER (ORDER BY i ROWS BETWEEN 10 PRECEDING AND 10 FOLLOWING) AS q FROM moving_table) a WHERE q IS DISTINCT FROM (SELECT quantile(x::double precision, ARRAY[0.1, 0.5]) FROM moving_table b WHERE b.i BETWEEN a.i - 10 AND a.i + 10);
+SELECT count(*) FROM (SELECT i, quantile(mod(x, 10)::numeric, 0.5) OVER (ORDER BY i ROWS BETWEEN 30 PRECEDING AND CURRENT ROW) AS q FROM moving_table) a WHERE q IS DISTINCT FROM (SELECT quantile(mod(x, 10)::numeric, 0.5) FROM moving_table b WHERE b.i BETWEEN a.i - 30 AND a.i);
+
+-- ordered-set aggregates (the calls on the same column share the state)
+SELECT quantile_disc(0.5) WITHIN GROUP (ORDER BY i), quantile_disc(0.9) WITHIN GROUP (ORDER BY i), quantile_disc(ARRAY[0, 0.25, 1]) WITHIN GROUP (ORDER BY i) FROM generate_series(1,1000) s(i);
+SELECT quantile_disc(0.1) WITHIN GROUP (ORDER BY i::bigint), quantile_disc(0.5) WITHIN GROUP (ORDER BY i::numeric), quantile_disc(ARRAY[0.1, 0.9]) WITHIN GROUP (ORDER BY i::numeric), quantile_disc(0.75) WITHIN GROUP (ORDER BY i::double precision) FROM generate_series(1,100) s(i);
+SELECT quantile_disc(ARRAY[0.5, 1]) WITHIN GROUP (ORDER BY x), quantile_disc(0.1) WITHIN GROUP (ORDER BY x) FROM (SELECT (CASE WHEN mod(i, 10) = 0 THEN 'NaN'::double precision ELSE i END) AS x FROM generate_series(1,100) s(i)) foo;
+SELECT quantile_disc(NULL::double precision) WITHIN GROUP (ORDER BY i), quantile_disc(0.5) WITHIN GROUP (ORDER BY i) FILTER (WHERE i > 100) FROM generate_series(1,100) s(i);
+SELECT quantile_disc(1.5) WITHIN GROUP (ORDER BY i) FROM generate_series(1,100) s(i);
+
+-- ordered-set aggregates with spilling
+SET quantile.work_mem = 64;
+
+SELECT g, quantile_disc(0.5) WITHIN GROUP (ORDER BY i::bigint), quantile_disc(ARRAY[0.5, 0.99]) WITHIN GROUP (ORDER BY i::bigint) FROM parallel_table GROUP BY g ORDER BY g;
+
+RESET quantile.work_mem;
+
+-- growing window frames (the final function only sorts the new values)
+SELECT count(*) FROM (SELECT i, quantile(x, 0.9) OVER (ORDER BY i ROWS BETWEEN UNBOUNDED PRECEDING AND CURRENT ROW) AS q FROM moving_table) a WHERE q IS DISTINCT FROM (SELECT quantile(x, 0.9) FROM moving_table b WHERE b.i <= a.i);
+SELECT count(*) FROM (SELECT i, quantile(x::double precision, ARRAY[0.1, 0.5, 1]) OVER (ORDER BY i ROWS BETWEEN UNBOUNDED PRECEDING AND CURRENT ROW) AS q FROM moving_table) a WHERE q IS DISTINCT FROM (SELECT quantile(x::double precision, ARRAY[0.1, 0.5, 1]) FROM moving_table b WHERE b.i <= a.i);
+SELECT count(*) FROM (SELECT i, quantile(x::numeric, 0.25) OVER (ORDER BY i ROWS BETWEEN UNBOUNDED PRECEDING AND CURRENT ROW) AS q FROM moving_table) a WHERE q IS DISTINCT FROM (SELECT quantile(x::numeric, 0.25) FROM moving_table b WHERE b.i <= a.i);
+
+-- values added in sorted (or nearly sorted) order
+SELECT quantile(i, ARRAY[0.1, 0.5, 1]), quantile(i::bigint, 0.25), quantile(i::double precision, 0.75) FROM generate_series(1,10000) s(i);
+SELECT quantile(i, ARRAY[0.1, 0.5, 1]), quantile(i::bigint, 0.25), quantile(i::double precision, 0.75) FROM generate_series(10000,1,-1) s(i);
+SELECT quantile(x, ARRAY[0.01, 0.5, 0.99]) = percentile_disc(ARRAY[0.01, 0.5, 0.99]) WITHIN GROUP (ORDER BY x), quantile(x::bigint, 0.3) = percentile_disc(0.3) WITHIN GROUP (ORDER BY x) FROM (SELECT (CASE WHEN mod(i, 100) = 0 THEN 10001 - i ELSE i END) AS x FROM generate_series(1,10000) s(i)) foo;
+SELECT quantile(x, ARRAY[0.5, 0.998, 1]) FROM (SELECT (CASE WHEN i > 9990 OR mod(i, 1000) = 0 THEN 'NaN'::double precision ELSE i END) AS x FROM generate_series(1,10000) s(i)) foo;
+
+-- sorted runs are not sorted again before spilling
+SET quantile.work_mem = 64;
+
+SELECT quantile(i::bigint, ARRAY[0.1, 0.5, 1]), quantile(i, 0.5) FROM generate_series(1,100000) s(i);
+
+RESET quantile.work_mem;
+
+-- real, smallint, date and timestamp values (kept in their native types)
+SET DateStyle = 'ISO, YMD';
+SET TimeZone = 'UTC';
+
+SELECT quantile(x::real / 4, ARRAY[0.1, 0.5, 1]), quantile(x::smallint, 0.25), quantile(x::smallint, ARRAY[0.5, 1]) FROM (SELECT mod(i * 7919, 1000) - 500 AS x FROM generate_series(1,1000) s(i)) foo;
+SELECT pg_typeof(quantile(1::real, 0.5)), pg_typeof(quantile(1::smallint, ARRAY[0.5])), pg_typeof(quantile(DATE '2020-01-01', 0.5)), pg_typeof(quantile(TIMESTAMP '2020-01-01', ARRAY[0.5]));
+SELECT quantile(d, 0.5), quantile(d, ARRAY[0, 1]), quantile(d::timestamp, 0.25), quantile(d::timestamptz, ARRAY[0.5]) FROM (SELECT DATE '2020-01-01' + mod(i * 7919, 1000) AS d FROM generate_series(1,1000) s(i)) foo;
+SELECT quantile_disc(0.5) WITHIN GROUP (ORDER BY d), quantile_disc(ARRAY[0.1, 0.9]) WITHIN GROUP (ORDER BY x::real), quantile_disc(0.75) WITHIN GROUP (ORDER BY x::smallint) FROM (SELECT mod(i * 7919, 1000) - 500 AS x, DATE '2020-01-01' + mod(i * 7919, 1000) AS d FROM generate_series(1,1000) s(i)) foo;
+SELECT count(*) FROM (SELECT i, quantile(DATE '2020-01-01' + x, 0.9) OVER (ORDER BY i ROWS BETWEEN 99 PRECEDING AND CURRENT ROW) AS q FROM moving_table) a WHERE q IS DISTINCT FROM (SELECT quantile(DATE '2020-01-01' + x, 0.9) FROM moving_table b WHERE b.i BETWEEN a.i - 99 AND a.i);
+SELECT count(*) FROM (SELECT i, quantile(x::real, ARRAY[0.1, 0.5]) OVER (ORDER BY i ROWS BETWEEN 10 PRECEDING AND 10 FOLLOWING) AS q FROM moving_table) a WHERE q IS DISTINCT FROM (SELECT quantile(x::real, ARRAY[0.1, 0.5]) FROM moving_table b WHERE b.i BETWEEN a.i - 10 AND a.i + 10);
+
+RESET DateStyle;
+RESET TimeZone;
+
+-- inputs with only a few distinct values (counted, instead of spilling them)
+SET quantile.work_mem = 256;
+
+SELECT quantile(mod(i, 10), ARRAY[0, 0.25, 0.5, 1]), quantile(mod(i, 10)::bigint, 0.95), quantile(mod(i, 7) / 4.0::double precision, 0.5) FROM generate_series(1,100000) s(i);
+SELECT quantile(x, ARRAY[0.01, 0.5, 0.99]) = percentile_disc(ARRAY[0.01, 0.5, 0.99]) WITHIN GROUP (ORDER BY x), quantile(x::real, 0.3) = percentile_disc(0.3) WITHIN GROUP (ORDER BY x::real) FROM (SELECT (CASE WHEN i > 80000 THEN i ELSE mod(i * 7919, 1000) END) AS x FROM generate_series(1,100000) s(i)) foo;
+SELECT quantile_disc(0.5) WITHIN GROUP (ORDER BY x), quantile_disc(ARRAY[0.1, 0.9]) WITHIN GROUP (ORDER BY x) FROM (SELECT mod(i, 100)::smallint AS x FROM generate_series(1,200000) s(i)) foo;
+
+RESET quantile.work_mem;
+
+-- integer values in a narrow range (dense counts), and with the range widened later
+SET quantile.work_mem = 256;
+
+SELECT quantile(x, ARRAY[0.01, 0.5, 0.99]) = percentile_disc(ARRAY[0.01, 0.5, 0.99]) WITHIN GROUP (ORDER BY x), quantile(x::smallint, 0.3) = percentile_disc(0.3) WITHIN GROUP (ORDER BY x::smallint) FROM (SELECT 1000 + mod(i * 7919, 5000) AS x FROM generate_series(1,100000) s(i)) foo;
+SELECT quantile(x, ARRAY[0.25, 0.75]), quantile(x::bigint, 0.9) FROM (SELECT (CASE WHEN i > 50000 THEN mod(i, 50) * 1000003 ELSE mod(i, 50) END) AS x FROM generate_series(1,100000) s(i)) foo;
+
+RESET quantile.work_mem;
+
+-- runtime statistics of the states
+SET quantile.track_stats = on;
+SELECT quantile_stats_reset();
+
+SELECT quantile(mod(i * 7919, 100000), 0.5) FROM generate_series(1,100000) s(i);
+SELECT quantile_disc(0.5) WITHIN GROUP (ORDER BY x), quantile_disc(0.9) WITHIN GROUP (ORDER BY x) FROM (SELECT mod(i * 7919, 1000) AS x FROM generate_series(1,1000) s(i)) foo;
+SELECT function::regproc, nvalues, peak_bytes > 0 AS memory, runs, spilled, counted, finals, final_ms >= 0 AS timed, path FROM quantile_stats();
+
+SELECT quantile_stats_reset();
+SELECT count(*) FROM quantile_stats();
+
+RESET quantile.track_stats;
+
+-- extreme quantiles (only the tail of the values is kept in memory once the
+-- values reach the memory limit, and nothing is spilled below it)
+SET quantile.track_stats = on;
+SET quantile.work_mem = 256;
+SELECT quantile_stats_reset();
+
+SELECT quantile(x, 0.999) = percentile_disc(0.999) WITHIN GROUP (ORDER BY x), quantile(x::double precision, ARRAY[0.99, 1]) = percentile_disc(ARRAY[0.99, 1]) WITHIN GROUP (ORDER BY x::double precision), quantile(x::bigint, ARRAY[0, 0.001]) = percentile_disc(ARRAY[0, 0.001]) WITHIN GROUP (ORDER BY x::bigint) FROM (SELECT mod(i * 7919, 1000003) AS x FROM generate_series(1,300000) s(i)) foo;
+SELECT function::regproc, nvalues, runs, spilled, peak_bytes < 1048576 AS memory, path FROM quantile_stats() ORDER BY function::regproc::text;
+
+RESET quantile.work_mem;
+SELECT quantile_stats_reset();
+
+SELECT quantile(x, 0.999) = percentile_disc(0.999) WITHIN GROUP (ORDER BY x), quantile(x::double precision, ARRAY[0.99, 1]) = percentile_disc(ARRAY[0.99, 1]) WITHIN GROUP (ORDER BY x::double precision), quantile(x::bigint, ARRAY[0, 0.001]) = percentile_disc(ARRAY[0, 0.001]) WITHIN GROUP (ORDER BY x::bigint) FROM (SELECT mod(i * 7919, 1000003) AS x FROM generate_series(1,300000) s(i)) foo;
+SELECT function::regproc, nvalues, runs, spilled FROM quantile_stats() ORDER BY function::regproc::text;
+
+RESET quantile.track_stats;
+
+-- states over the memory limit (fail, or switch to approximate quantiles)
+SET quantile.work_mem = 64;
+SET quantile.on_overflow = 'error';
+
+SELECT quantile(i::double precision, 0.5) FROM generate_series(1,100000) s(i);
+
+-- numeric values (fixed-point, and with different scales), and window aggregates
+SELECT quantile(i::numeric, 0.5) FROM generate_series(1,100000) s(i);
+SELECT quantile(round(i / 7.0, mod(i, 5)), 0.5) FROM generate_series(1,100000) s(i);
+SELECT count(*) FROM (SELECT quantile(i, 0.5) OVER () FROM generate_series(1,100000) s(i)) foo;
+SELECT count(*) FROM (SELECT quantile(i, 0.5) OVER (ORDER BY i ROWS BETWEEN 10000 PRECEDING AND CURRENT ROW) FROM generate_series(1,100000) s(i)) foo;
+
+SET quantile.on_overflow = 'approximate';
+
+SELECT abs(quantile(x, 0.5) - 49999) < 1000 AS median, quantile(x, ARRAY[0, 1]) AS minmax, abs(quantile(x::bigint, 0.9) - 89999) < 1000 AS p90 FROM (SELECT mod(i * 7919, 100000)::double precision AS x FROM generate_series(1,100000) s(i)) foo;
+SELECT quantile(i, ARRAY[0.5, 1]) FROM generate_series(1,1000) s(i);
+SELECT DISTINCT abs(q - 50000) < 1000 AS median FROM (SELECT quantile(i::double precision, 0.5) OVER () AS q FROM generate_series(1,100000) s(i)) foo;
+SELECT quantile(i::numeric, 0.5) FROM generate_series(1,100000) s(i);
+
+RESET quantile.on_overflow;
+RESET quantile.work_mem;
+
+-- quantiles of a fixed-size random sample (exact while the input fits)
+SELECT quantile_sample(i, 0.5, 1000) FROM generate_series(1,500) s(i);
+SELECT quantile_sample(i, ARRAY[0.1, 0.9], 1000) FROM generate_series(1,500) s(i);
+SELECT abs(quantile_sample(x, 0.5, 1000) - 49999) < 5000 AS median, quantile_sample(x, 0.5, 1) BETWEEN 0 AND 99999 AS single FROM (SELECT mod(i * 7919, 100000)::double precision AS x FROM generate_series(1,100000) s(i)) foo;
+SELECT quantile_sample(i, 0.5, 0) FROM generate_series(1,10) s(i);
+
+-- HDR histograms (bigint values with a fixed number of significant digits)
+SELECT quantile_hdr(i, 0.5), quantile_hdr(i, ARRAY[0, 0.9, 0.99, 1]) FROM generate_series(1,100) s(i);
+SELECT quantile_hdr(i * 1000, ARRAY[0.5, 0.99], 2) AS digits2, quantile_hdr(i * 1000, ARRAY[0.5, 0.99], 3) AS digits3, quantile(i * 1000, ARRAY[0.5, 0.99]) AS exact FROM generate_series(1,10000) s(i);
+SELECT quantile_hdr(i - 5, 0.5) FROM generate_series(1,10) s(i);
+SELECT quantile_hdr(i, 0.5, 6) FROM generate_series(1,10) s(i);
+
+-- aggregates over arrays of values, and quantiles of a single array
+SELECT quantile(v, 0.5), quantile(v, ARRAY[0, 0.9, 1]) FROM (SELECT array_agg(i::double precision) AS v FROM generate_series(1,100) s(i) GROUP BY mod(i, 4)) foo;
+SELECT quantile(ARRAY[i, i + 1000]::bigint[], 0.5), quantile(ARRAY[i, i + 1000]::bigint[], ARRAY[0.25, 0.75]) FROM generate_series(1,1000) s(i);
+SELECT quantile(v, 1) FROM (VALUES (ARRAY[1, NULL, 3]::double precision[]), (NULL), ('{}')) foo(v);
+SELECT quantile(v, 0.5), quantile(v, ARRAY[0, 1]), quantile(v::bigint[], 0), quantile(v::bigint[], ARRAY[0.5]) FROM (VALUES ('{}'::double precision[]), (ARRAY[NULL, NULL]::double precision[])) foo(v);
+SELECT quantile_of(ARRAY[5, 3, 1, 4, 2], 0.5), quantile_of(ARRAY[5, 3, 1, 4, 2], ARRAY[0, 0.25, 1]), quantile_of(ARRAY[1.5, 'NaN', 0.5]::real[], ARRAY[0.5, 1]);
+SELECT quantile_of(ARRAY[NULL, 2, NULL]::int[], 0.5), quantile_of('{}'::int[], 0.5) IS NULL AS empty;
+SELECT quantile_of(ARRAY['a', 'b'], 0.5);
+
+-- numeric values with the same scale (fixed-point), and with different ones
+SELECT quantile(x, 0.5), quantile(x, ARRAY[0, 0.25, 1]) FROM (SELECT (i / 100.0)::numeric(18,4) AS x FROM generate_series(-500,1000) s(i)) foo;
+SELECT quantile(x, ARRAY[0, 0.5, 1]) FROM (VALUES (1.5), (2.25), (3), (-0.125)) foo(x);
+SELECT quantile(x, ARRAY[0, 0.5, 1]) FROM (VALUES (1.0), (2.0), (12345678901234567890.5), (-3.0)) foo(x);
+SELECT quantile(x, ARRAY[0.5, 1]) FROM (VALUES (1.0), (2.0), ('NaN'::numeric), (-3.0)) foo(x);
+
+-- presorted input (ORDER BY, with the number of values known upfront)
+SELECT quantile_presorted(i, 0.5, 100 ORDER BY i), quantile_presorted(i, ARRAY[0, 0.9, 0.99, 1], 100 ORDER BY i) FROM generate_series(1,100) s(i);
+SELECT quantile_presorted(x, ARRAY[0.25, 0.5, 1], 4 ORDER BY x) FROM (VALUES (1.5), (2.25), (3), (-0.125)) foo(x);
+SELECT g, quantile_presorted(i, 0.5, n ORDER BY i) FROM (SELECT mod(i, 3) AS g, i, count(*) OVER (PARTITION BY mod(i, 3)) AS n FROM generate_series(1,10) s(i)) foo GROUP BY g ORDER BY g;
+SELECT quantile_presorted(i, 0.5, 10) FROM generate_series(10,1,-1) s(i);
+SELECT quantile_presorted(i, 0.5, 5 ORDER BY i) FROM generate_series(1,10) s(i);
+SELECT quantile_presorted(i, 0.5, 20 ORDER BY i) FROM generate_series(1,10) s(i);
+
+-- sorting in multiple threads (with a lower minimum of values per thread)
+SET quantile.sort_threads = 4;
+SET quantile.sort_thread_elements = 1024;
+SELECT quantile((i * 5003) % 10000, ARRAY[0, 0.25, 0.5, 0.75, 1]) FROM generate_series(0::bigint, 9999) s(i);
+RESET quantile.sort_thread_elements;
+RESET quantile.sort_threads;